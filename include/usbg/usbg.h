@@ -60,6 +60,52 @@ extern "C" {
  */
 #define USBG_RM_RECURSE 1
 
+/**
+ * @brief Option for usbg_init_opts().
+ * @details Gadgets are found during initialization but their
+ * functions, configs and bindings are parsed when they are
+ * accessed for the first time.
+ */
+#define USBG_INIT_LAZY 1
+
+/**
+ * @brief Option for usbg_init_opts().
+ * @details Attributes and strings of gadgets, configs and functions
+ * which has been read or written using this library are kept in
+ * objects and returned without accessing configfs until they are
+ * invalidated with usbg_invalidate_*() or usbg_refresh().
+ */
+#define USBG_INIT_CACHE 2
+
+/**
+ * @brief Option for usbg_init_opts().
+ * @details Gadgets are parsed by a small pool of threads, one gadget
+ * at a time. Gadgets are available in state in the same order as
+ * without this option.
+ */
+#define USBG_INIT_PARALLEL 4
+
+/**
+ * @brief Option for usbg_init_opts().
+ * @details Directories are not sorted and objects are appended to
+ * lists of their parents, so gadgets, configs, functions, bindings
+ * and UDCs are returned by usbg_get_first_*() and usbg_get_next_*()
+ * in no particular order. This makes parsing and creation of objects
+ * cheaper for users who don't need the order. usbg_sort_state() puts
+ * objects in name order on demand.
+ */
+#define USBG_INIT_UNORDERED 8
+
+/**
+ * @brief Option for usbg_init_opts().
+ * @details State files of UDCs and kernel uevents are watched, so
+ * binding between gadgets and UDCs is updated when kernel reports
+ * a change and usbg_get_gadget_udc(), usbg_get_udc_gadget() and
+ * usbg_get_udc_state() return cached values instead of reading
+ * UDC files on each call.
+ */
+#define USBG_INIT_WATCH 16
+
 /*
  * Internal structures
  */
@@ -311,6 +357,28 @@ typedef struct {
 	usbg_f_attrs attrs;
 } usbg_function_attrs;
 
+/**
+ * @typedef usbg_attr_type
+ * @brief Format of attribute file content
+ */
+typedef enum {
+	USBG_ATTR_DEC = 0,	/**< Decimal integer, dest is int * */
+	USBG_ATTR_HEX,		/**< Hexadecimal integer, dest is int * */
+	USBG_ATTR_BOOL,		/**< 0 or 1, dest is bool * */
+	USBG_ATTR_STRING,	/**< dest is char[USBG_MAX_STR_LENGTH] */
+	USBG_ATTR_STRING_ALLOC,	/**< dest is char **, free() it after use */
+} usbg_attr_type;
+
+/**
+ * @typedef usbg_attr_io
+ * @brief Single attribute to be read by usbg_get_*_attr_vec()
+ */
+typedef struct {
+	const char *name;
+	usbg_attr_type type;
+	void *dest;
+} usbg_attr_io;
+
 /* Error codes */
 
 /**
@@ -334,6 +402,7 @@ typedef enum  {
 	USBG_ERROR_INVALID_TYPE = -13,
 	USBG_ERROR_INVALID_VALUE = -14,
 	USBG_ERROR_NOT_EMPTY = -15,
+	USBG_ERROR_TIMEOUT = -16,
 	USBG_ERROR_OTHER_ERROR = -99
 } usbg_error;
 
@@ -361,12 +430,135 @@ extern const char *usbg_strerror(usbg_error e);
  */
 extern int usbg_init(const char *configfs_path, usbg_state **state);
 
+/**
+ * @brief Initialize the libusbg library state with additional options
+ * @param configfs_path Path to the mounted configfs filesystem
+ * @param opts Bitwise OR of USBG_INIT_* options or 0
+ * @param filter fnmatch(3) pattern, only gadgets with matching
+ * names are parsed and available in state. NULL means all gadgets.
+ * @param state Pointer to be filled with pointer to usbg_state
+ * @return 0 on success, usbg_error on error
+ * @note Gadgets which don't match filter are not visible for
+ * usbg_get_gadget() but they still exist in configfs
+ */
+extern int usbg_init_opts(const char *configfs_path, int opts,
+		const char *filter, usbg_state **state);
+
 /**
  * @brief Clean up the libusbg library state
  * @param s Pointer to state
  */
 extern void usbg_cleanup(usbg_state *s);
 
+/**
+ * @brief Lock state for reading in calling thread
+ * @details State may be used by many threads at once. Lookups,
+ * iteration and attribute access run in parallel while creating
+ * and removing objects, enabling, disabling and importing gadgets
+ * or refreshing state wait for exclusive access. Hold this lock to
+ * keep objects returned by lookups and iteration valid across calls.
+ * Lock may be taken again by the same thread.
+ * @param s Pointer to state
+ * @note Functions which need exclusive access fail with
+ * USBG_ERROR_BUSY when called by thread which holds this lock.
+ * @note usbg_init_opts() and usbg_cleanup() must not race with
+ * any other use of the same state.
+ */
+extern void usbg_lock_state(usbg_state *s);
+
+/**
+ * @brief Release lock taken with usbg_lock_state()
+ * @param s Pointer to state
+ */
+extern void usbg_unlock_state(usbg_state *s);
+
+/**
+ * @typedef usbg_object_type
+ * @brief Kind of object reported by usbg_refresh()
+ */
+typedef enum {
+	USBG_OBJ_GADGET = 0,
+	USBG_OBJ_CONFIG,
+	USBG_OBJ_FUNCTION,
+	USBG_OBJ_BINDING,
+	USBG_OBJ_UDC,
+} usbg_object_type;
+
+/**
+ * @typedef usbg_change_type
+ * @brief Kind of change reported by usbg_refresh()
+ */
+typedef enum {
+	USBG_CHANGE_ADDED = 0,
+	/* Object is freed just after callback returns */
+	USBG_CHANGE_REMOVED,
+	/* Gadget has been (un)bound to UDC or binding points to other function */
+	USBG_CHANGE_MODIFIED,
+} usbg_change_type;
+
+/**
+ * @brief Callback called by usbg_refresh() for each change
+ * @param change Kind of change
+ * @param type Type of object pointed by obj
+ * @param obj Pointer to usbg_gadget, usbg_config, usbg_function,
+ * usbg_binding or usbg_udc
+ * @param data User data passed to usbg_refresh()
+ */
+typedef void (*usbg_change_cb)(usbg_change_type change, usbg_object_type type,
+		void *obj, void *data);
+
+/**
+ * @brief Update library state with changes made in configfs by others
+ * @details Only objects which has been added or removed since last
+ * refresh are allocated or freed, all other pointers remain valid.
+ * Removal of gadget or config is reported only for this object,
+ * not for its content which is freed together with it.
+ * @param s Pointer to state
+ * @param cb Callback to be called for each change, may be NULL
+ * @param data Data passed to callback
+ * @return Number of changes on success, usbg_error on error
+ * @note All values cached in USBG_INIT_CACHE mode are dropped
+ */
+extern int usbg_refresh(usbg_state *s, usbg_change_cb cb, void *data);
+
+/**
+ * @brief Sort objects in state by name
+ * @details Gadgets, UDCs and content of parsed gadgets are put in
+ * the same order as in state initialized without USBG_INIT_UNORDERED.
+ * Objects created or parsed later are still appended at the end.
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error on error
+ */
+extern int usbg_sort_state(usbg_state *s);
+
+/**
+ * @brief Drop cached attributes and strings of all objects in state
+ * @details Next get will read them from configfs. Useful when
+ * state has been initialized with USBG_INIT_CACHE and configfs
+ * may have been modified by someone else.
+ * @param s Pointer to state
+ */
+extern void usbg_invalidate_all(usbg_state *s);
+
+/**
+ * @brief Drop cached attributes and strings of gadget
+ * @note Configs and functions of this gadget keep their values
+ * @param g Pointer to gadget
+ */
+extern void usbg_invalidate_gadget(usbg_gadget *g);
+
+/**
+ * @brief Drop cached attributes and strings of configuration
+ * @param c Pointer to config
+ */
+extern void usbg_invalidate_config(usbg_config *c);
+
+/**
+ * @brief Drop cached attributes of function
+ * @param f Pointer to function
+ */
+extern void usbg_invalidate_function(usbg_function *f);
+
 /**
  * @brief Get ConfigFS path
  * @param s Pointer to state
@@ -470,6 +662,17 @@ extern int usbg_rm_function(usbg_function *f, int opts);
  */
 extern int usbg_rm_gadget(usbg_gadget *g, int opts);
 
+/**
+ * @brief Remove all gadgets of state
+ * @details With USBG_RM_RECURSE gadgets bound to UDC are disabled first
+ * and then content of all gadgets is removed, gadgets independently of
+ * each other. Gadgets which could not be removed stay in state.
+ * @param s Pointer to state
+ * @param opts Additional options for gadget removal.
+ * @return 0 on success, usbg_error of first failure otherwise
+ */
+extern int usbg_rm_all_gadgets(usbg_state *s, int opts);
+
 /**
  * @brief Remove configuration strings for given language
  * @param c Pointer to configuration
@@ -583,6 +786,19 @@ extern int usbg_set_gadget_attrs(usbg_gadget *g,
  */
 extern int usbg_get_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs);
 
+/**
+ * @brief Read several attribute files of gadget at once
+ * @details Files are read in given order relative to gadget directory
+ * which is opened only once.
+ * @param g Pointer to gadget
+ * @param attrs Array of attributes to be read
+ * @param count Number of elements in attrs
+ * @return 0 on success usbg_error if error occurred. On error strings
+ * already allocated for USBG_ATTR_STRING_ALLOC are freed and set to NULL.
+ */
+extern int usbg_get_gadget_attr_vec(usbg_gadget *g, usbg_attr_io *attrs,
+		int count);
+
 /**
  * @brief Get gadget name
  * @param g Pointer to gadget
@@ -738,6 +954,40 @@ extern int usbg_set_gadget_manufacturer(usbg_gadget *g, int lang,
 extern int usbg_set_gadget_product(usbg_gadget *g, int lang,
 				   const char *prd);
 
+/**
+ * @brief Start recording changes of gadget attributes and strings
+ * @details Until transaction is committed or aborted usbg_set_gadget_*()
+ * functions only record new values and don't access configfs. So do
+ * usbg_set_function_attrs() and usbg_set_net_*() for net, mass storage,
+ * midi and loopback functions of this gadget. Other function types have
+ * no attributes to write, their attributes are only validated.
+ * Getters still return values which are currently in configfs.
+ * @param g Pointer to gadget
+ * @return 0 on success, usbg_error if error occurred
+ * (USBG_ERROR_BUSY if transaction is already open)
+ */
+extern int usbg_begin_gadget_transaction(usbg_gadget *g);
+
+/**
+ * @brief Write all changes recorded in transaction
+ * @details Only values which differ from current ones are written,
+ * all of them in a single batch. Missing string and LUN directories
+ * are created just before. If any write fails, values which have been
+ * already written are restored and directories created by commit are
+ * removed. LUNs which are no longer wanted are removed after all writes
+ * have succeeded; this step can't be undone. Transaction is closed
+ * in all cases.
+ * @param g Pointer to gadget
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_commit_gadget_transaction(usbg_gadget *g);
+
+/**
+ * @brief Drop all changes recorded in transaction and close it
+ * @param g Pointer to gadget
+ */
+extern void usbg_abort_gadget_transaction(usbg_gadget *g);
+
 /* USB function allocation and configuration */
 
 /**
@@ -878,6 +1128,17 @@ extern int usbg_set_config_attrs(usbg_config *c,
  */
 extern int usbg_get_config_attrs(usbg_config *c, usbg_config_attrs *c_attrs);
 
+/**
+ * @brief Read several attribute files of configuration at once
+ * @param c Pointer to configuration
+ * @param attrs Array of attributes to be read
+ * @param count Number of elements in attrs
+ * @return 0 on success or usbg_error if error occurred.
+ * @see usbg_get_gadget_attr_vec()
+ */
+extern int usbg_get_config_attr_vec(usbg_config *c, usbg_attr_io *attrs,
+		int count);
+
 /**
  * @brief Set the configuration maximum power
  * @param c Pointer to config
@@ -984,6 +1245,21 @@ extern int usbg_enable_gadget(usbg_gadget *g, usbg_udc *udc);
  */
 extern int usbg_disable_gadget(usbg_gadget *g);
 
+/**
+ * @brief Bind other gadget to UDC in place of the bound one
+ * @details UDC files of both gadgets are opened before the old gadget
+ * is unbound, so UDC stays without gadget only for two writes.
+ * If new gadget cannot be bound, the old one is bound back.
+ * @param u Pointer to UDC
+ * @param from Gadget bound to UDC or NULL if UDC is free
+ * @param to Gadget to be bound, must not be bound to any UDC
+ * @param latency_ns Filled with time (in nanoseconds) between unbinding
+ *  old gadget and binding new one or NULL
+ * @return 0 on success or usbg_error if error occurred.
+ */
+extern int usbg_switch_gadget(usbg_udc *u, usbg_gadget *from,
+		usbg_gadget *to, uint64_t *latency_ns);
+
 /**
  * @brief Get name of udc
  * @param u Pointer to udc
@@ -1025,6 +1301,139 @@ extern usbg_udc *usbg_get_gadget_udc(usbg_gadget *g);
  */
 extern usbg_gadget *usbg_get_udc_gadget(usbg_udc *u);
 
+/**
+ * @typedef usbg_udc_state
+ * @brief USB device state of UDC, as reported by kernel
+ */
+typedef enum {
+	USBG_UDC_STATE_UNKNOWN = 0,
+	USBG_UDC_STATE_NOT_ATTACHED,
+	USBG_UDC_STATE_ATTACHED,
+	USBG_UDC_STATE_POWERED,
+	USBG_UDC_STATE_RECONNECTING,
+	USBG_UDC_STATE_UNAUTHENTICATED,
+	USBG_UDC_STATE_DEFAULT,
+	USBG_UDC_STATE_ADDRESS,
+	USBG_UDC_STATE_CONFIGURED,
+	USBG_UDC_STATE_SUSPENDED,
+} usbg_udc_state;
+
+/**
+ * @brief Get USB device state of UDC
+ * @param u Pointer to udc
+ * @return State of UDC, USBG_UDC_STATE_UNKNOWN if it cannot be read
+ */
+extern usbg_udc_state usbg_get_udc_state(usbg_udc *u);
+
+/**
+ * @brief Get name of UDC state as used by kernel
+ * @param state UDC state
+ * @return Constant string with name of state, e.g. "configured"
+ */
+extern const char *usbg_get_udc_state_str(usbg_udc_state state);
+
+/**
+ * @brief Wait until UDC reaches given state
+ * @details State file of UDC is polled for sysfs notifications,
+ * state is not read again until kernel reports its change.
+ * @param u Pointer to udc, must not be removed while waiting
+ * @param state State to wait for, e.g. USBG_UDC_STATE_CONFIGURED
+ * @param timeout_ms Max time to wait in milliseconds, negative to
+ *  wait forever
+ * @return 0 when UDC is in given state, USBG_ERROR_TIMEOUT if it hasn't
+ * reached it in time, other usbg_error if error occurred.
+ * @note State is not locked while waiting
+ */
+extern int usbg_wait_udc_state(usbg_udc *u, usbg_udc_state state,
+		int timeout_ms);
+
+/**
+ * @typedef usbg_udc_timings
+ * @brief Times of enumeration of gadget bound to UDC
+ * @details Both times are taken from CLOCK_MONOTONIC and given in
+ * nanoseconds, its resolution is reported by clock_getres() and it's
+ * 1 ns on kernels with high resolution timers.
+ * configured_ns - bind_ns is the time host needed to configure gadget.
+ * configured_ns is taken when poll() in usbg_wait_udc_state() or
+ * epoll_wait() on event fd of watched UDCs returns, not when the event
+ * is processed. Still it's exact only if someone is waiting for state
+ * change at that time, otherwise it includes time until the next
+ * check of notifications or call of usbg_get_udc_state().
+ */
+typedef struct {
+	/* Time of write to UDC file by this library, 0 if none */
+	uint64_t bind_ns;
+	/* Time UDC was noticed configured after bind, 0 if not yet */
+	uint64_t configured_ns;
+} usbg_udc_timings;
+
+/**
+ * @brief Get times of last bind of gadget to UDC and its enumeration
+ * @param u Pointer to udc
+ * @param t Pointer to be filled with timings
+ * @return 0 on success, usbg_error if error occurred.
+ */
+extern int usbg_get_udc_timings(usbg_udc *u, usbg_udc_timings *t);
+
+/**
+ * @typedef usbg_event_type
+ * @brief Kind of event reported by usbg_process_events()
+ */
+typedef enum {
+	USBG_EVENT_GADGET_BOUND = 0,
+	USBG_EVENT_GADGET_UNBOUND,
+	USBG_EVENT_UDC_STATE,
+	USBG_EVENT_UDC_ADDED,
+	/* UDC is freed just after callback returns */
+	USBG_EVENT_UDC_REMOVED,
+} usbg_event_type;
+
+/**
+ * @typedef usbg_event
+ * @brief Change of gadget binding or UDC reported by kernel
+ */
+typedef struct {
+	usbg_event_type type;
+	usbg_udc *udc;
+	/* Gadget (un)bound to udc, NULL for other events */
+	usbg_gadget *gadget;
+	/* New state of udc for USBG_EVENT_UDC_STATE */
+	usbg_udc_state state;
+} usbg_event;
+
+/**
+ * @brief Callback called by usbg_process_events() for each event
+ * @param ev Event, valid only during the call
+ * @param data User data passed to usbg_process_events()
+ */
+typedef void (*usbg_event_cb)(const usbg_event *ev, void *data);
+
+/**
+ * @brief Get file descriptor which becomes readable on events
+ * @details UDCs are watched from now on, as with USBG_INIT_WATCH.
+ * Descriptor may be added to poll(), epoll or any main loop,
+ * usbg_process_events() should be called when it's readable.
+ * It must not be read or closed by caller.
+ * @param s Pointer to state
+ * @return File descriptor on success, usbg_error on error
+ */
+extern int usbg_get_event_fd(usbg_state *s);
+
+/**
+ * @brief Deliver events which have occurred since last call
+ * @details Events are queued since usbg_get_event_fd() has been called.
+ * Gadget bound or unbound by anyone, including this library, is
+ * reported when kernel notifies about it. UDCs which have appeared
+ * or disappeared in system are added to or removed from state here,
+ * so this should be called also by users of USBG_INIT_WATCH who
+ * don't need events.
+ * @param s Pointer to state
+ * @param cb Callback to be called for each event, may be NULL
+ * @param data Data passed to callback
+ * @return Number of events on success, usbg_error on error
+ */
+extern int usbg_process_events(usbg_state *s, usbg_event_cb cb, void *data);
+
 /*
  * USB function-specific attribute configuration
  */
@@ -1046,8 +1455,21 @@ extern usbg_function_type usbg_get_function_type(usbg_function *f);
 extern int usbg_get_function_attrs(usbg_function *f,
 		usbg_function_attrs *f_attrs);
 
+/**
+ * @brief Read several attribute files of function at once
+ * @param f Pointer to function
+ * @param attrs Array of attributes to be read
+ * @param count Number of elements in attrs
+ * @return 0 on success or usbg_error if error occurred.
+ * @see usbg_get_gadget_attr_vec()
+ */
+extern int usbg_get_function_attr_vec(usbg_function *f, usbg_attr_io *attrs,
+		int count);
+
 /**
  * @brief Set attributes of given function
+ * @details While transaction of function's gadget is open, attributes
+ * are only recorded and written on commit.
  * @param f Pointer to function
  * @param f_attrs Attributes to be set
  * @return 0 on success, usbg_error if error occurred
@@ -1199,6 +1621,350 @@ extern usbg_binding *usbg_get_next_binding(usbg_binding *b);
  */
 extern usbg_udc *usbg_get_next_udc(usbg_udc *u);
 
+/**
+ * @brief Get number of gadgets in state
+ * @param s State of library
+ * @return Number of gadgets or usbg_error if error occurred
+ */
+extern int usbg_get_gadget_count(usbg_state *s);
+
+/**
+ * @brief Get number of functions in gadget
+ * @param g Pointer to gadget
+ * @return Number of functions or usbg_error if error occurred
+ */
+extern int usbg_get_function_count(usbg_gadget *g);
+
+/**
+ * @brief Get number of configs in gadget
+ * @param g Pointer to gadget
+ * @return Number of configs or usbg_error if error occurred
+ */
+extern int usbg_get_config_count(usbg_gadget *g);
+
+/**
+ * @brief Get number of bindings in config
+ * @param c Pointer to config
+ * @return Number of bindings or usbg_error if error occurred
+ */
+extern int usbg_get_binding_count(usbg_config *c);
+
+/**
+ * @brief Get number of UDCs in state
+ * @param s State of library
+ * @return Number of UDCs or usbg_error if error occurred
+ */
+extern int usbg_get_udc_count(usbg_state *s);
+
+/**
+ * @brief Get gadget at given position in gadget list
+ * @details Children are indexed in the same order in which they are
+ * returned by usbg_get_first_*() and usbg_get_next_*(). Index is
+ * kept in an array which is rebuilt on first access after a child
+ * has been added or removed, so repeated access is O(1).
+ * @param s State of library
+ * @param index Position of gadget, starting from 0
+ * @return Pointer to gadget or NULL if index is out of range
+ */
+extern usbg_gadget *usbg_get_gadget_at(usbg_state *s, int index);
+
+/**
+ * @brief Get function at given position in function list
+ * @param g Pointer to gadget
+ * @param index Position of function, starting from 0
+ * @return Pointer to function or NULL if index is out of range
+ */
+extern usbg_function *usbg_get_function_at(usbg_gadget *g, int index);
+
+/**
+ * @brief Get config at given position in config list
+ * @param g Pointer to gadget
+ * @param index Position of config, starting from 0
+ * @return Pointer to config or NULL if index is out of range
+ */
+extern usbg_config *usbg_get_config_at(usbg_gadget *g, int index);
+
+/**
+ * @brief Get binding at given position in binding list
+ * @param c Pointer to config
+ * @param index Position of binding, starting from 0
+ * @return Pointer to binding or NULL if index is out of range
+ */
+extern usbg_binding *usbg_get_binding_at(usbg_config *c, int index);
+
+/**
+ * @brief Get UDC at given position in UDC list
+ * @param s State of library
+ * @param index Position of UDC, starting from 0
+ * @return Pointer to UDC or NULL if index is out of range
+ */
+extern usbg_udc *usbg_get_udc_at(usbg_state *s, int index);
+
+/**
+ * @brief Get array of all gadgets in state
+ * @details Array is a copy, it is not changed when gadgets are added
+ * or removed. Pointers in it stay valid as long as the gadgets are
+ * not removed, hold usbg_lock_state() to make sure of that.
+ * @param s State of library
+ * @param gadgets Pointer to be filled with array of gadgets which
+ * should be freed with free(). NULL if there are no gadgets.
+ * @return Number of gadgets or usbg_error if error occurred
+ */
+extern int usbg_get_gadgets(usbg_state *s, usbg_gadget ***gadgets);
+
+/**
+ * @brief Get array of all functions in gadget
+ * @param g Pointer to gadget
+ * @param functions Pointer to be filled with array of functions which
+ * should be freed with free(). NULL if there are no functions.
+ * @return Number of functions or usbg_error if error occurred
+ */
+extern int usbg_get_functions(usbg_gadget *g, usbg_function ***functions);
+
+/**
+ * @brief Get array of all configs in gadget
+ * @param g Pointer to gadget
+ * @param configs Pointer to be filled with array of configs which
+ * should be freed with free(). NULL if there are no configs.
+ * @return Number of configs or usbg_error if error occurred
+ */
+extern int usbg_get_configs(usbg_gadget *g, usbg_config ***configs);
+
+/**
+ * @brief Get array of all bindings in config
+ * @param c Pointer to config
+ * @param bindings Pointer to be filled with array of bindings which
+ * should be freed with free(). NULL if there are no bindings.
+ * @return Number of bindings or usbg_error if error occurred
+ */
+extern int usbg_get_bindings(usbg_config *c, usbg_binding ***bindings);
+
+/**
+ * @brief Get array of all UDCs in state
+ * @param s State of library
+ * @param udcs Pointer to be filled with array of UDCs which
+ * should be freed with free(). NULL if there are no UDCs.
+ * @return Number of UDCs or usbg_error if error occurred
+ */
+extern int usbg_get_udcs(usbg_state *s, usbg_udc ***udcs);
+
+/* Declarative configuration */
+
+/**
+ * @brief Option for usbg_reconcile_gadget().
+ * @details Only compute operations, don't modify anything.
+ */
+#define USBG_RECONCILE_DRY_RUN 1
+
+/**
+ * @typedef usbg_function_desc
+ * @brief Desired function of gadget
+ */
+typedef struct {
+	usbg_function_type type;
+	const char *instance;
+	/* Attributes to be set, NULL to leave current ones */
+	const usbg_function_attrs *attrs;
+} usbg_function_desc;
+
+/**
+ * @typedef usbg_binding_desc
+ * @brief Desired binding, its target has to be one of desired functions
+ */
+typedef struct {
+	/* Name of binding, NULL to use name of function */
+	const char *name;
+	usbg_function_type type;
+	const char *instance;
+} usbg_binding_desc;
+
+/**
+ * @typedef usbg_config_desc
+ * @brief Desired configuration of gadget
+ */
+typedef struct {
+	int id;
+	/* Label, NULL for DEFAULT_CONFIG_LABEL */
+	const char *label;
+	/* Attributes and strings (LANG_US_ENG) to be set, NULL to leave */
+	const usbg_config_attrs *attrs;
+	const usbg_config_strs *strs;
+	const usbg_binding_desc *bindings;
+	int nbindings;
+} usbg_config_desc;
+
+/**
+ * @typedef usbg_gadget_desc
+ * @brief Desired state of gadget
+ * @details Functions and configs which are not listed are removed.
+ */
+typedef struct {
+	/* Attributes and strings (LANG_US_ENG) to be set, NULL to leave */
+	const usbg_gadget_attrs *attrs;
+	const usbg_gadget_strs *strs;
+	const usbg_function_desc *functions;
+	int nfunctions;
+	const usbg_config_desc *configs;
+	int nconfigs;
+} usbg_gadget_desc;
+
+/**
+ * @typedef usbg_op_type
+ * @brief Operation done by usbg_reconcile_gadget(), in order of execution
+ */
+typedef enum {
+	/* Gadget is unbound from its UDC while its content is changed */
+	USBG_OP_DISABLE_GADGET = 0,
+	USBG_OP_RM_BINDING,
+	USBG_OP_RM_CONFIG,
+	USBG_OP_RM_FUNCTION,
+	USBG_OP_SET_GADGET_ATTRS,
+	USBG_OP_SET_GADGET_STRS,
+	USBG_OP_CREATE_FUNCTION,
+	USBG_OP_SET_FUNCTION_ATTRS,
+	USBG_OP_CREATE_CONFIG,
+	USBG_OP_SET_CONFIG_ATTRS,
+	USBG_OP_SET_CONFIG_STRS,
+	USBG_OP_ADD_BINDING,
+	USBG_OP_ENABLE_GADGET,
+} usbg_op_type;
+
+/**
+ * @typedef usbg_op
+ * @brief Single operation done by usbg_reconcile_gadget()
+ */
+typedef struct {
+	usbg_op_type type;
+	/*
+	 * Name of gadget, function or config which is modified.
+	 * For bindings it is config_name/binding_name.
+	 */
+	char name[USBG_MAX_STR_LENGTH];
+} usbg_op;
+
+/**
+ * @brief Bring gadget to desired state with minimal set of changes
+ * @details Current gadget content is compared with description and
+ * only objects and attributes which differ are created, removed or
+ * written. Bindings are removed before their configs and functions,
+ * and created after them. If gadget content has to be changed while
+ * it is enabled, it is disabled for this time and enabled again on
+ * the same UDC. Attributes and strings are written only if they
+ * differ from current values.
+ * @param g Pointer to gadget
+ * @param desc Desired state of gadget
+ * @param opts Bitwise OR of USBG_RECONCILE_* options or 0
+ * @param ops If not NULL, filled with pointer to array of operations,
+ * which should be released with free(), or NULL on error
+ * @return Number of operations on success, usbg_error if error occurred.
+ * On error operations which precede the failed one have been done.
+ */
+extern int usbg_reconcile_gadget(usbg_gadget *g, const usbg_gadget_desc *desc,
+		int opts, usbg_op **ops);
+
+/**
+ * @typedef usbg_gadget_override
+ * @brief Values which differ between gadgets created from one template
+ */
+typedef struct {
+	/* Serial number (LANG_US_ENG), NULL to use one from template */
+	const char *serial;
+	/* Attributes, NULL to use ones from template */
+	const usbg_gadget_attrs *attrs;
+} usbg_gadget_override;
+
+/**
+ * @brief Create many gadgets with the same content
+ * @details Gadget number i is named prefix followed by i in decimal.
+ * Directories of all gadgets are created at once and then attributes
+ * and strings of all of them are written at once. Functions, configs
+ * and bindings of template are created in each gadget as by
+ * usbg_reconcile_gadget().
+ * @param s Pointer to state
+ * @param prefix Prefix of names of new gadgets
+ * @param count Number of gadgets to be created
+ * @param tmpl Content of each gadget
+ * @param overrides Array of count values for each gadget or NULL
+ * @param gadgets Array of count pointers to be filled with new gadgets
+ * or NULL
+ * @return 0 on success, usbg_error if error occurred. On error all new
+ * gadgets are removed.
+ */
+extern int usbg_create_gadgets(usbg_state *s, const char *prefix, int count,
+		const usbg_gadget_desc *tmpl,
+		const usbg_gadget_override *overrides, usbg_gadget **gadgets);
+
+/**
+ * @brief Create copy of gadget
+ * @details New gadget gets attributes and strings in all languages of
+ * source gadget, copies of all its functions and configs and the same
+ * bindings. Everything is taken directly from source objects, without
+ * export to gadget scheme. Network functions of new gadget get random
+ * MAC addresses instead of the source ones. Read only attributes of
+ * functions, like interface names or port numbers, are not copied.
+ * @param src Pointer to gadget to be copied
+ * @param name Name of new gadget
+ * @param overrides Values which differ from source gadget or NULL
+ * @param g Pointer to be filled with pointer to new gadget
+ * @return 0 on success, usbg_error if error occurred. On error new
+ * gadget is removed.
+ */
+extern int usbg_clone_gadget(usbg_gadget *src, const char *name,
+		const usbg_gadget_override *overrides, usbg_gadget **g);
+
+/**
+ * @typedef usbg_warm_pool
+ * @brief Set of configured gadgets ready to be bound to one UDC
+ * @details UDC files of gadgets in pool are kept open, so switching
+ * between them doesn't touch anything but the two UDC files.
+ * Gadget removed with usbg_rm_gadget() or by usbg_refresh() leaves
+ * the pool. Pool may outlive its state only to be freed.
+ */
+typedef struct usbg_warm_pool usbg_warm_pool;
+
+/**
+ * @brief Create empty warm pool for UDC
+ * @param u Pointer to UDC
+ * @param p Pointer to be filled with pointer to new pool
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_warm_pool_new(usbg_udc *u, usbg_warm_pool **p);
+
+/**
+ * @brief Put gadget into warm pool
+ * @details Gadget is created if it doesn't exist and brought to
+ * given state as by usbg_reconcile_gadget(). It is not bound.
+ * @param p Pointer to pool
+ * @param name Name of gadget
+ * @param desc Desired content of gadget or NULL to take it as it is
+ * @param g Pointer to be filled with pointer to gadget or NULL
+ * @return 0 on success, usbg_error if error occurred.
+ * USBG_ERROR_BUSY if gadget is bound to other UDC.
+ */
+extern int usbg_warm_pool_add(usbg_warm_pool *p, const char *name,
+		const usbg_gadget_desc *desc, usbg_gadget **g);
+
+/**
+ * @brief Bind gadget from warm pool to UDC of pool
+ * @details Gadget bound currently to UDC is unbound as by
+ * usbg_switch_gadget(), it doesn't have to be in pool.
+ * @param p Pointer to pool
+ * @param name Name of gadget from pool
+ * @param latency_ns Filled with time (in nanoseconds) between unbinding
+ *  old gadget and binding new one or NULL
+ * @return 0 on success, usbg_error if error occurred.
+ * USBG_ERROR_NOT_FOUND if there is no such gadget in pool.
+ */
+extern int usbg_warm_pool_switch(usbg_warm_pool *p, const char *name,
+		uint64_t *latency_ns);
+
+/**
+ * @brief Free warm pool
+ * @details Gadgets are left in configfs as they are.
+ * @param p Pointer to pool
+ */
+extern void usbg_warm_pool_free(usbg_warm_pool *p);
+
 /* Import / Export API */
 
 /**
@@ -1262,6 +2028,8 @@ extern int usbg_import_gadget(usbg_state *s, FILE *stream,
 
 /**
  * @brief Get text of error which occurred during last function import
+ * @details Import errors are kept per thread, only the most recent
+ * failed import of calling thread is reported by all getters below.
  * @param g gadget where function import error occurred
  * @return Text of error or NULL if no error data
  */
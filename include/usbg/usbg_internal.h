@@ -14,16 +14,10 @@
 #define USBG_INTERNAL_H
 
 #include <sys/queue.h>
+#include <pthread.h>
 #include <string.h>
 #include <usbg/usbg.h>
 
-#ifdef HAS_LIBCONFIG
-#include <libconfig.h>
-#else
-	typedef struct _should_not_be_used config_t;
-	void config_destroy(config_t *config);
-#endif
-
 /**
  * @file include/usbg/usbg_internal.h
  */
@@ -39,39 +33,315 @@
                 })
 #endif /* container_of */
 
+/*
+ * Intrusive hash table, nodes are embedded in indexed objects.
+ * Lookup walks nodes with the same hash, caller compares keys.
+ */
+#define USBG_HTABLE_INLINE 8
+
+struct usbg_hnode
+{
+	struct usbg_hnode *next;
+	unsigned int hash;
+};
+
+struct usbg_arena;
+
+struct usbg_htable
+{
+	/* Buckets are allocated from arena, NULL as long as inline ones are used */
+	struct usbg_arena *arena;
+	struct usbg_hnode **buckets;
+	unsigned int size;
+	unsigned int count;
+	struct usbg_hnode *inline_buckets[USBG_HTABLE_INLINE];
+};
+
+unsigned int usbg_hash_str(const char *str);
+unsigned int usbg_hash_ptr(const void *ptr);
+
+void usbg_htable_init(struct usbg_htable *t, struct usbg_arena *arena);
+/* Free memory used by table, nodes are not touched */
+void usbg_htable_release(struct usbg_htable *t);
+void usbg_htable_add(struct usbg_htable *t, struct usbg_hnode *n,
+		     unsigned int hash);
+void usbg_htable_del(struct usbg_htable *t, struct usbg_hnode *n);
+struct usbg_hnode *usbg_htable_first(struct usbg_htable *t, unsigned int hash);
+struct usbg_hnode *usbg_htable_next(struct usbg_hnode *n, unsigned int hash);
+
+#define usbg_htable_for_each(n, t, hash) \
+	for (n = usbg_htable_first(t, hash); n; \
+	     n = usbg_htable_next(n->next, hash))
+
+/*
+ * Intrusive balanced tree of objects ordered by name, see usbg_order.c.
+ * Sorted lists use it to find position of new object in O(log n).
+ */
+struct usbg_onode
+{
+	struct usbg_onode *left;
+	struct usbg_onode *right;
+	const char *key;
+	int height;
+};
+
+struct usbg_order
+{
+	struct usbg_onode *root;
+};
+
+void usbg_order_init(struct usbg_order *o);
+/* Returns node which follows n in order, NULL if n is the last one */
+struct usbg_onode *usbg_order_add(struct usbg_order *o, struct usbg_onode *n,
+				  const char *key);
+void usbg_order_del(struct usbg_order *o, struct usbg_onode *n);
+
+/*
+ * Children of object collected in an array in the order of their list.
+ * Number of children is always up to date, the array is rebuilt with
+ * obj_lock held on first indexed access after the list has changed.
+ * The array is allocated from arena of the state.
+ */
+struct usbg_children
+{
+	struct usbg_arena *arena;
+	void **items;
+	int count;
+	int size;
+	int valid;
+};
+
+/*
+ * Memory arena owned by state. All objects of the state together with
+ * their strings, indexes, child arrays and caches are allocated from it.
+ * Freed blocks are reused by later allocations of the same size class,
+ * everything is released at once.
+ */
+#define USBG_ARENA_ALIGN 16
+#define USBG_ARENA_MAX_BLOCK 1024
+#define USBG_ARENA_CLASSES (USBG_ARENA_MAX_BLOCK / USBG_ARENA_ALIGN)
+
+struct usbg_arena_block;
+struct usbg_arena_chunk;
+struct usbg_arena_large;
+
+struct usbg_arena
+{
+	struct usbg_arena_chunk *chunks;
+	/* Blocks bigger than USBG_ARENA_MAX_BLOCK */
+	struct usbg_arena_large *large;
+	/* Free space of the newest chunk */
+	char *pos;
+	size_t left;
+	struct usbg_arena_block *free_blocks[USBG_ARENA_CLASSES];
+	/* Set while gadgets are parsed by worker threads */
+	pthread_mutex_t *lock;
+};
+
+void usbg_arena_init(struct usbg_arena *a);
+void usbg_arena_release(struct usbg_arena *a);
+void *usbg_arena_alloc(struct usbg_arena *a, size_t size);
+void usbg_arena_free(struct usbg_arena *a, void *ptr);
+
+/*
+ * Directory listing, see usbg_dir.c. Names point into the buffer the
+ * directory has been read to and are valid until usbg_release_dir().
+ * usbg_dir_contains() may be used only on a listing sorted with
+ * usbg_dirent_cmp().
+ */
+#define USBG_DIR_INLINE_BUF 2048
+#define USBG_DIR_INLINE_ENTS 32
+
+struct usbg_dirent
+{
+	const char *name;
+	unsigned char type;
+};
+
+struct usbg_dir
+{
+	struct usbg_dirent *ents;
+	int n;
+	char *buf;
+	struct usbg_dirent inline_ents[USBG_DIR_INLINE_ENTS];
+	char inline_buf[USBG_DIR_INLINE_BUF] __attribute__((aligned(8)));
+};
+
+typedef int (*usbg_dir_filter)(const char *name, unsigned char type);
+typedef int (*usbg_dir_compar)(const void *, const void *);
+
+int usbg_read_dir(int dirfd, const char *path, usbg_dir_filter filter,
+		  usbg_dir_compar compar, struct usbg_dir *d);
+void usbg_release_dir(struct usbg_dir *d);
+int usbg_dirent_cmp(const void *a, const void *b);
+int usbg_dir_contains(const struct usbg_dir *d, const char *name);
+
+/*
+ * Values kept in objects in USBG_INIT_CACHE mode. Cache is allocated
+ * on first use, flags tell which of its members are valid. Strings are
+ * kept only for the language which has been used most recently.
+ */
+#define USBG_CACHE_ATTRS 1
+#define USBG_CACHE_STRS 2
+
+struct usbg_gadget_cache
+{
+	int valid;
+	usbg_gadget_attrs attrs;
+	int lang;
+	usbg_gadget_strs strs;
+};
+
+struct usbg_config_cache
+{
+	int valid;
+	usbg_config_attrs attrs;
+	int lang;
+	usbg_config_strs strs;
+};
+
+struct usbg_function_cache
+{
+	int valid;
+	usbg_function_attrs attrs;
+};
+
+/*
+ * Changes recorded by gadget and function setters between
+ * usbg_begin_gadget_transaction() and usbg_commit_gadget_transaction().
+ * Last value set wins.
+ */
+struct usbg_txn_str
+{
+	int lang;
+	usbg_gadget_str str;
+	char val[USBG_MAX_STR_LENGTH];
+};
+
+/* Attributes of function of the gadget, owned by transaction */
+struct usbg_txn_func
+{
+	usbg_function *f;
+	/* Bit for each single net attribute which has been set, or all */
+	int dirty;
+	usbg_function_attrs attrs;
+};
+
+struct usbg_gadget_txn
+{
+	/* Bit for each usbg_gadget_attr which has been set */
+	int dirty;
+	usbg_gadget_attrs attrs;
+	int nstrs;
+	struct usbg_txn_str *strs;
+	int nfuncs;
+	struct usbg_txn_func *funcs;
+};
+
+/*
+ * Objects don't own copy of their parent directory path. They point
+ * to a path interned in parent object (path of gadgets, functions,
+ * configs or config directory) and full path is composed when needed.
+ * Lengths of all these strings are cached.
+ */
+
 struct usbg_state
 {
 	char *path;
+	size_t path_len;
 	char *configfs_path;
+	/* Directory fd of path, opened on first access */
+	int fd;
+	/* Backend used by usbg_io_batch(), set up on first use */
+	struct usbg_io_ring *io;
+	/* usbg_init_opts() options and gadget name pattern, NULL for all */
+	int opts;
+	char *filter;
 
 	TAILQ_HEAD(ghead, usbg_gadget) gadgets;
 	TAILQ_HEAD(uhead, usbg_udc) udcs;
-	config_t *last_failed_import;
+	/* gadgets and udcs by name */
+	struct usbg_htable gadget_index;
+	struct usbg_htable udc_index;
+	struct usbg_order gadget_order;
+	struct usbg_order udc_order;
+	struct usbg_children gadget_array;
+	struct usbg_children udc_array;
+	/* Memory of all gadgets, configs, functions, bindings and udcs */
+	struct usbg_arena arena;
+	/* Shared for lookups, exclusive for changes of the gadget tree */
+	pthread_rwlock_t lock;
+	/* Nesting of lock by the calling thread */
+	pthread_key_t owner;
+	/* Directory fds, lazy parsing of objects and arena under shared lock */
+	pthread_mutex_t obj_lock;
+	/* Held by the batch which uses io */
+	pthread_mutex_t io_lock;
+	/* Kernel notifications about UDCs, NULL if they are not watched */
+	struct usbg_watch *watch;
+	/* Warm pools of UDCs, they keep UDC files of gadgets open */
+	struct usbg_warm_pool *pools;
 };
 
 struct usbg_gadget
 {
 	char *name;
-	char *path;
+	size_t name_len;
+	/* Interned in state */
+	const char *path;
+	/* Prefixes of all functions and configs of this gadget */
+	char *functions_path;
+	size_t functions_path_len;
+	char *configs_path;
+	size_t configs_path_len;
+	int fd;
 
 	TAILQ_ENTRY(usbg_gadget) gnode;
+	struct usbg_hnode hnode;
+	struct usbg_onode onode;
 	TAILQ_HEAD(chead, usbg_config) configs;
 	TAILQ_HEAD(fhead, usbg_function) functions;
+	/* functions by type and instance */
+	struct usbg_htable function_index;
+	struct usbg_order function_order;
+	struct usbg_order config_order;
+	struct usbg_children function_array;
+	struct usbg_children config_array;
 	usbg_state *parent;
-	config_t *last_failed_import;
 	usbg_udc *udc;
+	/* functions and configs have not been parsed yet */
+	int lazy;
+	struct usbg_gadget_cache *cache;
+	/* Open transaction, if any */
+	struct usbg_gadget_txn *txn;
+	/* Caches and transaction of gadget, its configs and functions */
+	pthread_mutex_t attr_lock;
 };
 
 struct usbg_config
 {
 	TAILQ_ENTRY(usbg_config) cnode;
+	struct usbg_onode onode;
 	TAILQ_HEAD(bhead, usbg_binding) bindings;
+	/* bindings by name and by target */
+	struct usbg_htable binding_index;
+	struct usbg_htable target_index;
+	struct usbg_order binding_order;
+	struct usbg_children binding_array;
 	usbg_gadget *parent;
 
 	char *name;
-	char *path;
+	size_t name_len;
+	/* Interned in gadget */
+	const char *path;
+	/* Path of config directory, prefix of all its bindings */
+	char *bindings_path;
+	size_t bindings_path_len;
 	char *label;
+	size_t label_len;
 	int id;
+	int fd;
+	struct usbg_config_cache *cache;
 };
 
 typedef int (*usbg_rm_function_callback)(usbg_function *, int);
@@ -79,34 +349,57 @@ typedef int (*usbg_rm_function_callback)(usbg_function *, int);
 struct usbg_function
 {
 	TAILQ_ENTRY(usbg_function) fnode;
+	struct usbg_hnode hnode;
+	struct usbg_onode onode;
 	usbg_gadget *parent;
 
 	char *name;
-	char *path;
+	size_t name_len;
+	/* Interned in gadget */
+	const char *path;
 	char *instance;
+	size_t instance_len;
 	/* Only for internal library usage */
 	char *label;
 	usbg_function_type type;
 	usbg_rm_function_callback rm_callback;
+	int fd;
+	struct usbg_function_cache *cache;
 };
 
 struct usbg_binding
 {
 	TAILQ_ENTRY(usbg_binding) bnode;
+	struct usbg_hnode hnode;
+	struct usbg_hnode tnode;
+	struct usbg_onode onode;
 	usbg_config *parent;
 	usbg_function *target;
 
 	char *name;
-	char *path;
+	size_t name_len;
+	/* Interned in config */
+	const char *path;
 };
 
 struct usbg_udc
 {
 	TAILQ_ENTRY(usbg_udc) unode;
+	struct usbg_hnode hnode;
+	struct usbg_onode onode;
 	usbg_state *parent;
 	usbg_gadget *gadget;
 
 	char *name;
+	size_t name_len;
+	/* Watched state file and its last value, -1 if not watched */
+	int state_fd;
+	usbg_udc_state state;
+	/* Gadget reported in last bound event */
+	usbg_gadget *event_gadget;
+	/* Monotonic time of last bind and of reaching configured state */
+	uint64_t bind_ns;
+	uint64_t configured_ns;
 };
 
 #define ARRAY_SIZE(array) (sizeof(array)/sizeof(*array))
@@ -135,32 +428,14 @@ struct usbg_udc
                         fflush(stderr);\
                     } while (0)
 
-/* Insert in string order */
-#define INSERT_TAILQ_STRING_ORDER(HeadPtr, HeadType, NameField, ToInsert, NodeField) \
-	do { \
-		if (TAILQ_EMPTY((HeadPtr)) || \
-			(strcmp((ToInsert)->NameField, TAILQ_FIRST((HeadPtr))->NameField) < 0)) \
-			TAILQ_INSERT_HEAD((HeadPtr), (ToInsert), NodeField); \
-		else if (strcmp((ToInsert)->NameField, TAILQ_LAST((HeadPtr), HeadType)->NameField) > 0) \
-			TAILQ_INSERT_TAIL((HeadPtr), (ToInsert), NodeField); \
-		else { \
-			typeof(ToInsert) _cur; \
-			TAILQ_FOREACH(_cur, (HeadPtr), NodeField) { \
-				if (strcmp((ToInsert)->NameField, _cur->NameField) > 0) \
-					continue; \
-				TAILQ_INSERT_BEFORE(_cur, (ToInsert), NodeField); \
-			} \
-		} \
-	} while (0)
-
 #define STRINGS_DIR "strings"
 #define CONFIGS_DIR "configs"
 #define FUNCTIONS_DIR "functions"
 #define GADGETS_DIR "usb_gadget"
 
-static inline int file_select(const struct dirent *dent)
+static inline int file_select(const char *name, unsigned char type)
 {
-	if ((strcmp(dent->d_name, ".") == 0) || (strcmp(dent->d_name, "..") == 0))
+	if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0))
 		return 0;
 	else
 		return 1;
@@ -168,7 +443,167 @@ static inline int file_select(const struct dirent *dent)
 
 int usbg_translate_error(int error);
 
+/*
+ * State locking, see usbg_lock.c. Lock may be taken again by the thread
+ * which holds it. usbg_lock_exclusive() fails with USBG_ERROR_BUSY if the
+ * thread holds it only shared. usbg_lock_obj() takes the state lock shared
+ * and serializes lazy initialization of objects and allocations made from
+ * the arena with the state lock held shared. usbg_lock_attrs() takes the
+ * state lock shared and serializes access to caches and transaction of
+ * a gadget, its configs and functions. It may be followed by
+ * usbg_lock_obj(), never the other way around.
+ */
+int usbg_lock_init(usbg_state *s);
+void usbg_lock_destroy(usbg_state *s);
+void usbg_lock_shared(usbg_state *s);
+int usbg_lock_exclusive(usbg_state *s);
+void usbg_unlock(usbg_state *s);
+void usbg_lock_obj(usbg_state *s);
+void usbg_unlock_obj(usbg_state *s);
+int usbg_attr_lock_init(usbg_gadget *g);
+void usbg_attr_lock_destroy(usbg_gadget *g);
+void usbg_lock_attrs(usbg_gadget *g);
+void usbg_unlock_attrs(usbg_gadget *g);
+
+/*
+ * I/O engine
+ *
+ * Independent file system operations are described as usbg_io_op and
+ * executed by usbg_io_batch(). Depending on build configuration this
+ * submits them to io_uring or simply runs them one by one.
+ */
+typedef enum {
+	USBG_IO_READ,		/* read up to len - 1 bytes to buf, NUL-terminate */
+	USBG_IO_WRITE,		/* write len bytes of buf, len 0 just opens file */
+	USBG_IO_MKDIR,		/* create directory */
+	USBG_IO_RMDIR,		/* remove directory */
+	USBG_IO_UNLINK,		/* remove file or symlink */
+} usbg_io_type;
+
+struct usbg_io_op {
+	usbg_io_type type;
+	int dirfd;
+	const char *name;
+	char *buf;
+	int len;
+	/* Filled in when op is done: usbg_error and bytes transferred */
+	int ret;
+	int done;
+};
+
+/* Run operations synchronously, one after another */
+int usbg_io_run(struct usbg_io_op *op);
+int usbg_io_run_all(struct usbg_io_op *ops, int count);
+
+/*
+ * Execute count operations which don't depend on each other.
+ * They may be executed in any order or in parallel.
+ * @return USBG_SUCCESS or error of the first failed operation in array
+ */
+int usbg_io_batch(usbg_state *s, struct usbg_io_op *ops, int count);
+
+void usbg_io_cleanup(usbg_state *s);
+
+/**
+ * @brief Parse functions and configs of gadget if it has been found
+ * in USBG_INIT_LAZY mode and this hasn't been done yet
+ * @return 0 on success, usbg_error on error
+ */
+int usbg_parse_lazy_gadget(usbg_gadget *g);
+
 char *usbg_ether_ntoa_r(const struct ether_addr *addr, char *buf);
 
+/**
+ * @brief Read name of UDC to which gadget is bound, empty if none
+ * @return 0 on success, usbg_error on error
+ */
+int usbg_read_gadget_udc(usbg_gadget *g, char *buf);
+
+/**
+ * @brief Add UDC found in system to state
+ * @return 0 on success, usbg_error on error
+ */
+int usbg_parse_udc(usbg_state *s, const char *name);
+
+/**
+ * @brief Remove UDC from list, index and order of state
+ */
+void usbg_detach_udc(usbg_udc *u);
+
+void usbg_free_udc(usbg_udc *u);
+
+/**
+ * @brief Start watching state files of all UDCs and kernel uevents
+ * @return 0 on success, usbg_error on error
+ */
+int usbg_watch_start(usbg_state *s);
+
+/**
+ * @brief Stop watching and close all watch descriptors
+ */
+void usbg_watch_stop(usbg_state *s);
+
+/**
+ * @brief Add state file of UDC to watch of its state
+ * @return 0 on success, usbg_error on error
+ */
+int usbg_watch_udc(usbg_udc *u);
+
+/**
+ * @brief Apply notifications which kernel has sent since last call.
+ * Must be called with object lock held.
+ */
+void usbg_watch_sync(usbg_state *s);
+
+/**
+ * @brief Drop queued events which refer to object being freed
+ */
+void usbg_watch_forget_gadget(usbg_gadget *g);
+void usbg_watch_forget_udc(usbg_udc *u);
+
+/**
+ * @brief Find out which gadget is bound to UDC now
+ * @details Binding is synced with kernel notifications if UDCs are
+ * watched, otherwise it is read from UDC files of gadgets.
+ */
+void usbg_check_udc_binding(usbg_udc *u);
+
+/**
+ * @brief Drop gadget which is being freed from all warm pools
+ */
+void usbg_warm_pool_forget_gadget(usbg_gadget *g);
+
+/**
+ * @brief Close all warm pools of state which is being freed
+ * @details Pools are left only to be freed by their owners.
+ */
+void usbg_warm_pool_orphan_all(usbg_state *s);
+
+/**
+ * @brief Get CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t usbg_monotonic_ns(void);
+
+/**
+ * @brief Record that gadget has been bound to UDC at given time
+ */
+void usbg_udc_bound(usbg_udc *u, uint64_t bind_ns);
+
+/**
+ * @brief Open UDC file of gadget for writing
+ * @return 0 on success, usbg_error on error
+ */
+int usbg_open_udc_file(usbg_gadget *g, int *fd);
+
+/**
+ * @brief Bind gadget to UDC in place of the bound one using already
+ * opened UDC files. Must be called with state locked exclusive.
+ * @param from Gadget bound to UDC, NULL if UDC is free
+ * @param latency_ns Filled with time between unbind and bind or NULL
+ * @return 0 on success, usbg_error on error
+ */
+int usbg_switch_udc(usbg_udc *u, usbg_gadget *from, int from_fd,
+		    usbg_gadget *to, int to_fd, uint64_t *latency_ns);
+
 #endif /* USBG_INTERNAL_H */
 
@@ -16,6 +16,8 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 
 #include <netinet/ether.h>
 #include <stdio.h>
@@ -24,6 +26,7 @@
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -117,6 +120,9 @@ int usbg_translate_error(int error)
 	case ENOTEMPTY:
 		ret = USBG_ERROR_NOT_EMPTY;
 		break;
+	case ETIMEDOUT:
+		ret = USBG_ERROR_TIMEOUT;
+		break;
 	default:
 		ret = USBG_ERROR_OTHER_ERROR;
 	}
@@ -177,6 +183,9 @@ const char *usbg_error_name(usbg_error e)
 	case USBG_ERROR_NOT_EMPTY:
 		ret = "USBG_ERROR_NOT_EMPTY";
 		break;
+	case USBG_ERROR_TIMEOUT:
+		ret = "USBG_ERROR_TIMEOUT";
+		break;
 	case USBG_ERROR_OTHER_ERROR:
 		ret = "USBG_ERROR_OTHER_ERROR";
 		break;
@@ -238,6 +247,9 @@ const char *usbg_strerror(usbg_error e)
 	case USBG_ERROR_NOT_EMPTY:
 		ret = "Entity is not empty.";
 		break;
+	case USBG_ERROR_TIMEOUT:
+		ret = "Timeout expired.";
+		break;
 	case USBG_ERROR_OTHER_ERROR:
 		ret = "Other error";
 		break;
@@ -421,1536 +433,3157 @@ out:
 	return ret;
 }
 
-static int bindings_select(const struct dirent *dent)
+/* Listings are sorted so that objects are appended to sorted lists */
+static inline usbg_dir_compar usbg_dir_order(usbg_state *s)
+{
+	return s->opts & USBG_INIT_UNORDERED ? NULL : usbg_dirent_cmp;
+}
+
+static int bindings_select(const char *name, unsigned char type)
 {
-	if (dent->d_type == DT_LNK)
+	if (type == DT_LNK)
 		return 1;
 	else
 		return 0;
 }
 
-static int usbg_read_buf(const char *path, const char *name, const char *file,
-			 char *buf)
+/*
+ * Attribute I/O helpers take the directory fd the file is relative to.
+ * It may also be an error returned by one of *_dirfd() functions
+ * which is then returned without touching the file.
+ */
+#define USBG_DIRFD_ERROR(dirfd) ((dirfd) < 0 && (dirfd) != AT_FDCWD)
+
+/* Attributes are single line, drop anything after it */
+static inline void usbg_cut_line(char *buf)
 {
-	char p[USBG_MAX_PATH_LENGTH];
-	FILE *fp;
-	char *ret_ptr;
-	int nmb;
-	int ret = USBG_SUCCESS;
+	char *nl;
 
-	nmb = snprintf(p, sizeof(p), "%s/%s/%s", path, name, file);
-	if (nmb >= sizeof(p)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	nl = strchr(buf, '\n');
+	if (nl)
+		*(nl + 1) = '\0';
+}
 
-	fp = fopen(p, "r");
-	if (!fp) {
-		/* Set error correctly */
-		ret = usbg_translate_error(errno);
-		goto out;
-	}
+static int usbg_read_buf(int dirfd, const char *file, char *buf)
+{
+	struct usbg_io_op op = {
+		.type = USBG_IO_READ,
+		.dirfd = dirfd,
+		.name = file,
+		.buf = buf,
+		.len = USBG_MAX_STR_LENGTH,
+	};
 
-	ret_ptr = fgets(buf, USBG_MAX_STR_LENGTH, fp);
-	if (!ret_ptr) {
-		/* File is empty */
-		if (feof(fp))
-			buf[0] = '\0';
-		/* Error occurred */
-		else
-			ret = USBG_ERROR_IO;
-	}
+	if (USBG_DIRFD_ERROR(dirfd))
+		return dirfd;
 
-	fclose(fp);
+	if (usbg_io_run(&op) == USBG_SUCCESS)
+		usbg_cut_line(buf);
 
-out:
-	return ret;
+	return op.ret;
 }
 
-static int usbg_read_int(const char *path, const char *name, const char *file,
-			 int base, int *dest)
+/* Decode content of attribute file read to buf and store it in dest */
+static int usbg_decode_attr(char *buf, usbg_attr_type type, void *dest)
 {
-	char buf[USBG_MAX_STR_LENGTH];
 	char *pos;
-	int ret;
+	int val;
+	int ret = USBG_SUCCESS;
 
-	ret = usbg_read_buf(path, name, file, buf);
-	if (ret == USBG_SUCCESS) {
-		*dest = strtol(buf, &pos, base);
+	switch (type) {
+	case USBG_ATTR_DEC:
+	case USBG_ATTR_HEX:
+	case USBG_ATTR_BOOL:
+		val = strtol(buf, &pos, type == USBG_ATTR_HEX ? 16 : 10);
 		if (!pos)
 			ret = USBG_ERROR_OTHER_ERROR;
+		else if (type == USBG_ATTR_BOOL)
+			*(bool *)dest = !!val;
+		else
+			*(int *)dest = val;
+		break;
+	case USBG_ATTR_STRING:
+	case USBG_ATTR_STRING_ALLOC:
+		pos = strchr(buf, '\n');
+		if (pos)
+			*pos = '\0';
+
+		if (type == USBG_ATTR_STRING) {
+			strcpy((char *)dest, buf);
+			break;
+		}
+
+		pos = strdup(buf);
+		if (pos)
+			*(char **)dest = pos;
+		else
+			ret = USBG_ERROR_NO_MEM;
+		break;
+	default:
+		ret = USBG_ERROR_INVALID_PARAM;
 	}
 
 	return ret;
 }
 
-#define usbg_read_dec(p, n, f, d)	usbg_read_int(p, n, f, 10, d)
-#define usbg_read_hex(p, n, f, d)	usbg_read_int(p, n, f, 16, d)
-
-static int usbg_read_bool(const char *path, const char *name, const char *file,
-			  bool *dest)
+static int usbg_read_attr(int dirfd, const char *file, usbg_attr_type type,
+			  void *dest)
 {
-	int buf;
+	char buf[USBG_MAX_STR_LENGTH];
 	int ret;
 
-	ret = usbg_read_dec(path, name, file, &buf);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	ret = usbg_read_buf(dirfd, file, buf);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_decode_attr(buf, type, dest);
+	else if (type == USBG_ATTR_STRING)
+		/* Set this as empty string */
+		*(char *)dest = '\0';
 
-	*dest = !!buf;
-out:
 	return ret;
 }
 
-static int usbg_read_string(const char *path, const char *name,
-			    const char *file, char *buf)
+static inline int usbg_read_dec(int dirfd, const char *file, int *dest)
 {
-	char *p = NULL;
-	int ret;
-
-	ret = usbg_read_buf(path, name, file, buf);
-	/* Check whether read was successful */
-	if (ret == USBG_SUCCESS) {
-		if ((p = strchr(buf, '\n')) != NULL)
-				*p = '\0';
-	} else {
-		/* Set this as empty string */
-		*buf = '\0';
-	}
-
-	return ret;
+	return usbg_read_attr(dirfd, file, USBG_ATTR_DEC, dest);
 }
 
-static int usbg_read_string_alloc(const char *path, const char *name,
-			       const char *file, const char **dest)
+static inline int usbg_read_hex(int dirfd, const char *file, int *dest)
 {
-	char buf[USBG_MAX_FILE_SIZE];
-	char *new_buf = NULL;
-	int ret = USBG_SUCCESS;
-
-	ret = usbg_read_string(path, name, file, buf);
-	if (ret != USBG_SUCCESS)
-		goto out;
-
-	new_buf = strdup(buf);
-	if (!new_buf) {
-		ret = USBG_ERROR_NO_MEM;
-		goto out;
-	}
+	return usbg_read_attr(dirfd, file, USBG_ATTR_HEX, dest);
+}
 
-	*dest = new_buf;
-out:
-	return ret;
+static inline int usbg_read_bool(int dirfd, const char *file, bool *dest)
+{
+	return usbg_read_attr(dirfd, file, USBG_ATTR_BOOL, dest);
 }
 
-static int usbg_write_buf(const char *path, const char *name, const char *file,
-			  const char *buf)
+static inline int usbg_read_string(int dirfd, const char *file, char *buf)
 {
-	char p[USBG_MAX_PATH_LENGTH];
-	FILE *fp;
-	int nmb;
-	int ret = USBG_SUCCESS;
+	return usbg_read_attr(dirfd, file, USBG_ATTR_STRING, buf);
+}
 
-	nmb = snprintf(p, sizeof(p), "%s/%s/%s", path, name, file);
-	if (nmb < sizeof(p)) {
-		fp = fopen(p, "w");
-		if (fp) {
-			fputs(buf, fp);
-			fflush(fp);
+static inline int usbg_read_string_alloc(int dirfd, const char *file,
+					 const char **dest)
+{
+	return usbg_read_attr(dirfd, file, USBG_ATTR_STRING_ALLOC, dest);
+}
 
-			ret = ferror(fp);
-			if (ret)
-				ret = usbg_translate_error(errno);
+static int usbg_write_buf(int dirfd, const char *file, const char *buf)
+{
+	struct usbg_io_op op = {
+		.type = USBG_IO_WRITE,
+		.dirfd = dirfd,
+		.name = file,
+		.buf = (char *)buf,
+		.len = strlen(buf),
+	};
 
-			fclose(fp);
-		} else {
-			/* Set error correctly */
-			ret = usbg_translate_error(errno);
-		}
-	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-	}
+	if (USBG_DIRFD_ERROR(dirfd))
+		return dirfd;
 
-	return ret;
+	return usbg_io_run(&op);
 }
 
-static int usbg_write_int(const char *path, const char *name, const char *file,
-			  int value, const char *str)
+static int usbg_write_int(int dirfd, const char *file, int value,
+			  const char *str)
 {
 	char buf[USBG_MAX_STR_LENGTH];
 	int nmb;
 
 	nmb = snprintf(buf, USBG_MAX_STR_LENGTH, str, value);
 	return nmb < USBG_MAX_STR_LENGTH ?
-			usbg_write_buf(path, name, file, buf)
+			usbg_write_buf(dirfd, file, buf)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
-#define usbg_write_dec(p, n, f, v)	usbg_write_int(p, n, f, v, "%d\n")
-#define usbg_write_hex(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%x\n")
-#define usbg_write_hex16(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%04x\n")
-#define usbg_write_hex8(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%02x\n")
-#define usbg_write_bool(p, n, f, v)	usbg_write_dec(p, n, f, !!v)
+#define usbg_write_dec(d, f, v)	usbg_write_int(d, f, v, "%d\n")
+#define usbg_write_hex(d, f, v)	usbg_write_int(d, f, v, "0x%x\n")
+#define usbg_write_hex16(d, f, v)	usbg_write_int(d, f, v, "0x%04x\n")
+#define usbg_write_hex8(d, f, v)	usbg_write_int(d, f, v, "0x%02x\n")
+#define usbg_write_bool(d, f, v)	usbg_write_dec(d, f, !!v)
 
-static inline int usbg_write_string(const char *path, const char *name,
-				    const char *file, const char *buf)
+static inline int usbg_write_string(int dirfd, const char *file,
+				    const char *buf)
 {
-	return usbg_write_buf(path, name, file, buf);
+	return usbg_write_buf(dirfd, file, buf);
 }
 
-static inline void usbg_free_binding(usbg_binding *b)
-{
-	free(b->path);
-	free(b->name);
-	free(b);
-}
+/*
+ * Directory handles
+ *
+ * Each state, gadget, config and function keeps an O_PATH fd of its own
+ * directory, opened on the first attribute access and closed when the object
+ * is freed. All attributes are then opened relative to it so the kernel
+ * doesn't have to walk the whole configfs path for each of them. O_PATH
+ * doesn't call into configfs open()/release() so it doesn't pin the item.
+ */
 
-static inline void usbg_free_function(usbg_function *f)
+static int usbg_open_dir(int dirfd, const char *name, int *fd)
 {
-	free(f->path);
-	free(f->name);
-	free(f->label);
-	free(f);
+	int ret = USBG_SUCCESS;
+
+	*fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (*fd < 0)
+		ret = usbg_translate_error(errno);
+
+	return ret;
 }
 
-static void usbg_free_config(usbg_config *c)
+static inline void usbg_close_dir(int *fd)
 {
-	usbg_binding *b;
-	while (!TAILQ_EMPTY(&c->bindings)) {
-		b = TAILQ_FIRST(&c->bindings);
-		TAILQ_REMOVE(&c->bindings, b, bnode);
-		usbg_free_binding(b);
+	if (*fd >= 0) {
+		close(*fd);
+		*fd = -1;
 	}
-	free(c->path);
-	free(c->name);
-	free(c->label);
-	free(c);
 }
 
-static void usbg_free_gadget(usbg_gadget *g)
+/* All *_dirfd() functions return directory fd or usbg_error if failed */
+static int usbg_state_dirfd(usbg_state *s)
 {
-	usbg_config *c;
-	usbg_function *f;
+	int ret = USBG_SUCCESS;
 
-	if (g->last_failed_import) {
-		config_destroy(g->last_failed_import);
-		free(g->last_failed_import);
-	}
+	pthread_mutex_lock(&s->obj_lock);
+	if (s->fd < 0)
+		ret = usbg_open_dir(AT_FDCWD, s->path, &s->fd);
+	pthread_mutex_unlock(&s->obj_lock);
 
-	while (!TAILQ_EMPTY(&g->configs)) {
-		c = TAILQ_FIRST(&g->configs);
-		TAILQ_REMOVE(&g->configs, c, cnode);
-		usbg_free_config(c);
-	}
-	while (!TAILQ_EMPTY(&g->functions)) {
-		f = TAILQ_FIRST(&g->functions);
-		TAILQ_REMOVE(&g->functions, f, fnode);
-		usbg_free_function(f);
-	}
-	free(g->path);
-	free(g->name);
-	free(g);
+	return ret == USBG_SUCCESS ? s->fd : ret;
 }
 
-static void usbg_free_udc(usbg_udc *u)
+static int usbg_gadget_dirfd(usbg_gadget *g)
 {
-	free(u->name);
-	free(u);
-}
+	int ret = USBG_SUCCESS;
+	int sfd;
 
-static void usbg_free_state(usbg_state *s)
-{
-	usbg_gadget *g;
-	usbg_udc *u;
+	pthread_mutex_lock(&g->parent->obj_lock);
+	if (g->fd >= 0)
+		goto out;
 
-	while (!TAILQ_EMPTY(&s->gadgets)) {
-		g = TAILQ_FIRST(&s->gadgets);
-		TAILQ_REMOVE(&s->gadgets, g, gnode);
-		usbg_free_gadget(g);
+	sfd = usbg_state_dirfd(g->parent);
+	if (sfd < 0) {
+		ret = sfd;
+		goto out;
 	}
 
+	ret = usbg_open_dir(sfd, g->name, &g->fd);
+out:
+	pthread_mutex_unlock(&g->parent->obj_lock);
+	return ret == USBG_SUCCESS ? g->fd : ret;
+}
 
-	while (!TAILQ_EMPTY(&s->udcs)) {
-		u = TAILQ_FIRST(&s->udcs);
-		TAILQ_REMOVE(&s->udcs, u, unode);
-		usbg_free_udc(u);
+/* Open directory placed in subdir of gadget, eg. functions/acm.usb0 */
+static int usbg_gadget_subdir_dirfd(usbg_gadget *g, const char *subdir,
+				    const char *name, int *fd)
+{
+	char buf[USBG_MAX_PATH_LENGTH];
+	int ret = USBG_SUCCESS;
+	int gfd;
+	int nmb;
+
+	pthread_mutex_lock(&g->parent->obj_lock);
+	if (*fd >= 0)
+		goto out;
+
+	gfd = usbg_gadget_dirfd(g);
+	if (gfd < 0) {
+		ret = gfd;
+		goto out;
 	}
 
-	if (s->last_failed_import) {
-		config_destroy(s->last_failed_import);
-		free(s->last_failed_import);
+	nmb = snprintf(buf, sizeof(buf), "%s/%s", subdir, name);
+	if (nmb >= sizeof(buf)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
 	}
 
-	free(s->path);
-	free(s->configfs_path);
-	free(s);
+	ret = usbg_open_dir(gfd, buf, fd);
+out:
+	pthread_mutex_unlock(&g->parent->obj_lock);
+	return ret == USBG_SUCCESS ? *fd : ret;
 }
 
-static usbg_gadget *usbg_allocate_gadget(const char *path, const char *name,
-		usbg_state *parent)
+static inline int usbg_config_dirfd(usbg_config *c)
 {
-	usbg_gadget *g;
+	return usbg_gadget_subdir_dirfd(c->parent, CONFIGS_DIR, c->name,
+					&c->fd);
+}
 
-	g = malloc(sizeof(*g));
-	if (g) {
-		TAILQ_INIT(&g->functions);
-		TAILQ_INIT(&g->configs);
-		g->last_failed_import = NULL;
-		g->name = strdup(name);
-		g->path = strdup(path);
-		g->parent = parent;
-		g->udc = NULL;
+static inline int usbg_function_dirfd(usbg_function *f)
+{
+	return usbg_gadget_subdir_dirfd(f->parent, FUNCTIONS_DIR, f->name,
+					&f->fd);
+}
 
-		if (!(g->name) || !(g->path)) {
-			free(g->name);
-			free(g->path);
-			free(g);
-			g = NULL;
-		}
-	}
+/*
+ * Create directory relative to dirfd if it doesn't exist.
+ * Assume that user will always have access to already existing one.
+ */
+static int usbg_check_dir(int dirfd, const char *name)
+{
+	int ret = USBG_SUCCESS;
 
-	return g;
+	if (mkdirat(dirfd, name, S_IRWXU|S_IRWXG|S_IRWXO) != 0 &&
+	    errno != EEXIST)
+		ret = usbg_translate_error(errno);
+
+	return ret;
 }
 
-static usbg_config *usbg_allocate_config(const char *path, const char *label,
-		int id, usbg_gadget *parent)
+/* String files are kept in strings/0x<lang>/ of gadget or config directory */
+static int usbg_read_str_file(int dirfd, int lang, const char *file, char *buf)
 {
-	usbg_config *c;
-	int ret;
+	char name[USBG_MAX_PATH_LENGTH];
+	int nmb;
 
-	c = malloc(sizeof(*c));
-	if (!c)
-		goto out;
+	nmb = snprintf(name, sizeof(name), "%s/0x%x/%s", STRINGS_DIR, lang,
+		       file);
+	if (nmb >= sizeof(name))
+		return USBG_ERROR_PATH_TOO_LONG;
 
-	TAILQ_INIT(&c->bindings);
+	return usbg_read_string(dirfd, name, buf);
+}
 
-	ret = asprintf(&(c->name), "%s.%d", label, id);
-	if (ret < 0) {
-		free(c);
-		c = NULL;
-		goto out;
-	}
+static int usbg_check_str_dir(int dirfd, int lang)
+{
+	char name[USBG_MAX_PATH_LENGTH];
+	int nmb;
 
-	c->path = strdup(path);
-	c->label = strdup(label);
-	c->parent = parent;
-	c->id = id;
+	if (USBG_DIRFD_ERROR(dirfd))
+		return dirfd;
 
-	if (!(c->path) || !(c->label)) {
-		free(c->name);
-		free(c->path);
-		free(c->label);
-		free(c);
-		c = NULL;
-	}
+	nmb = snprintf(name, sizeof(name), "%s/0x%x", STRINGS_DIR, lang);
+	if (nmb >= sizeof(name))
+		return USBG_ERROR_PATH_TOO_LONG;
 
-out:
-	return c;
+	return usbg_check_dir(dirfd, name);
 }
 
-static int usbg_rm_ms_function(usbg_function *f, int opts);
+static int usbg_write_str_file(int dirfd, int lang, const char *file,
+			       const char *buf)
+{
+	char name[USBG_MAX_PATH_LENGTH];
+	int nmb;
+
+	nmb = snprintf(name, sizeof(name), "%s/0x%x/%s", STRINGS_DIR, lang,
+		       file);
+	if (nmb >= sizeof(name))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	return usbg_write_string(dirfd, name, buf);
+}
+
+/*
+ * Vectored attribute access
+ *
+ * All files are opened relative to the same directory fd and submitted
+ * to usbg_io_batch() together, so reading or writing whole attribute
+ * structure costs a single path lookup of the object and, with io_uring
+ * backend, a single system call.
+ */
 
-static usbg_function *usbg_allocate_function(const char *path,
-		usbg_function_type type, const char *instance, usbg_gadget *parent)
+static int usbg_read_attr_vec(usbg_state *s, int dirfd, usbg_attr_io *attrs,
+			      int count)
 {
-	usbg_function *f;
-	const char *type_name;
+	struct usbg_io_op *ops;
+	char *bufs;
 	int ret;
+	int i;
 
-	f = malloc(sizeof(*f));
-	if (!f)
-		goto out;
+	if (USBG_DIRFD_ERROR(dirfd))
+		return dirfd;
 
-	f->label = NULL;
-	type_name = usbg_get_function_type_str(type);
-	if (!type_name) {
-		free(f);
-		f = NULL;
+	if (!attrs || count < 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (count == 0)
+		return USBG_SUCCESS;
+
+	ops = calloc(count, sizeof(*ops));
+	bufs = malloc(count * USBG_MAX_STR_LENGTH);
+	if (!ops || !bufs) {
+		ret = USBG_ERROR_NO_MEM;
 		goto out;
 	}
 
-	ret = asprintf(&(f->name), "%s.%s", type_name, instance);
-	if (ret < 0) {
-		free(f);
-		f = NULL;
-		goto out;
+	for (i = 0; i < count; ++i) {
+		ops[i].type = USBG_IO_READ;
+		ops[i].dirfd = dirfd;
+		ops[i].name = attrs[i].name;
+		ops[i].buf = bufs + i * USBG_MAX_STR_LENGTH;
+		ops[i].len = USBG_MAX_STR_LENGTH;
 	}
-	f->instance = f->name + strlen(type_name) + 1;
-	f->path = strdup(path);
-	f->parent = parent;
-	f->type = type;
 
-	/* only composed functions (with subdirs) require this callback */
-	switch (usbg_lookup_function_attrs_type(type)) {
-	case USBG_F_ATTRS_MS:
-		f->rm_callback = usbg_rm_ms_function;
-		break;
-	default:
-		f->rm_callback = NULL;
-		break;
+	ret = usbg_io_batch(s, ops, count);
+
+	for (i = 0; ret == USBG_SUCCESS && i < count; ++i) {
+		usbg_cut_line(ops[i].buf);
+		ret = usbg_decode_attr(ops[i].buf, attrs[i].type,
+				       attrs[i].dest);
 	}
 
-	if (!(f->path)) {
-		free(f->name);
-		free(f->path);
-		free(f);
-		f = NULL;
+	if (ret != USBG_SUCCESS) {
+		/* Don't leave half of the strings allocated */
+		while (--i >= 0) {
+			if (attrs[i].type == USBG_ATTR_STRING_ALLOC) {
+				free(*(char **)attrs[i].dest);
+				*(char **)attrs[i].dest = NULL;
+			}
+		}
 	}
 
 out:
-	return f;
+	free(bufs);
+	free(ops);
+	return ret;
 }
 
-static usbg_binding *usbg_allocate_binding(const char *path, const char *name,
-		usbg_config *parent)
-{
-	usbg_binding *b;
-
-	b = malloc(sizeof(*b));
-	if (b) {
-		b->name = strdup(name);
-		b->path = strdup(path);
-		b->parent = parent;
+/* Attribute file stored in field of structure used by library */
+struct usbg_attr_field {
+	const char *name;
+	usbg_attr_type type;
+	size_t offset;
+	size_t size;
+};
 
-		if (!(b->name) || !(b->path)) {
-			free(b->name);
-			free(b->path);
-			free(b);
-			b = NULL;
-		}
+#define USBG_ATTR_FIELD(_struct, _field, _name, _type) {	\
+		.name = _name,					\
+		.type = _type,					\
+		.offset = offsetof(_struct, _field),		\
+		.size = sizeof(((_struct *)0)->_field),		\
 	}
 
-	return b;
-}
-
-static usbg_udc *usbg_allocate_udc(usbg_state *parent, const char *name)
+/* Store integer value narrowed to the size of field */
+static int usbg_store_attr_field(const struct usbg_attr_field *field,
+				 void *dest, int val)
 {
-	usbg_udc *u;
+	char *ptr = (char *)dest + field->offset;
 
-	u = malloc(sizeof(*u));
-	if (!u)
-		goto out;
+	if (field->type == USBG_ATTR_BOOL) {
+		*(bool *)ptr = val;
+		return USBG_SUCCESS;
+	}
 
-	u->gadget = NULL;
-	u->parent = parent;
-	u->name = strdup(name);
-	if (!u->name) {
-		free(u);
-		u = NULL;
+	switch (field->size) {
+	case sizeof(uint8_t):
+		*(uint8_t *)ptr = (uint8_t)val;
+		break;
+	case sizeof(uint16_t):
+		*(uint16_t *)ptr = (uint16_t)val;
+		break;
+	case sizeof(int):
+		*(int *)ptr = val;
+		break;
+	default:
+		return USBG_ERROR_INVALID_PARAM;
 	}
 
- out:
-	return u;
+	return USBG_SUCCESS;
 }
 
-static int ubsg_rm_file(const char *path, const char *name)
+/* Load integer value of field */
+static int usbg_load_attr_field(const struct usbg_attr_field *field,
+				const void *src)
 {
-	int ret = USBG_SUCCESS;
-	int nmb;
-	char buf[USBG_MAX_PATH_LENGTH];
+	const char *ptr = (const char *)src + field->offset;
 
-	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
-	if (nmb < sizeof(buf)) {
-		nmb = unlink(buf);
-		if (nmb != 0)
-			ret = usbg_translate_error(errno);
-	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-	}
+	if (field->type == USBG_ATTR_BOOL)
+		return *(const bool *)ptr;
+	if (field->size == sizeof(uint8_t))
+		return *(const uint8_t *)ptr;
+	if (field->size == sizeof(uint16_t))
+		return *(const uint16_t *)ptr;
 
-	return ret;
+	return *(const int *)ptr;
 }
 
-static int usbg_rm_dir(const char *path, const char *name)
-{
-	int ret = USBG_SUCCESS;
-	int nmb;
-	char buf[USBG_MAX_PATH_LENGTH];
+/*
+ * Read attributes described by fields table into dest structure.
+ * Integers are narrowed to the size of their field.
+ */
+static int usbg_read_attr_fields(usbg_state *s, int dirfd,
+				 const struct usbg_attr_field *fields,
+				 int count, void *dest)
+{
+	usbg_attr_io attrs[count];
+	int vals[count];
+	char *field;
+	int ret;
+	int i;
 
-	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
-	if (nmb < sizeof(buf)) {
-		nmb = rmdir(buf);
-		if (nmb != 0)
-			ret = usbg_translate_error(errno);
-	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	for (i = 0; i < count; ++i) {
+		attrs[i].name = fields[i].name;
+		attrs[i].type = fields[i].type;
+		field = (char *)dest + fields[i].offset;
+		if ((fields[i].type == USBG_ATTR_DEC ||
+		     fields[i].type == USBG_ATTR_HEX) &&
+		    fields[i].size != sizeof(int))
+			attrs[i].dest = &vals[i];
+		else
+			attrs[i].dest = field;
 	}
 
-	return ret;
-}
-
-static int usbg_rm_all_dirs(const char *path)
-{
-	int ret = USBG_SUCCESS;
-	int n, i;
-	struct dirent **dent;
-
-	n = scandir(path, &dent, file_select, alphasort);
-	if (n >= 0) {
-		for (i = 0; i < n; ++i) {
-			if (ret == USBG_SUCCESS)
-				ret = usbg_rm_dir(path, dent[i]->d_name);
+	ret = usbg_read_attr_vec(s, dirfd, attrs, count);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-			free(dent[i]);
-		}
-		free(dent);
-	} else {
-		ret = usbg_translate_error(errno);
+	for (i = 0; i < count && ret == USBG_SUCCESS; ++i) {
+		if (attrs[i].dest == &vals[i])
+			ret = usbg_store_attr_field(fields + i, dest, vals[i]);
 	}
 
+out:
 	return ret;
 }
 
-char *usbg_ether_ntoa_r(const struct ether_addr *addr, char *buf)
+/*
+ * Format integer value as it is written to attribute file.
+ * Hex values are written with as many digits as their field has.
+ */
+static int usbg_format_attr_field(const struct usbg_attr_field *field,
+				  int val, char *buf)
 {
-	sprintf(buf, "%02x:%02x:%02x:%02x:%02x:%02x",
-		addr->ether_addr_octet[0], addr->ether_addr_octet[1],
-		addr->ether_addr_octet[2], addr->ether_addr_octet[3],
-		addr->ether_addr_octet[4], addr->ether_addr_octet[5]);
-	return buf;
+	const char *fmt;
+
+	if (field->type != USBG_ATTR_HEX)
+		fmt = "%d\n";
+	else if (field->size == sizeof(uint8_t))
+		fmt = "0x%02x\n";
+	else if (field->size == sizeof(uint16_t))
+		fmt = "0x%04x\n";
+	else
+		fmt = "0x%x\n";
+
+	return snprintf(buf, USBG_MAX_STR_LENGTH, fmt, val);
 }
 
-static int usbg_parse_function_net_attrs(usbg_function *f,
-		usbg_f_net_attrs *f_net_attrs)
+/*
+ * Prepare write operations of attributes described by fields table
+ * from src structure. Integer values are formatted into bufs.
+ */
+static void usbg_fill_attr_ops(int dirfd, const struct usbg_attr_field *fields,
+			       int count, const void *src,
+			       struct usbg_io_op *ops,
+			       char (*bufs)[USBG_MAX_STR_LENGTH])
 {
-	struct ether_addr *addr;
-	struct ether_addr addr_buf;
-	char str_addr[USBG_MAX_STR_LENGTH];
-	int ret;
-
-	ret = usbg_read_string(f->path, f->name, "dev_addr", str_addr);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	const char *field;
+	const char *str;
+	int i;
 
-	addr = ether_aton_r(str_addr, &addr_buf);
-	if (addr) {
-		f_net_attrs->dev_addr = *addr;
-	} else {
-		ret = USBG_ERROR_IO;
-		goto out;
+	for (i = 0; i < count; ++i) {
+		field = (const char *)src + fields[i].offset;
+
+		ops[i].type = USBG_IO_WRITE;
+		ops[i].dirfd = dirfd;
+		ops[i].name = fields[i].name;
+
+		switch (fields[i].type) {
+		case USBG_ATTR_STRING:
+		case USBG_ATTR_STRING_ALLOC:
+			str = fields[i].type == USBG_ATTR_STRING ? field
+				: *(const char **)field;
+			/* Nothing to write is the same as empty string */
+			ops[i].buf = (char *)(str ? str : "");
+			ops[i].len = strlen(ops[i].buf);
+			break;
+		default:
+			ops[i].buf = bufs[i];
+			ops[i].len = usbg_format_attr_field(fields + i,
+					usbg_load_attr_field(fields + i, src),
+					bufs[i]);
+		}
 	}
+}
 
-	ret = usbg_read_string(f->path, f->name, "host_addr", str_addr);
-	if (ret != USBG_SUCCESS)
-		goto out;
-
-	addr = ether_aton_r(str_addr, &addr_buf);
-	if (addr) {
-		f_net_attrs->host_addr = *addr;
-	} else {
-		ret = USBG_ERROR_IO;
-		goto out;
-	}
+/*
+ * Write attributes described by fields table from src structure.
+ * All files are written even if some of them fail, first error is returned.
+ */
+static int usbg_write_attr_fields(usbg_state *s, int dirfd,
+				  const struct usbg_attr_field *fields,
+				  int count, const void *src)
+{
+	struct usbg_io_op ops[count];
+	char bufs[count][USBG_MAX_STR_LENGTH];
 
-	ret = usbg_read_dec(f->path, f->name, "qmult", &(f_net_attrs->qmult));
-	if (ret != USBG_SUCCESS)
-		goto out;
+	if (USBG_DIRFD_ERROR(dirfd))
+		return dirfd;
 
-	ret = usbg_read_string_alloc(f->path, f->name, "ifname",
-				     &(f_net_attrs->ifname));
-out:
-	return ret;
+	usbg_fill_attr_ops(dirfd, fields, count, src, ops, bufs);
+	return usbg_io_batch(s, ops, count);
 }
 
-static int usbg_parse_function_ms_lun_attrs(const char *path, const char *lun,
-					    usbg_f_ms_lun_attrs *lun_attrs)
+/*
+ * Objects are allocated from state's arena in one block
+ * together with their strings which follow the structure.
+ */
+static void *usbg_alloc_obj(usbg_state *s, size_t size, size_t strs_len)
 {
-	int ret;
-
-	memset(lun_attrs, 0, sizeof(*lun_attrs));
-
-	ret = sscanf(lun, "lun.%d", &lun_attrs->id);
-	if (ret != 1)
-		goto out;
+	void *obj;
 
-	ret = usbg_read_bool(path, lun, "cdrom", &(lun_attrs->cdrom));
-	if (ret != USBG_SUCCESS)
-		goto out;
+	obj = usbg_arena_alloc(&s->arena, size + strs_len);
+	if (obj)
+		memset(obj, 0, size);
 
-	ret = usbg_read_bool(path, lun, "ro", &(lun_attrs->ro));
-	if (ret != USBG_SUCCESS)
-		goto out;
+	return obj;
+}
 
-	ret = usbg_read_bool(path, lun, "nofua", &(lun_attrs->nofua));
-	if (ret != USBG_SUCCESS)
-		goto out;
+static inline void usbg_free_obj(usbg_state *s, void *obj)
+{
+	usbg_arena_free(&s->arena, obj);
+}
 
-	ret = usbg_read_bool(path, lun, "removable", &(lun_attrs->removable));
-	if (ret != USBG_SUCCESS)
-		goto out;
+/*
+ * Caches and transactions are allocated with attribute lock of gadget
+ * held, state may be locked only shared, so other threads may use the
+ * arena at the same time.
+ */
+static void *usbg_alloc_attr_obj(usbg_state *s, size_t size, size_t strs_len)
+{
+	void *obj;
 
-	ret = usbg_read_string_alloc(path, lun, "file",
-				     &(lun_attrs->filename));
+	pthread_mutex_lock(&s->obj_lock);
+	obj = usbg_alloc_obj(s, size, strs_len);
+	pthread_mutex_unlock(&s->obj_lock);
 
-out:
-	return ret;
+	return obj;
 }
 
-static inline int lun_select(const struct dirent *dent)
+static void usbg_free_attr_obj(usbg_state *s, void *obj)
 {
-	int ret;
-	int id;
+	pthread_mutex_lock(&s->obj_lock);
+	usbg_free_obj(s, obj);
+	pthread_mutex_unlock(&s->obj_lock);
+}
 
-	ret = file_select(dent);
-	if (!ret)
-		goto out;
+/*
+ * Caches are created on first access in USBG_INIT_CACHE mode, so object
+ * has a cache only if this mode is enabled. Getters return valid cached
+ * values, setters store what has been successfully written and drop
+ * the value if write has failed.
+ */
 
-	ret = sscanf(dent->d_name, "lun.%d", &id);
-out:
-	return ret;
+static struct usbg_gadget_cache *usbg_gadget_cache(usbg_gadget *g)
+{
+	if (!g->cache && g->parent->opts & USBG_INIT_CACHE)
+		g->cache = usbg_alloc_attr_obj(g->parent, sizeof(*g->cache), 0);
+
+	return g->cache;
 }
 
-static inline int lun_sort(const struct dirent **d1, const struct dirent **d2)
+static struct usbg_config_cache *usbg_config_cache(usbg_config *c)
 {
-	int ret;
-	int id1, id2;
-
-	ret = sscanf((*d1)->d_name, "lun.%d", &id1);
-	if (ret != 1)
-		goto err;
+	if (!c->cache && c->parent->parent->opts & USBG_INIT_CACHE)
+		c->cache = usbg_alloc_attr_obj(c->parent->parent,
+					       sizeof(*c->cache), 0);
 
-	ret = sscanf((*d2)->d_name, "lun.%d", &id2);
-	if (ret != 1)
-		goto err;
+	return c->cache;
+}
 
-	if (id1 < id2)
-		ret = 1;
+static struct usbg_function_cache *usbg_function_cache(usbg_function *f)
+{
+	if (!f->cache && f->parent->parent->opts & USBG_INIT_CACHE)
+		f->cache = usbg_alloc_attr_obj(f->parent->parent,
+					       sizeof(*f->cache), 0);
 
-	return id1 < id2 ? -1 : id1 > id2;
-err:
-	/*
-	 * This should not happened because dentries has been
-	 * already checked by lun_select function. This
-	 * error procedure is just in case.
-	 */
-	return -1;
+	return f->cache;
 }
 
-static int usbg_parse_function_ms_attrs(usbg_function *f,
-		usbg_f_ms_attrs *f_ms_attrs)
+/* Update cached integer attribute after it has been written */
+static int usbg_cache_attr_field(int *valid, const struct usbg_attr_field *field,
+				 void *attrs, int val, int ret)
 {
-	int ret;
-	int nmb;
-	int i = 0;
-	char fpath[USBG_MAX_PATH_LENGTH];
-	usbg_f_ms_lun_attrs *lun_attrs;
-	usbg_f_ms_lun_attrs **luns;
-	struct dirent **dent;
-
-	ret = usbg_read_bool(f->path, f->name, "stall",
-			     &(f_ms_attrs->stall));
 	if (ret != USBG_SUCCESS)
-		goto out;
+		*valid &= ~USBG_CACHE_ATTRS;
+	else if (*valid & USBG_CACHE_ATTRS)
+		usbg_store_attr_field(field, attrs, val);
 
+	return ret;
+}
 
-	nmb = snprintf(fpath, sizeof(fpath), "%s/%s/",
-		       f->path, f->name);
-	if (nmb >= sizeof(fpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+/* Update cached string after it has been written */
+static int usbg_cache_str(int *valid, int cached_lang, char *dest, int lang,
+			  const char *val, int ret)
+{
+	if (ret != USBG_SUCCESS)
+		*valid &= ~USBG_CACHE_STRS;
+	else if (*valid & USBG_CACHE_STRS && cached_lang == lang)
+		snprintf(dest, USBG_MAX_STR_LENGTH, "%s", val);
 
-	nmb = scandir(fpath, &dent, lun_select, lun_sort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
-	}
+	return ret;
+}
 
-	luns = calloc(nmb + 1, sizeof(*luns));
-	if (!luns) {
-		ret = USBG_ERROR_NO_MEM;
-		goto err;
-	}
+/*
+ * Every object is kept in its parent's list, sorted by name
+ * unless state has been initialized with USBG_INIT_UNORDERED,
+ * and in hash indexes used for lookups. Place in sorted list is
+ * found with parent's ordered index, in unordered state the index
+ * stays empty.
+ */
 
-	f_ms_attrs->luns = luns;
-	f_ms_attrs->nluns = nmb;
+#define USBG_INSERT_CHILD(State, HeadPtr, OrderPtr, ToInsert, NodeField) \
+	do { \
+		struct usbg_onode *_next; \
+		if ((State)->opts & USBG_INIT_UNORDERED) { \
+			TAILQ_INSERT_TAIL((HeadPtr), (ToInsert), NodeField); \
+			break; \
+		} \
+		_next = usbg_order_add((OrderPtr), &(ToInsert)->onode, \
+				       (ToInsert)->name); \
+		if (_next) \
+			TAILQ_INSERT_BEFORE(container_of(_next, \
+					typeof(*(ToInsert)), onode), \
+					(ToInsert), NodeField); \
+		else \
+			TAILQ_INSERT_TAIL((HeadPtr), (ToInsert), NodeField); \
+	} while (0)
 
-	for (i = 0; i < nmb; i++) {
-		lun_attrs = malloc(sizeof(*lun_attrs));
-		if (!lun_attrs) {
-			ret = USBG_ERROR_NO_MEM;
-			goto err;
-		}
+static inline void usbg_children_init(struct usbg_children *v,
+				      struct usbg_arena *arena)
+{
+	v->arena = arena;
+	v->items = NULL;
+	v->count = 0;
+	v->size = 0;
+	v->valid = 0;
+}
 
-		ret = usbg_parse_function_ms_lun_attrs(fpath, dent[i]->d_name,
-						       lun_attrs);
-		if (ret != USBG_SUCCESS) {
-			free(lun_attrs);
-			goto err;
-		}
+static inline void usbg_children_changed(struct usbg_children *v, int diff)
+{
+	v->count += diff;
+	v->valid = 0;
+}
 
-		luns[i] = lun_attrs;
-		free(dent[i]);
-	}
-	free(dent);
+static inline unsigned int usbg_function_hash(usbg_function_type type,
+		const char *instance)
+{
+	return usbg_hash_str(instance) ^ ((unsigned int)type * 2654435761u);
+}
 
-	return USBG_SUCCESS;
+static void usbg_insert_gadget(usbg_state *s, usbg_gadget *g)
+{
+	USBG_INSERT_CHILD(s, &s->gadgets, &s->gadget_order, g, gnode);
+	usbg_children_changed(&s->gadget_array, 1);
+	usbg_htable_add(&s->gadget_index, &g->hnode, usbg_hash_str(g->name));
+}
 
-err:
-	while (i < nmb) {
-		free(dent[i]);
-		++i;
-	}
-	free(dent);
+static void usbg_detach_gadget(usbg_gadget *g)
+{
+	TAILQ_REMOVE(&g->parent->gadgets, g, gnode);
+	usbg_order_del(&g->parent->gadget_order, &g->onode);
+	usbg_children_changed(&g->parent->gadget_array, -1);
+	usbg_htable_del(&g->parent->gadget_index, &g->hnode);
+}
 
-	usbg_cleanup_function_attrs(
-		container_of((usbg_f_attrs *)f_ms_attrs,
-			     usbg_function_attrs, attrs));
-out:
-	return ret;
+static void usbg_insert_udc(usbg_state *s, usbg_udc *u)
+{
+	USBG_INSERT_CHILD(s, &s->udcs, &s->udc_order, u, unode);
+	usbg_children_changed(&s->udc_array, 1);
+	usbg_htable_add(&s->udc_index, &u->hnode, usbg_hash_str(u->name));
 }
 
-static int usbg_parse_function_midi_attrs(usbg_function *f,
-		usbg_f_midi_attrs *attrs)
+void usbg_detach_udc(usbg_udc *u)
 {
-	int ret;
+	TAILQ_REMOVE(&u->parent->udcs, u, unode);
+	usbg_order_del(&u->parent->udc_order, &u->onode);
+	usbg_children_changed(&u->parent->udc_array, -1);
+	usbg_htable_del(&u->parent->udc_index, &u->hnode);
+}
 
-	ret = usbg_read_dec(f->path, f->name, "index", &(attrs->index));
-	if (ret != USBG_SUCCESS)
-		goto out;
+static void usbg_insert_function(usbg_gadget *g, usbg_function *f)
+{
+	USBG_INSERT_CHILD(g->parent, &g->functions, &g->function_order, f,
+			  fnode);
+	usbg_children_changed(&g->function_array, 1);
+	usbg_htable_add(&g->function_index, &f->hnode,
+			usbg_function_hash(f->type, f->instance));
+}
 
-	ret = usbg_read_string_alloc(f->path, f->name, "id", &(attrs->id));
-	if (ret != USBG_SUCCESS)
-		goto out;
+static void usbg_detach_function(usbg_function *f)
+{
+	TAILQ_REMOVE(&f->parent->functions, f, fnode);
+	usbg_order_del(&f->parent->function_order, &f->onode);
+	usbg_children_changed(&f->parent->function_array, -1);
+	usbg_htable_del(&f->parent->function_index, &f->hnode);
+}
 
-	ret = usbg_read_dec(f->path, f->name, "in_ports", (int*)&(attrs->in_ports));
-	if (ret != USBG_SUCCESS)
-		goto out;
+static void usbg_insert_config(usbg_gadget *g, usbg_config *c)
+{
+	USBG_INSERT_CHILD(g->parent, &g->configs, &g->config_order, c, cnode);
+	usbg_children_changed(&g->config_array, 1);
+}
 
-	ret = usbg_read_dec(f->path, f->name, "out_ports", (int*)&(attrs->out_ports));
-	if (ret != USBG_SUCCESS)
-		goto out;
+static void usbg_detach_config(usbg_config *c)
+{
+	TAILQ_REMOVE(&c->parent->configs, c, cnode);
+	usbg_order_del(&c->parent->config_order, &c->onode);
+	usbg_children_changed(&c->parent->config_array, -1);
+}
 
-	ret = usbg_read_dec(f->path, f->name, "buflen", (int*)&(attrs->buflen));
-	if (ret != USBG_SUCCESS)
-		goto out;
+static void usbg_insert_binding(usbg_config *c, usbg_binding *b)
+{
+	USBG_INSERT_CHILD(c->parent->parent, &c->bindings, &c->binding_order,
+			  b, bnode);
+	usbg_children_changed(&c->binding_array, 1);
+	usbg_htable_add(&c->binding_index, &b->hnode, usbg_hash_str(b->name));
+	usbg_htable_add(&c->target_index, &b->tnode, usbg_hash_ptr(b->target));
+}
 
-	ret = usbg_read_dec(f->path, f->name, "qlen", (int*)&(attrs->qlen));
-	if (ret != USBG_SUCCESS)
-		goto out;
+static void usbg_detach_binding(usbg_binding *b)
+{
+	TAILQ_REMOVE(&b->parent->bindings, b, bnode);
+	usbg_order_del(&b->parent->binding_order, &b->onode);
+	usbg_children_changed(&b->parent->binding_array, -1);
+	usbg_htable_del(&b->parent->binding_index, &b->hnode);
+	usbg_htable_del(&b->parent->target_index, &b->tnode);
+}
 
-out:
-	return ret;
+static void usbg_set_binding_target(usbg_binding *b, usbg_function *f)
+{
+	usbg_htable_del(&b->parent->target_index, &b->tnode);
+	b->target = f;
+	usbg_htable_add(&b->parent->target_index, &b->tnode, usbg_hash_ptr(f));
 }
 
-static int usbg_parse_function_loopback_attrs(usbg_function *f,
-		usbg_f_loopback_attrs *attrs)
+static inline void usbg_free_binding(usbg_binding *b)
 {
-	int ret;
+	usbg_free_obj(b->parent->parent->parent, b);
+}
 
-	ret = usbg_read_dec(f->path, f->name, "buflen", (int *)&(attrs->buflen));
-	if (ret != USBG_SUCCESS)
-		goto out;
+/* Drop attributes recorded for function in open transaction */
+static void usbg_txn_forget_function(usbg_function *f)
+{
+	struct usbg_gadget_txn *txn = f->parent->txn;
+	int i;
 
-	ret = usbg_read_dec(f->path, f->name, "qlen", (int *)&(attrs->qlen));
+	for (i = 0; txn && i < txn->nfuncs; ++i) {
+		if (txn->funcs[i].f != f)
+			continue;
 
-out:
-	return ret;
+		usbg_cleanup_function_attrs(&txn->funcs[i].attrs);
+		txn->funcs[i] = txn->funcs[--txn->nfuncs];
+		break;
+	}
 }
 
-static int usbg_parse_function_attrs(usbg_function *f,
-		usbg_function_attrs *f_attrs)
+static inline void usbg_free_function(usbg_function *f)
 {
-	int ret;
-	int attrs_type;
+	usbg_txn_forget_function(f);
+	usbg_close_dir(&f->fd);
+	usbg_free_obj(f->parent->parent, f->label);
+	usbg_invalidate_function(f);
+	usbg_free_obj(f->parent->parent, f->cache);
+	usbg_free_obj(f->parent->parent, f);
+}
 
-	attrs_type = usbg_lookup_function_attrs_type(f->type);
-	if (attrs_type < 0) {
-		ret = attrs_type;
-		goto out;
+static void usbg_free_config(usbg_config *c)
+{
+	usbg_binding *b;
+	while (!TAILQ_EMPTY(&c->bindings)) {
+		b = TAILQ_FIRST(&c->bindings);
+		TAILQ_REMOVE(&c->bindings, b, bnode);
+		usbg_free_binding(b);
 	}
+	usbg_htable_release(&c->binding_index);
+	usbg_htable_release(&c->target_index);
+	usbg_free_obj(c->parent->parent, c->binding_array.items);
+	usbg_close_dir(&c->fd);
+	usbg_free_obj(c->parent->parent, c->cache);
+	usbg_free_obj(c->parent->parent, c);
+}
 
-	switch (attrs_type) {
-	case USBG_F_ATTRS_SERIAL:
-		f_attrs->header.attrs_type = USBG_F_ATTRS_SERIAL;
-		ret = usbg_read_dec(f->path, f->name, "port_num",
-				&(f_attrs->attrs.serial.port_num));
-		break;
-
-	case USBG_F_ATTRS_NET:
-		f_attrs->header.attrs_type = USBG_F_ATTRS_NET;
-		ret = usbg_parse_function_net_attrs(f, &(f_attrs->attrs.net));
-		break;
-
-	case USBG_F_ATTRS_PHONET:
-		f_attrs->header.attrs_type = USBG_F_ATTRS_PHONET;
-		ret = usbg_read_string_alloc(f->path, f->name, "ifname",
-					     &(f_attrs->attrs.phonet.ifname));
-		break;
-
-	case USBG_F_ATTRS_FFS:
-	{
-		usbg_f_ffs_attrs *ffs_attrs = &(f_attrs->attrs.ffs);
+static void usbg_free_txn(usbg_state *s, struct usbg_gadget_txn *txn)
+{
+	int i;
 
-		f_attrs->header.attrs_type = USBG_F_ATTRS_FFS;
-		ffs_attrs->dev_name = strdup(f->instance);
-		if (!ffs_attrs->dev_name)
-			ret = USBG_ERROR_NO_MEM;
-		else
-			ret = USBG_SUCCESS;
-		break;
+	if (txn) {
+		for (i = 0; i < txn->nfuncs; ++i)
+			usbg_cleanup_function_attrs(&txn->funcs[i].attrs);
+		usbg_free_attr_obj(s, txn->funcs);
+		usbg_free_attr_obj(s, txn->strs);
 	}
+	usbg_free_attr_obj(s, txn);
+}
 
-	case USBG_F_ATTRS_MS:
-		f_attrs->header.attrs_type = USBG_F_ATTRS_MS;
-		ret = usbg_parse_function_ms_attrs(f, &(f_attrs->attrs.ms));
-		break;
-
-	case USBG_F_ATTRS_MIDI:
-		f_attrs->header.attrs_type = USBG_F_ATTRS_MIDI;
-		ret = usbg_parse_function_midi_attrs(f, &(f_attrs->attrs.midi));
-		break;
-
-	case USBG_F_ATTRS_LOOPBACK:
-		f_attrs->header.attrs_type = USBG_F_ATTRS_LOOPBACK;
-		ret = usbg_parse_function_loopback_attrs(f, &(f_attrs->attrs.loopback));
-		break;
+static void usbg_free_gadget(usbg_gadget *g)
+{
+	usbg_config *c;
+	usbg_function *f;
 
-	default:
-		ERROR("Unsupported function type\n");
-		ret = USBG_ERROR_NOT_SUPPORTED;
-		break;
+	usbg_watch_forget_gadget(g);
+	usbg_warm_pool_forget_gadget(g);
+	while (!TAILQ_EMPTY(&g->configs)) {
+		c = TAILQ_FIRST(&g->configs);
+		TAILQ_REMOVE(&g->configs, c, cnode);
+		usbg_free_config(c);
 	}
-out:
-	return ret;
+	while (!TAILQ_EMPTY(&g->functions)) {
+		f = TAILQ_FIRST(&g->functions);
+		TAILQ_REMOVE(&g->functions, f, fnode);
+		usbg_free_function(f);
+	}
+	usbg_htable_release(&g->function_index);
+	usbg_free_obj(g->parent, g->function_array.items);
+	usbg_free_obj(g->parent, g->config_array.items);
+	usbg_close_dir(&g->fd);
+	usbg_free_obj(g->parent, g->cache);
+	usbg_free_txn(g->parent, g->txn);
+	usbg_attr_lock_destroy(g);
+	usbg_free_obj(g->parent, g);
 }
 
-static int usbg_parse_functions(const char *path, usbg_gadget *g)
+void usbg_free_udc(usbg_udc *u)
 {
-	usbg_function *f;
-	int i, n;
-	int ret = USBG_SUCCESS;
-
-	struct dirent **dent;
-	char fpath[USBG_MAX_PATH_LENGTH];
+	usbg_watch_forget_udc(u);
+	if (u->state_fd >= 0)
+		close(u->state_fd);
+	usbg_free_obj(u->parent, u);
+}
 
-	n = snprintf(fpath, sizeof(fpath), "%s/%s/%s", path, g->name,
-			FUNCTIONS_DIR);
-	if (n >= sizeof(fpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+static void usbg_free_state(usbg_state *s)
+{
+	usbg_gadget *g;
+	usbg_config *c;
+	usbg_function *f;
 
-	n = scandir(fpath, &dent, file_select, alphasort);
-	if (n < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
-	}
+	usbg_watch_stop(s);
+	usbg_warm_pool_orphan_all(s);
 
-	for (i = 0; i < n; i++) {
-		if (ret == USBG_SUCCESS) {
-			const char *instance;
-			usbg_function_type type;
-			ret = usbg_split_function_instance_type(
-					dent[i]->d_name, &type, &instance);
-			if (ret == USBG_SUCCESS) {
-				f = usbg_allocate_function(fpath, type,
-						instance, g);
-				if (f)
-					TAILQ_INSERT_TAIL(&g->functions, f, fnode);
-				else
-					ret = USBG_ERROR_NO_MEM;
-			}
+	/*
+	 * Memory of all objects is released together with the arena.
+	 * Only directory fds and function attributes, cached or recorded
+	 * by open transaction, live outside of it, so objects are walked
+	 * just to drop them.
+	 */
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		usbg_close_dir(&g->fd);
+		TAILQ_FOREACH(c, &g->configs, cnode)
+			usbg_close_dir(&c->fd);
+		TAILQ_FOREACH(f, &g->functions, fnode) {
+			usbg_close_dir(&f->fd);
+			usbg_invalidate_function(f);
 		}
-		free(dent[i]);
+		usbg_free_txn(s, g->txn);
+		usbg_attr_lock_destroy(g);
 	}
-	free(dent);
 
-out:
-	return ret;
+	usbg_arena_release(&s->arena);
+
+	usbg_io_cleanup(s);
+	usbg_close_dir(&s->fd);
+	usbg_lock_destroy(s);
+	free(s->path);
+	free(s->configfs_path);
+	free(s->filter);
+	free(s);
 }
 
-static int usbg_parse_config_attrs(const char *path, const char *name,
-		usbg_config_attrs *c_attrs)
+/*
+ * Compose "prefix/name" in buf. Lengths of both parts are known so this
+ * is a simple append. Returns length of path or USBG_ERROR_PATH_TOO_LONG.
+ */
+static int usbg_join_path(char *buf, size_t size, const char *prefix,
+		size_t prefix_len, const char *name, size_t name_len)
 {
-	int buf, ret;
+	if (prefix_len + name_len + 1 >= size)
+		return USBG_ERROR_PATH_TOO_LONG;
 
-	ret = usbg_read_dec(path, name, "MaxPower", &buf);
-	if (ret == USBG_SUCCESS) {
-		c_attrs->bMaxPower = (uint8_t)buf;
+	memcpy(buf, prefix, prefix_len);
+	buf[prefix_len] = '/';
+	memcpy(buf + prefix_len + 1, name, name_len);
+	buf[prefix_len + name_len + 1] = '\0';
 
-		ret = usbg_read_hex(path, name, "bmAttributes", &buf);
-		if (ret == USBG_SUCCESS)
-			c_attrs->bmAttributes = (uint8_t)buf;
-	}
+	return prefix_len + name_len + 1;
+}
 
+/* Copy string to object's block and move to the place for next one */
+static char *usbg_obj_strcpy(char **pos, const char *str)
+{
+	char *ret = *pos;
+	size_t len = strlen(str) + 1;
+
+	memcpy(ret, str, len);
+	*pos += len;
 	return ret;
 }
 
-static int usbg_parse_config_strs(const char *path, const char *name,
-		int lang, usbg_config_strs *c_strs)
+static usbg_gadget *usbg_allocate_gadget(const char *name, usbg_state *parent)
 {
-	DIR *dir;
-	int ret;
-	int nmb;
-	char spath[USBG_MAX_PATH_LENGTH];
+	usbg_gadget *g;
+	char *pos;
+	size_t name_len = strlen(name);
+	/* path/name/ */
+	size_t dir_len = parent->path_len + name_len + 2;
 
-	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s/0x%x", path, name,
-			STRINGS_DIR, lang);
-	if (nmb < sizeof(spath)) {
-		/* Check if directory exist */
-		dir = opendir(spath);
-		if (dir) {
-			closedir(dir);
-			ret = usbg_read_string(spath, "", "configuration",
-					c_strs->configuration);
-		} else {
-			ret = usbg_translate_error(errno);
+	g = usbg_alloc_obj(parent, sizeof(*g), name_len + 1 +
+			   dir_len + sizeof(FUNCTIONS_DIR) +
+			   dir_len + sizeof(CONFIGS_DIR));
+	if (g) {
+		TAILQ_INIT(&g->functions);
+		TAILQ_INIT(&g->configs);
+		usbg_order_init(&g->function_order);
+		usbg_order_init(&g->config_order);
+		usbg_children_init(&g->function_array, &parent->arena);
+		usbg_children_init(&g->config_array, &parent->arena);
+		usbg_htable_init(&g->function_index, &parent->arena);
+		pos = (char *)(g + 1);
+		g->name = usbg_obj_strcpy(&pos, name);
+		g->name_len = name_len;
+		g->path = parent->path;
+
+		g->functions_path = pos;
+		g->functions_path_len = sprintf(pos, "%s/%s/%s", parent->path,
+						name, FUNCTIONS_DIR);
+		pos += g->functions_path_len + 1;
+
+		g->configs_path = pos;
+		g->configs_path_len = sprintf(pos, "%s/%s/%s", parent->path,
+					      name, CONFIGS_DIR);
+
+		g->parent = parent;
+		g->udc = NULL;
+		g->fd = -1;
+		g->lazy = 0;
+
+		if (usbg_attr_lock_init(g) != USBG_SUCCESS) {
+			usbg_free_obj(parent, g);
+			g = NULL;
 		}
-	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
 	}
 
-	return ret;
+	return g;
 }
 
-static int usbg_parse_config_binding(usbg_config *c, char *bpath, int path_size)
+static usbg_config *usbg_allocate_config(const char *label, int id,
+		usbg_gadget *parent)
 {
+	usbg_config *c;
+	char *pos;
 	int nmb;
-	int ret;
-	char target[USBG_MAX_PATH_LENGTH];
-	char *target_name;
-	const char *instance;
-	usbg_function_type type;
-	usbg_function *f;
-	usbg_binding *b;
+	size_t label_len = strlen(label);
 
-	nmb = readlink(bpath, target, sizeof(target) - 1 );
+	/* label.id */
+	nmb = snprintf(NULL, 0, "%s.%d", label, id);
 	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+		c = NULL;
 		goto out;
 	}
 
-	/* readlink() don't add this,
-	 * so we have to do it manually */
-	target[nmb] = '\0';
-	/* Target contains a full path
-	 * but we need only function dir name */
-	target_name = strrchr(target, '/') + 1;
-
-	ret = usbg_split_function_instance_type(target_name, &type, &instance);
-	if (ret != USBG_SUCCESS)
-		goto out;
-
-	f = usbg_get_function(c->parent, type, instance);
-	if (!f) {
-		ret = USBG_ERROR_OTHER_ERROR;
+	c = usbg_alloc_obj(parent->parent, sizeof(*c), nmb + 1 + label_len + 1 +
+			   parent->configs_path_len + nmb + 2);
+	if (!c)
 		goto out;
-	}
 
-	/* We have to cut last part of path */
-	bpath[path_size] = '\0';
-	/* path_to_config_dir \0 config_name */
-	b = usbg_allocate_binding(bpath, bpath + path_size + 1, c);
-	if (b) {
-		b->target = f;
-		TAILQ_INSERT_TAIL(&c->bindings, b, bnode);
-	} else {
-		ret = USBG_ERROR_NO_MEM;
-	}
+	TAILQ_INIT(&c->bindings);
+	usbg_order_init(&c->binding_order);
+	usbg_children_init(&c->binding_array, &parent->parent->arena);
+	usbg_htable_init(&c->binding_index, &parent->parent->arena);
+	usbg_htable_init(&c->target_index, &parent->parent->arena);
+
+	pos = (char *)(c + 1);
+	c->name = pos;
+	c->name_len = sprintf(c->name, "%s.%d", label, id);
+	pos += c->name_len + 1;
+	c->label = usbg_obj_strcpy(&pos, label);
+	c->label_len = label_len;
+	c->path = parent->configs_path;
+	c->bindings_path = pos;
+	c->bindings_path_len = usbg_join_path(pos, parent->configs_path_len +
+					      c->name_len + 2, c->path,
+					      parent->configs_path_len,
+					      c->name, c->name_len);
+	c->parent = parent;
+	c->id = id;
+	c->fd = -1;
 
 out:
-	return ret;
+	return c;
 }
 
-static int usbg_parse_config_bindings(usbg_config *c)
+static int usbg_rm_ms_function(usbg_function *f, int opts);
+
+static usbg_function *usbg_allocate_function(usbg_function_type type,
+		const char *instance, usbg_gadget *parent)
 {
-	int i, n, nmb;
-	int ret = USBG_SUCCESS;
-	struct dirent **dent;
-	char bpath[USBG_MAX_PATH_LENGTH];
-	int end;
+	usbg_function *f = NULL;
+	const char *type_name;
+	size_t type_len, instance_len;
 
-	end = snprintf(bpath, sizeof(bpath), "%s/%s", c->path, c->name);
-	if (end >= sizeof(bpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	type_name = usbg_get_function_type_str(type);
+	if (!type_name)
 		goto out;
-	}
 
-	n = scandir(bpath, &dent, bindings_select, alphasort);
-	if (n < 0) {
-		ret = usbg_translate_error(errno);
+	type_len = strlen(type_name);
+	instance_len = strlen(instance);
+
+	/* type.instance */
+	f = usbg_alloc_obj(parent->parent, sizeof(*f),
+			   type_len + instance_len + 2);
+	if (!f)
 		goto out;
-	}
 
-	for (i = 0; i < n; i++) {
-		if (ret == USBG_SUCCESS) {
-			nmb = snprintf(&(bpath[end]), sizeof(bpath) - end,
-					"/%s", dent[i]->d_name);
+	f->label = NULL;
+	f->name = (char *)(f + 1);
+	f->name_len = sprintf(f->name, "%s.%s", type_name, instance);
+	f->instance = f->name + type_len + 1;
+	f->instance_len = instance_len;
+	f->path = parent->functions_path;
+	f->parent = parent;
+	f->type = type;
+	f->fd = -1;
 
-			ret = nmb < sizeof(bpath) - end ?
-					usbg_parse_config_binding(c, bpath, end)
-					: USBG_ERROR_PATH_TOO_LONG;
-		} /* ret == USBG_SUCCESS */
-		free(dent[i]);
+	/* only composed functions (with subdirs) require this callback */
+	switch (usbg_lookup_function_attrs_type(type)) {
+	case USBG_F_ATTRS_MS:
+		f->rm_callback = usbg_rm_ms_function;
+		break;
+	default:
+		f->rm_callback = NULL;
+		break;
 	}
-	free(dent);
 
 out:
-	return ret;
+	return f;
 }
 
-static int usbg_parse_config(const char *path, const char *name,
-		usbg_gadget *g)
+static usbg_binding *usbg_allocate_binding(const char *name,
+		usbg_config *parent)
 {
-	int ret;
-	char *label = NULL;
-	usbg_config *c;
+	usbg_binding *b;
+	char *pos;
+	size_t name_len = strlen(name);
 
-	ret = usbg_split_config_label_id(name, &label);
-	if (ret <= 0)
-		goto out;
+	b = usbg_alloc_obj(parent->parent->parent, sizeof(*b), name_len + 1);
+	if (b) {
+		pos = (char *)(b + 1);
+		b->name = usbg_obj_strcpy(&pos, name);
+		b->name_len = name_len;
+		b->path = parent->bindings_path;
+		b->parent = parent;
+	}
 
-	c = usbg_allocate_config(path, label, ret, g);
-	if (!c) {
-		ret = USBG_ERROR_NO_MEM;
+	return b;
+}
+
+static usbg_udc *usbg_allocate_udc(usbg_state *parent, const char *name)
+{
+	usbg_udc *u;
+	char *pos;
+
+	u = usbg_alloc_obj(parent, sizeof(*u), strlen(name) + 1);
+	if (!u)
 		goto out;
-	}
 
-	ret = usbg_parse_config_bindings(c);
-	if (ret == USBG_SUCCESS)
-		TAILQ_INSERT_TAIL(&g->configs, c, cnode);
-	else
-		usbg_free_config(c);
+	pos = (char *)(u + 1);
+	u->gadget = NULL;
+	u->parent = parent;
+	u->name = usbg_obj_strcpy(&pos, name);
+	u->name_len = strlen(name);
+	u->state_fd = -1;
+	u->state = USBG_UDC_STATE_UNKNOWN;
+	u->event_gadget = NULL;
+	u->bind_ns = 0;
+	u->configured_ns = 0;
 
-out:
-	free(label);
-	return ret;
+ out:
+	return u;
 }
 
-static int usbg_parse_configs(const char *path, usbg_gadget *g)
+static int ubsg_rm_file(const char *path, const char *name)
 {
-	int i, n;
 	int ret = USBG_SUCCESS;
-	struct dirent **dent;
-	char cpath[USBG_MAX_PATH_LENGTH];
+	int nmb;
+	char buf[USBG_MAX_PATH_LENGTH];
 
-	n = snprintf(cpath, sizeof(cpath), "%s/%s/%s", path, g->name,
-			CONFIGS_DIR);
-	if (n >= sizeof(cpath)) {
+	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
+	if (nmb < sizeof(buf)) {
+		nmb = unlink(buf);
+		if (nmb != 0)
+			ret = usbg_translate_error(errno);
+	} else {
 		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
 	}
 
-	n = scandir(cpath, &dent, file_select, alphasort);
-	if (n < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
-	}
+	return ret;
+}
+
+static int usbg_rm_dir(const char *path, const char *name)
+{
+	int ret = USBG_SUCCESS;
+	int nmb;
+	char buf[USBG_MAX_PATH_LENGTH];
 
-	for (i = 0; i < n; i++) {
-		ret = ret == USBG_SUCCESS ?
-				usbg_parse_config(cpath, dent[i]->d_name, g)
-				: ret;
-		free(dent[i]);
+	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
+	if (nmb < sizeof(buf)) {
+		nmb = rmdir(buf);
+		if (nmb != 0)
+			ret = usbg_translate_error(errno);
+	} else {
+		ret = USBG_ERROR_PATH_TOO_LONG;
 	}
-	free(dent);
 
-out:
 	return ret;
 }
 
-static int usbg_parse_gadget_attrs(const char *path, const char *name,
-		usbg_gadget_attrs *g_attrs)
+static int usbg_rm_all_dirs(usbg_state *s, const char *path)
 {
-	int buf, ret;
-
-	/* Actual attributes */
-
-	ret = usbg_read_hex(path, name, "bcdUSB", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bcdUSB = (uint16_t) buf;
-	else
-		goto out;
+	int ret = USBG_SUCCESS;
+	int i;
+	int fd;
+	struct usbg_dir dir;
+	struct usbg_io_op *ops;
 
-	ret = usbg_read_hex(path, name, "bDeviceClass", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bDeviceClass = (uint8_t)buf;
-	else
+	/* Order doesn't matter for removal so the listing is not sorted */
+	ret = usbg_read_dir(AT_FDCWD, path, file_select, NULL, &dir);
+	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_hex(path, name, "bDeviceSubClass", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bDeviceSubClass = (uint8_t)buf;
-	else
-		goto out;
-
-	ret = usbg_read_hex(path, name, "bDeviceProtocol", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bDeviceProtocol = (uint8_t) buf;
-	else
-		goto out;
-
-	ret = usbg_read_hex(path, name, "bMaxPacketSize0", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bMaxPacketSize0 = (uint8_t) buf;
-	else
-		goto out;
+	ops = calloc(dir.n, sizeof(*ops));
+	if (!ops) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out_dir;
+	}
 
-	ret = usbg_read_hex(path, name, "idVendor", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->idVendor = (uint16_t) buf;
-	else
-		goto out;
+	ret = usbg_open_dir(AT_FDCWD, path, &fd);
+	if (ret != USBG_SUCCESS)
+		goto out_ops;
 
-	ret = usbg_read_hex(path, name, "idProduct", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->idProduct = (uint16_t) buf;
-	else
-		goto out;
+	for (i = 0; i < dir.n; ++i) {
+		ops[i].type = USBG_IO_RMDIR;
+		ops[i].dirfd = fd;
+		ops[i].name = dir.ents[i].name;
+	}
 
-	ret = usbg_read_hex(path, name, "bcdDevice", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bcdDevice = (uint16_t) buf;
-	else
-		goto out;
+	ret = usbg_io_batch(s, ops, dir.n);
+	close(fd);
 
+out_ops:
+	free(ops);
+out_dir:
+	usbg_release_dir(&dir);
 out:
 	return ret;
 }
 
-static int usbg_parse_gadget_strs(const char *path, const char *name, int lang,
-		usbg_gadget_strs *g_strs)
+char *usbg_ether_ntoa_r(const struct ether_addr *addr, char *buf)
+{
+	sprintf(buf, "%02x:%02x:%02x:%02x:%02x:%02x",
+		addr->ether_addr_octet[0], addr->ether_addr_octet[1],
+		addr->ether_addr_octet[2], addr->ether_addr_octet[3],
+		addr->ether_addr_octet[4], addr->ether_addr_octet[5]);
+	return buf;
+}
+
+static int usbg_parse_function_net_attrs(usbg_function *f,
+		usbg_f_net_attrs *f_net_attrs)
 {
+	struct ether_addr *addr;
+	char dev_addr[USBG_MAX_STR_LENGTH];
+	char host_addr[USBG_MAX_STR_LENGTH];
+	usbg_attr_io attrs[] = {
+		{ "dev_addr", USBG_ATTR_STRING, dev_addr },
+		{ "host_addr", USBG_ATTR_STRING, host_addr },
+		{ "qmult", USBG_ATTR_DEC, &(f_net_attrs->qmult) },
+		{ "ifname", USBG_ATTR_STRING_ALLOC, &(f_net_attrs->ifname) },
+	};
 	int ret;
-	int nmb;
-	DIR *dir;
-	char spath[USBG_MAX_PATH_LENGTH];
 
-	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s/0x%x", path, name,
-			STRINGS_DIR, lang);
-	if (nmb >= sizeof(spath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	ret = usbg_read_attr_vec(f->parent->parent, usbg_function_dirfd(f),
+				 attrs, ARRAY_SIZE(attrs));
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
-
-	/* Check if directory exist */
-	dir = opendir(spath);
-	if (dir) {
-		closedir(dir);
-		ret = usbg_read_string(spath, "", "serialnumber", g_strs->str_ser);
-		if (ret != USBG_SUCCESS)
-			goto out;
 
-		ret = usbg_read_string(spath, "", "manufacturer", g_strs->str_mnf);
-		if (ret != USBG_SUCCESS)
-			goto out;
+	addr = ether_aton_r(dev_addr, &f_net_attrs->dev_addr);
+	if (addr)
+		addr = ether_aton_r(host_addr, &f_net_attrs->host_addr);
 
-		ret = usbg_read_string(spath, "", "product", g_strs->str_prd);
-		if (ret != USBG_SUCCESS)
-			goto out;
-	} else {
-		ret = usbg_translate_error(errno);
+	if (!addr) {
+		ret = USBG_ERROR_IO;
+		free((char *)f_net_attrs->ifname);
+		f_net_attrs->ifname = NULL;
 	}
-
 out:
 	return ret;
 }
 
-static inline int usbg_parse_gadget(usbg_gadget *g)
+static const struct usbg_attr_field ms_attr_fields[] = {
+	USBG_ATTR_FIELD(usbg_f_ms_attrs, stall, "stall", USBG_ATTR_BOOL),
+};
+
+static const struct usbg_attr_field ms_lun_attr_fields[] = {
+	USBG_ATTR_FIELD(usbg_f_ms_lun_attrs, cdrom, "cdrom", USBG_ATTR_BOOL),
+	USBG_ATTR_FIELD(usbg_f_ms_lun_attrs, ro, "ro", USBG_ATTR_BOOL),
+	USBG_ATTR_FIELD(usbg_f_ms_lun_attrs, nofua, "nofua", USBG_ATTR_BOOL),
+	USBG_ATTR_FIELD(usbg_f_ms_lun_attrs, removable, "removable",
+			USBG_ATTR_BOOL),
+	USBG_ATTR_FIELD(usbg_f_ms_lun_attrs, filename, "file",
+			USBG_ATTR_STRING_ALLOC),
+};
+
+static int usbg_parse_function_ms_lun_attrs(usbg_state *s, int dirfd,
+					    const char *lun,
+					    usbg_f_ms_lun_attrs *lun_attrs)
 {
 	int ret;
-	char buf[USBG_MAX_STR_LENGTH];
+	int fd;
 
-	/* UDC bound to, if any */
-	ret = usbg_read_string(g->path, g->name, "UDC", buf);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	memset(lun_attrs, 0, sizeof(*lun_attrs));
 
-	g->udc = usbg_get_udc(g->parent, buf);
-	if (g->udc)
-		g->udc->gadget = g;
+	ret = sscanf(lun, "lun.%d", &lun_attrs->id);
+	if (ret != 1)
+		goto out;
 
-	ret = usbg_parse_functions(g->path, g);
+	ret = usbg_open_dir(dirfd, lun, &fd);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_parse_configs(g->path, g);
+	ret = usbg_read_attr_fields(s, fd, ms_lun_attr_fields,
+				    ARRAY_SIZE(ms_lun_attr_fields), lun_attrs);
+	close(fd);
 out:
 	return ret;
 }
 
-static int usbg_parse_gadgets(const char *path, usbg_state *s)
-{
-	usbg_gadget *g;
-	int i, n;
-	int ret = USBG_SUCCESS;
-	struct dirent **dent;
-
-	n = scandir(path, &dent, file_select, alphasort);
-	if (n >= 0) {
-		for (i = 0; i < n; i++) {
-			/* Check if earlier gadgets
-			 * has been created correctly */
-			if (ret == USBG_SUCCESS) {
-				/* Create new gadget and insert it into list */
-				g = usbg_allocate_gadget(path, dent[i]->d_name, s);
-				if (g) {
-					ret = usbg_parse_gadget(g);
-					if (ret == USBG_SUCCESS)
-						TAILQ_INSERT_TAIL(&s->gadgets, g, gnode);
-					else
-						usbg_free_gadget(g);
-				} else {
-					ret = USBG_ERROR_NO_MEM;
-				}
-			}
-			free(dent[i]);
-		}
-		free(dent);
-	} else {
-		ret = usbg_translate_error(errno);
-	}
-
-	return ret;
-}
-
-static int usbg_parse_udcs(usbg_state *s)
+static inline int lun_select(const char *name, unsigned char type)
 {
-	usbg_udc *u;
-	int n, i;
-	int ret = USBG_SUCCESS;
-	struct dirent **dent;
+	int ret;
+	int id;
 
-	n = scandir("/sys/class/udc", &dent, file_select, alphasort);
-	if (n < 0) {
-		ret = usbg_translate_error(errno);
+	ret = file_select(name, type);
+	if (!ret)
 		goto out;
-	}
-
-	for (i = 0; i < n; ++i) {
-		if (ret == USBG_SUCCESS) {
-			u = usbg_allocate_udc(s, dent[i]->d_name);
-			if (u)
-				TAILQ_INSERT_TAIL(&s->udcs, u, unode);
-			else
-				ret = USBG_ERROR_NO_MEM;
-		}
-
-		free(dent[i]);
-	}
-	free(dent);
 
+	ret = sscanf(name, "lun.%d", &id);
 out:
 	return ret;
 }
 
-static usbg_state *usbg_allocate_state(const char *configfs_path, char *path)
+static inline int lun_sort(const void *a, const void *b)
 {
-	usbg_state *s;
+	const struct usbg_dirent *d1 = a;
+	const struct usbg_dirent *d2 = b;
+	int ret;
+	int id1, id2;
 
-	s = malloc(sizeof(*s));
-	if (!s)
+	ret = sscanf(d1->name, "lun.%d", &id1);
+	if (ret != 1)
 		goto err;
 
-	s->configfs_path = strdup(configfs_path);
-	if (!s->configfs_path)
-		goto cpath_failed;
-
-	/* State takes the ownership of path and should free it */
-	s->path = path;
-	s->last_failed_import = NULL;
-	TAILQ_INIT(&s->gadgets);
-	TAILQ_INIT(&s->udcs);
-
-	return s;
+	ret = sscanf(d2->name, "lun.%d", &id2);
+	if (ret != 1)
+		goto err;
 
-cpath_failed:
-	free(s);
+	return id1 < id2 ? -1 : id1 > id2;
 err:
-	return NULL;
+	/*
+	 * This should not happened because dentries has been
+	 * already checked by lun_select function. This
+	 * error procedure is just in case.
+	 */
+	return -1;
 }
 
-static int usbg_parse_state(usbg_state *s)
+static int usbg_parse_function_ms_attrs(usbg_function *f,
+		usbg_f_ms_attrs *f_ms_attrs)
 {
-	int ret = USBG_SUCCESS;
+	int ret;
+	int nmb;
+	int i = 0;
+	char fpath[USBG_MAX_PATH_LENGTH];
+	usbg_f_ms_lun_attrs *lun_attrs;
+	usbg_f_ms_lun_attrs **luns;
+	struct usbg_dir dir;
+	int fd;
 
-	/*
-	 * USBG_ERROR_NOT_FOUND is returned if we are running on machine where
-	 * there is no udc support in kernel (no /sys/class/udc dir).
-	 * This check allows to run library on such machine or if we don't
-	 * have rights to read this directory.
-	 * User will be able to finish init function and manage gadgets but
-	 * wont be able to bind it as there is no UDC.
-	 */
-	ret = usbg_parse_udcs(s);
-	if (ret != USBG_SUCCESS && ret != USBG_ERROR_NOT_FOUND &&
-		ret != USBG_ERROR_NO_ACCESS) {
-		ERROR("Unable to parse udcs");
+	fd = usbg_function_dirfd(f);
+	if (fd < 0) {
+		ret = fd;
 		goto out;
 	}
 
-	ret = usbg_parse_gadgets(s->path, s);
+	ret = usbg_read_bool(fd, "stall", &(f_ms_attrs->stall));
 	if (ret != USBG_SUCCESS)
-		ERROR("unable to parse %s\n", s->path);
-
-out:
-	return ret;
-}
+		goto out;
 
-/*
- * User API
- */
 
-int usbg_init(const char *configfs_path, usbg_state **state)
-{
-	int ret = USBG_SUCCESS;
-	DIR *dir;
-	char *path;
-	usbg_state *s;
+	nmb = snprintf(fpath, sizeof(fpath), "%s/%s/",
+		       f->path, f->name);
+	if (nmb >= sizeof(fpath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
 
-	ret = asprintf(&path, "%s/" GADGETS_DIR, configfs_path);
-	if (ret < 0)
-		return USBG_ERROR_NO_MEM;
-	else
-		ret = USBG_SUCCESS;
+	ret = usbg_read_dir(AT_FDCWD, fpath, lun_select, lun_sort, &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-	/* Check if directory exist */
-	dir = opendir(path);
-	if (!dir) {
-		ERRORNO("couldn't init gadget state\n");
-		ret = usbg_translate_error(errno);
-		goto err;
-	}
+	nmb = dir.n;
 
-	closedir(dir);
-	s = usbg_allocate_state(configfs_path, path);
-	if (!s) {
+	luns = calloc(nmb + 1, sizeof(*luns));
+	if (!luns) {
 		ret = USBG_ERROR_NO_MEM;
 		goto err;
 	}
 
-	ret = usbg_parse_state(s);
-	if (ret != USBG_SUCCESS) {
-		ERROR("couldn't init gadget state\n");
-		usbg_free_state(s);
-		goto out;
-	}
+	f_ms_attrs->luns = luns;
+	f_ms_attrs->nluns = nmb;
 
-	*state = s;
+	for (i = 0; i < nmb; i++) {
+		lun_attrs = malloc(sizeof(*lun_attrs));
+		if (!lun_attrs) {
+			ret = USBG_ERROR_NO_MEM;
+			goto err;
+		}
 
-	return ret;
+		ret = usbg_parse_function_ms_lun_attrs(f->parent->parent, fd,
+						       dir.ents[i].name,
+						       lun_attrs);
+		if (ret != USBG_SUCCESS) {
+			free(lun_attrs);
+			goto err;
+		}
+
+		luns[i] = lun_attrs;
+	}
+	usbg_release_dir(&dir);
+
+	return USBG_SUCCESS;
 
 err:
-	free(path);
+	usbg_release_dir(&dir);
+
+	usbg_cleanup_function_attrs(
+		container_of((usbg_f_attrs *)f_ms_attrs,
+			     usbg_function_attrs, attrs));
 out:
 	return ret;
 }
 
-void usbg_cleanup(usbg_state *s)
-{
-	usbg_free_state(s);
-}
+static const struct usbg_attr_field midi_attr_fields[] = {
+	USBG_ATTR_FIELD(usbg_f_midi_attrs, index, "index", USBG_ATTR_DEC),
+	USBG_ATTR_FIELD(usbg_f_midi_attrs, id, "id", USBG_ATTR_STRING_ALLOC),
+	USBG_ATTR_FIELD(usbg_f_midi_attrs, in_ports, "in_ports", USBG_ATTR_DEC),
+	USBG_ATTR_FIELD(usbg_f_midi_attrs, out_ports, "out_ports",
+			USBG_ATTR_DEC),
+	USBG_ATTR_FIELD(usbg_f_midi_attrs, buflen, "buflen", USBG_ATTR_DEC),
+	USBG_ATTR_FIELD(usbg_f_midi_attrs, qlen, "qlen", USBG_ATTR_DEC),
+};
 
-const char *usbg_get_configfs_path(usbg_state *s)
+static int usbg_parse_function_midi_attrs(usbg_function *f,
+		usbg_f_midi_attrs *attrs)
 {
-	return s ? s->configfs_path : NULL;
+	return usbg_read_attr_fields(f->parent->parent,
+				     usbg_function_dirfd(f), midi_attr_fields,
+				     ARRAY_SIZE(midi_attr_fields), attrs);
 }
 
-size_t usbg_get_configfs_path_len(usbg_state *s)
-{
-	return s ? strlen(s->configfs_path) : USBG_ERROR_INVALID_PARAM;
-}
+static const struct usbg_attr_field loopback_attr_fields[] = {
+	USBG_ATTR_FIELD(usbg_f_loopback_attrs, buflen, "buflen", USBG_ATTR_DEC),
+	USBG_ATTR_FIELD(usbg_f_loopback_attrs, qlen, "qlen", USBG_ATTR_DEC),
+};
 
-int usbg_cpy_configfs_path(usbg_state *s, char *buf, size_t len)
+static int usbg_parse_function_loopback_attrs(usbg_function *f,
+		usbg_f_loopback_attrs *attrs)
 {
-	if (!s || !buf || len == 0)
-		return USBG_ERROR_INVALID_PARAM;
-
-	buf[--len] = '\0';
-	strncpy(buf, s->configfs_path, len);
-
-	return USBG_SUCCESS;
+	return usbg_read_attr_fields(f->parent->parent,
+				     usbg_function_dirfd(f),
+				     loopback_attr_fields,
+				     ARRAY_SIZE(loopback_attr_fields), attrs);
 }
 
-usbg_gadget *usbg_get_gadget(usbg_state *s, const char *name)
+static int usbg_parse_function_attrs(usbg_function *f,
+		usbg_function_attrs *f_attrs)
 {
-	usbg_gadget *g;
+	int ret;
+	int attrs_type;
 
-	TAILQ_FOREACH(g, &s->gadgets, gnode)
-		if (!strcmp(g->name, name))
-			return g;
+	attrs_type = usbg_lookup_function_attrs_type(f->type);
+	if (attrs_type < 0) {
+		ret = attrs_type;
+		goto out;
+	}
 
-	return NULL;
+	switch (attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		f_attrs->header.attrs_type = USBG_F_ATTRS_SERIAL;
+		ret = usbg_function_dirfd(f);
+		if (ret >= 0)
+			ret = usbg_read_dec(ret, "port_num",
+					&(f_attrs->attrs.serial.port_num));
+		break;
+
+	case USBG_F_ATTRS_NET:
+		f_attrs->header.attrs_type = USBG_F_ATTRS_NET;
+		ret = usbg_parse_function_net_attrs(f, &(f_attrs->attrs.net));
+		break;
+
+	case USBG_F_ATTRS_PHONET:
+		f_attrs->header.attrs_type = USBG_F_ATTRS_PHONET;
+		ret = usbg_function_dirfd(f);
+		if (ret >= 0)
+			ret = usbg_read_string_alloc(ret, "ifname",
+					&(f_attrs->attrs.phonet.ifname));
+		break;
+
+	case USBG_F_ATTRS_FFS:
+	{
+		usbg_f_ffs_attrs *ffs_attrs = &(f_attrs->attrs.ffs);
+
+		f_attrs->header.attrs_type = USBG_F_ATTRS_FFS;
+		ffs_attrs->dev_name = strdup(f->instance);
+		if (!ffs_attrs->dev_name)
+			ret = USBG_ERROR_NO_MEM;
+		else
+			ret = USBG_SUCCESS;
+		break;
+	}
+
+	case USBG_F_ATTRS_MS:
+		f_attrs->header.attrs_type = USBG_F_ATTRS_MS;
+		ret = usbg_parse_function_ms_attrs(f, &(f_attrs->attrs.ms));
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		f_attrs->header.attrs_type = USBG_F_ATTRS_MIDI;
+		ret = usbg_parse_function_midi_attrs(f, &(f_attrs->attrs.midi));
+		break;
+
+	case USBG_F_ATTRS_LOOPBACK:
+		f_attrs->header.attrs_type = USBG_F_ATTRS_LOOPBACK;
+		ret = usbg_parse_function_loopback_attrs(f, &(f_attrs->attrs.loopback));
+		break;
+
+	default:
+		ERROR("Unsupported function type\n");
+		ret = USBG_ERROR_NOT_SUPPORTED;
+		break;
+	}
+out:
+	return ret;
 }
 
-usbg_function *usbg_get_function(usbg_gadget *g,
-		usbg_function_type type, const char *instance)
+static int usbg_parse_function(const char *name, usbg_gadget *g)
 {
-	usbg_function *f = NULL;
+	const char *instance;
+	usbg_function_type type;
+	usbg_function *f;
+	int ret;
 
-	TAILQ_FOREACH(f, &g->functions, fnode)
-		if (f->type == type && (!strcmp(f->instance, instance)))
-			break;
+	ret = usbg_split_function_instance_type(name, &type, &instance);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-	return f;
+	f = usbg_allocate_function(type, instance, g);
+	if (f)
+		usbg_insert_function(g, f);
+	else
+		ret = USBG_ERROR_NO_MEM;
+
+out:
+	return ret;
 }
 
-usbg_config *usbg_get_config(usbg_gadget *g, int id, const char *label)
+static int usbg_parse_functions(usbg_gadget *g)
 {
-	usbg_config *c = NULL;
+	int i;
+	int ret = USBG_SUCCESS;
 
-	TAILQ_FOREACH(c, &g->configs, cnode)
-		if (c->id == id && (!label || !strcmp(c->label, label)))
-			break;
+	struct usbg_dir dir;
 
-	return c;
+	if (g->functions_path_len >= USBG_MAX_PATH_LENGTH) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	ret = usbg_read_dir(AT_FDCWD, g->functions_path, file_select,
+			    usbg_dir_order(g->parent), &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; i++)
+		ret = usbg_parse_function(dir.ents[i].name, g);
+
+	usbg_release_dir(&dir);
+
+out:
+	return ret;
 }
 
-usbg_udc *usbg_get_udc(usbg_state *s, const char *name)
+static const struct usbg_attr_field config_attr_fields[] = {
+	USBG_ATTR_FIELD(usbg_config_attrs, bMaxPower, "MaxPower",
+			USBG_ATTR_DEC),
+	USBG_ATTR_FIELD(usbg_config_attrs, bmAttributes, "bmAttributes",
+			USBG_ATTR_HEX),
+};
+
+static int usbg_parse_config_attrs(usbg_config *c,
+		usbg_config_attrs *c_attrs)
 {
-	usbg_udc *u;
+	return usbg_read_attr_fields(c->parent->parent, usbg_config_dirfd(c),
+				     config_attr_fields,
+				     ARRAY_SIZE(config_attr_fields), c_attrs);
+}
 
-	TAILQ_FOREACH(u, &s->udcs, unode)
-		if (!strcmp(u->name, name))
-			return u;
+static int usbg_parse_config_strs(usbg_config *c, int lang,
+		usbg_config_strs *c_strs)
+{
+	int fd;
 
-	return NULL;
+	fd = usbg_config_dirfd(c);
+	if (fd < 0)
+		return fd;
+
+	return usbg_read_str_file(fd, lang, "configuration",
+				  c_strs->configuration);
 }
 
-usbg_binding *usbg_get_binding(usbg_config *c, const char *name)
+/* Find function in index of gadget, functions must have been parsed */
+static usbg_function *usbg_lookup_function(usbg_gadget *g,
+		usbg_function_type type, const char *instance)
 {
-	usbg_binding *b;
+	struct usbg_hnode *n;
+	usbg_function *f;
+	unsigned int hash = usbg_function_hash(type, instance);
 
-	TAILQ_FOREACH(b, &c->bindings, bnode)
-		if (!strcmp(b->name, name))
-			return b;
+	usbg_htable_for_each(n, &g->function_index, hash) {
+		f = container_of(n, usbg_function, hnode);
+		if (f->type == type && (!strcmp(f->instance, instance)))
+			return f;
+	}
 
 	return NULL;
 }
 
-usbg_binding *usbg_get_link_binding(usbg_config *c, usbg_function *f)
+static int usbg_parse_binding_target(usbg_gadget *g, const char *bpath,
+		usbg_function **f)
 {
-	usbg_binding *b;
+	int nmb;
+	int ret;
+	char target[USBG_MAX_PATH_LENGTH];
+	char *target_name;
+	const char *instance;
+	usbg_function_type type;
 
-	TAILQ_FOREACH(b, &c->bindings, bnode)
-		if (b->target == f)
-			return b;
+	nmb = readlink(bpath, target, sizeof(target) - 1 );
+	if (nmb < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
 
-	return NULL;
+	/* readlink() don't add this,
+	 * so we have to do it manually */
+	target[nmb] = '\0';
+	/* Target contains a full path
+	 * but we need only function dir name */
+	target_name = strrchr(target, '/') + 1;
+
+	ret = usbg_split_function_instance_type(target_name, &type, &instance);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	/*
+	 * Functions of gadget have just been parsed by this thread, so they
+	 * are looked up directly, without taking any lock of the state.
+	 */
+	*f = usbg_lookup_function(g, type, instance);
+	if (!*f)
+		ret = USBG_ERROR_OTHER_ERROR;
+
+out:
+	return ret;
 }
 
-int usbg_rm_binding(usbg_binding *b)
+static int usbg_parse_config_binding(usbg_config *c, const char *bpath,
+		const char *name)
 {
-	int ret = USBG_SUCCESS;
-	usbg_config *c;
-
-	if (!b)
-		return USBG_ERROR_INVALID_PARAM;
+	int ret;
+	usbg_function *f;
+	usbg_binding *b;
 
-	c = b->parent;
+	ret = usbg_parse_binding_target(c->parent, bpath, &f);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-	ret = ubsg_rm_file(b->path, b->name);
-	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(c->bindings), b, bnode);
-		usbg_free_binding(b);
+	b = usbg_allocate_binding(name, c);
+	if (b) {
+		b->target = f;
+		usbg_insert_binding(c, b);
+	} else {
+		ret = USBG_ERROR_NO_MEM;
 	}
 
+out:
 	return ret;
 }
 
-int usbg_rm_config(usbg_config *c, int opts)
+static int usbg_parse_config_bindings(usbg_config *c)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
-	usbg_gadget *g;
+	int i, nmb;
+	int ret = USBG_SUCCESS;
+	struct usbg_dir dir;
+	char bpath[USBG_MAX_PATH_LENGTH];
 
-	if (!c)
-		return ret;
+	if (c->bindings_path_len >= sizeof(bpath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
 
-	g = c->parent;
+	ret = usbg_read_dir(AT_FDCWD, c->bindings_path, bindings_select,
+			    usbg_dir_order(c->parent->parent), &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-	if (opts & USBG_RM_RECURSE) {
-		/* Recursive flag was given
-		 * so remove all bindings and strings */
-		char spath[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		usbg_binding *b;
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; i++) {
+		nmb = usbg_join_path(bpath, sizeof(bpath),
+				     c->bindings_path,
+				     c->bindings_path_len,
+				     dir.ents[i].name,
+				     strlen(dir.ents[i].name));
 
-		while (!TAILQ_EMPTY(&c->bindings)) {
-			b = TAILQ_FIRST(&c->bindings);
-			ret = usbg_rm_binding(b);
-			if (ret != USBG_SUCCESS)
-				goto out;
-		}
+		ret = nmb >= 0 ?
+			usbg_parse_config_binding(c, bpath, dir.ents[i].name)
+			: nmb;
+	}
 
-		nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", c->path,
-				c->name, STRINGS_DIR);
-		if (nmb >= sizeof(spath)) {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-			goto out;
-		}
+	usbg_release_dir(&dir);
 
-		ret = usbg_rm_all_dirs(spath);
-		if (ret != USBG_SUCCESS)
-			goto out;
+out:
+	return ret;
+}
+
+static int usbg_parse_config(const char *name, usbg_gadget *g)
+{
+	int ret;
+	char *label = NULL;
+	usbg_config *c;
+
+	ret = usbg_split_config_label_id(name, &label);
+	if (ret <= 0)
+		goto out;
+
+	c = usbg_allocate_config(label, ret, g);
+	if (!c) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
 	}
 
-	ret = usbg_rm_dir(c->path, c->name);
-	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(g->configs), c, cnode);
+	ret = usbg_parse_config_bindings(c);
+	if (ret == USBG_SUCCESS)
+		usbg_insert_config(g, c);
+	else
 		usbg_free_config(c);
-	}
 
 out:
+	free(label);
 	return ret;
 }
 
-static int usbg_rm_ms_function(usbg_function *f, int opts)
+static int usbg_parse_configs(usbg_gadget *g)
 {
-	int ret;
-	int nmb;
 	int i;
-	char lpath[USBG_MAX_PATH_LENGTH];
-	struct dirent **dent;
+	int ret = USBG_SUCCESS;
+	struct usbg_dir dir;
 
-	ret = snprintf(lpath, sizeof(lpath), "%s/%s/", f->path, f->name);
-	if (ret >= sizeof(lpath)) {
+	if (g->configs_path_len >= USBG_MAX_PATH_LENGTH) {
 		ret = USBG_ERROR_PATH_TOO_LONG;
 		goto out;
 	}
 
-	nmb = scandir(lpath, &dent, lun_select, lun_sort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+	ret = usbg_read_dir(AT_FDCWD, g->configs_path, file_select,
+			    usbg_dir_order(g->parent), &dir);
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
 
-	for (i = nmb - 1; i > 0; --i) {
-		ret = usbg_rm_dir(lpath, dent[i]->d_name);
-		free(dent[i]);
-		if (ret)
-			goto err_free_dent_loop;
-	}
-	free(dent[0]);
-	free(dent);
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; i++)
+		ret = usbg_parse_config(dir.ents[i].name, g);
 
-	return USBG_SUCCESS;
+	usbg_release_dir(&dir);
 
-err_free_dent_loop:
-	while (--i >= 0)
-		free(dent[i]);
-	free(dent[i]);
 out:
 	return ret;
 }
 
-int usbg_rm_function(usbg_function *f, int opts)
+static const struct usbg_attr_field gadget_attr_fields[] = {
+	USBG_ATTR_FIELD(usbg_gadget_attrs, bcdUSB, "bcdUSB", USBG_ATTR_HEX),
+	USBG_ATTR_FIELD(usbg_gadget_attrs, bDeviceClass, "bDeviceClass",
+			USBG_ATTR_HEX),
+	USBG_ATTR_FIELD(usbg_gadget_attrs, bDeviceSubClass, "bDeviceSubClass",
+			USBG_ATTR_HEX),
+	USBG_ATTR_FIELD(usbg_gadget_attrs, bDeviceProtocol, "bDeviceProtocol",
+			USBG_ATTR_HEX),
+	USBG_ATTR_FIELD(usbg_gadget_attrs, bMaxPacketSize0, "bMaxPacketSize0",
+			USBG_ATTR_HEX),
+	USBG_ATTR_FIELD(usbg_gadget_attrs, idVendor, "idVendor", USBG_ATTR_HEX),
+	USBG_ATTR_FIELD(usbg_gadget_attrs, idProduct, "idProduct",
+			USBG_ATTR_HEX),
+	USBG_ATTR_FIELD(usbg_gadget_attrs, bcdDevice, "bcdDevice",
+			USBG_ATTR_HEX),
+};
+
+static int usbg_parse_gadget_attrs(usbg_gadget *g,
+		usbg_gadget_attrs *g_attrs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
-	usbg_gadget *g;
+	return usbg_read_attr_fields(g->parent, usbg_gadget_dirfd(g),
+				     gadget_attr_fields,
+				     ARRAY_SIZE(gadget_attr_fields), g_attrs);
+}
 
-	if (!f)
-		return ret;
+static int usbg_parse_gadget_strs(usbg_gadget *g, int lang,
+		usbg_gadget_strs *g_strs)
+{
+	int ret;
+	int fd;
 
-	g = f->parent;
+	fd = usbg_gadget_dirfd(g);
+	if (fd < 0) {
+		ret = fd;
+		goto out;
+	}
 
-	if (opts & USBG_RM_RECURSE) {
-		/* Recursive flag was given
-		 * so remove all bindings to this function */
-		usbg_config *c;
-		usbg_binding *b;
+	ret = usbg_read_str_file(fd, lang, "serialnumber", g_strs->str_ser);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-		TAILQ_FOREACH(c, &g->configs, cnode) {
+	ret = usbg_read_str_file(fd, lang, "manufacturer", g_strs->str_mnf);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_read_str_file(fd, lang, "product", g_strs->str_prd);
+
+out:
+	return ret;
+}
+
+static inline int usbg_parse_gadget(usbg_gadget *g)
+{
+	int ret;
+	int nmb;
+	char buf[USBG_MAX_STR_LENGTH];
+	char upath[USBG_MAX_PATH_LENGTH];
+
+	/*
+	 * UDC bound to, if any. Don't open gadget directory just for this,
+	 * it would stay open for each gadget found in configfs.
+	 */
+	nmb = snprintf(upath, sizeof(upath), "%s/%s/UDC", g->path, g->name);
+	if (nmb >= sizeof(upath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	ret = usbg_read_string(AT_FDCWD, upath, buf);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	g->udc = usbg_get_udc(g->parent, buf);
+	if (g->udc)
+		g->udc->gadget = g;
+
+	if (g->parent->opts & USBG_INIT_LAZY) {
+		/* Functions and configs will be parsed on first access */
+		g->lazy = 1;
+		goto out;
+	}
+
+	ret = usbg_parse_functions(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_parse_configs(g);
+out:
+	return ret;
+}
+
+int usbg_parse_lazy_gadget(usbg_gadget *g)
+{
+	usbg_config *c;
+	usbg_function *f;
+	int ret = USBG_SUCCESS;
+
+	/* Readers may reach the same gadget at once, only one parses it */
+	pthread_mutex_lock(&g->parent->obj_lock);
+	if (!g->lazy)
+		goto out;
+
+	ret = usbg_parse_functions(g);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_parse_configs(g);
+
+	if (ret == USBG_SUCCESS) {
+		g->lazy = 0;
+		goto out;
+	}
+
+	/* Drop what has been parsed so we can try again on next access */
+	while (!TAILQ_EMPTY(&g->configs)) {
+		c = TAILQ_FIRST(&g->configs);
+		usbg_detach_config(c);
+		usbg_free_config(c);
+	}
+	while (!TAILQ_EMPTY(&g->functions)) {
+		f = TAILQ_FIRST(&g->functions);
+		usbg_detach_function(f);
+		usbg_free_function(f);
+	}
+out:
+	pthread_mutex_unlock(&g->parent->obj_lock);
+	return ret;
+}
+
+/* Check if gadget is one of those which user is interested in */
+static inline int usbg_gadget_filter_match(usbg_state *s, const char *name)
+{
+	return !s->filter || !fnmatch(s->filter, name, 0);
+}
+
+static int usbg_parse_gadget_dir(const char *name, usbg_state *s)
+{
+	usbg_gadget *g;
+	int ret;
+
+	/* Create new gadget and insert it into list */
+	g = usbg_allocate_gadget(name, s);
+	if (!g) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	ret = usbg_parse_gadget(g);
+	if (ret == USBG_SUCCESS)
+		usbg_insert_gadget(s, g);
+	else
+		usbg_free_gadget(g);
+
+out:
+	return ret;
+}
+
+/*
+ * Gadgets processed by worker threads. Each worker takes next gadget
+ * which has not been taken yet, so slow gadgets don't hold others.
+ */
+#define USBG_POOL_MAX_THREADS 8
+
+struct usbg_gadget_job {
+	usbg_gadget **gadgets;
+	int *results;
+	int count;
+	int next;
+	int (*fn)(usbg_gadget *g);
+	pthread_mutex_t lock;
+};
+
+static void *usbg_gadget_worker(void *data)
+{
+	struct usbg_gadget_job *job = data;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		if (i >= job->count)
+			break;
+
+		job->results[i] = job->fn(job->gadgets[i]);
+	}
+
+	return NULL;
+}
+
+static int usbg_pool_threads(int count)
+{
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if (ncpus > USBG_POOL_MAX_THREADS)
+		ncpus = USBG_POOL_MAX_THREADS;
+
+	return count < ncpus ? count : ncpus;
+}
+
+/*
+ * Calling thread processes gadgets together with workers. If some of
+ * them can't be started, remaining ones do more work.
+ */
+static void usbg_run_gadget_job(struct usbg_gadget_job *job)
+{
+	pthread_t threads[USBG_POOL_MAX_THREADS];
+	int nthreads, started;
+
+	job->next = 0;
+	pthread_mutex_init(&job->lock, NULL);
+
+	nthreads = usbg_pool_threads(job->count);
+	for (started = 0; started < nthreads - 1; ++started)
+		if (pthread_create(threads + started, NULL,
+				   usbg_gadget_worker, job))
+			break;
+
+	usbg_gadget_worker(job);
+
+	while (started > 0)
+		pthread_join(threads[--started], NULL);
+
+	pthread_mutex_destroy(&job->lock);
+}
+
+static void usbg_parse_gadgets_parallel(usbg_state *s,
+		struct usbg_gadget_job *job)
+{
+	pthread_mutex_t arena_lock;
+
+	if (usbg_pool_threads(job->count) < 2) {
+		usbg_run_gadget_job(job);
+		return;
+	}
+
+	/* Workers allocate objects from arena of state */
+	pthread_mutex_init(&arena_lock, NULL);
+	s->arena.lock = &arena_lock;
+
+	usbg_run_gadget_job(job);
+
+	s->arena.lock = NULL;
+	pthread_mutex_destroy(&arena_lock);
+}
+
+static int usbg_parse_gadgets_pool(usbg_state *s, struct usbg_dir *dir)
+{
+	struct usbg_gadget_job job;
+	int ret = USBG_SUCCESS;
+	int i;
+
+	job.count = 0;
+	job.fn = usbg_parse_gadget;
+	job.gadgets = calloc(dir->n, sizeof(*job.gadgets));
+	job.results = calloc(dir->n, sizeof(*job.results));
+	if (!job.gadgets || !job.results) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	for (i = 0; i < dir->n; ++i) {
+		if (!usbg_gadget_filter_match(s, dir->ents[i].name))
+			continue;
+
+		job.gadgets[job.count] = usbg_allocate_gadget(dir->ents[i].name,
+							      s);
+		if (!job.gadgets[job.count]) {
+			ret = USBG_ERROR_NO_MEM;
+			goto out;
+		}
+		job.count++;
+	}
+
+	usbg_parse_gadgets_parallel(s, &job);
+
+	/* Same gadgets end up in state as if they were parsed one by one */
+	for (i = 0; i < job.count; ++i) {
+		if (ret == USBG_SUCCESS)
+			ret = job.results[i];
+
+		if (ret == USBG_SUCCESS)
+			usbg_insert_gadget(s, job.gadgets[i]);
+		else
+			usbg_free_gadget(job.gadgets[i]);
+	}
+	job.count = 0;
+
+out:
+	if (job.gadgets) {
+		for (i = 0; i < job.count; ++i)
+			usbg_free_gadget(job.gadgets[i]);
+	}
+	free(job.gadgets);
+	free(job.results);
+	return ret;
+}
+
+static int usbg_parse_gadgets(const char *path, usbg_state *s)
+{
+	int i;
+	int ret;
+	struct usbg_dir dir;
+
+	ret = usbg_read_dir(AT_FDCWD, path, file_select, usbg_dir_order(s),
+			    &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	if (s->opts & USBG_INIT_PARALLEL) {
+		ret = usbg_parse_gadgets_pool(s, &dir);
+		goto out_dir;
+	}
+
+	/* Stop at first gadget which has not been created correctly */
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; i++) {
+		if (usbg_gadget_filter_match(s, dir.ents[i].name))
+			ret = usbg_parse_gadget_dir(dir.ents[i].name, s);
+	}
+
+out_dir:
+	usbg_release_dir(&dir);
+out:
+	return ret;
+}
+
+int usbg_parse_udc(usbg_state *s, const char *name)
+{
+	usbg_udc *u;
+
+	u = usbg_allocate_udc(s, name);
+	if (!u)
+		return USBG_ERROR_NO_MEM;
+
+	usbg_insert_udc(s, u);
+	return s->watch ? usbg_watch_udc(u) : USBG_SUCCESS;
+}
+
+static int usbg_parse_udcs(usbg_state *s)
+{
+	int i;
+	int ret;
+	struct usbg_dir dir;
+
+	ret = usbg_read_dir(AT_FDCWD, "/sys/class/udc", file_select,
+			    usbg_dir_order(s), &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; ++i)
+		ret = usbg_parse_udc(s, dir.ents[i].name);
+
+	usbg_release_dir(&dir);
+
+out:
+	return ret;
+}
+
+static usbg_state *usbg_allocate_state(const char *configfs_path, char *path,
+		int opts, const char *filter)
+{
+	usbg_state *s;
+
+	s = malloc(sizeof(*s));
+	if (!s)
+		goto err;
+
+	s->configfs_path = strdup(configfs_path);
+	if (!s->configfs_path)
+		goto cpath_failed;
+
+	s->filter = NULL;
+	if (filter) {
+		s->filter = strdup(filter);
+		if (!s->filter)
+			goto filter_failed;
+	}
+
+	/* State takes the ownership of path and should free it */
+	s->path = path;
+	s->path_len = strlen(path);
+	s->opts = opts;
+	s->fd = -1;
+	s->io = NULL;
+	s->watch = NULL;
+	s->pools = NULL;
+	TAILQ_INIT(&s->gadgets);
+	TAILQ_INIT(&s->udcs);
+	usbg_order_init(&s->gadget_order);
+	usbg_order_init(&s->udc_order);
+	usbg_arena_init(&s->arena);
+	usbg_children_init(&s->gadget_array, &s->arena);
+	usbg_children_init(&s->udc_array, &s->arena);
+	usbg_htable_init(&s->gadget_index, &s->arena);
+	usbg_htable_init(&s->udc_index, &s->arena);
+
+	if (usbg_lock_init(s) != USBG_SUCCESS)
+		goto lock_failed;
+
+	return s;
+
+lock_failed:
+	free(s->filter);
+filter_failed:
+	free(s->configfs_path);
+cpath_failed:
+	free(s);
+err:
+	return NULL;
+}
+
+static int usbg_parse_state(usbg_state *s)
+{
+	int ret = USBG_SUCCESS;
+
+	/*
+	 * USBG_ERROR_NOT_FOUND is returned if we are running on machine where
+	 * there is no udc support in kernel (no /sys/class/udc dir).
+	 * This check allows to run library on such machine or if we don't
+	 * have rights to read this directory.
+	 * User will be able to finish init function and manage gadgets but
+	 * wont be able to bind it as there is no UDC.
+	 */
+	ret = usbg_parse_udcs(s);
+	if (ret != USBG_SUCCESS && ret != USBG_ERROR_NOT_FOUND &&
+		ret != USBG_ERROR_NO_ACCESS) {
+		ERROR("Unable to parse udcs");
+		goto out;
+	}
+
+	ret = usbg_parse_gadgets(s->path, s);
+	if (ret != USBG_SUCCESS) {
+		ERROR("unable to parse %s\n", s->path);
+		goto out;
+	}
+
+	if (s->opts & USBG_INIT_WATCH)
+		ret = usbg_watch_start(s);
+out:
+	return ret;
+}
+
+/*
+ * User API
+ */
+
+int usbg_init(const char *configfs_path, usbg_state **state)
+{
+	return usbg_init_opts(configfs_path, 0, NULL, state);
+}
+
+int usbg_init_opts(const char *configfs_path, int opts, const char *filter,
+		usbg_state **state)
+{
+	int ret = USBG_SUCCESS;
+	DIR *dir;
+	char *path;
+	usbg_state *s;
+
+	ret = asprintf(&path, "%s/" GADGETS_DIR, configfs_path);
+	if (ret < 0)
+		return USBG_ERROR_NO_MEM;
+	else
+		ret = USBG_SUCCESS;
+
+	/* Check if directory exist */
+	dir = opendir(path);
+	if (!dir) {
+		ERRORNO("couldn't init gadget state\n");
+		ret = usbg_translate_error(errno);
+		goto err;
+	}
+
+	closedir(dir);
+	s = usbg_allocate_state(configfs_path, path, opts, filter);
+	if (!s) {
+		ret = USBG_ERROR_NO_MEM;
+		goto err;
+	}
+
+	ret = usbg_parse_state(s);
+	if (ret != USBG_SUCCESS) {
+		ERROR("couldn't init gadget state\n");
+		usbg_free_state(s);
+		goto out;
+	}
+
+	*state = s;
+
+	return ret;
+
+err:
+	free(path);
+out:
+	return ret;
+}
+
+void usbg_cleanup(usbg_state *s)
+{
+	usbg_free_state(s);
+}
+
+const char *usbg_get_configfs_path(usbg_state *s)
+{
+	return s ? s->configfs_path : NULL;
+}
+
+size_t usbg_get_configfs_path_len(usbg_state *s)
+{
+	return s ? strlen(s->configfs_path) : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_cpy_configfs_path(usbg_state *s, char *buf, size_t len)
+{
+	if (!s || !buf || len == 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	buf[--len] = '\0';
+	strncpy(buf, s->configfs_path, len);
+
+	return USBG_SUCCESS;
+}
+
+static usbg_gadget *usbg_get_gadget_locked(usbg_state *s, const char *name)
+{
+	struct usbg_hnode *n;
+	usbg_gadget *g;
+	unsigned int hash = usbg_hash_str(name);
+
+	usbg_htable_for_each(n, &s->gadget_index, hash) {
+		g = container_of(n, usbg_gadget, hnode);
+		if (!strcmp(g->name, name))
+			return g;
+	}
+
+	return NULL;
+}
+
+usbg_gadget *usbg_get_gadget(usbg_state *s, const char *name)
+{
+	usbg_gadget *g;
+
+	if (!s)
+		return NULL;
+
+	usbg_lock_shared(s);
+	g = usbg_get_gadget_locked(s, name);
+	usbg_unlock(s);
+
+	return g;
+}
+
+static usbg_function *usbg_get_function_locked(usbg_gadget *g,
+		usbg_function_type type, const char *instance)
+{
+	if (usbg_parse_lazy_gadget(g) != USBG_SUCCESS)
+		return NULL;
+
+	return usbg_lookup_function(g, type, instance);
+}
+
+usbg_function *usbg_get_function(usbg_gadget *g,
+		usbg_function_type type, const char *instance)
+{
+	usbg_function *f;
+
+	if (!g)
+		return NULL;
+
+	usbg_lock_shared(g->parent);
+	f = usbg_get_function_locked(g, type, instance);
+	usbg_unlock(g->parent);
+
+	return f;
+}
+
+static usbg_config *usbg_get_config_locked(usbg_gadget *g, int id,
+		const char *label)
+{
+	usbg_config *c = NULL;
+
+	if (usbg_parse_lazy_gadget(g) != USBG_SUCCESS)
+		return NULL;
+
+	TAILQ_FOREACH(c, &g->configs, cnode)
+		if (c->id == id && (!label || !strcmp(c->label, label)))
+			break;
+
+	return c;
+}
+
+usbg_config *usbg_get_config(usbg_gadget *g, int id, const char *label)
+{
+	usbg_config *c;
+
+	if (!g)
+		return NULL;
+
+	usbg_lock_shared(g->parent);
+	c = usbg_get_config_locked(g, id, label);
+	usbg_unlock(g->parent);
+
+	return c;
+}
+
+static usbg_udc *usbg_get_udc_locked(usbg_state *s, const char *name)
+{
+	struct usbg_hnode *n;
+	usbg_udc *u;
+	unsigned int hash = usbg_hash_str(name);
+
+	usbg_htable_for_each(n, &s->udc_index, hash) {
+		u = container_of(n, usbg_udc, hnode);
+		if (!strcmp(u->name, name))
+			return u;
+	}
+
+	return NULL;
+}
+
+usbg_udc *usbg_get_udc(usbg_state *s, const char *name)
+{
+	usbg_udc *u;
+
+	if (!s)
+		return NULL;
+
+	usbg_lock_shared(s);
+	u = usbg_get_udc_locked(s, name);
+	usbg_unlock(s);
+
+	return u;
+}
+
+static usbg_binding *usbg_get_binding_locked(usbg_config *c, const char *name)
+{
+	struct usbg_hnode *n;
+	usbg_binding *b;
+	unsigned int hash = usbg_hash_str(name);
+
+	usbg_htable_for_each(n, &c->binding_index, hash) {
+		b = container_of(n, usbg_binding, hnode);
+		if (!strcmp(b->name, name))
+			return b;
+	}
+
+	return NULL;
+}
+
+usbg_binding *usbg_get_binding(usbg_config *c, const char *name)
+{
+	usbg_binding *b;
+
+	if (!c)
+		return NULL;
+
+	usbg_lock_shared(c->parent->parent);
+	b = usbg_get_binding_locked(c, name);
+	usbg_unlock(c->parent->parent);
+
+	return b;
+}
+
+/*
+ * State refresh
+ */
+
+struct usbg_changes {
+	usbg_change_cb cb;
+	void *data;
+	int count;
+};
+
+static void usbg_notify_change(struct usbg_changes *ch,
+		usbg_change_type change, usbg_object_type type, void *obj)
+{
+	ch->count++;
+	if (ch->cb)
+		ch->cb(change, type, obj, ch->data);
+}
+
+static usbg_function *usbg_find_function(usbg_gadget *g, const char *name)
+{
+	const char *instance;
+	usbg_function_type type;
+
+	if (usbg_split_function_instance_type(name, &type, &instance)
+	    != USBG_SUCCESS)
+		return NULL;
+
+	return usbg_get_function(g, type, instance);
+}
+
+static usbg_config *usbg_find_config(usbg_gadget *g, const char *name)
+{
+	usbg_config *c;
+
+	TAILQ_FOREACH(c, &g->configs, cnode)
+		if (!strcmp(c->name, name))
+			break;
+
+	return c;
+}
+
+static void usbg_drop_binding(usbg_binding *b, struct usbg_changes *ch)
+{
+	usbg_notify_change(ch, USBG_CHANGE_REMOVED, USBG_OBJ_BINDING, b);
+	usbg_detach_binding(b);
+	usbg_free_binding(b);
+}
+
+static int usbg_refresh_config_bindings(usbg_config *c,
+		struct usbg_changes *ch)
+{
+	int i, nmb;
+	int ret = USBG_SUCCESS;
+	struct usbg_dir dir;
+	char bpath[USBG_MAX_PATH_LENGTH];
+	usbg_binding *b, *next;
+	usbg_function *f;
+
+	if (c->bindings_path_len >= sizeof(bpath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	/* Sorted even in unordered mode to look names up in listing */
+	ret = usbg_read_dir(AT_FDCWD, c->bindings_path, bindings_select,
+			    usbg_dirent_cmp, &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	for (b = TAILQ_FIRST(&c->bindings); b; b = next) {
+		next = TAILQ_NEXT(b, bnode);
+		if (!usbg_dir_contains(&dir, b->name))
+			usbg_drop_binding(b, ch);
+	}
+
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; ++i) {
+		nmb = usbg_join_path(bpath, sizeof(bpath), c->bindings_path,
+				     c->bindings_path_len, dir.ents[i].name,
+				     strlen(dir.ents[i].name));
+		if (nmb < 0) {
+			ret = nmb;
+			break;
+		}
+
+		b = usbg_get_binding(c, dir.ents[i].name);
+		if (!b) {
+			ret = usbg_parse_config_binding(c, bpath,
+							dir.ents[i].name);
+			if (ret == USBG_SUCCESS)
+				usbg_notify_change(ch, USBG_CHANGE_ADDED,
+					USBG_OBJ_BINDING,
+					usbg_get_binding(c, dir.ents[i].name));
+			continue;
+		}
+
+		/* Link might have been recreated to point somewhere else */
+		ret = usbg_parse_binding_target(c->parent, bpath, &f);
+		if (ret == USBG_SUCCESS && f != b->target) {
+			usbg_set_binding_target(b, f);
+			usbg_notify_change(ch, USBG_CHANGE_MODIFIED,
+					   USBG_OBJ_BINDING, b);
+		}
+	}
+
+	usbg_release_dir(&dir);
+out:
+	return ret;
+}
+
+static int usbg_refresh_gadget_udc(usbg_gadget *g, struct usbg_changes *ch)
+{
+	int ret;
+	int nmb;
+	char buf[USBG_MAX_STR_LENGTH];
+	char upath[USBG_MAX_PATH_LENGTH];
+	usbg_udc *u;
+
+	nmb = snprintf(upath, sizeof(upath), "%s/%s/UDC", g->path, g->name);
+	if (nmb >= sizeof(upath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	ret = usbg_read_string(AT_FDCWD, upath, buf);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	u = usbg_get_udc(g->parent, buf);
+	if (u == g->udc)
+		goto out;
+
+	if (g->udc)
+		g->udc->gadget = NULL;
+	g->udc = u;
+	if (u)
+		u->gadget = g;
+
+	usbg_notify_change(ch, USBG_CHANGE_MODIFIED, USBG_OBJ_GADGET, g);
+out:
+	return ret;
+}
+
+static int usbg_refresh_gadget(usbg_gadget *g, struct usbg_changes *ch)
+{
+	int i;
+	int ret;
+	struct usbg_dir fdir, cdir;
+	usbg_function *f, *fnext;
+	usbg_config *c, *cnext;
+	usbg_binding *b, *bnext;
+
+	ret = usbg_refresh_gadget_udc(g, ch);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	/* Content of lazy gadget will be read from scratch on first access */
+	if (g->lazy)
+		goto out;
+
+	if (g->functions_path_len >= USBG_MAX_PATH_LENGTH ||
+	    g->configs_path_len >= USBG_MAX_PATH_LENGTH) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	ret = usbg_read_dir(AT_FDCWD, g->functions_path, file_select,
+			    usbg_dirent_cmp, &fdir);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_read_dir(AT_FDCWD, g->configs_path, file_select,
+			    usbg_dirent_cmp, &cdir);
+	if (ret != USBG_SUCCESS)
+		goto out_fdir;
+
+	/* New functions first, so new bindings may point to them */
+	for (i = 0; i < fdir.n && ret == USBG_SUCCESS; ++i) {
+		if (usbg_find_function(g, fdir.ents[i].name))
+			continue;
+
+		ret = usbg_parse_function(fdir.ents[i].name, g);
+		if (ret == USBG_SUCCESS)
+			usbg_notify_change(ch, USBG_CHANGE_ADDED,
+					USBG_OBJ_FUNCTION,
+					usbg_find_function(g, fdir.ents[i].name));
+	}
+
+	for (c = TAILQ_FIRST(&g->configs); c; c = cnext) {
+		cnext = TAILQ_NEXT(c, cnode);
+		if (usbg_dir_contains(&cdir, c->name))
+			continue;
+
+		usbg_notify_change(ch, USBG_CHANGE_REMOVED, USBG_OBJ_CONFIG, c);
+		usbg_detach_config(c);
+		usbg_free_config(c);
+	}
+
+	for (i = 0; i < cdir.n && ret == USBG_SUCCESS; ++i) {
+		c = usbg_find_config(g, cdir.ents[i].name);
+		if (c) {
+			ret = usbg_refresh_config_bindings(c, ch);
+			continue;
+		}
+
+		ret = usbg_parse_config(cdir.ents[i].name, g);
+		if (ret == USBG_SUCCESS)
+			usbg_notify_change(ch, USBG_CHANGE_ADDED,
+					USBG_OBJ_CONFIG,
+					usbg_find_config(g, cdir.ents[i].name));
+	}
+
+	if (ret != USBG_SUCCESS)
+		goto out_cdir;
+
+	for (f = TAILQ_FIRST(&g->functions); f; f = fnext) {
+		fnext = TAILQ_NEXT(f, fnode);
+		if (usbg_dir_contains(&fdir, f->name))
+			continue;
+
+		/* Don't leave any binding with dangling target */
+		TAILQ_FOREACH(c, &g->configs, cnode) {
+			for (b = TAILQ_FIRST(&c->bindings); b; b = bnext) {
+				bnext = TAILQ_NEXT(b, bnode);
+				if (b->target == f)
+					usbg_drop_binding(b, ch);
+			}
+		}
+
+		usbg_notify_change(ch, USBG_CHANGE_REMOVED,
+				   USBG_OBJ_FUNCTION, f);
+		usbg_detach_function(f);
+		usbg_free_function(f);
+	}
+
+out_cdir:
+	usbg_release_dir(&cdir);
+out_fdir:
+	usbg_release_dir(&fdir);
+out:
+	return ret;
+}
+
+static int usbg_refresh_gadgets(usbg_state *s, struct usbg_changes *ch)
+{
+	int i;
+	int ret = USBG_SUCCESS;
+	struct usbg_dir dir;
+	usbg_gadget *g, *next;
+
+	ret = usbg_read_dir(AT_FDCWD, s->path, file_select, usbg_dirent_cmp,
+			    &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	for (g = TAILQ_FIRST(&s->gadgets); g; g = next) {
+		next = TAILQ_NEXT(g, gnode);
+		if (usbg_dir_contains(&dir, g->name))
+			continue;
+
+		usbg_notify_change(ch, USBG_CHANGE_REMOVED, USBG_OBJ_GADGET, g);
+		if (g->udc)
+			g->udc->gadget = NULL;
+		usbg_detach_gadget(g);
+		usbg_free_gadget(g);
+	}
+
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; ++i) {
+		if (!usbg_gadget_filter_match(s, dir.ents[i].name))
+			continue;
+
+		g = usbg_get_gadget(s, dir.ents[i].name);
+		if (g) {
+			ret = usbg_refresh_gadget(g, ch);
+			continue;
+		}
+
+		ret = usbg_parse_gadget_dir(dir.ents[i].name, s);
+		if (ret == USBG_SUCCESS)
+			usbg_notify_change(ch, USBG_CHANGE_ADDED, USBG_OBJ_GADGET,
+					   usbg_get_gadget(s, dir.ents[i].name));
+	}
+
+	usbg_release_dir(&dir);
+out:
+	return ret;
+}
+
+static int usbg_refresh_udcs(usbg_state *s, struct usbg_changes *ch)
+{
+	int i;
+	int ret = USBG_SUCCESS;
+	struct usbg_dir dir;
+	usbg_udc *u, *next;
+
+	ret = usbg_read_dir(AT_FDCWD, "/sys/class/udc", file_select,
+			    usbg_dirent_cmp, &dir);
+	if (ret != USBG_SUCCESS) {
+		/* The same as in usbg_parse_state() */
+		if (ret == USBG_ERROR_NOT_FOUND || ret == USBG_ERROR_NO_ACCESS)
+			ret = USBG_SUCCESS;
+		goto out;
+	}
+
+	for (u = TAILQ_FIRST(&s->udcs); u; u = next) {
+		next = TAILQ_NEXT(u, unode);
+		if (usbg_dir_contains(&dir, u->name))
+			continue;
+
+		if (u->gadget) {
+			u->gadget->udc = NULL;
+			usbg_notify_change(ch, USBG_CHANGE_MODIFIED,
+					   USBG_OBJ_GADGET, u->gadget);
+		}
+		usbg_notify_change(ch, USBG_CHANGE_REMOVED, USBG_OBJ_UDC, u);
+		usbg_detach_udc(u);
+		usbg_free_udc(u);
+	}
+
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; ++i) {
+		if (usbg_get_udc(s, dir.ents[i].name))
+			continue;
+
+		ret = usbg_parse_udc(s, dir.ents[i].name);
+		if (ret == USBG_SUCCESS)
+			usbg_notify_change(ch, USBG_CHANGE_ADDED, USBG_OBJ_UDC,
+					   usbg_get_udc(s, dir.ents[i].name));
+	}
+
+	usbg_release_dir(&dir);
+out:
+	return ret;
+}
+
+static int usbg_refresh_locked(usbg_state *s, usbg_change_cb cb, void *data)
+{
+	struct usbg_changes ch = {
+		.cb = cb,
+		.data = data,
+		.count = 0,
+	};
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	/* Rescan can't tell if attributes have changed so read them again */
+	usbg_invalidate_all(s);
+
+	/* UDCs go first, so gadgets can be linked with new ones */
+	ret = usbg_refresh_udcs(s, &ch);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_refresh_gadgets(s, &ch);
+out:
+	return ret == USBG_SUCCESS ? ch.count : ret;
+}
+
+int usbg_refresh(usbg_state *s, usbg_change_cb cb, void *data)
+{
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_refresh_locked(s, cb, data);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+#define USBG_NAME_CMP(Type) \
+static int Type##_name_cmp(const void *a, const void *b) \
+{ \
+	return strcmp((*(Type * const *)a)->name, \
+		      (*(Type * const *)b)->name); \
+}
+
+USBG_NAME_CMP(usbg_gadget)
+USBG_NAME_CMP(usbg_udc)
+USBG_NAME_CMP(usbg_function)
+USBG_NAME_CMP(usbg_config)
+USBG_NAME_CMP(usbg_binding)
+
+/* List is sorted in an array of its elements and then rebuilt */
+#define USBG_SORT_TAILQ(HeadPtr, Type, NodeField, Ret) \
+	do { \
+		Type *_obj, **_objs; \
+		int _n = 0, _i = 0; \
+		TAILQ_FOREACH(_obj, (HeadPtr), NodeField) \
+			_n++; \
+		if (_n < 2) \
+			break; \
+		_objs = malloc(_n * sizeof(*_objs)); \
+		if (!_objs) { \
+			(Ret) = USBG_ERROR_NO_MEM; \
+			break; \
+		} \
+		TAILQ_FOREACH(_obj, (HeadPtr), NodeField) \
+			_objs[_i++] = _obj; \
+		qsort(_objs, _n, sizeof(*_objs), Type##_name_cmp); \
+		TAILQ_INIT((HeadPtr)); \
+		for (_i = 0; _i < _n; _i++) \
+			TAILQ_INSERT_TAIL((HeadPtr), _objs[_i], NodeField); \
+		free(_objs); \
+	} while (0)
+
+static int usbg_sort_gadget(usbg_gadget *g)
+{
+	usbg_config *c;
+	int ret = USBG_SUCCESS;
+
+	USBG_SORT_TAILQ(&g->functions, usbg_function, fnode, ret);
+	USBG_SORT_TAILQ(&g->configs, usbg_config, cnode, ret);
+	usbg_children_changed(&g->function_array, 0);
+	usbg_children_changed(&g->config_array, 0);
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		USBG_SORT_TAILQ(&c->bindings, usbg_binding, bnode, ret);
+		usbg_children_changed(&c->binding_array, 0);
+	}
+
+	return ret;
+}
+
+static int usbg_sort_state_locked(usbg_state *s)
+{
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
+
+	USBG_SORT_TAILQ(&s->gadgets, usbg_gadget, gnode, ret);
+	USBG_SORT_TAILQ(&s->udcs, usbg_udc, unode, ret);
+	usbg_children_changed(&s->gadget_array, 0);
+	usbg_children_changed(&s->udc_array, 0);
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_sort_gadget(g);
+	}
+
+	return ret;
+}
+
+int usbg_sort_state(usbg_state *s)
+{
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_sort_state_locked(s);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+static void usbg_invalidate_gadget_locked(usbg_gadget *g)
+{
+	if (g && g->cache)
+		g->cache->valid = 0;
+}
+
+void usbg_invalidate_gadget(usbg_gadget *g)
+{
+	if (!g)
+		return;
+
+	usbg_lock_attrs(g);
+	usbg_invalidate_gadget_locked(g);
+	usbg_unlock_attrs(g);
+}
+
+static void usbg_invalidate_config_locked(usbg_config *c)
+{
+	if (c && c->cache)
+		c->cache->valid = 0;
+}
+
+void usbg_invalidate_config(usbg_config *c)
+{
+	if (!c)
+		return;
+
+	usbg_lock_attrs(c->parent);
+	usbg_invalidate_config_locked(c);
+	usbg_unlock_attrs(c->parent);
+}
+
+static void usbg_invalidate_function_locked(usbg_function *f)
+{
+	if (!f || !f->cache || !f->cache->valid)
+		return;
+
+	usbg_cleanup_function_attrs(&f->cache->attrs);
+	f->cache->valid = 0;
+}
+
+void usbg_invalidate_function(usbg_function *f)
+{
+	if (!f)
+		return;
+
+	usbg_lock_attrs(f->parent);
+	usbg_invalidate_function_locked(f);
+	usbg_unlock_attrs(f->parent);
+}
+
+static void usbg_invalidate_all_locked(usbg_state *s)
+{
+	usbg_gadget *g;
+	usbg_config *c;
+	usbg_function *f;
+
+	if (!s || !(s->opts & USBG_INIT_CACHE))
+		return;
+
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		usbg_lock_attrs(g);
+		/* Lists of lazy gadget are filled with obj_lock held */
+		pthread_mutex_lock(&s->obj_lock);
+		usbg_invalidate_gadget_locked(g);
+		TAILQ_FOREACH(c, &g->configs, cnode)
+			usbg_invalidate_config_locked(c);
+		TAILQ_FOREACH(f, &g->functions, fnode)
+			usbg_invalidate_function_locked(f);
+		pthread_mutex_unlock(&s->obj_lock);
+		usbg_unlock_attrs(g);
+	}
+}
+
+void usbg_invalidate_all(usbg_state *s)
+{
+	if (!s)
+		return;
+
+	usbg_lock_shared(s);
+	usbg_invalidate_all_locked(s);
+	usbg_unlock(s);
+}
+
+static usbg_binding *usbg_get_link_binding_locked(usbg_config *c,
+		usbg_function *f)
+{
+	struct usbg_hnode *n;
+	usbg_binding *b;
+	unsigned int hash = usbg_hash_ptr(f);
+
+	usbg_htable_for_each(n, &c->target_index, hash) {
+		b = container_of(n, usbg_binding, tnode);
+		if (b->target == f)
+			return b;
+	}
+
+	return NULL;
+}
+
+usbg_binding *usbg_get_link_binding(usbg_config *c, usbg_function *f)
+{
+	usbg_binding *b;
+
+	if (!c)
+		return NULL;
+
+	usbg_lock_shared(c->parent->parent);
+	b = usbg_get_link_binding_locked(c, f);
+	usbg_unlock(c->parent->parent);
+
+	return b;
+}
+
+static int usbg_rm_binding_locked(usbg_binding *b)
+{
+	int ret = USBG_SUCCESS;
+
+	if (!b)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = ubsg_rm_file(b->path, b->name);
+	if (ret == USBG_SUCCESS) {
+		usbg_detach_binding(b);
+		usbg_free_binding(b);
+	}
+
+	return ret;
+}
+
+int usbg_rm_binding(usbg_binding *b)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!b)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = b->parent->parent->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_rm_binding_locked(b);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+static int usbg_rm_config_locked(usbg_config *c, int opts)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_gadget *g;
+
+	if (!c)
+		return ret;
+
+	g = c->parent;
+
+	if (opts & USBG_RM_RECURSE) {
+		/* Recursive flag was given
+		 * so remove all bindings and strings */
+		char spath[USBG_MAX_PATH_LENGTH];
+		int nmb;
+		usbg_binding *b;
+
+		while (!TAILQ_EMPTY(&c->bindings)) {
+			b = TAILQ_FIRST(&c->bindings);
+			ret = usbg_rm_binding(b);
+			if (ret != USBG_SUCCESS)
+				goto out;
+		}
+
+		nmb = usbg_join_path(spath, sizeof(spath), c->bindings_path,
+				     c->bindings_path_len, STRINGS_DIR,
+				     sizeof(STRINGS_DIR) - 1);
+		if (nmb < 0) {
+			ret = nmb;
+			goto out;
+		}
+
+		ret = usbg_rm_all_dirs(g->parent, spath);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	ret = usbg_rm_dir(c->path, c->name);
+	if (ret == USBG_SUCCESS) {
+		usbg_detach_config(c);
+		usbg_free_config(c);
+	}
+
+out:
+	return ret;
+}
+
+int usbg_rm_config(usbg_config *c, int opts)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!c)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = c->parent->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_rm_config_locked(c, opts);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+static int usbg_rm_ms_function(usbg_function *f, int opts)
+{
+	int ret;
+	int i;
+	char lpath[USBG_MAX_PATH_LENGTH];
+	struct usbg_dir dir;
+
+	ret = snprintf(lpath, sizeof(lpath), "%s/%s/", f->path, f->name);
+	if (ret >= sizeof(lpath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	ret = usbg_read_dir(AT_FDCWD, lpath, lun_select, lun_sort, &dir);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	/* lun.0 is removed by kernel together with function */
+	for (i = dir.n - 1; i > 0 && ret == USBG_SUCCESS; --i)
+		ret = usbg_rm_dir(lpath, dir.ents[i].name);
+
+	usbg_release_dir(&dir);
+out:
+	return ret;
+}
+
+static int usbg_rm_function_locked(usbg_function *f, int opts)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_gadget *g;
+
+	if (!f)
+		return ret;
+
+	g = f->parent;
+
+	if (opts & USBG_RM_RECURSE) {
+		/* Recursive flag was given
+		 * so remove all bindings to this function */
+		usbg_config *c;
+		usbg_binding *b;
+
+		TAILQ_FOREACH(c, &g->configs, cnode) {
 			b = TAILQ_FIRST(&c->bindings);
 			while (b != NULL) {
 				if (b->target == f) {
@@ -1959,1514 +3592,4168 @@ int usbg_rm_function(usbg_function *f, int opts)
 					if (ret != USBG_SUCCESS)
 						return ret;
 
-					b = b_next;
-				} else {
-					b = TAILQ_NEXT(b, bnode);
-				}
-			} /* while */
-		} /* TAILQ_FOREACH */
+					b = b_next;
+				} else {
+					b = TAILQ_NEXT(b, bnode);
+				}
+			} /* while */
+		} /* TAILQ_FOREACH */
+	}
+
+	if (f->rm_callback) {
+		ret = f->rm_callback(f, opts);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	ret = usbg_rm_dir(f->path, f->name);
+	if (ret == USBG_SUCCESS) {
+		usbg_detach_function(f);
+		usbg_free_function(f);
+	}
+
+out:
+	return ret;
+}
+
+int usbg_rm_function(usbg_function *f, int opts)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!f)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = f->parent->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_rm_function_locked(f, opts);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+/*
+ * Fast recursive removal
+ *
+ * Content of gadget is removed level by level with paths relative to
+ * directory fds: first all bindings, then strings and additional LUNs,
+ * then all configs and functions. Operations on one level don't depend
+ * on each other so each level is a single batch. Objects are freed only
+ * when the whole gadget is gone, if anything fails gadget content is
+ * read again from configfs.
+ */
+
+/* io is state to batch operations in or NULL to run them synchronously */
+static int usbg_rm_run(usbg_state *io, struct usbg_io_op *ops, int count)
+{
+	return io ? usbg_io_batch(io, ops, count) : usbg_io_run_all(ops, count);
+}
+
+static void usbg_rm_op(struct usbg_io_op *op, usbg_io_type type, int dirfd,
+		       const char *name)
+{
+	op->type = type;
+	op->dirfd = dirfd;
+	op->name = name;
+}
+
+static int usbg_rm_gadget_bindings(usbg_gadget *g, usbg_state *io)
+{
+	struct usbg_io_op *ops;
+	usbg_config *c;
+	usbg_binding *b;
+	int ret = USBG_SUCCESS;
+	int n = 0;
+	int fd;
+
+	TAILQ_FOREACH(c, &g->configs, cnode)
+		TAILQ_FOREACH(b, &c->bindings, bnode)
+			n++;
+
+	if (n == 0)
+		goto out;
+
+	ops = calloc(n, sizeof(*ops));
+	if (!ops) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	n = 0;
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		fd = usbg_config_dirfd(c);
+		if (fd < 0) {
+			ret = fd;
+			goto out_ops;
+		}
+
+		TAILQ_FOREACH(b, &c->bindings, bnode)
+			usbg_rm_op(ops + n++, USBG_IO_UNLINK, fd, b->name);
+	}
+
+	ret = usbg_rm_run(io, ops, n);
+
+out_ops:
+	free(ops);
+out:
+	return ret;
+}
+
+/* Subdirectories which kernel doesn't remove together with their parent */
+struct usbg_rm_subdirs {
+	struct usbg_dir *dirs;
+	int *fds;
+	int count;
+};
+
+static inline int usbg_extra_lun_select(const char *name, unsigned char type)
+{
+	/* lun.0 is removed by kernel together with function */
+	return lun_select(name, type) && strcmp(name, "lun.0");
+}
+
+static int usbg_rm_list_subdirs(struct usbg_rm_subdirs *sd, int dirfd,
+				const char *path, usbg_dir_filter filter)
+{
+	struct usbg_dir *dir = sd->dirs + sd->count;
+	int ret;
+
+	if (USBG_DIRFD_ERROR(dirfd))
+		return dirfd;
+
+	ret = usbg_read_dir(dirfd, path, filter, NULL, dir);
+	/* Nothing to be removed */
+	if (ret == USBG_ERROR_NOT_FOUND)
+		return USBG_SUCCESS;
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (dir->n == 0) {
+		usbg_release_dir(dir);
+		return USBG_SUCCESS;
+	}
+
+	ret = usbg_open_dir(dirfd, path, sd->fds + sd->count);
+	if (ret != USBG_SUCCESS) {
+		usbg_release_dir(dir);
+		return ret;
+	}
+
+	sd->count++;
+	return USBG_SUCCESS;
+}
+
+static int usbg_rm_gadget_subdirs(usbg_gadget *g, usbg_state *io)
+{
+	struct usbg_rm_subdirs sd = { .count = 0 };
+	struct usbg_io_op *ops = NULL;
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+	int n = 1;
+	int i, j;
+
+	TAILQ_FOREACH(c, &g->configs, cnode)
+		n++;
+	TAILQ_FOREACH(f, &g->functions, fnode)
+		n++;
+
+	sd.dirs = calloc(n, sizeof(*sd.dirs));
+	sd.fds = calloc(n, sizeof(*sd.fds));
+	if (!sd.dirs || !sd.fds) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	ret = usbg_rm_list_subdirs(&sd, usbg_gadget_dirfd(g), STRINGS_DIR,
+				   file_select);
+
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		if (ret != USBG_SUCCESS)
+			goto out;
+		ret = usbg_rm_list_subdirs(&sd, usbg_config_dirfd(c),
+					   STRINGS_DIR, file_select);
+	}
+
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		if (ret != USBG_SUCCESS)
+			goto out;
+		if (usbg_lookup_function_attrs_type(f->type) ==
+		    USBG_F_ATTRS_MS)
+			ret = usbg_rm_list_subdirs(&sd, usbg_function_dirfd(f),
+						   ".", usbg_extra_lun_select);
+	}
+
+	if (ret != USBG_SUCCESS || sd.count == 0)
+		goto out;
+
+	for (n = 0, i = 0; i < sd.count; ++i)
+		n += sd.dirs[i].n;
+
+	ops = calloc(n, sizeof(*ops));
+	if (!ops) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	for (n = 0, i = 0; i < sd.count; ++i)
+		for (j = 0; j < sd.dirs[i].n; ++j)
+			usbg_rm_op(ops + n++, USBG_IO_RMDIR, sd.fds[i],
+				   sd.dirs[i].ents[j].name);
+
+	ret = usbg_rm_run(io, ops, n);
+
+out:
+	for (i = 0; i < sd.count; ++i) {
+		usbg_release_dir(sd.dirs + i);
+		close(sd.fds[i]);
+	}
+	free(ops);
+	free(sd.fds);
+	free(sd.dirs);
+	return ret;
+}
+
+static int usbg_rm_gadget_children(usbg_gadget *g, usbg_state *io)
+{
+	struct usbg_io_op *ops;
+	usbg_function *f;
+	usbg_config *c;
+	int cfd = -1;
+	int ffd = -1;
+	int gfd;
+	int ret;
+	int n = 0;
+
+	TAILQ_FOREACH(c, &g->configs, cnode)
+		n++;
+	TAILQ_FOREACH(f, &g->functions, fnode)
+		n++;
+
+	if (n == 0)
+		return USBG_SUCCESS;
+
+	ops = calloc(n, sizeof(*ops));
+	if (!ops)
+		return USBG_ERROR_NO_MEM;
+
+	gfd = usbg_gadget_dirfd(g);
+	if (gfd < 0) {
+		ret = gfd;
+		goto out;
+	}
+
+	ret = usbg_open_dir(gfd, CONFIGS_DIR, &cfd);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_open_dir(gfd, FUNCTIONS_DIR, &ffd);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	n = 0;
+	TAILQ_FOREACH(c, &g->configs, cnode)
+		usbg_rm_op(ops + n++, USBG_IO_RMDIR, cfd, c->name);
+	TAILQ_FOREACH(f, &g->functions, fnode)
+		usbg_rm_op(ops + n++, USBG_IO_RMDIR, ffd, f->name);
+
+	ret = usbg_rm_run(io, ops, n);
+
+out:
+	usbg_close_dir(&cfd);
+	usbg_close_dir(&ffd);
+	free(ops);
+	return ret;
+}
+
+/* Remove everything what is inside of gadget directory */
+static int usbg_rm_gadget_content(usbg_gadget *g, usbg_state *io)
+{
+	int ret;
+
+	ret = usbg_rm_gadget_bindings(g, io);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_rm_gadget_subdirs(g, io);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_rm_gadget_children(g, io);
+
+	return ret;
+}
+
+/* Used by worker threads which can't share io_uring of state */
+static int usbg_rm_gadget_content_sync(usbg_gadget *g)
+{
+	return usbg_rm_gadget_content(g, NULL);
+}
+
+/* Bring objects of gadget in line with configfs after failed removal */
+static void usbg_resync_gadget(usbg_gadget *g)
+{
+	struct usbg_changes ch = {
+		.cb = NULL,
+		.count = 0,
+	};
+
+	usbg_refresh_gadget(g, &ch);
+}
+
+static void usbg_drop_gadget(usbg_gadget *g)
+{
+	if (g->udc)
+		g->udc->gadget = NULL;
+	usbg_detach_gadget(g);
+	usbg_free_gadget(g);
+}
+
+static int usbg_rm_gadget_locked(usbg_gadget *g, int opts)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g)
+		goto out;
+
+	if (opts & USBG_RM_RECURSE) {
+		/* Recursive flag was given so remove whole gadget content */
+		ret = usbg_parse_lazy_gadget(g);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		ret = usbg_rm_gadget_content(g, g->parent);
+		if (ret != USBG_SUCCESS) {
+			usbg_resync_gadget(g);
+			goto out;
+		}
+	}
+
+	ret = usbg_rm_dir(g->path, g->name);
+	if (ret == USBG_SUCCESS)
+		usbg_drop_gadget(g);
+	else if (opts & USBG_RM_RECURSE)
+		usbg_resync_gadget(g);
+
+out:
+	return ret;
+}
+
+int usbg_rm_gadget(usbg_gadget *g, int opts)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = g->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_rm_gadget_locked(g, opts);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+/* Unbind all gadgets which are bound to any UDC at once */
+static int usbg_disable_gadgets(usbg_state *s, usbg_gadget **gads,
+				int count)
+{
+	struct usbg_io_op *ops;
+	usbg_gadget **bound;
+	int ret = USBG_SUCCESS;
+	int n = 0;
+	int fd;
+	int i;
+
+	ops = calloc(count, sizeof(*ops));
+	bound = calloc(count, sizeof(*bound));
+	if (!ops || !bound) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (!gads[i]->udc)
+			continue;
+
+		fd = usbg_gadget_dirfd(gads[i]);
+		if (fd < 0) {
+			ret = fd;
+			goto out;
+		}
+
+		ops[n].type = USBG_IO_WRITE;
+		ops[n].dirfd = fd;
+		ops[n].name = "UDC";
+		ops[n].buf = "\n";
+		ops[n].len = 1;
+		bound[n++] = gads[i];
+	}
+
+	usbg_io_batch(s, ops, n);
+
+	for (i = 0; i < n; ++i) {
+		/* Gadget may have been already unbound by kernel */
+		if (ops[i].ret != USBG_SUCCESS &&
+		    ops[i].ret != USBG_ERROR_NO_DEV) {
+			if (ret == USBG_SUCCESS)
+				ret = ops[i].ret;
+			continue;
+		}
+
+		bound[i]->udc->gadget = NULL;
+		bound[i]->udc = NULL;
+	}
+
+out:
+	free(bound);
+	free(ops);
+	return ret;
+}
+
+static int usbg_rm_all_gadgets_locked(usbg_state *s, int opts)
+{
+	struct usbg_gadget_job job = { .count = 0 };
+	struct usbg_io_op *ops = NULL;
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
+	int n = 0;
+	int sfd;
+	int i;
+
+	TAILQ_FOREACH(g, &s->gadgets, gnode)
+		job.count++;
+
+	if (job.count == 0)
+		goto out;
+
+	job.gadgets = calloc(job.count, sizeof(*job.gadgets));
+	job.results = calloc(job.count, sizeof(*job.results));
+	ops = calloc(job.count, sizeof(*ops));
+	if (!job.gadgets || !job.results || !ops) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	i = 0;
+	TAILQ_FOREACH(g, &s->gadgets, gnode)
+		job.gadgets[i++] = g;
+
+	sfd = usbg_state_dirfd(s);
+	if (sfd < 0) {
+		ret = sfd;
+		goto out;
+	}
+
+	if (opts & USBG_RM_RECURSE) {
+		/* Content of bound gadget can't be removed */
+		ret = usbg_disable_gadgets(s, job.gadgets, job.count);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		/* Workers don't parse, it would allocate from shared arena */
+		for (i = 0; i < job.count && ret == USBG_SUCCESS; ++i)
+			ret = usbg_parse_lazy_gadget(job.gadgets[i]);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		/* Gadgets are independent so they are emptied in parallel */
+		if (usbg_pool_threads(job.count) < 2) {
+			for (i = 0; i < job.count; ++i)
+				job.results[i] = usbg_rm_gadget_content(
+						job.gadgets[i], s);
+		} else {
+			job.fn = usbg_rm_gadget_content_sync;
+			usbg_run_gadget_job(&job);
+		}
+	}
+
+	for (i = 0; i < job.count; ++i) {
+		if (job.results[i] != USBG_SUCCESS) {
+			if (ret == USBG_SUCCESS)
+				ret = job.results[i];
+			usbg_resync_gadget(job.gadgets[i]);
+			job.gadgets[i] = NULL;
+			continue;
+		}
+
+		usbg_rm_op(ops + n++, USBG_IO_RMDIR, sfd, job.gadgets[i]->name);
+	}
+
+	usbg_io_batch(s, ops, n);
+
+	for (n = 0, i = 0; i < job.count; ++i) {
+		if (!job.gadgets[i])
+			continue;
+
+		if (ops[n++].ret == USBG_SUCCESS) {
+			usbg_drop_gadget(job.gadgets[i]);
+			continue;
+		}
+
+		if (ret == USBG_SUCCESS)
+			ret = ops[n - 1].ret;
+		if (opts & USBG_RM_RECURSE)
+			usbg_resync_gadget(job.gadgets[i]);
+	}
+
+out:
+	free(ops);
+	free(job.results);
+	free(job.gadgets);
+	return ret;
+}
+
+int usbg_rm_all_gadgets(usbg_state *s, int opts)
+{
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_rm_all_gadgets_locked(s, opts);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+int usbg_rm_config_strs(usbg_config *c, int lang)
+{
+	int ret = USBG_SUCCESS;
+	int nmb;
+	char path[USBG_MAX_PATH_LENGTH];
+
+	if (!c)
+		return USBG_ERROR_INVALID_PARAM;
+
+	nmb = snprintf(path, sizeof(path), "%s/%s/0x%x", c->bindings_path,
+			STRINGS_DIR, lang);
+	if (nmb >= sizeof(path))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	usbg_lock_attrs(c->parent);
+	ret = usbg_rm_dir(path, "");
+	/* Don't trust cached strings whose directory may be gone */
+	if (c->cache && c->cache->lang == lang)
+		c->cache->valid &= ~USBG_CACHE_STRS;
+	usbg_unlock_attrs(c->parent);
+
+	return ret;
+}
+
+int usbg_rm_gadget_strs(usbg_gadget *g, int lang)
+{
+	int ret = USBG_SUCCESS;
+	int nmb;
+	char path[USBG_MAX_PATH_LENGTH];
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path, g->name,
+			STRINGS_DIR, lang);
+	if (nmb >= sizeof(path))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	usbg_lock_attrs(g);
+	ret = usbg_rm_dir(path, "");
+	/* Don't trust cached strings whose directory may be gone */
+	if (g->cache && g->cache->lang == lang)
+		g->cache->valid &= ~USBG_CACHE_STRS;
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+
+static int usbg_create_empty_gadget(usbg_state *s, const char *name,
+				    usbg_gadget **g)
+{
+	char gpath[USBG_MAX_PATH_LENGTH];
+	char buf[USBG_MAX_STR_LENGTH];
+	int nmb;
+	usbg_gadget *gad;
+	int ret = USBG_SUCCESS;
+
+	nmb = usbg_join_path(gpath, sizeof(gpath), s->path, s->path_len,
+			     name, strlen(name));
+	if (nmb < 0) {
+		ret = nmb;
+		goto out;
+	}
+
+	*g = usbg_allocate_gadget(name, s);
+	if (!*g) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	gad = *g; /* alias only */
+
+	ret = mkdir(gpath, S_IRWXU|S_IRWXG|S_IRWXO);
+	if (ret == 0) {
+		/* Should be empty but read the default */
+		ret = usbg_read_string(usbg_gadget_dirfd(gad), "UDC", buf);
+		if (ret != USBG_SUCCESS) {
+			rmdir(gpath);
+		} else {
+			gad->udc = usbg_get_udc(s, buf);
+			if (gad->udc)
+				gad->udc->gadget = gad;
+		}
+	} else {
+		ret = usbg_translate_error(errno);
+	}
+
+	if (ret != USBG_SUCCESS) {
+		usbg_free_gadget(*g);
+		*g = NULL;
+	}
+
+out:
+	return ret;
+}
+
+static int usbg_create_gadget_vid_pid_locked(usbg_state *s, const char *name,
+		uint16_t idVendor, uint16_t idProduct, usbg_gadget **g)
+{
+	int ret;
+	usbg_gadget *gad;
+
+	if (!s || !g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	gad = usbg_get_gadget(s, name);
+	if (gad) {
+		ERROR("duplicate gadget name\n");
+		return USBG_ERROR_EXIST;
+	}
+
+	ret = usbg_create_empty_gadget(s, name, g);
+	gad = *g;
+
+	/* Check if gadget creation was successful and set attributes */
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_write_hex16(usbg_gadget_dirfd(gad), "idVendor",
+				       idVendor);
+		if (ret == USBG_SUCCESS) {
+			ret = usbg_write_hex16(usbg_gadget_dirfd(gad),
+					       "idProduct", idProduct);
+			if (ret == USBG_SUCCESS)
+				usbg_insert_gadget(s, gad);
+			else
+				usbg_free_gadget(gad);
+		}
+	}
+
+	return ret;
+}
+
+int usbg_create_gadget_vid_pid(usbg_state *s, const char *name,
+		uint16_t idVendor, uint16_t idProduct, usbg_gadget **g)
+{
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_create_gadget_vid_pid_locked(s, name, idVendor,
+							idProduct, g);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+static int usbg_create_gadget_locked(usbg_state *s, const char *name,
+		       const usbg_gadget_attrs *g_attrs, const usbg_gadget_strs *g_strs,
+		       usbg_gadget **g)
+{
+	usbg_gadget *gad;
+	int ret;
+
+	if (!s || !g)
+			return USBG_ERROR_INVALID_PARAM;
+
+	gad = usbg_get_gadget(s, name);
+	if (gad) {
+		ERROR("duplicate gadget name\n");
+		return USBG_ERROR_EXIST;
+	}
+
+	ret = usbg_create_empty_gadget(s, name, g);
+	gad = *g;
+
+	/* Check if gadget creation was successful and set attrs and strings */
+	if (ret == USBG_SUCCESS) {
+		if (g_attrs)
+			ret = usbg_set_gadget_attrs(gad, g_attrs);
+
+		if (g_strs)
+			ret = usbg_set_gadget_strs(gad, LANG_US_ENG, g_strs);
+
+		if (ret == USBG_SUCCESS)
+			usbg_insert_gadget(s, gad);
+		else
+			usbg_free_gadget(gad);
+	}
+	return ret;
+}
+
+int usbg_create_gadget(usbg_state *s, const char *name,
+		       const usbg_gadget_attrs *g_attrs, const usbg_gadget_strs *g_strs,
+		       usbg_gadget **g)
+{
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_create_gadget_locked(s, name, g_attrs, g_strs, g);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+/*
+ * Batch creation of gadgets
+ *
+ * Each step is done for all gadgets before the next one, so operations
+ * of a step are independent and can be submitted to usbg_io_batch()
+ * together: first all gadget directories, then all string directories
+ * and then all attribute and string files.
+ */
+
+static void usbg_fill_str_op(struct usbg_io_op *op, int dirfd,
+			     const char *name, char *buf)
+{
+	op->type = USBG_IO_WRITE;
+	op->dirfd = dirfd;
+	op->name = name;
+	op->buf = buf;
+	op->len = strlen(buf);
+}
+
+static int usbg_write_new_gadgets(usbg_state *s, usbg_gadget **gads,
+		int count, const usbg_gadget_desc *tmpl,
+		const usbg_gadget_override *overrides)
+{
+	const int nattrs = ARRAY_SIZE(gadget_attr_fields);
+	char str_dir[USBG_MAX_NAME_LENGTH];
+	char str_files[USBG_GADGET_STR_MAX][USBG_MAX_STR_LENGTH];
+	char (*bufs)[USBG_MAX_STR_LENGTH];
+	const usbg_gadget_attrs **attrs;
+	usbg_gadget_strs *strs;
+	struct usbg_io_op *ops;
+	struct usbg_gadget_cache *cache;
+	const char *serial;
+	int ret = USBG_SUCCESS;
+	int n = 0;
+	int i, j;
+	int fd;
+
+	ops = calloc(count, (nattrs + USBG_GADGET_STR_MAX) * sizeof(*ops));
+	bufs = calloc(count, nattrs * sizeof(*bufs));
+	attrs = calloc(count, sizeof(*attrs));
+	strs = calloc(count, sizeof(*strs));
+	if (!ops || !bufs || !attrs || !strs) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	snprintf(str_dir, sizeof(str_dir), "%s/0x%x", STRINGS_DIR,
+		 LANG_US_ENG);
+	for (j = USBG_GADGET_STR_MIN; j < USBG_GADGET_STR_MAX; ++j)
+		snprintf(str_files[j], sizeof(str_files[j]), "%s/%s", str_dir,
+			 gadget_str_names[j]);
+
+	for (i = 0; i < count; ++i) {
+		attrs[i] = overrides && overrides[i].attrs ?
+			overrides[i].attrs : tmpl->attrs;
+
+		serial = overrides ? overrides[i].serial : NULL;
+		if (!tmpl->strs && !serial)
+			continue;
+
+		if (tmpl->strs)
+			strs[i] = *tmpl->strs;
+		if (serial) {
+			strncpy(strs[i].str_ser, serial,
+				sizeof(strs[i].str_ser) - 1);
+			strs[i].str_ser[sizeof(strs[i].str_ser) - 1] = '\0';
+		}
+
+		fd = usbg_gadget_dirfd(gads[i]);
+		if (fd < 0) {
+			ret = fd;
+			goto out;
+		}
+
+		ops[n].type = USBG_IO_MKDIR;
+		ops[n].dirfd = fd;
+		ops[n].name = str_dir;
+		++n;
+	}
+
+	/* Directories for strings of all gadgets, files are placed in them */
+	usbg_io_batch(s, ops, n);
+	for (i = 0; i < n; ++i) {
+		/* As in usbg_check_dir() existing one is fine */
+		if (ops[i].ret != USBG_SUCCESS &&
+		    ops[i].ret != USBG_ERROR_EXIST) {
+			ret = ops[i].ret;
+			goto out;
+		}
+	}
+
+	n = 0;
+	for (i = 0; i < count; ++i) {
+		fd = usbg_gadget_dirfd(gads[i]);
+		if (fd < 0) {
+			ret = fd;
+			goto out;
+		}
+
+		if (attrs[i]) {
+			usbg_fill_attr_ops(fd, gadget_attr_fields, nattrs,
+					   attrs[i], ops + n, bufs + i * nattrs);
+			n += nattrs;
+		}
+
+		if (!tmpl->strs && !(overrides && overrides[i].serial))
+			continue;
+
+		usbg_fill_str_op(ops + n++, fd, str_files[STR_SERIAL_NUMBER],
+				 strs[i].str_ser);
+		usbg_fill_str_op(ops + n++, fd, str_files[STR_MANUFACTURER],
+				 strs[i].str_mnf);
+		usbg_fill_str_op(ops + n++, fd, str_files[STR_PRODUCT],
+				 strs[i].str_prd);
+	}
+
+	ret = usbg_io_batch(s, ops, n);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	for (i = 0; i < count; ++i) {
+		cache = usbg_gadget_cache(gads[i]);
+		if (!cache)
+			continue;
+
+		if (attrs[i]) {
+			cache->attrs = *attrs[i];
+			cache->valid |= USBG_CACHE_ATTRS;
+		}
+
+		if (tmpl->strs || (overrides && overrides[i].serial)) {
+			cache->strs = strs[i];
+			cache->lang = LANG_US_ENG;
+			cache->valid |= USBG_CACHE_STRS;
+		}
+	}
+
+out:
+	free(strs);
+	free(attrs);
+	free(bufs);
+	free(ops);
+	return ret;
+}
+
+static int usbg_create_gadgets_locked(usbg_state *s, const char *prefix,
+		int count, const usbg_gadget_desc *tmpl,
+		const usbg_gadget_override *overrides, usbg_gadget **gadgets)
+{
+	char (*names)[USBG_MAX_NAME_LENGTH];
+	struct usbg_io_op *ops;
+	usbg_gadget **gads;
+	usbg_gadget_desc content;
+	int ret = USBG_SUCCESS;
+	int nmb;
+	int sfd;
+	int i;
+
+	names = calloc(count, sizeof(*names));
+	ops = calloc(count, sizeof(*ops));
+	gads = calloc(count, sizeof(*gads));
+	if (!names || !ops || !gads) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	sfd = usbg_state_dirfd(s);
+	if (sfd < 0) {
+		ret = sfd;
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		nmb = snprintf(names[i], sizeof(names[i]), "%s%d", prefix, i);
+		if (nmb >= sizeof(names[i])) {
+			ret = USBG_ERROR_PATH_TOO_LONG;
+			goto out;
+		}
+
+		if (usbg_get_gadget(s, names[i])) {
+			ERROR("duplicate gadget name\n");
+			ret = USBG_ERROR_EXIST;
+			goto out;
+		}
+
+		ops[i].type = USBG_IO_MKDIR;
+		ops[i].dirfd = sfd;
+		ops[i].name = names[i];
+	}
+
+	usbg_io_batch(s, ops, count);
+
+	/*
+	 * New gadgets are not bound to any UDC, so unlike
+	 * usbg_create_empty_gadget() their UDC file is not read.
+	 */
+	for (i = 0; i < count; ++i) {
+		if (ops[i].ret != USBG_SUCCESS) {
+			if (ret == USBG_SUCCESS)
+				ret = ops[i].ret;
+			continue;
+		}
+
+		gads[i] = usbg_allocate_gadget(names[i], s);
+		if (!gads[i]) {
+			unlinkat(sfd, names[i], AT_REMOVEDIR);
+			ret = USBG_ERROR_NO_MEM;
+			continue;
+		}
+
+		usbg_insert_gadget(s, gads[i]);
+	}
+
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	ret = usbg_write_new_gadgets(s, gads, count, tmpl, overrides);
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	/* Attributes and strings have been already written */
+	content = *tmpl;
+	content.attrs = NULL;
+	content.strs = NULL;
+	for (i = 0; i < count; ++i) {
+		ret = usbg_reconcile_gadget(gads[i], &content, 0, NULL);
+		if (ret < 0)
+			goto err;
+	}
+
+	ret = USBG_SUCCESS;
+	if (gadgets)
+		memcpy(gadgets, gads, count * sizeof(*gads));
+	goto out;
+
+err:
+	for (i = 0; i < count; ++i)
+		if (gads[i])
+			usbg_rm_gadget_locked(gads[i], USBG_RM_RECURSE);
+out:
+	free(gads);
+	free(ops);
+	free(names);
+	return ret;
+}
+
+int usbg_create_gadgets(usbg_state *s, const char *prefix, int count,
+		const usbg_gadget_desc *tmpl,
+		const usbg_gadget_override *overrides, usbg_gadget **gadgets)
+{
+	int ret;
+
+	if (!s || !prefix || count <= 0 || !tmpl)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_create_gadgets_locked(s, prefix, count, tmpl,
+						 overrides, gadgets);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+static int usbg_get_gadget_attrs_locked(usbg_gadget *g,
+		usbg_gadget_attrs *g_attrs)
+{
+	struct usbg_gadget_cache *cache;
+	int ret;
+
+	if (!g || !g_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	cache = usbg_gadget_cache(g);
+	if (cache && cache->valid & USBG_CACHE_ATTRS) {
+		*g_attrs = cache->attrs;
+		return USBG_SUCCESS;
+	}
+
+	ret = usbg_parse_gadget_attrs(g, g_attrs);
+	if (ret == USBG_SUCCESS && cache) {
+		cache->attrs = *g_attrs;
+		cache->valid |= USBG_CACHE_ATTRS;
+	}
+
+	return ret;
+}
+
+int usbg_get_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_get_gadget_attrs_locked(g, g_attrs);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+/* Update cached gadget attribute, if any, after write */
+static inline int usbg_cache_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr,
+					 int val, int ret)
+{
+	return g->cache ? usbg_cache_attr_field(&g->cache->valid,
+						gadget_attr_fields + attr,
+						&g->cache->attrs, val, ret)
+			: ret;
+}
+
+/* Write single gadget attribute or record it in open transaction */
+static int usbg_write_gadget_attr_locked(usbg_gadget *g, usbg_gadget_attr attr,
+				  int val)
+{
+	const struct usbg_attr_field *field = gadget_attr_fields + attr;
+	char buf[USBG_MAX_STR_LENGTH];
+	int ret;
+
+	if (g->txn) {
+		usbg_store_attr_field(field, &g->txn->attrs, val);
+		g->txn->dirty |= 1 << attr;
+		return USBG_SUCCESS;
+	}
+
+	usbg_format_attr_field(field, val, buf);
+	ret = usbg_write_buf(usbg_gadget_dirfd(g), field->name, buf);
+
+	return usbg_cache_gadget_attr(g, attr, val, ret);
+}
+
+static int usbg_write_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr,
+				  int val)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_write_gadget_attr_locked(g, attr, val);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+int usbg_get_gadget_attr_vec(usbg_gadget *g, usbg_attr_io *attrs, int count)
+{
+	return g ? usbg_read_attr_vec(g->parent, usbg_gadget_dirfd(g), attrs,
+				      count)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+const char *usbg_get_gadget_name(usbg_gadget *g)
+{
+	return g ? g->name : NULL;
+}
+
+size_t usbg_get_gadget_name_len(usbg_gadget *g)
+{
+	return g ? g->name_len : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_cpy_gadget_name(usbg_gadget *g, char *buf, size_t len)
+{
+	if (!g || !buf || len == 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	buf[--len] = '\0';
+	strncpy(buf, g->name, len);
+
+	return USBG_SUCCESS;
+}
+
+const char *usbg_get_udc_name(usbg_udc *u)
+{
+	return u ? u->name : NULL;
+}
+
+size_t usbg_get_udc_name_len(usbg_udc *u)
+{
+	return u ? u->name_len : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_cpy_udc_name(usbg_udc *u, char *buf, size_t len)
+{
+	if (!u || !buf || len == 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	buf[--len] = '\0';
+	strncpy(buf, u->name, len);
+
+	return USBG_SUCCESS;
+}
+
+int usbg_set_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr, int val)
+{
+	const char *attr_name;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g)
+		goto out;
+
+	attr_name = usbg_get_gadget_attr_str(attr);
+	if (!attr_name)
+		goto out;
+
+	ret = usbg_write_gadget_attr(g, attr, val);
+
+out:
+	return ret;
+}
+
+static int usbg_get_gadget_attr_locked(usbg_gadget *g, usbg_gadget_attr attr)
+{
+	const char *attr_name;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g)
+		goto out;
+
+	attr_name = usbg_get_gadget_attr_str(attr);
+	if (!attr_name)
+		goto out;
+
+	if (g->cache && g->cache->valid & USBG_CACHE_ATTRS) {
+		ret = usbg_load_attr_field(gadget_attr_fields + attr,
+					   &g->cache->attrs);
+		goto out;
+	}
+
+	usbg_read_hex(usbg_gadget_dirfd(g), attr_name, &ret);
+
+out:
+	return ret;
+}
+
+int usbg_get_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_get_gadget_attr_locked(g, attr);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+int usbg_read_gadget_udc(usbg_gadget *g, char *buf)
+{
+	return usbg_read_string(usbg_gadget_dirfd(g), "UDC", buf);
+}
+
+static usbg_udc *usbg_get_gadget_udc_locked(usbg_gadget *g)
+{
+	usbg_udc *u = NULL;
+
+	if (!g)
+		goto out;
+	/*
+	 * if gadget was enabled we have to check if kernel
+	 * didn't modify the UDC file due to some errors.
+	 * For example some FFS daemon could just get
+	 * a segmentation fault or sth
+	 */
+	if (g->parent->watch) {
+		/* Binding is kept up to date by kernel notifications */
+		usbg_watch_sync(g->parent);
+		u = g->udc;
+		goto out;
+	}
+
+	if (g->udc) {
+		char buf[USBG_MAX_STR_LENGTH];
+		int ret;
+
+		ret = usbg_read_gadget_udc(g, buf);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		if (!strcmp(g->udc->name, buf)) {
+			/* Gadget is still assigned to this UDC */
+			u = g->udc;
+		} else {
+			/* Kernel decided to detach this gadget */
+			g->udc->gadget = NULL;
+			g->udc = NULL;
+		}
+	}
+
+out:
+	return u;
+}
+
+usbg_udc *usbg_get_gadget_udc(usbg_gadget *g)
+{
+	usbg_udc *u;
+
+	if (!g)
+		return NULL;
+
+	usbg_lock_obj(g->parent);
+	u = usbg_get_gadget_udc_locked(g);
+	usbg_unlock_obj(g->parent);
+
+	return u;
+}
+
+static usbg_gadget *usbg_get_udc_gadget_locked(usbg_udc *u)
+{
+	usbg_gadget *g = NULL;
+
+	if (!u)
+		goto out;
+
+	if (u->parent->watch) {
+		usbg_watch_sync(u->parent);
+		g = u->gadget;
+		goto out;
+	}
+	/*
+	 * if gadget was enabled on this UDC we have to check if kernel
+	 * didn't modify this due to some errors.
+	 * For example some FFS daemon could just get a segmentation fault
+	 * what causes detach of gadget
+	 */
+	if (u->gadget) {
+		usbg_udc *u_checked;
+
+		u_checked = usbg_get_gadget_udc(u->gadget);
+		if (u_checked) {
+			g = u->gadget;
+		} else {
+			u->gadget->udc = NULL;
+			u->gadget = NULL;
+		}
+	}
+
+out:
+	return g;
+}
+
+usbg_gadget *usbg_get_udc_gadget(usbg_udc *u)
+{
+	usbg_gadget *g;
+
+	if (!u)
+		return NULL;
+
+	usbg_lock_obj(u->parent);
+	g = usbg_get_udc_gadget_locked(u);
+	usbg_unlock_obj(u->parent);
+
+	return g;
+}
+
+static int usbg_set_gadget_attrs_locked(usbg_gadget *g,
+		const usbg_gadget_attrs *g_attrs)
+{
+	struct usbg_gadget_cache *cache;
+	int ret;
+
+	if (!g || !g_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (g->txn) {
+		g->txn->attrs = *g_attrs;
+		g->txn->dirty = (1 << USBG_GADGET_ATTR_MAX) - 1;
+		return USBG_SUCCESS;
+	}
+
+	ret = usbg_write_attr_fields(g->parent, usbg_gadget_dirfd(g),
+				     gadget_attr_fields,
+				     ARRAY_SIZE(gadget_attr_fields), g_attrs);
+
+	cache = usbg_gadget_cache(g);
+	if (!cache)
+		goto out;
+
+	if (ret == USBG_SUCCESS) {
+		cache->attrs = *g_attrs;
+		cache->valid |= USBG_CACHE_ATTRS;
+	} else {
+		cache->valid &= ~USBG_CACHE_ATTRS;
+	}
+
+out:
+	return ret;
+}
+
+int usbg_set_gadget_attrs(usbg_gadget *g, const usbg_gadget_attrs *g_attrs)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_set_gadget_attrs_locked(g, g_attrs);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+int usbg_set_gadget_vendor_id(usbg_gadget *g, uint16_t idVendor)
+{
+	return g ? usbg_write_gadget_attr(g, ID_VENDOR, idVendor)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_product_id(usbg_gadget *g, uint16_t idProduct)
+{
+	return g ? usbg_write_gadget_attr(g, ID_PRODUCT, idProduct)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_device_class(usbg_gadget *g, uint8_t bDeviceClass)
+{
+	return g ? usbg_write_gadget_attr(g, B_DEVICE_CLASS, bDeviceClass)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_device_protocol(usbg_gadget *g, uint8_t bDeviceProtocol)
+{
+	return g ? usbg_write_gadget_attr(g, B_DEVICE_PROTOCOL, bDeviceProtocol)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_device_subclass(usbg_gadget *g, uint8_t bDeviceSubClass)
+{
+	return g ? usbg_write_gadget_attr(g, B_DEVICE_SUB_CLASS, bDeviceSubClass)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_device_max_packet(usbg_gadget *g, uint8_t bMaxPacketSize0)
+{
+	return g ? usbg_write_gadget_attr(g, B_MAX_PACKET_SIZE_0, bMaxPacketSize0)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_device_bcd_device(usbg_gadget *g, uint16_t bcdDevice)
+{
+	return g ? usbg_write_gadget_attr(g, BCD_DEVICE, bcdDevice)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_device_bcd_usb(usbg_gadget *g, uint16_t bcdUSB)
+{
+	return g ? usbg_write_gadget_attr(g, BCD_USB, bcdUSB)
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+static int usbg_get_gadget_strs_locked(usbg_gadget *g, int lang,
+		usbg_gadget_strs *g_strs)
+{
+	struct usbg_gadget_cache *cache;
+	int ret;
+
+	if (!g || !g_strs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	cache = usbg_gadget_cache(g);
+	if (cache && cache->valid & USBG_CACHE_STRS && cache->lang == lang) {
+		*g_strs = cache->strs;
+		return USBG_SUCCESS;
+	}
+
+	ret = usbg_parse_gadget_strs(g, lang, g_strs);
+	if (ret == USBG_SUCCESS && cache) {
+		cache->strs = *g_strs;
+		cache->lang = lang;
+		cache->valid |= USBG_CACHE_STRS;
+	}
+
+	return ret;
+}
+
+int usbg_get_gadget_strs(usbg_gadget *g, int lang,
+		usbg_gadget_strs *g_strs)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_get_gadget_strs_locked(g, lang, g_strs);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+static char *usbg_gadget_strs_field(usbg_gadget_strs *g_strs,
+				    usbg_gadget_str str)
+{
+	switch (str) {
+	case STR_SERIAL_NUMBER:
+		return g_strs->str_ser;
+	case STR_MANUFACTURER:
+		return g_strs->str_mnf;
+	default:
+		return g_strs->str_prd;
+	}
+}
+
+/* Update cached gadget string, if any, after write */
+static int usbg_cache_gadget_str(usbg_gadget *g, usbg_gadget_str str,
+				 int lang, const char *val, int ret)
+{
+	return g->cache ? usbg_cache_str(&g->cache->valid, g->cache->lang,
+				usbg_gadget_strs_field(&g->cache->strs, str),
+				lang, val, ret)
+			: ret;
+}
+
+/* Record gadget string in open transaction */
+static int usbg_txn_set_str(usbg_gadget *g, usbg_gadget_str str,
+			    int lang, const char *val)
+{
+	struct usbg_gadget_txn *txn = g->txn;
+	struct usbg_txn_str *strs;
+	int i;
+
+	for (i = 0; i < txn->nstrs; ++i) {
+		if (txn->strs[i].lang == lang && txn->strs[i].str == str)
+			goto out;
+	}
+
+	strs = usbg_alloc_attr_obj(g->parent, 0,
+				   (txn->nstrs + 1) * sizeof(*strs));
+	if (!strs)
+		return USBG_ERROR_NO_MEM;
+
+	if (txn->nstrs)
+		memcpy(strs, txn->strs, txn->nstrs * sizeof(*strs));
+	usbg_free_attr_obj(g->parent, txn->strs);
+	txn->strs = strs;
+	txn->strs[i].lang = lang;
+	txn->strs[i].str = str;
+	txn->nstrs++;
+out:
+	snprintf(txn->strs[i].val, sizeof(txn->strs[i].val), "%s", val);
+	return USBG_SUCCESS;
+}
+
+static int usbg_set_gadget_str_locked(usbg_gadget *g, usbg_gadget_str str,
+		int lang, const char *val)
+{
+	const char *str_name;
+	int ret = USBG_ERROR_INVALID_PARAM;
+	int fd;
+
+	if (!g)
+		goto out;
+
+	str_name = usbg_get_gadget_str_name(str);
+	if (!str_name)
+		goto out;
+
+	if (g->txn) {
+		ret = usbg_txn_set_str(g, str, lang, val);
+		goto out;
+	}
+
+	fd = usbg_gadget_dirfd(g);
+	ret = usbg_check_str_dir(fd, lang);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_write_str_file(fd, lang, str_name, val);
+	ret = usbg_cache_gadget_str(g, str, lang, val, ret);
+
+out:
+	return ret;
+}
+
+int usbg_set_gadget_str(usbg_gadget *g, usbg_gadget_str str, int lang,
+		const char *val)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_set_gadget_str_locked(g, str, lang, val);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+static int usbg_set_gadget_strs_locked(usbg_gadget *g, int lang,
+		const usbg_gadget_strs *g_strs)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+	int fd;
+
+	if (!g || !g_strs)
+		goto out;
+
+	if (g->txn) {
+		ret = usbg_txn_set_str(g, STR_SERIAL_NUMBER, lang,
+				       g_strs->str_ser);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_txn_set_str(g, STR_MANUFACTURER, lang,
+					       g_strs->str_mnf);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_txn_set_str(g, STR_PRODUCT, lang,
+					       g_strs->str_prd);
+		return ret;
+	}
+
+	fd = usbg_gadget_dirfd(g);
+	ret = usbg_check_str_dir(fd, lang);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_write_str_file(fd, lang, "serialnumber", g_strs->str_ser);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_write_str_file(fd, lang, "manufacturer", g_strs->str_mnf);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_write_str_file(fd, lang, "product", g_strs->str_prd);
+
+out:
+	if (g && usbg_gadget_cache(g)) {
+		if (ret == USBG_SUCCESS) {
+			g->cache->strs = *g_strs;
+			g->cache->lang = lang;
+			g->cache->valid |= USBG_CACHE_STRS;
+		} else {
+			g->cache->valid &= ~USBG_CACHE_STRS;
+		}
+	}
+
+	return ret;
+}
+
+int usbg_set_gadget_strs(usbg_gadget *g, int lang,
+		const usbg_gadget_strs *g_strs)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_set_gadget_strs_locked(g, lang, g_strs);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+int usbg_set_gadget_serial_number(usbg_gadget *g, int lang, const char *serno)
+{
+	return serno ? usbg_set_gadget_str(g, STR_SERIAL_NUMBER, lang, serno)
+		: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_manufacturer(usbg_gadget *g, int lang, const char *mnf)
+{
+	return mnf ? usbg_set_gadget_str(g, STR_MANUFACTURER, lang, mnf)
+		: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_product(usbg_gadget *g, int lang, const char *prd)
+{
+	return prd ? usbg_set_gadget_str(g, STR_PRODUCT, lang, prd)
+		: USBG_ERROR_INVALID_PARAM;
+}
+
+/*
+ * Transactions
+ *
+ * Setters called while transaction is open only record values.
+ * On commit each recorded value is compared with the current one
+ * and only those which differ are written, in a single batch.
+ * Current values are kept to write them back if any write fails.
+ * Directories are created by commit too, just before the writes,
+ * so rollback removes those which it has created.
+ */
+
+/* Net attributes which have been recorded by single setters */
+#define USBG_TXN_NET_DEV_ADDR	(1 << 0)
+#define USBG_TXN_NET_HOST_ADDR	(1 << 1)
+#define USBG_TXN_NET_QMULT	(1 << 2)
+#define USBG_TXN_FUNC_ALL	(~0)
+
+struct usbg_txn_op {
+	int dirfd;
+	char name[USBG_MAX_NAME_LENGTH];
+	char val[USBG_MAX_PATH_LENGTH];
+	char old[USBG_MAX_PATH_LENGTH];
+	/* File comes with directory created by commit, nothing to restore */
+	bool fresh;
+};
+
+struct usbg_txn_dir {
+	int dirfd;
+	char name[USBG_MAX_NAME_LENGTH];
+	bool created;
+};
+
+/*
+ * Everything commit is going to do. Mass storage LUNs which are no longer
+ * wanted are removed only after all writes have succeeded, because
+ * removal of directory can't be undone.
+ */
+struct usbg_txn_plan {
+	struct usbg_txn_op *tops;
+	int count;
+	struct usbg_txn_dir *dirs;
+	int ndirs;
+	struct usbg_txn_dir *rms;
+	int nrms;
+};
+
+static int usbg_begin_gadget_transaction_locked(usbg_gadget *g)
+{
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (g->txn)
+		return USBG_ERROR_BUSY;
+
+	g->txn = usbg_alloc_attr_obj(g->parent, sizeof(*g->txn), 0);
+	return g->txn ? USBG_SUCCESS : USBG_ERROR_NO_MEM;
+}
+
+int usbg_begin_gadget_transaction(usbg_gadget *g)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_begin_gadget_transaction_locked(g);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+static void usbg_abort_gadget_transaction_locked(usbg_gadget *g)
+{
+	if (!g)
+		return;
+
+	usbg_free_txn(g->parent, g->txn);
+	g->txn = NULL;
+}
+
+void usbg_abort_gadget_transaction(usbg_gadget *g)
+{
+	if (!g)
+		return;
+
+	usbg_lock_attrs(g);
+	usbg_abort_gadget_transaction_locked(g);
+	usbg_unlock_attrs(g);
+}
+
+/*
+ * Add write of file to plan. When old is NULL, file is in directory
+ * which is going to be created and there is nothing to restore.
+ */
+static int usbg_txn_add_op(struct usbg_txn_plan *p, int dirfd,
+			   const char *dir, const char *file,
+			   const char *val, const char *old)
+{
+	struct usbg_txn_op *top = p->tops + p->count;
+	int nmb;
+
+	if (dir)
+		nmb = snprintf(top->name, sizeof(top->name), "%s/%s",
+			       dir, file);
+	else
+		nmb = snprintf(top->name, sizeof(top->name), "%s", file);
+	if (nmb >= sizeof(top->name))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	if (strlen(val) >= sizeof(top->val) ||
+	    (old && strlen(old) >= sizeof(top->old)))
+		return USBG_ERROR_INVALID_PARAM;
+
+	top->dirfd = dirfd;
+	strcpy(top->val, val);
+	strcpy(top->old, old ? old : "");
+	top->fresh = !old;
+	p->count++;
+
+	return USBG_SUCCESS;
+}
+
+/* Add directory to the list unless it is already there */
+static int usbg_txn_add_dir(struct usbg_txn_dir *dirs, int *ndirs,
+			    int dirfd, const char *name)
+{
+	int i;
+
+	for (i = 0; i < *ndirs; ++i) {
+		if (dirs[i].dirfd == dirfd && !strcmp(dirs[i].name, name))
+			return USBG_SUCCESS;
+	}
+
+	if (strlen(name) >= sizeof(dirs[i].name))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	dirs[i].dirfd = dirfd;
+	strcpy(dirs[i].name, name);
+	dirs[i].created = false;
+	++*ndirs;
+
+	return USBG_SUCCESS;
+}
+
+/* Prepare writes of attributes which differ from current values */
+static int usbg_txn_prep_attrs(usbg_gadget *g, int fd,
+			       struct usbg_gadget_txn *txn,
+			       struct usbg_txn_plan *p)
+{
+	const struct usbg_attr_field *field;
+	char vbuf[USBG_MAX_STR_LENGTH], obuf[USBG_MAX_STR_LENGTH];
+	usbg_gadget_attrs cur;
+	int val, old;
+	int ret;
+	int i;
+
+	if (!txn->dirty)
+		return USBG_SUCCESS;
+
+	ret = usbg_get_gadget_attrs(g, &cur);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i) {
+		if (!(txn->dirty & (1 << i)))
+			continue;
+
+		field = gadget_attr_fields + i;
+		val = usbg_load_attr_field(field, &txn->attrs);
+		old = usbg_load_attr_field(field, &cur);
+		if (val == old)
+			continue;
+
+		usbg_format_attr_field(field, val, vbuf);
+		usbg_format_attr_field(field, old, obuf);
+		ret = usbg_txn_add_op(p, fd, NULL, field->name, vbuf, obuf);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Prepare writes of strings which differ from current values */
+static int usbg_txn_prep_strs(usbg_gadget *g, int fd,
+			      struct usbg_gadget_txn *txn,
+			      struct usbg_txn_plan *p)
+{
+	char dir[USBG_MAX_NAME_LENGTH];
+	char path[USBG_MAX_PATH_LENGTH];
+	char old[USBG_MAX_STR_LENGTH];
+	struct usbg_txn_str *ts;
+	const char *name;
+	bool missing;
+	int ret;
+	int i;
+
+	for (i = 0; i < txn->nstrs; ++i) {
+		ts = txn->strs + i;
+		name = usbg_get_gadget_str_name(ts->str);
+		snprintf(dir, sizeof(dir), "%s/0x%x", STRINGS_DIR, ts->lang);
+		missing = false;
+
+		if (g->cache && g->cache->valid & USBG_CACHE_STRS &&
+		    g->cache->lang == ts->lang) {
+			strcpy(old, usbg_gadget_strs_field(&g->cache->strs,
+							   ts->str));
+		} else {
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			ret = usbg_read_string(fd, path, old);
+			/* New language directory comes with empty strings */
+			if (ret == USBG_ERROR_NOT_FOUND) {
+				old[0] = '\0';
+				missing = true;
+			} else if (ret != USBG_SUCCESS) {
+				return ret;
+			}
+		}
+
+		if (!strcmp(old, ts->val))
+			continue;
+
+		if (missing) {
+			ret = usbg_txn_add_dir(p->dirs, &p->ndirs, fd, dir);
+			if (ret != USBG_SUCCESS)
+				return ret;
+		}
+
+		ret = usbg_txn_add_op(p, fd, dir, name, ts->val,
+				      missing ? NULL : old);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/*
+ * Prepare writes of fields which differ from current values.
+ * Without current values all fields are written.
+ */
+static int usbg_txn_prep_fields(struct usbg_txn_plan *p, int fd,
+				const char *dir,
+				const struct usbg_attr_field *fields,
+				int count, const void *val, const void *old)
+{
+	struct usbg_io_op vops[count], oops[count];
+	char vbufs[count][USBG_MAX_STR_LENGTH];
+	char obufs[count][USBG_MAX_STR_LENGTH];
+	int ret;
+	int i;
+
+	usbg_fill_attr_ops(fd, fields, count, val, vops, vbufs);
+	if (old)
+		usbg_fill_attr_ops(fd, fields, count, old, oops, obufs);
+
+	for (i = 0; i < count; ++i) {
+		if (old && !strcmp(vops[i].buf, oops[i].buf))
+			continue;
+
+		ret = usbg_txn_add_op(p, fd, dir, fields[i].name, vops[i].buf,
+				      old ? oops[i].buf : NULL);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_txn_prep_net(struct usbg_txn_plan *p, int fd,
+			     struct usbg_txn_func *tf,
+			     const usbg_f_net_attrs *cur)
+{
+	const usbg_f_net_attrs *net = &tf->attrs.attrs.net;
+	char vbuf[USBG_MAX_STR_LENGTH], obuf[USBG_MAX_STR_LENGTH];
+	int ret = USBG_SUCCESS;
+
+	if (tf->dirty & USBG_TXN_NET_DEV_ADDR &&
+	    memcmp(&net->dev_addr, &cur->dev_addr, sizeof(net->dev_addr)))
+		ret = usbg_txn_add_op(p, fd, NULL, "dev_addr",
+				      usbg_ether_ntoa_r(&net->dev_addr, vbuf),
+				      usbg_ether_ntoa_r(&cur->dev_addr, obuf));
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (tf->dirty & USBG_TXN_NET_HOST_ADDR &&
+	    memcmp(&net->host_addr, &cur->host_addr, sizeof(net->host_addr)))
+		ret = usbg_txn_add_op(p, fd, NULL, "host_addr",
+				      usbg_ether_ntoa_r(&net->host_addr, vbuf),
+				      usbg_ether_ntoa_r(&cur->host_addr, obuf));
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (tf->dirty & USBG_TXN_NET_QMULT && net->qmult != cur->qmult) {
+		snprintf(vbuf, sizeof(vbuf), "%d\n", net->qmult);
+		snprintf(obuf, sizeof(obuf), "%d\n", cur->qmult);
+		ret = usbg_txn_add_op(p, fd, NULL, "qmult", vbuf, obuf);
+	}
+
+	return ret;
+}
+
+static int usbg_txn_prep_ms(struct usbg_txn_plan *p, int fd,
+			    const usbg_f_ms_attrs *ms,
+			    const usbg_f_ms_attrs *cur)
+{
+	char lun[USBG_MAX_NAME_LENGTH];
+	int ret;
+	int i;
+
+	ret = usbg_txn_prep_fields(p, fd, NULL, ms_attr_fields,
+				   ARRAY_SIZE(ms_attr_fields), ms, cur);
+	/* lun0 cannot be removed */
+	if (ret != USBG_SUCCESS || !ms->luns || ms->nluns <= 0)
+		return ret;
+
+	for (i = 0; i < ms->nluns; ++i) {
+		snprintf(lun, sizeof(lun), "lun.%d", i);
+		if (i >= cur->nluns) {
+			ret = usbg_txn_add_dir(p->dirs, &p->ndirs, fd, lun);
+			if (ret != USBG_SUCCESS)
+				return ret;
+		}
+
+		if (!ms->luns[i])
+			continue;
+
+		ret = usbg_txn_prep_fields(p, fd, lun, ms_lun_attr_fields,
+					   ARRAY_SIZE(ms_lun_attr_fields),
+					   ms->luns[i],
+					   i < cur->nluns ? cur->luns[i] : NULL);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	for (i = ms->nluns; i < cur->nluns; ++i) {
+		snprintf(lun, sizeof(lun), "lun.%d", i);
+		ret = usbg_txn_add_dir(p->rms, &p->nrms, fd, lun);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Prepare writes of function attributes which differ from current ones */
+static int usbg_txn_prep_funcs(struct usbg_gadget_txn *txn,
+			       struct usbg_txn_plan *p)
+{
+	struct usbg_txn_dir *rms;
+	struct usbg_txn_func *tf;
+	usbg_function_attrs cur;
+	int ret = USBG_SUCCESS;
+	int fd;
+	int i;
+
+	for (i = 0; i < txn->nfuncs && ret == USBG_SUCCESS; ++i) {
+		tf = txn->funcs + i;
+
+		fd = usbg_function_dirfd(tf->f);
+		if (USBG_DIRFD_ERROR(fd))
+			return fd;
+
+		ret = usbg_get_function_attrs(tf->f, &cur);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		switch (tf->attrs.header.attrs_type) {
+		case USBG_F_ATTRS_NET:
+			ret = usbg_txn_prep_net(p, fd, tf, &cur.attrs.net);
+			break;
+
+		case USBG_F_ATTRS_MS:
+			/* Room for all LUNs which may be removed */
+			rms = realloc(p->rms, (p->nrms + cur.attrs.ms.nluns + 1)
+				      * sizeof(*rms));
+			if (!rms) {
+				ret = USBG_ERROR_NO_MEM;
+				break;
+			}
+			p->rms = rms;
+			ret = usbg_txn_prep_ms(p, fd, &tf->attrs.attrs.ms,
+					       &cur.attrs.ms);
+			break;
+
+		case USBG_F_ATTRS_MIDI:
+			ret = usbg_txn_prep_fields(p, fd, NULL, midi_attr_fields,
+						   ARRAY_SIZE(midi_attr_fields),
+						   &tf->attrs.attrs.midi,
+						   &cur.attrs.midi);
+			break;
+
+		case USBG_F_ATTRS_LOOPBACK:
+			ret = usbg_txn_prep_fields(p, fd, NULL,
+					loopback_attr_fields,
+					ARRAY_SIZE(loopback_attr_fields),
+					&tf->attrs.attrs.loopback,
+					&cur.attrs.loopback);
+			break;
+		}
+
+		usbg_cleanup_function_attrs(&cur);
+	}
+
+	return ret;
+}
+
+/* Upper bound of writes which function may need */
+static int usbg_txn_func_max_ops(struct usbg_txn_func *tf)
+{
+	const usbg_f_ms_attrs *ms = &tf->attrs.attrs.ms;
+
+	switch (tf->attrs.header.attrs_type) {
+	case USBG_F_ATTRS_NET:
+		return 3;
+	case USBG_F_ATTRS_MS:
+		return ARRAY_SIZE(ms_attr_fields) + (ms->luns && ms->nluns > 0 ?
+			ms->nluns * ARRAY_SIZE(ms_lun_attr_fields) : 0);
+	case USBG_F_ATTRS_MIDI:
+		return ARRAY_SIZE(midi_attr_fields);
+	case USBG_F_ATTRS_LOOPBACK:
+		return ARRAY_SIZE(loopback_attr_fields);
+	default:
+		return 0;
+	}
+}
+
+/* Create all directories, those which already exist are fine */
+static int usbg_txn_create_dirs(usbg_state *s, struct usbg_io_op *ops,
+				struct usbg_txn_plan *p)
+{
+	int ret = USBG_SUCCESS;
+	int i;
+
+	for (i = 0; i < p->ndirs; ++i) {
+		ops[i].type = USBG_IO_MKDIR;
+		ops[i].dirfd = p->dirs[i].dirfd;
+		ops[i].name = p->dirs[i].name;
+	}
+
+	usbg_io_batch(s, ops, p->ndirs);
+
+	for (i = 0; i < p->ndirs; ++i) {
+		if (ops[i].ret == USBG_SUCCESS)
+			p->dirs[i].created = true;
+		else if (ops[i].ret != USBG_ERROR_EXIST && ret == USBG_SUCCESS)
+			ret = ops[i].ret;
+	}
+
+	return ret;
+}
+
+/*
+ * Write back values of attributes which have been already written
+ * and remove directories which have been created by commit.
+ */
+static void usbg_txn_rollback(usbg_gadget *g, struct usbg_io_op *ops,
+			      struct usbg_txn_plan *p, int count)
+{
+	struct usbg_txn_op *top;
+	int n = 0;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		top = p->tops + i;
+		/* Files of created directories go away with them */
+		if (ops[i].ret != USBG_SUCCESS || top->fresh)
+			continue;
+
+		ops[n] = ops[i];
+		ops[n].buf = top->old;
+		ops[n].len = strlen(top->old);
+		++n;
+	}
+
+	if (n > 0 && usbg_io_batch(g->parent, ops, n) != USBG_SUCCESS)
+		ERROR("unable to restore attributes of gadget %s\n", g->name);
+
+	for (i = p->ndirs - 1; i >= 0; --i) {
+		if (p->dirs[i].created &&
+		    unlinkat(p->dirs[i].dirfd, p->dirs[i].name, AT_REMOVEDIR))
+			ERROR("unable to remove %s of gadget %s\n",
+			      p->dirs[i].name, g->name);
+	}
+
+	/* Whatever happened, cached values may be wrong now */
+	if (g->cache)
+		g->cache->valid = 0;
+}
+
+static int usbg_commit_gadget_transaction_locked(usbg_gadget *g)
+{
+	struct usbg_gadget_txn *txn;
+	struct usbg_io_op *ops = NULL;
+	struct usbg_txn_plan p;
+	struct usbg_txn_str *ts;
+	int nops, ndirs;
+	int ret;
+	int fd;
+	int i;
+
+	if (!g || !g->txn)
+		return USBG_ERROR_INVALID_PARAM;
+
+	/* Transaction is closed now, so cache is updated as usual */
+	txn = g->txn;
+	g->txn = NULL;
+	memset(&p, 0, sizeof(p));
+
+	fd = usbg_gadget_dirfd(g);
+	if (USBG_DIRFD_ERROR(fd)) {
+		ret = fd;
+		goto out;
+	}
+
+	nops = USBG_GADGET_ATTR_MAX + txn->nstrs;
+	ndirs = txn->nstrs;
+	for (i = 0; i < txn->nfuncs; ++i) {
+		nops += usbg_txn_func_max_ops(txn->funcs + i);
+		if (txn->funcs[i].attrs.header.attrs_type == USBG_F_ATTRS_MS &&
+		    txn->funcs[i].attrs.attrs.ms.luns &&
+		    txn->funcs[i].attrs.attrs.ms.nluns > 0)
+			ndirs += txn->funcs[i].attrs.attrs.ms.nluns;
+	}
+
+	p.tops = calloc(nops, sizeof(*p.tops));
+	p.dirs = calloc(ndirs + 1, sizeof(*p.dirs));
+	ops = calloc(nops + ndirs, sizeof(*ops));
+	if (!p.tops || !p.dirs || !ops) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	ret = usbg_txn_prep_attrs(g, fd, txn, &p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_txn_prep_strs(g, fd, txn, &p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_txn_prep_funcs(txn, &p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = p.ndirs > 0 ? usbg_txn_create_dirs(g->parent, ops, &p)
+		: USBG_SUCCESS;
+	if (ret != USBG_SUCCESS) {
+		usbg_txn_rollback(g, ops, &p, 0);
+		goto out;
+	}
+
+	for (i = 0; i < p.count; ++i) {
+		ops[i].type = USBG_IO_WRITE;
+		ops[i].dirfd = p.tops[i].dirfd;
+		ops[i].name = p.tops[i].name;
+		ops[i].buf = p.tops[i].val;
+		ops[i].len = strlen(p.tops[i].val);
+	}
+
+	ret = p.count > 0 ? usbg_io_batch(g->parent, ops, p.count)
+		: USBG_SUCCESS;
+	if (ret != USBG_SUCCESS) {
+		usbg_txn_rollback(g, ops, &p, p.count);
+		goto out;
+	}
+
+	/* There is no good way to recover from this */
+	for (i = 0; i < p.nrms && ret == USBG_SUCCESS; ++i) {
+		if (unlinkat(p.rms[i].dirfd, p.rms[i].name, AT_REMOVEDIR))
+			ret = usbg_translate_error(errno);
+	}
+
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i) {
+		if (txn->dirty & (1 << i))
+			usbg_cache_gadget_attr(g, i, usbg_load_attr_field(
+					gadget_attr_fields + i, &txn->attrs),
+					USBG_SUCCESS);
+	}
+
+	for (i = 0; i < txn->nstrs; ++i) {
+		ts = txn->strs + i;
+		usbg_cache_gadget_str(g, ts->str, ts->lang, ts->val,
+				      USBG_SUCCESS);
+	}
+
+out:
+	/* Read only attributes of functions may have changed as well */
+	for (i = 0; i < txn->nfuncs; ++i)
+		usbg_invalidate_function(txn->funcs[i].f);
+
+	free(ops);
+	free(p.rms);
+	free(p.dirs);
+	free(p.tops);
+	usbg_free_txn(g->parent, txn);
+	return ret;
+}
+
+int usbg_commit_gadget_transaction(usbg_gadget *g)
+{
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(g);
+	ret = usbg_commit_gadget_transaction_locked(g);
+	usbg_unlock_attrs(g);
+
+	return ret;
+}
+
+static int usbg_create_function_locked(usbg_gadget *g, usbg_function_type type,
+			 const char *instance, const usbg_function_attrs *f_attrs,
+			 usbg_function **f)
+{
+	char fpath[USBG_MAX_PATH_LENGTH];
+	usbg_function *func;
+	int ret = USBG_ERROR_INVALID_PARAM;
+	int n;
+
+	if (!g || !f)
+		return ret;
+
+	/* if attrs type is set, check if it has correct type */
+	if (f_attrs && f_attrs->header.attrs_type) {
+		int attrs_type;
+		attrs_type = usbg_lookup_function_attrs_type(type);
+		if (attrs_type < 0 || attrs_type != f_attrs->header.attrs_type)
+			return ret;
+	}
+
+	if (!instance) {
+		/* If someone creates ffs function and doesn't pass instance name
+		   this means that device name from attrs should be used */
+		if (type == F_FFS && f_attrs && f_attrs->attrs.ffs.dev_name) {
+			instance = f_attrs->attrs.ffs.dev_name;
+			f_attrs = NULL;
+		} else {
+			return ret;
+		}
+	}
+
+	func = usbg_get_function(g, type, instance);
+	if (func) {
+		ERROR("duplicate function name\n");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	*f = usbg_allocate_function(type, instance, g);
+	func = *f;
+	if (!func) {
+		ERROR("allocating function\n");
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	n = usbg_join_path(fpath, sizeof(fpath), func->path,
+			   g->functions_path_len, func->name, func->name_len);
+	if (n < 0) {
+		ret = n;
+	} else {
+		ret = mkdir(fpath, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (!ret) {
+			/* Success */
+			ret = USBG_SUCCESS;
+			if (f_attrs)
+				ret = usbg_set_function_attrs(func, f_attrs);
+		} else {
+			ret = usbg_translate_error(errno);
+		}
+	}
+
+	if (ret == USBG_SUCCESS)
+		usbg_insert_function(g, func);
+	else
+		usbg_free_function(func);
+
+out:
+	return ret;
+}
+
+int usbg_create_function(usbg_gadget *g, usbg_function_type type,
+			 const char *instance, const usbg_function_attrs *f_attrs,
+			 usbg_function **f)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = g->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_create_function_locked(g, type, instance,
+						  f_attrs, f);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+static int usbg_create_config_locked(usbg_gadget *g, int id, const char *label,
+		const usbg_config_attrs *c_attrs, const usbg_config_strs *c_strs,
+		usbg_config **c)
+{
+	usbg_config *conf = NULL;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g || !c || id <= 0 || id > 255)
+		goto out;
+
+	if (!label)
+		label = DEFAULT_CONFIG_LABEL;
+
+	conf = usbg_get_config(g, id, NULL);
+	if (conf) {
+		ERROR("duplicate configuration id\n");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	*c = usbg_allocate_config(label, id, g);
+	conf = *c;
+	if (!conf) {
+		ERROR("allocating configuration\n");
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
 	}
 
-	if (f->rm_callback) {
-		ret = f->rm_callback(f, opts);
-		if (ret != USBG_SUCCESS)
-			goto out;
+	if (conf->bindings_path_len >= USBG_MAX_PATH_LENGTH) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		usbg_free_config(conf);
+		goto out;
 	}
 
-	ret = usbg_rm_dir(f->path, f->name);
-	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(g->functions), f, fnode);
-		usbg_free_function(f);
+	ret = mkdir(conf->bindings_path, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (!ret) {
+		ret = USBG_SUCCESS;
+		if (c_attrs)
+			ret = usbg_set_config_attrs(conf, c_attrs);
+
+		if (ret == USBG_SUCCESS && c_strs)
+			ret = usbg_set_config_string(conf, LANG_US_ENG,
+					c_strs->configuration);
+	} else {
+		ret = usbg_translate_error(errno);
 	}
 
+	if (ret == USBG_SUCCESS)
+		usbg_insert_config(g, conf);
+	else
+		usbg_free_config(conf);
+
 out:
 	return ret;
 }
 
-int usbg_rm_gadget(usbg_gadget *g, int opts)
+int usbg_create_config(usbg_gadget *g, int id, const char *label,
+		const usbg_config_attrs *c_attrs, const usbg_config_strs *c_strs,
+		usbg_config **c)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
 	usbg_state *s;
+	int ret;
+
 	if (!g)
-		goto out;
+		return USBG_ERROR_INVALID_PARAM;
 
 	s = g->parent;
-
-	if (opts & USBG_RM_RECURSE) {
-		/* Recursive flag was given
-		 * so remove all configs and functions
-		 * using recursive flags */
-		usbg_config *c;
-		usbg_function *f;
-		int nmb;
-		char spath[USBG_MAX_PATH_LENGTH];
-
-		while (!TAILQ_EMPTY(&g->configs)) {
-			c = TAILQ_FIRST(&g->configs);
-			ret = usbg_rm_config(c, opts);
-			if (ret != USBG_SUCCESS)
-				goto out;
-		}
-
-		while (!TAILQ_EMPTY(&g->functions)) {
-			f = TAILQ_FIRST(&g->functions);
-			ret = usbg_rm_function(f, opts);
-			if (ret != USBG_SUCCESS)
-				goto out;
-		}
-
-		nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", g->path,
-				g->name, STRINGS_DIR);
-		if (nmb >= sizeof(spath)) {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-			goto out;
-		}
-
-		ret = usbg_rm_all_dirs(spath);
-		if (ret != USBG_SUCCESS)
-			goto out;
-	}
-
-	ret = usbg_rm_dir(g->path, g->name);
+	ret = usbg_lock_exclusive(s);
 	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(s->gadgets), g, gnode);
-		usbg_free_gadget(g);
+		ret = usbg_create_config_locked(g, id, label, c_attrs,
+						c_strs, c);
+		usbg_unlock(s);
 	}
 
-out:
 	return ret;
 }
 
-int usbg_rm_config_strs(usbg_config *c, int lang)
+const char *usbg_get_config_label(usbg_config *c)
 {
-	int ret = USBG_SUCCESS;
-	int nmb;
-	char path[USBG_MAX_PATH_LENGTH];
+	return c ? c->label : NULL;
+}
 
-	if (!c)
+size_t usbg_get_config_label_len(usbg_config *c)
+{
+	return c ? c->label_len : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_cpy_config_label(usbg_config *c, char *buf, size_t len)
+{
+	if (!c || !buf || len == 0)
 		return USBG_ERROR_INVALID_PARAM;
 
-	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", c->path, c->name,
-			STRINGS_DIR, lang);
-	if (nmb < sizeof(path))
-		ret = usbg_rm_dir(path, "");
-	else
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	buf[--len] = '\0';
+	strncpy(buf, c->label, len);
 
-	return ret;
+	return USBG_SUCCESS;
 }
 
-int usbg_rm_gadget_strs(usbg_gadget *g, int lang)
+int usbg_get_config_id(usbg_config *c)
 {
-	int ret = USBG_SUCCESS;
-	int nmb;
-	char path[USBG_MAX_PATH_LENGTH];
+	return c ? c->id : USBG_ERROR_INVALID_PARAM;
+}
 
-	if (!g)
+const char *usbg_get_function_instance(usbg_function *f)
+{
+	return f ? f->instance : NULL;
+}
+
+size_t usbg_get_function_instance_len(usbg_function *f)
+{
+	return f ? f->instance_len : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_cpy_function_instance(usbg_function *f, char *buf, size_t len)
+{
+	if (!f || !buf || len == 0)
 		return USBG_ERROR_INVALID_PARAM;
 
-	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path, g->name,
-			STRINGS_DIR, lang);
-	if (nmb < sizeof(path))
-		ret = usbg_rm_dir(path, "");
-	else
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	buf[--len] = '\0';
+	strncpy(buf, f->instance, len);
 
-	return ret;
+	return USBG_SUCCESS;
 }
 
-
-static int usbg_create_empty_gadget(usbg_state *s, const char *name,
-				    usbg_gadget **g)
+static int usbg_set_config_attrs_locked(usbg_config *c,
+		const usbg_config_attrs *c_attrs)
 {
-	char gpath[USBG_MAX_PATH_LENGTH];
-	char buf[USBG_MAX_STR_LENGTH];
-	int nmb;
-	usbg_gadget *gad;
-	int ret = USBG_SUCCESS;
+	struct usbg_config_cache *cache;
+	int ret;
 
-	nmb = snprintf(gpath, sizeof(gpath), "%s/%s", s->path, name);
-	if (nmb >= sizeof(gpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	if (!c || !c_attrs)
+		return USBG_ERROR_INVALID_PARAM;
 
-	*g = usbg_allocate_gadget(s->path, name, s);
-	if (!*g) {
-		ret = USBG_ERROR_NO_MEM;
-		goto out;
-	}
+	ret = usbg_write_attr_fields(c->parent->parent, usbg_config_dirfd(c),
+				     config_attr_fields,
+				     ARRAY_SIZE(config_attr_fields), c_attrs);
 
-	gad = *g; /* alias only */
+	cache = usbg_config_cache(c);
+	if (!cache)
+		goto out;
 
-	ret = mkdir(gpath, S_IRWXU|S_IRWXG|S_IRWXO);
-	if (ret == 0) {
-		/* Should be empty but read the default */
-		ret = usbg_read_string(gad->path, gad->name,
-				       "UDC", buf);
-		if (ret != USBG_SUCCESS) {
-			rmdir(gpath);
-		} else {
-			gad->udc = usbg_get_udc(s, buf);
-			if (gad->udc)
-				gad->udc->gadget = gad;
-		}
+	if (ret == USBG_SUCCESS) {
+		cache->attrs = *c_attrs;
+		cache->valid |= USBG_CACHE_ATTRS;
 	} else {
-		ret = usbg_translate_error(errno);
-	}
-
-	if (ret != USBG_SUCCESS) {
-		usbg_free_gadget(*g);
-		*g = NULL;
+		cache->valid &= ~USBG_CACHE_ATTRS;
 	}
 
 out:
 	return ret;
 }
 
-int usbg_create_gadget_vid_pid(usbg_state *s, const char *name,
-		uint16_t idVendor, uint16_t idProduct, usbg_gadget **g)
+int usbg_set_config_attrs(usbg_config *c, const usbg_config_attrs *c_attrs)
 {
 	int ret;
-	usbg_gadget *gad;
 
-	if (!s || !g)
+	if (!c)
 		return USBG_ERROR_INVALID_PARAM;
 
-	gad = usbg_get_gadget(s, name);
-	if (gad) {
-		ERROR("duplicate gadget name\n");
-		return USBG_ERROR_EXIST;
-	}
-
-	ret = usbg_create_empty_gadget(s, name, g);
-	gad = *g;
-
-	/* Check if gadget creation was successful and set attributes */
-	if (ret == USBG_SUCCESS) {
-		ret = usbg_write_hex16(s->path, name, "idVendor", idVendor);
-		if (ret == USBG_SUCCESS) {
-			ret = usbg_write_hex16(s->path, name, "idProduct", idProduct);
-			if (ret == USBG_SUCCESS)
-				INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
-						gad, gnode);
-			else
-				usbg_free_gadget(gad);
-		}
-	}
+	usbg_lock_attrs(c->parent);
+	ret = usbg_set_config_attrs_locked(c, c_attrs);
+	usbg_unlock_attrs(c->parent);
 
 	return ret;
 }
 
-int usbg_create_gadget(usbg_state *s, const char *name,
-		       const usbg_gadget_attrs *g_attrs, const usbg_gadget_strs *g_strs,
-		       usbg_gadget **g)
+static int usbg_get_config_attrs_locked(usbg_config *c,
+		usbg_config_attrs *c_attrs)
 {
-	usbg_gadget *gad;
+	struct usbg_config_cache *cache;
 	int ret;
 
-	if (!s || !g)
-			return USBG_ERROR_INVALID_PARAM;
+	if (!c || !c_attrs)
+		return USBG_ERROR_INVALID_PARAM;
 
-	gad = usbg_get_gadget(s, name);
-	if (gad) {
-		ERROR("duplicate gadget name\n");
-		return USBG_ERROR_EXIST;
+	cache = usbg_config_cache(c);
+	if (cache && cache->valid & USBG_CACHE_ATTRS) {
+		*c_attrs = cache->attrs;
+		return USBG_SUCCESS;
 	}
 
-	ret = usbg_create_empty_gadget(s, name, g);
-	gad = *g;
+	ret = usbg_parse_config_attrs(c, c_attrs);
+	if (ret == USBG_SUCCESS && cache) {
+		cache->attrs = *c_attrs;
+		cache->valid |= USBG_CACHE_ATTRS;
+	}
 
-	/* Check if gadget creation was successful and set attrs and strings */
-	if (ret == USBG_SUCCESS) {
-		if (g_attrs)
-			ret = usbg_set_gadget_attrs(gad, g_attrs);
+	return ret;
+}
 
-		if (g_strs)
-			ret = usbg_set_gadget_strs(gad, LANG_US_ENG, g_strs);
+int usbg_get_config_attrs(usbg_config *c,
+		usbg_config_attrs *c_attrs)
+{
+	int ret;
+
+	if (!c)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(c->parent);
+	ret = usbg_get_config_attrs_locked(c, c_attrs);
+	usbg_unlock_attrs(c->parent);
 
-		if (ret == USBG_SUCCESS)
-			INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
-				gad, gnode);
-		else
-			usbg_free_gadget(gad);
-	}
 	return ret;
 }
 
-int usbg_get_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs)
+/* Update cached config attribute, if any, after write */
+static inline int usbg_cache_config_attr(usbg_config *c, int idx, int val,
+					 int ret)
 {
-	return g && g_attrs ? usbg_parse_gadget_attrs(g->path, g->name, g_attrs)
-			: USBG_ERROR_INVALID_PARAM;
+	return c->cache ? usbg_cache_attr_field(&c->cache->valid,
+						config_attr_fields + idx,
+						&c->cache->attrs, val, ret)
+			: ret;
 }
 
-const char *usbg_get_gadget_name(usbg_gadget *g)
+int usbg_get_config_attr_vec(usbg_config *c, usbg_attr_io *attrs, int count)
 {
-	return g ? g->name : NULL;
+	return c ? usbg_read_attr_vec(c->parent->parent, usbg_config_dirfd(c),
+				      attrs, count)
+			: USBG_ERROR_INVALID_PARAM;
 }
 
-size_t usbg_get_gadget_name_len(usbg_gadget *g)
+static int usbg_set_config_max_power_locked(usbg_config *c, int bMaxPower)
 {
-	return g ? strlen(g->name) : USBG_ERROR_INVALID_PARAM;
+	return c ? usbg_cache_config_attr(c, 0, bMaxPower,
+			usbg_write_dec(usbg_config_dirfd(c), "MaxPower", bMaxPower))
+			: USBG_ERROR_INVALID_PARAM;
 }
 
-int usbg_cpy_gadget_name(usbg_gadget *g, char *buf, size_t len)
+int usbg_set_config_max_power(usbg_config *c, int bMaxPower)
 {
-	if (!g || !buf || len == 0)
+	int ret;
+
+	if (!c)
 		return USBG_ERROR_INVALID_PARAM;
 
-	buf[--len] = '\0';
-	strncpy(buf, g->name, len);
+	usbg_lock_attrs(c->parent);
+	ret = usbg_set_config_max_power_locked(c, bMaxPower);
+	usbg_unlock_attrs(c->parent);
 
-	return USBG_SUCCESS;
+	return ret;
 }
 
-const char *usbg_get_udc_name(usbg_udc *u)
+static int usbg_set_config_bm_attrs_locked(usbg_config *c, int bmAttributes)
 {
-	return u ? u->name : NULL;
+	return c ? usbg_cache_config_attr(c, 1, bmAttributes,
+			usbg_write_hex8(usbg_config_dirfd(c), "bmAttributes", bmAttributes))
+			: USBG_ERROR_INVALID_PARAM;
 }
 
-size_t usbg_get_udc_name_len(usbg_udc *u)
+int usbg_set_config_bm_attrs(usbg_config *c, int bmAttributes)
 {
-	return u ? strlen(u->name) : USBG_ERROR_INVALID_PARAM;
-}
+	int ret;
 
-int usbg_cpy_udc_name(usbg_udc *u, char *buf, size_t len)
-{
-	if (!u || !buf || len == 0)
+	if (!c)
 		return USBG_ERROR_INVALID_PARAM;
 
-	buf[--len] = '\0';
-	strncpy(buf, u->name, len);
+	usbg_lock_attrs(c->parent);
+	ret = usbg_set_config_bm_attrs_locked(c, bmAttributes);
+	usbg_unlock_attrs(c->parent);
 
-	return USBG_SUCCESS;
+	return ret;
 }
 
-int usbg_set_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr, int val)
+static int usbg_get_config_strs_locked(usbg_config *c, int lang,
+		usbg_config_strs *c_strs)
 {
-	const char *attr_name;
-	int ret = USBG_ERROR_INVALID_PARAM;
+	struct usbg_config_cache *cache;
+	int ret;
 
-	if (!g)
-		goto out;
+	if (!c || !c_strs)
+		return USBG_ERROR_INVALID_PARAM;
 
-	attr_name = usbg_get_gadget_attr_str(attr);
-	if (!attr_name)
-		goto out;
+	cache = usbg_config_cache(c);
+	if (cache && cache->valid & USBG_CACHE_STRS && cache->lang == lang) {
+		*c_strs = cache->strs;
+		return USBG_SUCCESS;
+	}
 
-	ret = usbg_write_hex(g->path, g->name, attr_name, val);
+	ret = usbg_parse_config_strs(c, lang, c_strs);
+	if (ret == USBG_SUCCESS && cache) {
+		cache->strs = *c_strs;
+		cache->lang = lang;
+		cache->valid |= USBG_CACHE_STRS;
+	}
 
-out:
 	return ret;
 }
 
-int usbg_get_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr)
+int usbg_get_config_strs(usbg_config *c, int lang, usbg_config_strs *c_strs)
 {
-	const char *attr_name;
-	int ret = USBG_ERROR_INVALID_PARAM;
-
-	if (!g)
-		goto out;
+	int ret;
 
-	attr_name = usbg_get_gadget_attr_str(attr);
-	if (!attr_name)
-		goto out;
+	if (!c)
+		return USBG_ERROR_INVALID_PARAM;
 
-	usbg_read_hex(g->path, g->name, attr_name, &ret);
+	usbg_lock_attrs(c->parent);
+	ret = usbg_get_config_strs_locked(c, lang, c_strs);
+	usbg_unlock_attrs(c->parent);
 
-out:
 	return ret;
 }
 
-usbg_udc *usbg_get_gadget_udc(usbg_gadget *g)
+int usbg_set_config_strs(usbg_config *c, int lang,
+		const usbg_config_strs *c_strs)
 {
-	usbg_udc *u = NULL;
-
-	if (!g)
-		goto out;
-	/*
-	 * if gadget was enabled we have to check if kernel
-	 * didn't modify the UDC file due to some errors.
-	 * For example some FFS daemon could just get
-	 * a segmentation fault or sth
-	 */
-	if (g->udc) {
-		char buf[USBG_MAX_STR_LENGTH];
-		int ret;
+	return usbg_set_config_string(c, lang, c_strs->configuration);
+}
 
-		ret = usbg_read_string(g->path, g->name, "UDC", buf);
-		if (ret != USBG_SUCCESS)
-			goto out;
+static int usbg_set_config_string_locked(usbg_config *c, int lang,
+		const char *str)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+	int fd;
 
-		if (!strcmp(g->udc->name, buf)) {
-			/* Gadget is still assigned to this UDC */
-			u = g->udc;
-		} else {
-			/* Kernel decided to detach this gadget */
-			g->udc->gadget = NULL;
-			g->udc = NULL;
+	if (c && str) {
+		fd = usbg_config_dirfd(c);
+		ret = usbg_check_str_dir(fd, lang);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_write_str_file(fd, lang, "configuration",
+						  str);
+
+		/* This is the only config string so cache it as a whole */
+		if (ret == USBG_SUCCESS && usbg_config_cache(c)) {
+			snprintf(c->cache->strs.configuration,
+				 USBG_MAX_STR_LENGTH, "%s", str);
+			c->cache->lang = lang;
+			c->cache->valid |= USBG_CACHE_STRS;
+		} else if (c->cache) {
+			c->cache->valid &= ~USBG_CACHE_STRS;
 		}
 	}
 
-out:
-	return u;
+	return ret;
 }
 
-usbg_gadget *usbg_get_udc_gadget(usbg_udc *u)
+int usbg_set_config_string(usbg_config *c, int lang, const char *str)
 {
-	usbg_gadget *g = NULL;
+	int ret;
 
-	if (!u)
-		goto out;
-	/*
-	 * if gadget was enabled on this UDC we have to check if kernel
-	 * didn't modify this due to some errors.
-	 * For example some FFS daemon could just get a segmentation fault
-	 * what causes detach of gadget
-	 */
-	if (u->gadget) {
-		usbg_udc *u_checked;
+	if (!c)
+		return USBG_ERROR_INVALID_PARAM;
 
-		u_checked = usbg_get_gadget_udc(u->gadget);
-		if (u_checked) {
-			g = u->gadget;
-		} else {
-			u->gadget->udc = NULL;
-			u->gadget = NULL;
-		}
-	}
+	usbg_lock_attrs(c->parent);
+	ret = usbg_set_config_string_locked(c, lang, str);
+	usbg_unlock_attrs(c->parent);
 
-out:
-	return g;
+	return ret;
 }
 
-int usbg_set_gadget_attrs(usbg_gadget *g, const usbg_gadget_attrs *g_attrs)
+static int usbg_add_config_function_locked(usbg_config *c, const char *name,
+		usbg_function *f)
 {
-	int ret;
-	if (!g || !g_attrs)
-		return USBG_ERROR_INVALID_PARAM;
+	char bpath[USBG_MAX_PATH_LENGTH];
+	char fpath[USBG_MAX_PATH_LENGTH];
+	usbg_binding *b;
+	int ret = USBG_SUCCESS;
+	int nmb;
 
-	ret = usbg_write_hex16(g->path, g->name, "bcdUSB", g_attrs->bcdUSB);
-	if (ret != USBG_SUCCESS)
+	if (!c || !f) {
+		ret = USBG_ERROR_INVALID_PARAM;
 		goto out;
+	}
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceClass",
-		g_attrs->bDeviceClass);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	if (!name)
+		name = f->name;
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceSubClass",
-		g_attrs->bDeviceSubClass);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	b = usbg_get_binding(c, name);
+	if (b) {
+		ERROR("duplicate binding name\n");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceProtocol",
-		g_attrs->bDeviceProtocol);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	b = usbg_get_link_binding(c, f);
+	if (b) {
+		ERROR("duplicate binding link\n");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
 
-	ret = usbg_write_hex8(g->path, g->name, "bMaxPacketSize0",
-		g_attrs->bMaxPacketSize0);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	nmb = usbg_join_path(fpath, sizeof(fpath), f->path,
+			     f->parent->functions_path_len, f->name,
+			     f->name_len);
+	if (nmb < 0) {
+		ret = nmb;
+		goto out;
+	}
 
-	ret = usbg_write_hex16(g->path, g->name, "idVendor",
-		g_attrs->idVendor);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	b = usbg_allocate_binding(name, c);
+	if (b) {
+		b->target = f;
+		nmb = usbg_join_path(bpath, sizeof(bpath), b->path,
+				     c->bindings_path_len, b->name,
+				     b->name_len);
+		if (nmb >= 0) {
 
-	ret = usbg_write_hex16(g->path, g->name, "idProduct",
-		 g_attrs->idProduct);
-	if (ret != USBG_SUCCESS)
-			goto out;
+			ret = symlink(fpath, bpath);
+			if (ret == 0) {
+				usbg_insert_binding(c, b);
+			} else {
+				ERRORNO("%s -> %s\n", bpath, fpath);
+				ret = usbg_translate_error(errno);
+			}
+		} else {
+			ret = USBG_ERROR_PATH_TOO_LONG;
+		}
 
-	ret = usbg_write_hex16(g->path, g->name, "bcdDevice",
-		g_attrs->bcdDevice);
+		if (ret != USBG_SUCCESS) {
+			usbg_free_binding(b);
+			b = NULL;
+		}
+	} else {
+		ret = USBG_ERROR_NO_MEM;
+	}
 
 out:
 	return ret;
 }
 
-int usbg_set_gadget_vendor_id(usbg_gadget *g, uint16_t idVendor)
+int usbg_add_config_function(usbg_config *c, const char *name, usbg_function *f)
 {
-	return g ? usbg_write_hex16(g->path, g->name, "idVendor", idVendor)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	usbg_state *s;
+	int ret;
 
-int usbg_set_gadget_product_id(usbg_gadget *g, uint16_t idProduct)
-{
-	return g ? usbg_write_hex16(g->path, g->name, "idProduct", idProduct)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	if (!c)
+		return USBG_ERROR_INVALID_PARAM;
 
-int usbg_set_gadget_device_class(usbg_gadget *g, uint8_t bDeviceClass)
-{
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceClass", bDeviceClass)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	s = c->parent->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_add_config_function_locked(c, name, f);
+		usbg_unlock(s);
+	}
 
-int usbg_set_gadget_device_protocol(usbg_gadget *g, uint8_t bDeviceProtocol)
-{
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceProtocol", bDeviceProtocol)
-			: USBG_ERROR_INVALID_PARAM;
+	return ret;
 }
 
-int usbg_set_gadget_device_subclass(usbg_gadget *g, uint8_t bDeviceSubClass)
+static usbg_function *usbg_get_binding_target_locked(usbg_binding *b)
 {
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceSubClass", bDeviceSubClass)
-			: USBG_ERROR_INVALID_PARAM;
+	return b ? b->target : NULL;
 }
 
-int usbg_set_gadget_device_max_packet(usbg_gadget *g, uint8_t bMaxPacketSize0)
+usbg_function *usbg_get_binding_target(usbg_binding *b)
 {
-	return g ? usbg_write_hex8(g->path, g->name, "bMaxPacketSize0", bMaxPacketSize0)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	usbg_function *f;
 
-int usbg_set_gadget_device_bcd_device(usbg_gadget *g, uint16_t bcdDevice)
-{
-	return g ? usbg_write_hex16(g->path, g->name, "bcdDevice", bcdDevice)
-			: USBG_ERROR_INVALID_PARAM;
+	if (!b)
+		return NULL;
+
+	usbg_lock_shared(b->parent->parent->parent);
+	f = usbg_get_binding_target_locked(b);
+	usbg_unlock(b->parent->parent->parent);
+
+	return f;
 }
 
-int usbg_set_gadget_device_bcd_usb(usbg_gadget *g, uint16_t bcdUSB)
+const char *usbg_get_binding_name(usbg_binding *b)
 {
-	return g ? usbg_write_hex16(g->path, g->name, "bcdUSB", bcdUSB)
-			: USBG_ERROR_INVALID_PARAM;
+	return b ? b->name : NULL;
 }
 
-int usbg_get_gadget_strs(usbg_gadget *g, int lang,
-		usbg_gadget_strs *g_strs)
+size_t usbg_get_binding_name_len(usbg_binding *b)
 {
-	return g && g_strs ? usbg_parse_gadget_strs(g->path, g->name, lang,
-			g_strs)	: USBG_ERROR_INVALID_PARAM;
+	return b ? b->name_len : USBG_ERROR_INVALID_PARAM;
 }
 
-static int usbg_check_dir(const char *path)
+int usbg_cpy_binding_name(usbg_binding *b, char *buf, size_t len)
 {
-	int ret = USBG_SUCCESS;
-	DIR *dir;
+	if (!b || !buf || len == 0)
+		return USBG_ERROR_INVALID_PARAM;
 
-	/* Assume that user will always have read access to this directory */
-	dir = opendir(path);
-	if (dir)
-		closedir(dir);
-	else if (errno != ENOENT || mkdir(path, S_IRWXU|S_IRWXG|S_IRWXO) != 0)
-		ret = usbg_translate_error(errno);
+	buf[--len] = '\0';
+	strncpy(buf, b->name, len);
 
-	return ret;
+	return USBG_SUCCESS;
 }
 
-int usbg_set_gadget_str(usbg_gadget *g, usbg_gadget_str str, int lang,
-		const char *val)
+static int usbg_enable_gadget_locked(usbg_gadget *g, usbg_udc *udc)
 {
-	const char *str_name;
 	int ret = USBG_ERROR_INVALID_PARAM;
-	char path[USBG_MAX_PATH_LENGTH];
-	int nmb;
+	uint64_t bind_ns;
 
 	if (!g)
-		goto out;
+		return ret;
 
-	str_name = usbg_get_gadget_str_name(str);
-	if (!str_name)
-		goto out;
+	if (!udc) {
+		udc = usbg_get_first_udc(g->parent);
+		if (!udc)
+			return ret;
+	}
 
-	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path, g->name,
-			STRINGS_DIR, lang);
-	if (nmb >= sizeof(path)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
+	bind_ns = usbg_monotonic_ns();
+	ret = usbg_write_string(usbg_gadget_dirfd(g), "UDC", udc->name);
+	if (ret == USBG_SUCCESS) {
+		/* If gadget has been detached and we didn't noticed
+		 * it we have to clean up now.
+		 */
+		if (g->udc)
+			g->udc->gadget = NULL;
+		g->udc = udc;
+		udc->gadget = g;
+		usbg_udc_bound(udc, bind_ns);
 	}
 
-	ret = usbg_check_dir(path);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	return ret;
+}
+
+int usbg_enable_gadget(usbg_gadget *g, usbg_udc *udc)
+{
+	usbg_state *s;
+	int ret;
 
-	ret = usbg_write_string(path, "", str_name, val);
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = g->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_enable_gadget_locked(g, udc);
+		usbg_unlock(s);
+	}
 
-out:
 	return ret;
 }
 
-int usbg_set_gadget_strs(usbg_gadget *g, int lang,
-		const usbg_gadget_strs *g_strs)
+static int usbg_disable_gadget_locked(usbg_gadget *g)
 {
-	char path[USBG_MAX_PATH_LENGTH];
-	int nmb;
 	int ret = USBG_ERROR_INVALID_PARAM;
 
-	if (!g || !g_strs)
-		goto out;
+	if (!g)
+		return ret;
 
-	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path, g->name,
-			STRINGS_DIR, lang);
-	if (nmb >= sizeof(path)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
+	ret = usbg_write_string(usbg_gadget_dirfd(g), "UDC", "\n");
+	if (ret == USBG_SUCCESS) {
+		if (g->udc)
+			g->udc->gadget = NULL;
+		g->udc = NULL;
 	}
 
-	ret = usbg_check_dir(path);
-	if (ret == USBG_SUCCESS) {
-		ret = usbg_write_string(path, "", "serialnumber", g_strs->str_ser);
-		if (ret != USBG_SUCCESS)
-			goto out;
+	return ret;
+}
 
-		ret = usbg_write_string(path, "", "manufacturer", g_strs->str_mnf);
-		if (ret != USBG_SUCCESS)
-			goto out;
+int usbg_disable_gadget(usbg_gadget *g)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
 
-		ret = usbg_write_string(path, "", "product", g_strs->str_prd);
+	s = g->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_disable_gadget_locked(g);
+		usbg_unlock(s);
 	}
 
-out:
 	return ret;
 }
 
-int usbg_set_gadget_serial_number(usbg_gadget *g, int lang, const char *serno)
-{
-	int ret = USBG_ERROR_INVALID_PARAM;
+/*
+ * Gadget switch
+ *
+ * UDC files of both gadgets are opened before the old one is unbound,
+ * so UDC stays without gadget only for the time of two writes.
+ */
 
-	if (g && serno) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
-				g->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "serialnumber", serno);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
-	}
+uint64_t usbg_monotonic_ns(void)
+{
+	struct timespec ts;
 
-	return ret;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-int usbg_set_gadget_manufacturer(usbg_gadget *g, int lang, const char *mnf)
+int usbg_open_udc_file(usbg_gadget *g, int *fd)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	int gfd;
 
-	if (g && mnf) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
-				g->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "manufacturer", mnf);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
-	}
+	gfd = usbg_gadget_dirfd(g);
+	if (gfd < 0)
+		return gfd;
 
-	return ret;
+	*fd = openat(gfd, "UDC", O_WRONLY | O_CLOEXEC);
+	return *fd < 0 ? usbg_translate_error(errno) : USBG_SUCCESS;
 }
 
-int usbg_set_gadget_product(usbg_gadget *g, int lang, const char *prd)
+static int usbg_write_udc_fd(int fd, const char *buf)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	ssize_t len = strlen(buf);
+	ssize_t nmb;
 
-	if (g && prd) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
-				g->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "product", prd);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
-	}
+	nmb = write(fd, buf, len);
+	if (nmb < 0)
+		return usbg_translate_error(errno);
 
-	return ret;
+	return nmb == len ? USBG_SUCCESS : USBG_ERROR_IO;
 }
 
-int usbg_create_function(usbg_gadget *g, usbg_function_type type,
-			 const char *instance, const usbg_function_attrs *f_attrs,
-			 usbg_function **f)
+int usbg_switch_udc(usbg_udc *u, usbg_gadget *from, int from_fd,
+		    usbg_gadget *to, int to_fd, uint64_t *latency_ns)
 {
-	char fpath[USBG_MAX_PATH_LENGTH];
-	usbg_function *func;
-	int ret = USBG_ERROR_INVALID_PARAM;
-	int n, free_space;
+	uint64_t start, bind, end;
+	int ret;
 
-	if (!g || !f)
-		return ret;
+	start = usbg_monotonic_ns();
 
-	/* if attrs type is set, check if it has correct type */
-	if (f_attrs && f_attrs->header.attrs_type) {
-		int attrs_type;
-		attrs_type = usbg_lookup_function_attrs_type(type);
-		if (attrs_type < 0 || attrs_type != f_attrs->header.attrs_type)
+	if (from) {
+		ret = usbg_write_udc_fd(from_fd, "\n");
+		/* Gadget may have been already unbound by kernel */
+		if (ret != USBG_SUCCESS && ret != USBG_ERROR_NO_DEV)
 			return ret;
+
+		from->udc = NULL;
+		u->gadget = NULL;
 	}
 
-	if (!instance) {
-		/* If someone creates ffs function and doesn't pass instance name
-		   this means that device name from attrs should be used */
-		if (type == F_FFS && f_attrs && f_attrs->attrs.ffs.dev_name) {
-			instance = f_attrs->attrs.ffs.dev_name;
-			f_attrs = NULL;
-		} else {
-			return ret;
+	bind = usbg_monotonic_ns();
+	ret = usbg_write_udc_fd(to_fd, u->name);
+	end = usbg_monotonic_ns();
+
+	if (ret != USBG_SUCCESS) {
+		/* Don't leave UDC without any gadget */
+		if (from && usbg_write_udc_fd(from_fd, u->name) ==
+		    USBG_SUCCESS) {
+			from->udc = u;
+			u->gadget = from;
 		}
+		return ret;
 	}
 
-	func = usbg_get_function(g, type, instance);
-	if (func) {
-		ERROR("duplicate function name\n");
-		ret = USBG_ERROR_EXIST;
-		goto out;
-	}
+	to->udc = u;
+	u->gadget = to;
+	usbg_udc_bound(u, bind);
 
-	n = snprintf(fpath, sizeof(fpath), "%s/%s/%s", g->path, g->name,
-			FUNCTIONS_DIR);
-	if (n >= sizeof(fpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	if (latency_ns)
+		*latency_ns = end - start;
 
-	*f = usbg_allocate_function(fpath, type, instance, g);
-	func = *f;
-	if (!func) {
-		ERROR("allocating function\n");
-		ret = USBG_ERROR_NO_MEM;
-		goto out;
+	return USBG_SUCCESS;
+}
+
+static int usbg_switch_gadget_locked(usbg_udc *u, usbg_gadget *from,
+		usbg_gadget *to, uint64_t *latency_ns)
+{
+	int from_fd = -1;
+	int to_fd = -1;
+	int ret;
+
+	if (!u || !to || from != u->gadget || to->parent != u->parent)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (to == from) {
+		if (latency_ns)
+			*latency_ns = 0;
+		return USBG_SUCCESS;
 	}
 
-	free_space = sizeof(fpath) - n;
-	n = snprintf(&(fpath[n]), free_space, "/%s", func->name);
-	if (n < free_space) {
-		ret = mkdir(fpath, S_IRWXU | S_IRWXG | S_IRWXO);
-		if (!ret) {
-			/* Success */
-			ret = USBG_SUCCESS;
-			if (f_attrs)
-				ret = usbg_set_function_attrs(func, f_attrs);
-		} else {
-			ret = usbg_translate_error(errno);
-		}
+	if (to->udc)
+		return USBG_ERROR_BUSY;
+
+	if (from) {
+		ret = usbg_open_udc_file(from, &from_fd);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
+	ret = usbg_open_udc_file(to, &to_fd);
 	if (ret == USBG_SUCCESS)
-		INSERT_TAILQ_STRING_ORDER(&g->functions, fhead, name,
-				func, fnode);
-	else
-		usbg_free_function(func);
+		ret = usbg_switch_udc(u, from, from_fd, to, to_fd, latency_ns);
 
 out:
+	if (from_fd >= 0)
+		close(from_fd);
+	if (to_fd >= 0)
+		close(to_fd);
 	return ret;
 }
 
-int usbg_create_config(usbg_gadget *g, int id, const char *label,
-		const usbg_config_attrs *c_attrs, const usbg_config_strs *c_strs,
-		usbg_config **c)
+int usbg_switch_gadget(usbg_udc *u, usbg_gadget *from, usbg_gadget *to,
+		uint64_t *latency_ns)
 {
-	char cpath[USBG_MAX_PATH_LENGTH];
-	usbg_config *conf = NULL;
-	int ret = USBG_ERROR_INVALID_PARAM;
-	int n, free_space;
-
-	if (!g || !c || id <= 0 || id > 255)
-		goto out;
+	int ret;
 
-	if (!label)
-		label = DEFAULT_CONFIG_LABEL;
+	if (!u)
+		return USBG_ERROR_INVALID_PARAM;
 
-	conf = usbg_get_config(g, id, NULL);
-	if (conf) {
-		ERROR("duplicate configuration id\n");
-		ret = USBG_ERROR_EXIST;
-		goto out;
+	ret = usbg_lock_exclusive(u->parent);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_switch_gadget_locked(u, from, to, latency_ns);
+		usbg_unlock(u->parent);
 	}
 
-	n = snprintf(cpath, sizeof(cpath), "%s/%s/%s", g->path, g->name,
-			CONFIGS_DIR);
-	if (n >= sizeof(cpath)) {
-		ret =  USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	return ret;
+}
 
-	*c = usbg_allocate_config(cpath, label, id, g);
-	conf = *c;
-	if (!conf) {
-		ERROR("allocating configuration\n");
-		ret = USBG_ERROR_NO_MEM;
-		goto out;
-	}
+/*
+ * USB function-specific attribute configuration
+ */
 
-	free_space = sizeof(cpath) - n;
-	/* Append string at the end of previous one */
-	n = snprintf(&(cpath[n]), free_space, "/%s", (*c)->name);
-	if (n >= free_space) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		usbg_free_config(conf);
-		goto out;
-	}
+usbg_function_type usbg_get_function_type(usbg_function *f)
+{
+	return f ? f->type : USBG_ERROR_INVALID_PARAM;
+}
 
-	ret = mkdir(cpath, S_IRWXU | S_IRWXG | S_IRWXO);
-	if (!ret) {
-		ret = USBG_SUCCESS;
-		if (c_attrs)
-			ret = usbg_set_config_attrs(conf, c_attrs);
+static int usbg_copy_function_attrs(usbg_function_attrs *dst,
+		const usbg_function_attrs *src);
 
-		if (ret == USBG_SUCCESS && c_strs)
-			ret = usbg_set_config_string(conf, LANG_US_ENG,
-					c_strs->configuration);
-	} else {
-		ret = usbg_translate_error(errno);
-	}
+static int usbg_get_function_attrs_locked(usbg_function *f,
+		usbg_function_attrs *f_attrs)
+{
+	struct usbg_function_cache *cache;
+	int ret;
 
-	if (ret == USBG_SUCCESS)
-		INSERT_TAILQ_STRING_ORDER(&g->configs, chead, name,
-				conf, cnode);
-	else
-		usbg_free_config(conf);
+	if (!f || !f_attrs)
+		return USBG_ERROR_INVALID_PARAM;
 
-out:
-	return ret;
-}
+	/* Caller owns strings in attributes so give him a copy */
+	cache = usbg_function_cache(f);
+	if (cache && cache->valid & USBG_CACHE_ATTRS)
+		return usbg_copy_function_attrs(f_attrs, &cache->attrs);
 
-const char *usbg_get_config_label(usbg_config *c)
-{
-	return c ? c->label : NULL;
-}
+	ret = usbg_parse_function_attrs(f, f_attrs);
+	if (ret == USBG_SUCCESS && cache &&
+	    usbg_copy_function_attrs(&cache->attrs, f_attrs) == USBG_SUCCESS)
+		cache->valid |= USBG_CACHE_ATTRS;
 
-size_t usbg_get_config_label_len(usbg_config *c)
-{
-	return c ? strlen(c->label) : USBG_ERROR_INVALID_PARAM;
+	return ret;
 }
 
-int usbg_cpy_config_label(usbg_config *c, char *buf, size_t len)
+int usbg_get_function_attrs(usbg_function *f, usbg_function_attrs *f_attrs)
 {
-	if (!c || !buf || len == 0)
+	int ret;
+
+	if (!f)
 		return USBG_ERROR_INVALID_PARAM;
 
-	buf[--len] = '\0';
-	strncpy(buf, c->label, len);
+	usbg_lock_attrs(f->parent);
+	ret = usbg_get_function_attrs_locked(f, f_attrs);
+	usbg_unlock_attrs(f->parent);
 
-	return USBG_SUCCESS;
+	return ret;
 }
 
-int usbg_get_config_id(usbg_config *c)
+int usbg_get_function_attr_vec(usbg_function *f, usbg_attr_io *attrs,
+		int count)
 {
-	return c ? c->id : USBG_ERROR_INVALID_PARAM;
+	return f ? usbg_read_attr_vec(f->parent->parent,
+				      usbg_function_dirfd(f), attrs, count)
+			: USBG_ERROR_INVALID_PARAM;
 }
 
-const char *usbg_get_function_instance(usbg_function *f)
+static void usbg_cleanup_function_ms_lun_attrs(usbg_f_ms_lun_attrs *lun_attrs)
 {
-	return f ? f->instance : NULL;
+	if (!lun_attrs)
+		return;
+
+	free((char*)lun_attrs->filename);
+	lun_attrs->id = -1;
 }
 
-size_t usbg_get_function_instance_len(usbg_function *f)
+void usbg_cleanup_function_attrs(usbg_function_attrs *f_attrs)
 {
-	return f ? strlen(f->instance) : USBG_ERROR_INVALID_PARAM;
+	usbg_f_attrs *attrs;
+
+	if (!f_attrs)
+		return;
+
+	attrs = &f_attrs->attrs;
+
+	switch (f_attrs->header.attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		break;
+
+	case USBG_F_ATTRS_NET:
+		free((char*)attrs->net.ifname);
+		attrs->net.ifname = NULL;
+		break;
+
+	case USBG_F_ATTRS_PHONET:
+		free((char*)attrs->phonet.ifname);
+		attrs->phonet.ifname = NULL;
+		break;
+
+	case USBG_F_ATTRS_FFS:
+		free((char*)attrs->ffs.dev_name);
+		attrs->ffs.dev_name = NULL;
+		break;
+
+	case USBG_F_ATTRS_MS:
+	{
+		int i;
+		usbg_f_ms_attrs *ms_attrs = &attrs->ms;
+
+		if (!ms_attrs->luns)
+			goto ms_break;
+
+		for (i = 0; i < ms_attrs->nluns; ++i) {
+			if (!ms_attrs->luns[i])
+				continue;
+
+			usbg_cleanup_function_ms_lun_attrs(ms_attrs->luns[i]);
+			free(ms_attrs->luns[i]);
+		}
+		free(ms_attrs->luns);
+		ms_attrs->luns = NULL;
+		ms_attrs->nluns = -1;
+	ms_break:
+		break;
+	}
+
+	case USBG_F_ATTRS_MIDI:
+		free((char*)attrs->midi.id);
+		attrs->midi.id = NULL;
+		break;
+
+	case USBG_F_ATTRS_LOOPBACK:
+		break;
+
+	default:
+		ERROR("Unsupported attrs type\n");
+		break;
+	}
 }
 
-int usbg_cpy_function_instance(usbg_function *f, char *buf, size_t len)
+static int usbg_copy_function_ms_attrs(usbg_f_ms_attrs *dst,
+		const usbg_f_ms_attrs *src)
 {
-	if (!f || !buf || len == 0)
-		return USBG_ERROR_INVALID_PARAM;
+	int i;
+
+	dst->nluns = 0;
+	dst->luns = NULL;
+	if (!src->luns)
+		return USBG_SUCCESS;
+
+	dst->luns = calloc(src->nluns + 1, sizeof(*dst->luns));
+	if (!dst->luns)
+		return USBG_ERROR_NO_MEM;
 
-	buf[--len] = '\0';
-	strncpy(buf, f->instance, len);
+	/* Only copied luns are released on error */
+	for (i = 0; i < src->nluns; ++i) {
+		if (!src->luns[i])
+			continue;
+
+		dst->luns[i] = malloc(sizeof(*dst->luns[i]));
+		if (!dst->luns[i])
+			return USBG_ERROR_NO_MEM;
+
+		dst->nluns = i + 1;
+		*dst->luns[i] = *src->luns[i];
+		dst->luns[i]->filename = NULL;
+		if (src->luns[i]->filename) {
+			dst->luns[i]->filename = strdup(src->luns[i]->filename);
+			if (!dst->luns[i]->filename)
+				return USBG_ERROR_NO_MEM;
+		}
+	}
+	dst->nluns = src->nluns;
 
 	return USBG_SUCCESS;
 }
 
-int usbg_set_config_attrs(usbg_config *c, const usbg_config_attrs *c_attrs)
+/* Deep copy of attributes, dst has to be released by cleanup */
+static int usbg_copy_function_attrs(usbg_function_attrs *dst,
+		const usbg_function_attrs *src)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_f_attrs *attrs = &dst->attrs;
+	const char **str = NULL;
+	int ret = USBG_SUCCESS;
 
-	if (c && c_attrs) {
-		ret = usbg_write_dec(c->path, c->name, "MaxPower", c_attrs->bMaxPower);
-		if (ret == USBG_SUCCESS)
-			ret = usbg_write_hex8(c->path, c->name, "bmAttributes",
-					c_attrs->bmAttributes);
+	*dst = *src;
+
+	switch (src->header.attrs_type) {
+	case USBG_F_ATTRS_NET:
+		str = &attrs->net.ifname;
+		break;
+	case USBG_F_ATTRS_PHONET:
+		str = &attrs->phonet.ifname;
+		break;
+	case USBG_F_ATTRS_FFS:
+		str = &attrs->ffs.dev_name;
+		break;
+	case USBG_F_ATTRS_MIDI:
+		str = &attrs->midi.id;
+		break;
+	case USBG_F_ATTRS_MS:
+		ret = usbg_copy_function_ms_attrs(&attrs->ms, &src->attrs.ms);
+		break;
+	default:
+		break;
+	}
+
+	if (str && *str) {
+		*str = strdup(*str);
+		if (!*str)
+			ret = USBG_ERROR_NO_MEM;
 	}
 
+	if (ret != USBG_SUCCESS)
+		usbg_cleanup_function_attrs(dst);
+
 	return ret;
 }
 
-int usbg_get_config_attrs(usbg_config *c,
-		usbg_config_attrs *c_attrs)
+int usbg_set_function_net_attrs(usbg_function *f, const usbg_f_net_attrs *attrs)
 {
-	return c && c_attrs ? usbg_parse_config_attrs(c->path, c->name, c_attrs)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	int ret = USBG_SUCCESS;
+	char addr_buf[USBG_MAX_STR_LENGTH];
+	char *addr;
+	int fd;
 
-int usbg_set_config_max_power(usbg_config *c, int bMaxPower)
-{
-	return c ? usbg_write_dec(c->path, c->name, "MaxPower", bMaxPower)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	/* Read only values may differ from written ones, read them again */
+	usbg_invalidate_function(f);
 
-int usbg_set_config_bm_attrs(usbg_config *c, int bmAttributes)
-{
-	return c ? usbg_write_hex8(c->path, c->name, "bmAttributes", bmAttributes)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	/* ifname is read only so we accept only empty string for this param */
+	if (attrs->ifname && attrs->ifname[0]) {
+		ret = USBG_ERROR_INVALID_PARAM;
+		goto out;
+	}
 
-int usbg_get_config_strs(usbg_config *c, int lang, usbg_config_strs *c_strs)
-{
-	return c && c_strs ? usbg_parse_config_strs(c->path, c->name, lang, c_strs)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	fd = usbg_function_dirfd(f);
+	addr = usbg_ether_ntoa_r(&attrs->dev_addr, addr_buf);
+	ret = usbg_write_string(fd, "dev_addr", addr);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-int usbg_set_config_strs(usbg_config *c, int lang,
-		const usbg_config_strs *c_strs)
-{
-	return usbg_set_config_string(c, lang, c_strs->configuration);
+	addr = usbg_ether_ntoa_r(&attrs->host_addr, addr_buf);
+	ret = usbg_write_string(fd, "host_addr", addr);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_write_dec(fd, "qmult", attrs->qmult);
+
+out:
+	return ret;
 }
 
-int usbg_set_config_string(usbg_config *c, int lang, const char *str)
+static int usbg_set_f_ms_lun_attrs(usbg_state *s, int dirfd, const char *lun,
+				   usbg_f_ms_lun_attrs *lun_attrs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	int ret;
+	int fd;
 
-	if (c && str) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", c->path,
-				c->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "configuration", str);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
-	}
+	ret = usbg_open_dir(dirfd, lun, &fd);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
+	ret = usbg_write_attr_fields(s, fd, ms_lun_attr_fields,
+				     ARRAY_SIZE(ms_lun_attr_fields), lun_attrs);
+	close(fd);
+out:
 	return ret;
 }
 
-int usbg_add_config_function(usbg_config *c, const char *name, usbg_function *f)
+static int usbg_set_function_ms_attrs(usbg_function *f,
+				      const usbg_f_ms_attrs *f_attrs)
 {
-	char bpath[USBG_MAX_PATH_LENGTH];
-	char fpath[USBG_MAX_PATH_LENGTH];
-	usbg_binding *b;
-	int ret = USBG_SUCCESS;
-	int nmb;
+	int ret;
+	int i;
+	int fd;
+	char *new_lun_mask;
+	char lpath[USBG_MAX_PATH_LENGTH];
+	char lun_name[USBG_MAX_NAME_LENGTH];
+	char (*lun_names)[USBG_MAX_NAME_LENGTH] = NULL;
+	struct usbg_io_op *ops = NULL;
+	struct usbg_dir dir;
 
-	if (!c || !f) {
-		ret = USBG_ERROR_INVALID_PARAM;
+	fd = usbg_function_dirfd(f);
+	ret = usbg_write_bool(fd, "stall", f_attrs->stall);
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
 
-	if (!name)
-		name = f->name;
+	/* lun0 cannot be removed */
+	if (!f_attrs->luns || f_attrs->nluns <= 0)
+		goto out;
 
-	b = usbg_get_binding(c, name);
-	if (b) {
-		ERROR("duplicate binding name\n");
-		ret = USBG_ERROR_EXIST;
+	ret = snprintf(lpath, sizeof(lpath), "%s/%s/", f->path, f->name);
+	if (ret >= sizeof(lpath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
 		goto out;
 	}
+	ret = USBG_SUCCESS;
 
-	b = usbg_get_link_binding(c, f);
-	if (b) {
-		ERROR("duplicate binding link\n");
-		ret = USBG_ERROR_EXIST;
-		goto out;
+	/* One more for error path which starts at nluns */
+	new_lun_mask = calloc(f_attrs->nluns + 1, sizeof (char));
+	ops = calloc(f_attrs->nluns, sizeof(*ops));
+	lun_names = calloc(f_attrs->nluns, sizeof(*lun_names));
+	if (!new_lun_mask || !ops || !lun_names) {
+		ret = USBG_ERROR_NO_MEM;
+		goto err_alloc;
 	}
 
-	nmb = snprintf(fpath, sizeof(fpath), "%s/%s", f->path, f->name);
-	if (nmb >= sizeof(fpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
+	for (i = 0; i < f_attrs->nluns; ++i) {
+		usbg_f_ms_lun_attrs *lun = f_attrs->luns[i];
+
+		/*
+		 * id may be left unset in lun attrs but
+		 * if it is set it has to be equal to position
+		 * in lun array
+		 */
+		if (lun && lun->id >= 0 && lun->id != i) {
+			ret = USBG_ERROR_INVALID_PARAM;
+			goto err_alloc;
+		}
+
+		snprintf(lun_names[i], sizeof(lun_names[i]), "lun.%d", i);
+		ops[i].type = USBG_IO_MKDIR;
+		ops[i].dirfd = fd;
+		ops[i].name = lun_names[i];
 	}
 
-	nmb = snprintf(bpath, sizeof(bpath), "%s/%s", c->path, c->name);
-	if (nmb >= sizeof(bpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
+	/* Create all dirs which don't exist yet at once */
+	usbg_io_batch(f->parent->parent, ops, f_attrs->nluns);
+
+	for (i = 0; i < f_attrs->nluns; ++i) {
+		if (ops[i].ret == USBG_SUCCESS)
+			/*
+			 * If we have created a new directory in
+			 * this function let's mark it so we can
+			 * cleanup in case of error
+			 */
+			new_lun_mask[i] = 1;
+		else if (ops[i].ret != USBG_ERROR_EXIST && ret == USBG_SUCCESS)
+			ret = ops[i].ret;
 	}
 
-	b = usbg_allocate_binding(bpath, name, c);
-	if (b) {
-		int free_space = sizeof(bpath) - nmb;
+	i = f_attrs->nluns;
+	if (ret != USBG_SUCCESS)
+		goto err_lun_loop;
 
-		b->target = f;
-		nmb = snprintf(&(bpath[nmb]), free_space, "/%s", name);
-		if (nmb < free_space) {
+	for (i = 0; i < f_attrs->nluns; ++i) {
+		usbg_f_ms_lun_attrs *lun = f_attrs->luns[i];
 
-			ret = symlink(fpath, bpath);
-			if (ret == 0) {
-				b->target = f;
-				INSERT_TAILQ_STRING_ORDER(&c->bindings, bhead,
-						name, b, bnode);
-			} else {
-				ERRORNO("%s -> %s\n", bpath, fpath);
-				ret = usbg_translate_error(errno);
-			}
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
+		/* if attributes has not been provided just go to next one */
+		if (!lun)
+			continue;
 
+		ret = usbg_set_f_ms_lun_attrs(f->parent->parent, fd,
+					      lun_names[i], lun);
 		if (ret != USBG_SUCCESS) {
-			usbg_free_binding(b);
-			b = NULL;
+			i = f_attrs->nluns;
+			goto err_lun_loop;
 		}
-	} else {
-		ret = USBG_ERROR_NO_MEM;
 	}
 
+	/* Check if function has more luns and remove them */
+	i = 0;
+	ret = usbg_read_dir(AT_FDCWD, lpath, lun_select, lun_sort, &dir);
+	if (ret != USBG_SUCCESS)
+		goto err_lun_loop;
+
+	for (i = f_attrs->nluns; i < dir.n; ++i) {
+		ret = usbg_rm_dir(lpath, dir.ents[i].name);
+		/* There is no good way to recover form this */
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+	usbg_release_dir(&dir);
+
+	if (ret == USBG_SUCCESS) {
+		free(lun_names);
+		free(ops);
+		free(new_lun_mask);
+
+		return USBG_SUCCESS;
+	}
+
+	i = f_attrs->nluns;
+err_lun_loop:
+	/* array is null terminated so we may access lun[nluns] */
+	for (; i >= 0; --i) {
+		if (!new_lun_mask[i])
+			continue;
+
+		snprintf(lun_name, sizeof(lun_name), "lun.%d", i);
+		unlinkat(fd, lun_name, AT_REMOVEDIR);
+	}
+err_alloc:
+	free(lun_names);
+	free(ops);
+	free(new_lun_mask);
+
 out:
 	return ret;
 }
 
-usbg_function *usbg_get_binding_target(usbg_binding *b)
+int usbg_set_function_midi_attrs(usbg_function *f,
+				 const usbg_f_midi_attrs *attrs)
 {
-	return b ? b->target : NULL;
+	usbg_invalidate_function(f);
+	return usbg_write_attr_fields(f->parent->parent, usbg_function_dirfd(f),
+				      midi_attr_fields,
+				      ARRAY_SIZE(midi_attr_fields), attrs);
 }
 
-const char *usbg_get_binding_name(usbg_binding *b)
+int usbg_set_function_loopback_attrs(usbg_function *f,
+				 const usbg_f_loopback_attrs *attrs)
 {
-	return b ? b->name : NULL;
+	usbg_invalidate_function(f);
+	return usbg_write_attr_fields(f->parent->parent, usbg_function_dirfd(f),
+				      loopback_attr_fields,
+				      ARRAY_SIZE(loopback_attr_fields), attrs);
 }
 
-size_t usbg_get_binding_name_len(usbg_binding *b)
+/* Entry of function in open transaction, created on first use */
+static struct usbg_txn_func *usbg_txn_func(usbg_function *f, int attrs_type)
 {
-	return b ? strlen(b->name) : USBG_ERROR_INVALID_PARAM;
-}
+	struct usbg_gadget_txn *txn = f->parent->txn;
+	struct usbg_txn_func *funcs;
+	int i;
 
-int usbg_cpy_binding_name(usbg_binding *b, char *buf, size_t len)
-{
-	if (!b || !buf || len == 0)
-		return USBG_ERROR_INVALID_PARAM;
+	for (i = 0; i < txn->nfuncs; ++i) {
+		if (txn->funcs[i].f == f)
+			return txn->funcs + i;
+	}
 
-	buf[--len] = '\0';
-	strncpy(buf, b->name, len);
+	funcs = usbg_alloc_attr_obj(f->parent->parent, 0,
+				    (txn->nfuncs + 1) * sizeof(*funcs));
+	if (!funcs)
+		return NULL;
 
-	return USBG_SUCCESS;
+	if (txn->nfuncs)
+		memcpy(funcs, txn->funcs, txn->nfuncs * sizeof(*funcs));
+	usbg_free_attr_obj(f->parent->parent, txn->funcs);
+	txn->funcs = funcs;
+	memset(funcs + i, 0, sizeof(*funcs));
+	funcs[i].f = f;
+	funcs[i].attrs.header.attrs_type = attrs_type;
+	txn->nfuncs++;
+
+	return funcs + i;
 }
 
-int usbg_enable_gadget(usbg_gadget *g, usbg_udc *udc)
+/* Record copy of function attributes in open transaction */
+static int usbg_txn_set_function_attrs(usbg_function *f, int attrs_type,
+				       const usbg_function_attrs *f_attrs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_function_attrs src = *f_attrs;
+	usbg_function_attrs copy;
+	struct usbg_txn_func *tf;
+	int ret;
+	int i;
 
-	if (!g)
-		return ret;
+	switch (attrs_type) {
+	case USBG_F_ATTRS_NET:
+		if (f_attrs->attrs.net.ifname && f_attrs->attrs.net.ifname[0])
+			return USBG_ERROR_INVALID_PARAM;
+		break;
 
-	if (!udc) {
-		udc = usbg_get_first_udc(g->parent);
-		if (!udc)
-			return ret;
+	case USBG_F_ATTRS_MS:
+		for (i = 0; f_attrs->attrs.ms.luns &&
+			     i < f_attrs->attrs.ms.nluns; ++i) {
+			if (f_attrs->attrs.ms.luns[i] &&
+			    f_attrs->attrs.ms.luns[i]->id >= 0 &&
+			    f_attrs->attrs.ms.luns[i]->id != i)
+				return USBG_ERROR_INVALID_PARAM;
+		}
+		break;
 	}
 
-	ret = usbg_write_string(g->path, g->name, "UDC", udc->name);
-	if (ret == USBG_SUCCESS) {
-		/* If gadget has been detached and we didn't noticed
-		 * it we have to clean up now.
-		 */
-		if (g->udc)
-			g->udc->gadget = NULL;
-		g->udc = udc;
-		udc->gadget = g;
+	src.header.attrs_type = attrs_type;
+	ret = usbg_copy_function_attrs(&copy, &src);
+	if (ret != USBG_SUCCESS) {
+		usbg_cleanup_function_attrs(&copy);
+		return ret;
 	}
 
-	return ret;
+	tf = usbg_txn_func(f, attrs_type);
+	if (!tf) {
+		usbg_cleanup_function_attrs(&copy);
+		return USBG_ERROR_NO_MEM;
+	}
+
+	usbg_cleanup_function_attrs(&tf->attrs);
+	tf->attrs = copy;
+	tf->dirty = USBG_TXN_FUNC_ALL;
+
+	return USBG_SUCCESS;
 }
 
-int usbg_disable_gadget(usbg_gadget *g)
+/* Record single net attribute in open transaction */
+static int usbg_txn_set_net_attr(usbg_function *f, int attr,
+				 const struct ether_addr *addr, int qmult)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
-
-	if (!g)
-		return ret;
+	struct usbg_txn_func *tf;
+	usbg_f_net_attrs *net;
 
-	ret = usbg_write_string(g->path, g->name, "UDC", "\n");
-	if (ret == USBG_SUCCESS) {
-		if (g->udc)
-			g->udc->gadget = NULL;
-		g->udc = NULL;
-	}
+	if (usbg_lookup_function_attrs_type(f->type) != USBG_F_ATTRS_NET)
+		return USBG_ERROR_INVALID_PARAM;
 
-	return ret;
-}
+	tf = usbg_txn_func(f, USBG_F_ATTRS_NET);
+	if (!tf)
+		return USBG_ERROR_NO_MEM;
 
-/*
- * USB function-specific attribute configuration
- */
+	net = &tf->attrs.attrs.net;
+	switch (attr) {
+	case USBG_TXN_NET_DEV_ADDR:
+		net->dev_addr = *addr;
+		break;
+	case USBG_TXN_NET_HOST_ADDR:
+		net->host_addr = *addr;
+		break;
+	default:
+		net->qmult = qmult;
+		break;
+	}
+	tf->dirty |= attr;
 
-usbg_function_type usbg_get_function_type(usbg_function *f)
-{
-	return f ? f->type : USBG_ERROR_INVALID_PARAM;
+	return USBG_SUCCESS;
 }
 
-int usbg_get_function_attrs(usbg_function *f, usbg_function_attrs *f_attrs)
+static int usbg_set_function_attrs_locked(usbg_function *f,
+			    const usbg_function_attrs *f_attrs)
 {
-	return f && f_attrs ? usbg_parse_function_attrs(f, f_attrs)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	int ret = USBG_ERROR_INVALID_PARAM;
+	int attrs_type;
 
-static void usbg_cleanup_function_ms_lun_attrs(usbg_f_ms_lun_attrs *lun_attrs)
-{
-	if (!lun_attrs)
-		return;
+	if (!f || !f_attrs)
+		return ret;
 
-	free((char*)lun_attrs->filename);
-	lun_attrs->id = -1;
-}
+	usbg_invalidate_function(f);
 
-void usbg_cleanup_function_attrs(usbg_function_attrs *f_attrs)
-{
-	usbg_f_attrs *attrs;
+	attrs_type = usbg_lookup_function_attrs_type(f->type);
+	if (attrs_type < 0)
+		return ret;
 
-	if (!f_attrs)
-		return;
+	/* if attrs type is set, check if it has correct type */
+	if (f_attrs->header.attrs_type && attrs_type != f_attrs->header.attrs_type)
+		return ret;
 
-	attrs = &f_attrs->attrs;
+	/* Only types with something to write are left for commit */
+	if (f->parent->txn) {
+		switch (attrs_type) {
+		case USBG_F_ATTRS_NET:
+		case USBG_F_ATTRS_MS:
+		case USBG_F_ATTRS_MIDI:
+		case USBG_F_ATTRS_LOOPBACK:
+			return usbg_txn_set_function_attrs(f, attrs_type,
+							   f_attrs);
+		}
+	}
 
-	switch (f_attrs->header.attrs_type) {
+	switch (attrs_type) {
 	case USBG_F_ATTRS_SERIAL:
+		/* port_num attribute is read only so we accept only 0
+		 * and do nothing with it */
+		ret = f_attrs->attrs.serial.port_num ? USBG_ERROR_INVALID_PARAM
+			: USBG_SUCCESS;
 		break;
 
 	case USBG_F_ATTRS_NET:
-		free((char*)attrs->net.ifname);
-		attrs->net.ifname = NULL;
+		ret = usbg_set_function_net_attrs(f, &f_attrs->attrs.net);
 		break;
 
 	case USBG_F_ATTRS_PHONET:
-		free((char*)attrs->phonet.ifname);
-		attrs->phonet.ifname = NULL;
+		/* ifname attribute is read only
+		 * so we accept only empty string */
+		ret = f_attrs->attrs.phonet.ifname && f_attrs->attrs.phonet.ifname[0] ?
+			USBG_ERROR_INVALID_PARAM : USBG_SUCCESS;
 		break;
 
 	case USBG_F_ATTRS_FFS:
-		free((char*)attrs->ffs.dev_name);
-		attrs->ffs.dev_name = NULL;
+		/* dev_name is a virtual attribute so allow only to use empty
+		 * empty string which means nop */
+		ret = f_attrs->attrs.ffs.dev_name && f_attrs->attrs.ffs.dev_name[0] ?
+			USBG_ERROR_INVALID_PARAM : USBG_SUCCESS;
 		break;
 
 	case USBG_F_ATTRS_MS:
-	{
-		int i;
-		usbg_f_ms_attrs *ms_attrs = &attrs->ms;
-
-		if (!ms_attrs->luns)
-			goto ms_break;
-
-		for (i = 0; i < ms_attrs->nluns; ++i) {
-			if (!ms_attrs->luns[i])
-				continue;
-
-			usbg_cleanup_function_ms_lun_attrs(ms_attrs->luns[i]);
-			free(ms_attrs->luns[i]);
-		}
-		free(ms_attrs->luns);
-		ms_attrs->luns = NULL;
-		ms_attrs->nluns = -1;
-	ms_break:
+		ret = usbg_set_function_ms_attrs(f, &f_attrs->attrs.ms);
 		break;
-	}
 
 	case USBG_F_ATTRS_MIDI:
-		free((char*)attrs->midi.id);
-		attrs->midi.id = NULL;
+		ret = usbg_set_function_midi_attrs(f, &f_attrs->attrs.midi);
 		break;
 
 	case USBG_F_ATTRS_LOOPBACK:
+		ret = usbg_set_function_loopback_attrs(f, &f_attrs->attrs.loopback);
 		break;
 
 	default:
-		ERROR("Unsupported attrs type\n");
+		ERROR("Unsupported function type\n");
+		ret = USBG_ERROR_NOT_SUPPORTED;
 		break;
 	}
+
+	return ret;
 }
 
-int usbg_set_function_net_attrs(usbg_function *f, const usbg_f_net_attrs *attrs)
+int usbg_set_function_attrs(usbg_function *f,
+			    const usbg_function_attrs *f_attrs)
+{
+	int ret;
+
+	if (!f)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_attrs(f->parent);
+	ret = usbg_set_function_attrs_locked(f, f_attrs);
+	usbg_unlock_attrs(f->parent);
+
+	return ret;
+}
+
+int usbg_set_net_dev_addr(usbg_function *f, struct ether_addr *dev_addr)
 {
 	int ret = USBG_SUCCESS;
-	char addr_buf[USBG_MAX_STR_LENGTH];
-	char *addr;
 
-	/* ifname is read only so we accept only empty string for this param */
-	if (attrs->ifname && attrs->ifname[0]) {
+	if (f && dev_addr) {
+		char str_buf[USBG_MAX_STR_LENGTH];
+		char *str_addr = usbg_ether_ntoa_r(dev_addr, str_buf);
+
+		usbg_lock_attrs(f->parent);
+		if (f->parent->txn) {
+			ret = usbg_txn_set_net_attr(f, USBG_TXN_NET_DEV_ADDR,
+						    dev_addr, 0);
+		} else {
+			usbg_invalidate_function(f);
+			ret = usbg_write_string(usbg_function_dirfd(f),
+						"dev_addr", str_addr);
+		}
+		usbg_unlock_attrs(f->parent);
+	} else {
 		ret = USBG_ERROR_INVALID_PARAM;
-		goto out;
 	}
 
-	addr = usbg_ether_ntoa_r(&attrs->dev_addr, addr_buf);
-	ret = usbg_write_string(f->path, f->name, "dev_addr", addr);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	return ret;
+}
 
-	addr = usbg_ether_ntoa_r(&attrs->host_addr, addr_buf);
-	ret = usbg_write_string(f->path, f->name, "host_addr", addr);
-	if (ret != USBG_SUCCESS)
-		goto out;
+int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *host_addr)
+{
+	int ret = USBG_SUCCESS;
 
-	ret = usbg_write_dec(f->path, f->name, "qmult", attrs->qmult);
+	if (f && host_addr) {
+		char str_buf[USBG_MAX_STR_LENGTH];
+		char *str_addr = usbg_ether_ntoa_r(host_addr, str_buf);
+
+		usbg_lock_attrs(f->parent);
+		if (f->parent->txn) {
+			ret = usbg_txn_set_net_attr(f, USBG_TXN_NET_HOST_ADDR,
+						    host_addr, 0);
+		} else {
+			usbg_invalidate_function(f);
+			ret = usbg_write_string(usbg_function_dirfd(f),
+						"host_addr", str_addr);
+		}
+		usbg_unlock_attrs(f->parent);
+	} else {
+		ret = USBG_ERROR_INVALID_PARAM;
+	}
 
-out:
 	return ret;
 }
 
-static int usbg_set_f_ms_lun_attrs(const char *path, const char *lun,
-				   usbg_f_ms_lun_attrs *lun_attrs)
+int usbg_set_net_qmult(usbg_function *f, int qmult)
 {
 	int ret;
 
-	ret = usbg_write_bool(path, lun, "cdrom", lun_attrs->cdrom);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	if (!f)
+		return USBG_ERROR_INVALID_PARAM;
 
-	ret = usbg_write_bool(path, lun, "ro", lun_attrs->ro);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	usbg_lock_attrs(f->parent);
+	if (f->parent->txn) {
+		ret = usbg_txn_set_net_attr(f, USBG_TXN_NET_QMULT, NULL, qmult);
+	} else {
+		usbg_invalidate_function(f);
+		ret = usbg_write_dec(usbg_function_dirfd(f), "qmult", qmult);
+	}
+	usbg_unlock_attrs(f->parent);
 
-	ret = usbg_write_bool(path, lun, "nofua", lun_attrs->nofua);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	return ret;
+}
 
-	ret = usbg_write_bool(path, lun, "removable", lun_attrs->removable);
-	if (ret != USBG_SUCCESS)
-		goto out;
+usbg_gadget *usbg_get_first_gadget(usbg_state *s)
+{
+	usbg_gadget *g;
 
-	ret = usbg_write_string(path, lun, "file",
-				      lun_attrs->filename);
+	if (!s)
+		return NULL;
 
-out:
-	return ret;
+	usbg_lock_shared(s);
+	g = TAILQ_FIRST(&s->gadgets);
+	usbg_unlock(s);
+
+	return g;
 }
 
-static int usbg_set_function_ms_attrs(usbg_function *f,
-				      const usbg_f_ms_attrs *f_attrs)
+usbg_function *usbg_get_first_function(usbg_gadget *g)
 {
-	int ret;
-	int i, nmb;
-	int space_left;
-	char *new_lun_mask;
-	char lpath[USBG_MAX_PATH_LENGTH];
-	char *lpath_end;
-	DIR *dir;
-	struct dirent **dent;
+	usbg_function *f = NULL;
 
-	ret = usbg_write_bool(f->path, f->name, "stall", f_attrs->stall);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	if (!g)
+		return NULL;
 
-	/* lun0 cannot be removed */
-	if (!f_attrs->luns || f_attrs->nluns <= 0)
-		goto out;
+	usbg_lock_shared(g->parent);
+	if (usbg_parse_lazy_gadget(g) == USBG_SUCCESS)
+		f = TAILQ_FIRST(&g->functions);
+	usbg_unlock(g->parent);
 
-	ret = snprintf(lpath, sizeof(lpath), "%s/%s/", f->path, f->name);
-	if (ret >= sizeof(lpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	return f;
+}
 
-	lpath_end = lpath + strlen(lpath);
-	space_left = sizeof(lpath) - (lpath_end - lpath);
+usbg_config *usbg_get_first_config(usbg_gadget *g)
+{
+	usbg_config *c = NULL;
 
-	new_lun_mask = calloc(f_attrs->nluns, sizeof (char));
-	if (!new_lun_mask) {
-		ret = USBG_ERROR_NO_MEM;
-		goto out;
-	}
+	if (!g)
+		return NULL;
 
-	for (i = 0; i < f_attrs->nluns; ++i) {
-		usbg_f_ms_lun_attrs *lun = f_attrs->luns[i];
+	usbg_lock_shared(g->parent);
+	if (usbg_parse_lazy_gadget(g) == USBG_SUCCESS)
+		c = TAILQ_FIRST(&g->configs);
+	usbg_unlock(g->parent);
 
-		/*
-		 * id may be left unset in lun attrs but
-		 * if it is set it has to be equal to position
-		 * in lun array
-		 */
-		if (lun && lun->id >= 0 && lun->id != i) {
-			ret = USBG_ERROR_INVALID_PARAM;
-			goto err_lun_loop;
-		}
+	return c;
+}
 
-		ret = snprintf(lpath_end, space_left, "/lun.%d/", i);
-		if (ret >= space_left) {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-			goto err_lun_loop;
-		}
+usbg_binding *usbg_get_first_binding(usbg_config *c)
+{
+	usbg_binding *b;
 
-		/*
-		 * Check if dir exist and create it if needed
-		 */
-		dir = opendir(lpath);
-		if (dir) {
-			closedir(dir);
-		} else if (errno != ENOENT) {
-			ret = usbg_translate_error(errno);
-			goto err_lun_loop;
-		} else {
-			ret = mkdir(lpath, S_IRWXU|S_IRWXG|S_IRWXO);
-			if (!ret) {
-				/*
-				 * If we have created a new directory in
-				 * this function let's mark it so we can
-				 * cleanup in case of error
-				 */
-				new_lun_mask[i] = 1;
-			} else {
-				ret = usbg_translate_error(errno);
-				goto err_lun_loop;
-			}
-		}
+	if (!c)
+		return NULL;
 
-		/* if attributes has not been provided just go to next one */
-		if (!lun)
-			continue;
+	usbg_lock_shared(c->parent->parent);
+	b = TAILQ_FIRST(&c->bindings);
+	usbg_unlock(c->parent->parent);
 
-		ret = usbg_set_f_ms_lun_attrs(lpath, "", lun);
-		if (ret != USBG_SUCCESS)
-			goto err_lun_loop;
-	}
+	return b;
+}
 
-	/* Check if function has more luns and remove them */
-	*lpath_end = '\0';
-	i = 0;
-	nmb = scandir(lpath, &dent, lun_select, lun_sort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
-		goto err_lun_loop;
-	}
+usbg_udc *usbg_get_first_udc(usbg_state *s)
+{
+	usbg_udc *u;
+
+	if (!s)
+		return NULL;
+
+	usbg_lock_shared(s);
+	u = TAILQ_FIRST(&s->udcs);
+	usbg_unlock(s);
+
+	return u;
+}
 
-	for (i = 0; i < f_attrs->nluns; ++i)
-		free(dent[i]);
+usbg_gadget *usbg_get_next_gadget(usbg_gadget *g)
+{
+	usbg_state *s;
+
+	if (!g)
+		return NULL;
+
+	s = g->parent;
+	usbg_lock_shared(s);
+	g = TAILQ_NEXT(g, gnode);
+	usbg_unlock(s);
+
+	return g;
+}
+
+usbg_function *usbg_get_next_function(usbg_function *f)
+{
+	usbg_state *s;
+
+	if (!f)
+		return NULL;
 
-	for (; i < nmb; ++i) {
-		ret = usbg_rm_dir(lpath, dent[i]->d_name);
-		free(dent[i]);
-		/* There is no good way to recover form this */
-		if (ret != USBG_SUCCESS)
-			goto err_rm_loop;
-	}
-	free(dent);
-	free(new_lun_mask);
+	s = f->parent->parent;
+	usbg_lock_shared(s);
+	f = TAILQ_NEXT(f, fnode);
+	usbg_unlock(s);
 
-	return USBG_SUCCESS;
+	return f;
+}
 
-err_rm_loop:
-	while (++i < nmb)
-		free(dent[i]);
-	free(dent);
+usbg_config *usbg_get_next_config(usbg_config *c)
+{
+	usbg_state *s;
 
-	i = f_attrs->nluns;
-err_lun_loop:
-	/* array is null terminated so we may access lun[nluns] */
-	for (; i >= 0; --i) {
-		if (!new_lun_mask[i])
-			continue;
+	if (!c)
+		return NULL;
 
-		ret = snprintf(lpath_end, space_left, "/lun.%d/", i);
-		if (ret >= space_left) {
-			/*
-			 * This should not happen because if we were
-			 * able to create this directory we should be
-			 * also able to remove it.
-			 */
-			continue;
-		}
-		rmdir(lpath);
-	}
-	free(new_lun_mask);
+	s = c->parent->parent;
+	usbg_lock_shared(s);
+	c = TAILQ_NEXT(c, cnode);
+	usbg_unlock(s);
 
-out:
-	return ret;
+	return c;
 }
 
-int usbg_set_function_midi_attrs(usbg_function *f,
-				 const usbg_f_midi_attrs *attrs)
+usbg_binding *usbg_get_next_binding(usbg_binding *b)
 {
-	int ret;
+	usbg_state *s;
 
-	ret = usbg_write_dec(f->path, f->name, "index", attrs->index);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	if (!b)
+		return NULL;
 
-	ret = usbg_write_string(f->path, f->name, "id", attrs->id);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	s = b->parent->parent->parent;
+	usbg_lock_shared(s);
+	b = TAILQ_NEXT(b, bnode);
+	usbg_unlock(s);
 
-	ret = usbg_write_dec(f->path, f->name, "in_ports", attrs->in_ports);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	return b;
+}
 
-	ret = usbg_write_dec(f->path, f->name, "out_ports", attrs->out_ports);
-	if (ret != USBG_SUCCESS)
-		goto out;
+usbg_udc *usbg_get_next_udc(usbg_udc *u)
+{
+	usbg_state *s;
 
-	ret = usbg_write_dec(f->path, f->name, "buflen", attrs->buflen);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	if (!u)
+		return NULL;
 
-	ret = usbg_write_dec(f->path, f->name, "qlen", attrs->qlen);
+	s = u->parent;
+	usbg_lock_shared(s);
+	u = TAILQ_NEXT(u, unode);
+	usbg_unlock(s);
 
-out:
-	return ret;
+	return u;
 }
 
-int usbg_set_function_loopback_attrs(usbg_function *f,
-				 const usbg_f_loopback_attrs *attrs)
+
+/* Called with obj_lock held, array stays as it is if it is valid */
+static int usbg_children_reserve(struct usbg_children *v)
 {
-	int ret;
+	void **items;
 
-	ret = usbg_write_dec(f->path, f->name, "buflen", attrs->buflen);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	if (v->valid || v->size >= v->count)
+		return USBG_SUCCESS;
 
-	ret = usbg_write_dec(f->path, f->name, "qlen", attrs->qlen);
+	/* Array is filled again from scratch, old content is not needed */
+	items = usbg_arena_alloc(v->arena, v->count * sizeof(*items));
+	if (!items)
+		return USBG_ERROR_NO_MEM;
 
-out:
-	return ret;
+	usbg_arena_free(v->arena, v->items);
+	v->items = items;
+	v->size = v->count;
+	return USBG_SUCCESS;
 }
 
-int usbg_set_function_attrs(usbg_function *f,
-			    const usbg_function_attrs *f_attrs)
+#define USBG_CHILDREN_UPDATE(Vec, HeadPtr, NodeField, Ret) \
+	do { \
+		typeof(TAILQ_FIRST(HeadPtr)) _obj; \
+		int _i = 0; \
+		(Ret) = usbg_children_reserve(Vec); \
+		if ((Ret) != USBG_SUCCESS || (Vec)->valid) \
+			break; \
+		TAILQ_FOREACH(_obj, (HeadPtr), NodeField) \
+			(Vec)->items[_i++] = _obj; \
+		(Vec)->valid = 1; \
+	} while (0)
+
+static void *usbg_children_at(struct usbg_children *v, int index)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
-	int attrs_type;
+	if (index < 0 || index >= v->count)
+		return NULL;
 
-	if (!f || !f_attrs)
-		return ret;
+	return v->items[index];
+}
 
-	attrs_type = usbg_lookup_function_attrs_type(f->type);
-	if (attrs_type < 0)
-		return ret;
+static int usbg_children_snapshot(struct usbg_children *v, void **out)
+{
+	void *copy = NULL;
 
-	/* if attrs type is set, check if it has correct type */
-	if (f_attrs->header.attrs_type && attrs_type != f_attrs->header.attrs_type)
-		return ret;
+	if (v->count > 0) {
+		copy = malloc(v->count * sizeof(*v->items));
+		if (!copy)
+			return USBG_ERROR_NO_MEM;
 
-	switch (attrs_type) {
-	case USBG_F_ATTRS_SERIAL:
-		/* port_num attribute is read only so we accept only 0
-		 * and do nothing with it */
-		ret = f_attrs->attrs.serial.port_num ? USBG_ERROR_INVALID_PARAM
-			: USBG_SUCCESS;
-		break;
+		memcpy(copy, v->items, v->count * sizeof(*v->items));
+	}
 
-	case USBG_F_ATTRS_NET:
-		ret = usbg_set_function_net_attrs(f, &f_attrs->attrs.net);
-		break;
+	*out = copy;
+	return v->count;
+}
 
-	case USBG_F_ATTRS_PHONET:
-		/* ifname attribute is read only
-		 * so we accept only empty string */
-		ret = f_attrs->attrs.phonet.ifname && f_attrs->attrs.phonet.ifname[0] ?
-			USBG_ERROR_INVALID_PARAM : USBG_SUCCESS;
-		break;
+int usbg_get_gadget_count(usbg_state *s)
+{
+	int ret;
 
-	case USBG_F_ATTRS_FFS:
-		/* dev_name is a virtual attribute so allow only to use empty
-		 * empty string which means nop */
-		ret = f_attrs->attrs.ffs.dev_name && f_attrs->attrs.ffs.dev_name[0] ?
-			USBG_ERROR_INVALID_PARAM : USBG_SUCCESS;
-		break;
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
 
-	case USBG_F_ATTRS_MS:
-		ret = usbg_set_function_ms_attrs(f, &f_attrs->attrs.ms);
-		break;
+	usbg_lock_shared(s);
+	ret = s->gadget_array.count;
+	usbg_unlock(s);
 
-	case USBG_F_ATTRS_MIDI:
-		ret = usbg_set_function_midi_attrs(f, &f_attrs->attrs.midi);
-		break;
+	return ret;
+}
 
-	case USBG_F_ATTRS_LOOPBACK:
-		ret = usbg_set_function_loopback_attrs(f, &f_attrs->attrs.loopback);
-		break;
+int usbg_get_function_count(usbg_gadget *g)
+{
+	int ret;
 
-	default:
-		ERROR("Unsupported function type\n");
-		ret = USBG_ERROR_NOT_SUPPORTED;
-		break;
-	}
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_shared(g->parent);
+	ret = usbg_parse_lazy_gadget(g);
+	if (ret == USBG_SUCCESS)
+		ret = g->function_array.count;
+	usbg_unlock(g->parent);
 
 	return ret;
 }
 
-int usbg_set_net_dev_addr(usbg_function *f, struct ether_addr *dev_addr)
+int usbg_get_config_count(usbg_gadget *g)
 {
-	int ret = USBG_SUCCESS;
+	int ret;
 
-	if (f && dev_addr) {
-		char str_buf[USBG_MAX_STR_LENGTH];
-		char *str_addr = usbg_ether_ntoa_r(dev_addr, str_buf);
-		ret = usbg_write_string(f->path, f->name, "dev_addr", str_addr);
-	} else {
-		ret = USBG_ERROR_INVALID_PARAM;
-	}
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_shared(g->parent);
+	ret = usbg_parse_lazy_gadget(g);
+	if (ret == USBG_SUCCESS)
+		ret = g->config_array.count;
+	usbg_unlock(g->parent);
 
 	return ret;
 }
 
-int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *host_addr)
+int usbg_get_binding_count(usbg_config *c)
 {
-	int ret = USBG_SUCCESS;
+	int ret;
 
-	if (f && host_addr) {
-		char str_buf[USBG_MAX_STR_LENGTH];
-		char *str_addr = usbg_ether_ntoa_r(host_addr, str_buf);
-		ret = usbg_write_string(f->path, f->name, "host_addr", str_addr);
-	} else {
-		ret = USBG_ERROR_INVALID_PARAM;
-	}
+	if (!c)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_shared(c->parent->parent);
+	ret = c->binding_array.count;
+	usbg_unlock(c->parent->parent);
 
 	return ret;
 }
 
-int usbg_set_net_qmult(usbg_function *f, int qmult)
+int usbg_get_udc_count(usbg_state *s)
 {
-	return f ? usbg_write_dec(f->path, f->name, "qmult", qmult)
-			: USBG_ERROR_INVALID_PARAM;
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_shared(s);
+	ret = s->udc_array.count;
+	usbg_unlock(s);
+
+	return ret;
 }
 
-usbg_gadget *usbg_get_first_gadget(usbg_state *s)
+usbg_gadget *usbg_get_gadget_at(usbg_state *s, int index)
 {
-	return s ? TAILQ_FIRST(&s->gadgets) : NULL;
+	usbg_gadget *g = NULL;
+	int ret;
+
+	if (!s)
+		return NULL;
+
+	usbg_lock_obj(s);
+	USBG_CHILDREN_UPDATE(&s->gadget_array, &s->gadgets, gnode, ret);
+	if (ret == USBG_SUCCESS)
+		g = usbg_children_at(&s->gadget_array, index);
+	usbg_unlock_obj(s);
+
+	return g;
 }
 
-usbg_function *usbg_get_first_function(usbg_gadget *g)
+usbg_function *usbg_get_function_at(usbg_gadget *g, int index)
 {
-	return g ? TAILQ_FIRST(&g->functions) : NULL;
+	usbg_function *f = NULL;
+	int ret;
+
+	if (!g)
+		return NULL;
+
+	usbg_lock_obj(g->parent);
+	ret = usbg_parse_lazy_gadget(g);
+	if (ret == USBG_SUCCESS)
+		USBG_CHILDREN_UPDATE(&g->function_array, &g->functions, fnode,
+				     ret);
+	if (ret == USBG_SUCCESS)
+		f = usbg_children_at(&g->function_array, index);
+	usbg_unlock_obj(g->parent);
+
+	return f;
 }
 
-usbg_config *usbg_get_first_config(usbg_gadget *g)
+usbg_config *usbg_get_config_at(usbg_gadget *g, int index)
 {
-	return g ? TAILQ_FIRST(&g->configs) : NULL;
+	usbg_config *c = NULL;
+	int ret;
+
+	if (!g)
+		return NULL;
+
+	usbg_lock_obj(g->parent);
+	ret = usbg_parse_lazy_gadget(g);
+	if (ret == USBG_SUCCESS)
+		USBG_CHILDREN_UPDATE(&g->config_array, &g->configs, cnode,
+				     ret);
+	if (ret == USBG_SUCCESS)
+		c = usbg_children_at(&g->config_array, index);
+	usbg_unlock_obj(g->parent);
+
+	return c;
 }
 
-usbg_binding *usbg_get_first_binding(usbg_config *c)
+usbg_binding *usbg_get_binding_at(usbg_config *c, int index)
 {
-	return c ? TAILQ_FIRST(&c->bindings) : NULL;
+	usbg_binding *b = NULL;
+	usbg_state *s;
+	int ret;
+
+	if (!c)
+		return NULL;
+
+	s = c->parent->parent;
+	usbg_lock_obj(s);
+	USBG_CHILDREN_UPDATE(&c->binding_array, &c->bindings, bnode, ret);
+	if (ret == USBG_SUCCESS)
+		b = usbg_children_at(&c->binding_array, index);
+	usbg_unlock_obj(s);
+
+	return b;
 }
 
-usbg_udc *usbg_get_first_udc(usbg_state *s)
+usbg_udc *usbg_get_udc_at(usbg_state *s, int index)
 {
-	return s ? TAILQ_FIRST(&s->udcs) : NULL;
+	usbg_udc *u = NULL;
+	int ret;
+
+	if (!s)
+		return NULL;
+
+	usbg_lock_obj(s);
+	USBG_CHILDREN_UPDATE(&s->udc_array, &s->udcs, unode, ret);
+	if (ret == USBG_SUCCESS)
+		u = usbg_children_at(&s->udc_array, index);
+	usbg_unlock_obj(s);
+
+	return u;
 }
 
-usbg_gadget *usbg_get_next_gadget(usbg_gadget *g)
+int usbg_get_gadgets(usbg_state *s, usbg_gadget ***gadgets)
 {
-	return g ? TAILQ_NEXT(g, gnode) : NULL;
+	void *copy;
+	int ret;
+
+	if (!s || !gadgets)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_obj(s);
+	USBG_CHILDREN_UPDATE(&s->gadget_array, &s->gadgets, gnode, ret);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_children_snapshot(&s->gadget_array, &copy);
+	usbg_unlock_obj(s);
+
+	if (ret >= 0)
+		*gadgets = copy;
+
+	return ret;
 }
 
-usbg_function *usbg_get_next_function(usbg_function *f)
+int usbg_get_functions(usbg_gadget *g, usbg_function ***functions)
 {
-	return f ? TAILQ_NEXT(f, fnode) : NULL;
+	void *copy;
+	int ret;
+
+	if (!g || !functions)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_obj(g->parent);
+	ret = usbg_parse_lazy_gadget(g);
+	if (ret == USBG_SUCCESS)
+		USBG_CHILDREN_UPDATE(&g->function_array, &g->functions, fnode,
+				     ret);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_children_snapshot(&g->function_array, &copy);
+	usbg_unlock_obj(g->parent);
+
+	if (ret >= 0)
+		*functions = copy;
+
+	return ret;
 }
 
-usbg_config *usbg_get_next_config(usbg_config *c)
+int usbg_get_configs(usbg_gadget *g, usbg_config ***configs)
 {
-	return c ? TAILQ_NEXT(c, cnode) : NULL;
+	void *copy;
+	int ret;
+
+	if (!g || !configs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_obj(g->parent);
+	ret = usbg_parse_lazy_gadget(g);
+	if (ret == USBG_SUCCESS)
+		USBG_CHILDREN_UPDATE(&g->config_array, &g->configs, cnode,
+				     ret);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_children_snapshot(&g->config_array, &copy);
+	usbg_unlock_obj(g->parent);
+
+	if (ret >= 0)
+		*configs = copy;
+
+	return ret;
 }
 
-usbg_binding *usbg_get_next_binding(usbg_binding *b)
+int usbg_get_bindings(usbg_config *c, usbg_binding ***bindings)
 {
-	return b ? TAILQ_NEXT(b, bnode) : NULL;
+	usbg_state *s;
+	void *copy;
+	int ret;
+
+	if (!c || !bindings)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = c->parent->parent;
+	usbg_lock_obj(s);
+	USBG_CHILDREN_UPDATE(&c->binding_array, &c->bindings, bnode, ret);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_children_snapshot(&c->binding_array, &copy);
+	usbg_unlock_obj(s);
+
+	if (ret >= 0)
+		*bindings = copy;
+
+	return ret;
 }
 
-usbg_udc *usbg_get_next_udc(usbg_udc *u)
+int usbg_get_udcs(usbg_state *s, usbg_udc ***udcs)
 {
-	return u ? TAILQ_NEXT(u, unode) : NULL;
-}
+	void *copy;
+	int ret;
+
+	if (!s || !udcs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_obj(s);
+	USBG_CHILDREN_UPDATE(&s->udc_array, &s->udcs, unode, ret);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_children_snapshot(&s->udc_array, &copy);
+	usbg_unlock_obj(s);
+
+	if (ret >= 0)
+		*udcs = copy;
 
+	return ret;
+}
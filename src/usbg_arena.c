@@ -0,0 +1,199 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_arena.c
+ * @brief Memory arena used for library objects
+ * @details Blocks are carved from large chunks. Each block is preceded
+ * by a header with its rounded size, so it can be put on a free list
+ * of its size class and reused by next allocation of similar size.
+ * Blocks larger than USBG_ARENA_MAX_BLOCK are malloc()ed one by one and
+ * chained into the arena, so they are released together with chunks.
+ */
+
+#define USBG_ARENA_CHUNK_SIZE 16384
+
+union usbg_arena_hdr {
+	size_t size;
+	max_align_t align;
+};
+
+struct usbg_arena_block {
+	struct usbg_arena_block *next;
+};
+
+struct usbg_arena_chunk {
+	struct usbg_arena_chunk *next;
+	max_align_t data[];
+};
+
+struct usbg_arena_large {
+	struct usbg_arena_large *next;
+	struct usbg_arena_large **pprev;
+	union usbg_arena_hdr hdr;
+};
+
+#define USBG_ARENA_ROUND(size) \
+	(((size) + USBG_ARENA_ALIGN - 1) & ~((size_t)USBG_ARENA_ALIGN - 1))
+#define USBG_ARENA_CLASS(size) ((size) / USBG_ARENA_ALIGN - 1)
+
+void usbg_arena_init(struct usbg_arena *a)
+{
+	int i;
+
+	a->chunks = NULL;
+	a->large = NULL;
+	a->pos = NULL;
+	a->left = 0;
+	a->lock = NULL;
+	for (i = 0; i < USBG_ARENA_CLASSES; ++i)
+		a->free_blocks[i] = NULL;
+}
+
+void usbg_arena_release(struct usbg_arena *a)
+{
+	struct usbg_arena_chunk *chunk, *next;
+	struct usbg_arena_large *large, *lnext;
+
+	for (chunk = a->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	for (large = a->large; large; large = lnext) {
+		lnext = large->next;
+		free(large);
+	}
+
+	usbg_arena_init(a);
+}
+
+static inline void usbg_arena_lock(struct usbg_arena *a)
+{
+	if (a->lock)
+		pthread_mutex_lock(a->lock);
+}
+
+static inline void usbg_arena_unlock(struct usbg_arena *a)
+{
+	if (a->lock)
+		pthread_mutex_unlock(a->lock);
+}
+
+static void *usbg_arena_alloc_large(struct usbg_arena *a, size_t size)
+{
+	struct usbg_arena_large *large;
+
+	large = malloc(sizeof(*large) + size);
+	if (!large)
+		return NULL;
+
+	large->next = a->large;
+	if (a->large)
+		a->large->pprev = &large->next;
+	large->pprev = &a->large;
+	a->large = large;
+
+	large->hdr.size = size;
+	return &large->hdr + 1;
+}
+
+static void usbg_arena_free_large(union usbg_arena_hdr *hdr)
+{
+	struct usbg_arena_large *large;
+
+	large = (struct usbg_arena_large *)
+		((char *)hdr - offsetof(struct usbg_arena_large, hdr));
+	*large->pprev = large->next;
+	if (large->next)
+		large->next->pprev = large->pprev;
+	free(large);
+}
+
+static void *usbg_arena_alloc_locked(struct usbg_arena *a, size_t size)
+{
+	union usbg_arena_hdr *hdr;
+	struct usbg_arena_block *block;
+	struct usbg_arena_chunk *chunk;
+	size_t need;
+
+	size = USBG_ARENA_ROUND(size ? size : 1);
+	if (size > USBG_ARENA_MAX_BLOCK)
+		return usbg_arena_alloc_large(a, size);
+
+	block = a->free_blocks[USBG_ARENA_CLASS(size)];
+	if (block) {
+		a->free_blocks[USBG_ARENA_CLASS(size)] = block->next;
+		return block;
+	}
+
+	need = sizeof(*hdr) + size;
+	if (a->left < need) {
+		/* Rest of current chunk is lost, it is never bigger than a block */
+		chunk = malloc(sizeof(*chunk) + USBG_ARENA_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		a->pos = (char *)chunk->data;
+		a->left = USBG_ARENA_CHUNK_SIZE;
+	}
+
+	hdr = (union usbg_arena_hdr *)a->pos;
+	a->pos += need;
+	a->left -= need;
+	hdr->size = size;
+	return hdr + 1;
+}
+
+static void usbg_arena_free_locked(struct usbg_arena *a, void *ptr)
+{
+	union usbg_arena_hdr *hdr;
+	struct usbg_arena_block *block = ptr;
+
+	hdr = (union usbg_arena_hdr *)ptr - 1;
+	if (hdr->size > USBG_ARENA_MAX_BLOCK) {
+		usbg_arena_free_large(hdr);
+		return;
+	}
+
+	block->next = a->free_blocks[USBG_ARENA_CLASS(hdr->size)];
+	a->free_blocks[USBG_ARENA_CLASS(hdr->size)] = block;
+}
+
+void *usbg_arena_alloc(struct usbg_arena *a, size_t size)
+{
+	void *ptr;
+
+	usbg_arena_lock(a);
+	ptr = usbg_arena_alloc_locked(a, size);
+	usbg_arena_unlock(a);
+
+	return ptr;
+}
+
+void usbg_arena_free(struct usbg_arena *a, void *ptr)
+{
+	if (!ptr)
+		return;
+
+	usbg_arena_lock(a);
+	usbg_arena_free_locked(a, ptr);
+	usbg_arena_unlock(a);
+}
@@ -0,0 +1,286 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_clone.c
+ * @brief Copying gadget with all its content
+ * @details New gadget is built directly from objects of the source
+ * one. Attributes are taken through usual getters, so they come from
+ * cache if library has been initialized with USBG_INIT_CACHE, and
+ * nothing is serialized on the way.
+ */
+
+/* List languages of strings kept in path/name/strings */
+static int usbg_read_langs(const char *path, const char *name,
+			   struct usbg_dir *dir)
+{
+	char spath[USBG_MAX_PATH_LENGTH];
+	int nmb;
+
+	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", path, name,
+		       STRINGS_DIR);
+	if (nmb >= sizeof(spath))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	return usbg_read_dir(AT_FDCWD, spath, file_select, NULL, dir);
+}
+
+static int usbg_clone_gadget_strs(usbg_gadget *src, usbg_gadget *g,
+				  const char *serial)
+{
+	struct usbg_dir dir;
+	usbg_gadget_strs strs;
+	int serial_done = 0;
+	int ret;
+	int lang;
+	int i;
+
+	ret = usbg_read_langs(src->path, src->name, &dir);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; ++i) {
+		if (sscanf(dir.ents[i].name, "%x", &lang) != 1)
+			continue;
+
+		ret = usbg_get_gadget_strs(src, lang, &strs);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		if (lang == LANG_US_ENG && serial) {
+			strncpy(strs.str_ser, serial, sizeof(strs.str_ser) - 1);
+			strs.str_ser[sizeof(strs.str_ser) - 1] = '\0';
+			serial_done = 1;
+		}
+
+		ret = usbg_set_gadget_strs(g, lang, &strs);
+	}
+
+	usbg_release_dir(&dir);
+
+	if (ret == USBG_SUCCESS && serial && !serial_done)
+		ret = usbg_set_gadget_serial_number(g, LANG_US_ENG, serial);
+
+	return ret;
+}
+
+static int usbg_clone_config_strs(usbg_config *src, usbg_config *c)
+{
+	struct usbg_dir dir;
+	usbg_config_strs strs;
+	int ret;
+	int lang;
+	int i;
+
+	ret = usbg_read_langs(src->path, src->name, &dir);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	for (i = 0; i < dir.n && ret == USBG_SUCCESS; ++i) {
+		if (sscanf(dir.ents[i].name, "%x", &lang) != 1)
+			continue;
+
+		ret = usbg_get_config_strs(src, lang, &strs);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_set_config_strs(c, lang, &strs);
+	}
+
+	usbg_release_dir(&dir);
+	return ret;
+}
+
+/* Random unicast, locally administered address, as kernel makes it */
+static int usbg_random_ether_addr(struct ether_addr *addr)
+{
+	if (getrandom(addr, sizeof(*addr), 0) != sizeof(*addr))
+		return usbg_translate_error(errno);
+
+	addr->ether_addr_octet[0] &= 0xfe;
+	addr->ether_addr_octet[0] |= 0x02;
+	return USBG_SUCCESS;
+}
+
+/*
+ * Two network functions must not share MAC address, so clone gets
+ * new ones.
+ */
+static int usbg_clone_net_attrs(usbg_f_net_attrs *attrs)
+{
+	int ret;
+
+	ret = usbg_random_ether_addr(&attrs->dev_addr);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_random_ether_addr(&attrs->host_addr);
+
+	return ret;
+}
+
+/*
+ * Getters return also read only and virtual attributes which setters
+ * accept only when empty, so drop them before attrs are written.
+ */
+static int usbg_clone_function_attrs(usbg_function_attrs *attrs)
+{
+	int ret = USBG_SUCCESS;
+
+	switch (attrs->header.attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		attrs->attrs.serial.port_num = 0;
+		break;
+
+	case USBG_F_ATTRS_NET:
+		free((char *)attrs->attrs.net.ifname);
+		attrs->attrs.net.ifname = NULL;
+		ret = usbg_clone_net_attrs(&attrs->attrs.net);
+		break;
+
+	case USBG_F_ATTRS_PHONET:
+		free((char *)attrs->attrs.phonet.ifname);
+		attrs->attrs.phonet.ifname = NULL;
+		break;
+
+	case USBG_F_ATTRS_FFS:
+		free((char *)attrs->attrs.ffs.dev_name);
+		attrs->attrs.ffs.dev_name = NULL;
+		break;
+
+	default:
+		/* All other attributes are writable */
+		break;
+	}
+
+	return ret;
+}
+
+static int usbg_clone_functions(usbg_gadget *src, usbg_gadget *g)
+{
+	usbg_function_attrs attrs;
+	usbg_function *f, *nf;
+	int ret = USBG_SUCCESS;
+
+	TAILQ_FOREACH(f, &src->functions, fnode) {
+		ret = usbg_get_function_attrs(f, &attrs);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		ret = usbg_clone_function_attrs(&attrs);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_create_function(g, f->type, f->instance,
+						   &attrs, &nf);
+		usbg_cleanup_function_attrs(&attrs);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_clone_config(usbg_config *src, usbg_gadget *g)
+{
+	usbg_config_attrs attrs;
+	usbg_binding *b;
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+
+	ret = usbg_get_config_attrs(src, &attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_create_config(g, src->id, src->label, &attrs, NULL, &c);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_clone_config_strs(src, c);
+
+	TAILQ_FOREACH(b, &src->bindings, bnode) {
+		if (ret != USBG_SUCCESS)
+			break;
+
+		/* All functions have been already copied */
+		f = usbg_get_function(g, b->target->type, b->target->instance);
+		ret = f ? usbg_add_config_function(c, b->name, f)
+			: USBG_ERROR_NOT_FOUND;
+	}
+
+	return ret;
+}
+
+static int usbg_clone_gadget_locked(usbg_gadget *src, const char *name,
+		const usbg_gadget_override *overrides, usbg_gadget **g)
+{
+	usbg_gadget_attrs attrs;
+	usbg_config *c;
+	int ret;
+
+	ret = usbg_parse_lazy_gadget(src);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (overrides && overrides->attrs) {
+		attrs = *overrides->attrs;
+	} else {
+		ret = usbg_get_gadget_attrs(src, &attrs);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	ret = usbg_create_gadget(src->parent, name, &attrs, NULL, g);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_clone_gadget_strs(src, *g,
+				     overrides ? overrides->serial : NULL);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_clone_functions(src, *g);
+
+	TAILQ_FOREACH(c, &src->configs, cnode) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_clone_config(c, *g);
+	}
+
+	if (ret != USBG_SUCCESS) {
+		usbg_rm_gadget(*g, USBG_RM_RECURSE);
+		*g = NULL;
+	}
+
+	return ret;
+}
+
+int usbg_clone_gadget(usbg_gadget *src, const char *name,
+		const usbg_gadget_override *overrides, usbg_gadget **g)
+{
+	int ret;
+
+	if (!src || !name || !g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	/* Source must not change while it's copied */
+	ret = usbg_lock_exclusive(src->parent);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_clone_gadget_locked(src, name, overrides, g);
+		usbg_unlock(src->parent);
+	}
+
+	return ret;
+}
@@ -0,0 +1,205 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef HAVE_GETDENTS64
+#include <sys/syscall.h>
+#endif
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_dir.c
+ * @brief Listing of configfs directories
+ * @details Directory is read with getdents64() into a single buffer and
+ * entries only point to names in that buffer, so nothing is allocated
+ * per entry. Small directories fit into buffers embedded in the listing
+ * and are read without any allocation at all. Entries are sorted only
+ * if caller asks for it.
+ */
+
+/* Record returned by getdents64(), glibc does not export it on all versions */
+struct usbg_linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#ifndef HAVE_GETDENTS64
+/* C library older than glibc 2.30 has no wrapper for this syscall */
+static ssize_t getdents64(int fd, void *buf, size_t count)
+{
+	return syscall(SYS_getdents64, fd, buf, count);
+}
+#endif
+
+/* Space which guarantees that at least one more record can be read */
+#define USBG_DIR_MIN_READ (sizeof(struct usbg_linux_dirent64) + NAME_MAX + 1)
+
+static int usbg_dir_grow_buf(struct usbg_dir *d, size_t *size)
+{
+	size_t new_size = *size * 2;
+	char *buf;
+
+	if (d->buf == d->inline_buf) {
+		buf = malloc(new_size);
+		if (buf)
+			memcpy(buf, d->buf, *size);
+	} else {
+		buf = realloc(d->buf, new_size);
+	}
+
+	if (!buf)
+		return USBG_ERROR_NO_MEM;
+
+	d->buf = buf;
+	*size = new_size;
+	return USBG_SUCCESS;
+}
+
+static int usbg_dir_read_all(struct usbg_dir *d, int fd, size_t *len)
+{
+	size_t size = sizeof(d->inline_buf);
+	ssize_t n;
+	int ret;
+
+	*len = 0;
+	for (;;) {
+		if (size - *len < USBG_DIR_MIN_READ) {
+			ret = usbg_dir_grow_buf(d, &size);
+			if (ret != USBG_SUCCESS)
+				return ret;
+		}
+
+		n = getdents64(fd, d->buf + *len, size - *len);
+		if (n == 0)
+			break;
+
+		if (n < 0)
+			return usbg_translate_error(errno);
+
+		*len += n;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_dir_add(struct usbg_dir *d, int *size, const char *name,
+			unsigned char type)
+{
+	struct usbg_dirent *ents;
+
+	if (d->n == *size) {
+		if (d->ents == d->inline_ents) {
+			ents = malloc(*size * 2 * sizeof(*ents));
+			if (ents)
+				memcpy(ents, d->ents, *size * sizeof(*ents));
+		} else {
+			ents = realloc(d->ents, *size * 2 * sizeof(*ents));
+		}
+
+		if (!ents)
+			return USBG_ERROR_NO_MEM;
+
+		d->ents = ents;
+		*size *= 2;
+	}
+
+	d->ents[d->n].name = name;
+	d->ents[d->n].type = type;
+	d->n++;
+	return USBG_SUCCESS;
+}
+
+int usbg_read_dir(int dirfd, const char *path, usbg_dir_filter filter,
+		  usbg_dir_compar compar, struct usbg_dir *d)
+{
+	struct usbg_linux_dirent64 *rec;
+	int size = USBG_DIR_INLINE_ENTS;
+	size_t len, pos;
+	int ret;
+	int fd;
+
+	d->ents = d->inline_ents;
+	d->buf = d->inline_buf;
+	d->n = 0;
+
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	ret = usbg_dir_read_all(d, fd, &len);
+	close(fd);
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	for (pos = 0; pos < len; pos += rec->d_reclen) {
+		rec = (struct usbg_linux_dirent64 *)(d->buf + pos);
+		if (filter && !filter(rec->d_name, rec->d_type))
+			continue;
+
+		ret = usbg_dir_add(d, &size, rec->d_name, rec->d_type);
+		if (ret != USBG_SUCCESS)
+			goto err;
+	}
+
+	if (compar && d->n > 1)
+		qsort(d->ents, d->n, sizeof(*d->ents), compar);
+
+	return USBG_SUCCESS;
+
+err:
+	usbg_release_dir(d);
+out:
+	return ret;
+}
+
+void usbg_release_dir(struct usbg_dir *d)
+{
+	if (d->ents != d->inline_ents)
+		free(d->ents);
+	if (d->buf != d->inline_buf)
+		free(d->buf);
+
+	d->ents = d->inline_ents;
+	d->buf = d->inline_buf;
+	d->n = 0;
+}
+
+int usbg_dirent_cmp(const void *a, const void *b)
+{
+	const struct usbg_dirent *d1 = a;
+	const struct usbg_dirent *d2 = b;
+
+	return strcmp(d1->name, d2->name);
+}
+
+int usbg_dir_contains(const struct usbg_dir *d, const char *name)
+{
+	struct usbg_dirent key = { .name = name };
+
+	/* Only listings sorted by usbg_dirent_cmp() may be searched */
+	return bsearch(&key, d->ents, d->n, sizeof(*d->ents),
+		       usbg_dirent_cmp) != NULL;
+}
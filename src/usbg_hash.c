@@ -0,0 +1,142 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_hash.c
+ * @brief Intrusive hash tables used to index library objects
+ * @details Tables start with a small bucket array embedded in the
+ * table itself and grow when the number of nodes exceeds the number
+ * of buckets. Bigger bucket arrays come from arena of the state.
+ * If growing fails the table keeps working, only with longer chains,
+ * so adding a node never fails.
+ */
+
+static inline struct usbg_hnode **usbg_htable_buckets(struct usbg_htable *t)
+{
+	return t->buckets ? t->buckets : t->inline_buckets;
+}
+
+unsigned int usbg_hash_str(const char *str)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+unsigned int usbg_hash_ptr(const void *ptr)
+{
+	uintptr_t val = (uintptr_t)ptr;
+
+	/* Objects are at least 8 bytes aligned */
+	val >>= 3;
+	return (unsigned int)(val ^ (val >> 32)) * 2654435761u;
+}
+
+void usbg_htable_init(struct usbg_htable *t, struct usbg_arena *arena)
+{
+	int i;
+
+	t->arena = arena;
+	t->buckets = NULL;
+	t->size = USBG_HTABLE_INLINE;
+	t->count = 0;
+	for (i = 0; i < USBG_HTABLE_INLINE; ++i)
+		t->inline_buckets[i] = NULL;
+}
+
+void usbg_htable_release(struct usbg_htable *t)
+{
+	usbg_arena_free(t->arena, t->buckets);
+	usbg_htable_init(t, t->arena);
+}
+
+static void usbg_htable_grow(struct usbg_htable *t)
+{
+	struct usbg_hnode **old = usbg_htable_buckets(t);
+	struct usbg_hnode **buckets;
+	struct usbg_hnode *n, *next;
+	unsigned int size = t->size * 2;
+	unsigned int i;
+
+	buckets = usbg_arena_alloc(t->arena, size * sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	memset(buckets, 0, size * sizeof(*buckets));
+	for (i = 0; i < t->size; ++i) {
+		for (n = old[i]; n; n = next) {
+			next = n->next;
+			n->next = buckets[n->hash & (size - 1)];
+			buckets[n->hash & (size - 1)] = n;
+		}
+	}
+
+	usbg_arena_free(t->arena, t->buckets);
+	t->buckets = buckets;
+	t->size = size;
+}
+
+void usbg_htable_add(struct usbg_htable *t, struct usbg_hnode *n,
+		     unsigned int hash)
+{
+	struct usbg_hnode **bucket;
+
+	if (t->count >= t->size)
+		usbg_htable_grow(t);
+
+	bucket = usbg_htable_buckets(t) + (hash & (t->size - 1));
+	n->hash = hash;
+	n->next = *bucket;
+	*bucket = n;
+	t->count++;
+}
+
+void usbg_htable_del(struct usbg_htable *t, struct usbg_hnode *n)
+{
+	struct usbg_hnode **pos;
+
+	pos = usbg_htable_buckets(t) + (n->hash & (t->size - 1));
+	for (; *pos; pos = &(*pos)->next) {
+		if (*pos == n) {
+			*pos = n->next;
+			t->count--;
+			break;
+		}
+	}
+}
+
+struct usbg_hnode *usbg_htable_next(struct usbg_hnode *n, unsigned int hash)
+{
+	while (n && n->hash != hash)
+		n = n->next;
+
+	return n;
+}
+
+struct usbg_hnode *usbg_htable_first(struct usbg_htable *t, unsigned int hash)
+{
+	return usbg_htable_next(usbg_htable_buckets(t)[hash & (t->size - 1)],
+				hash);
+}
@@ -0,0 +1,102 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_io.c
+ * @brief Synchronous execution of usbg_io_op
+ */
+
+static int usbg_io_rw(struct usbg_io_op *op)
+{
+	int fd;
+	int nmb;
+	int ret = USBG_SUCCESS;
+
+	fd = openat(op->dirfd, op->name, (op->type == USBG_IO_READ ?
+					  O_RDONLY : O_WRONLY) | O_CLOEXEC);
+	if (fd < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	if (op->type == USBG_IO_READ) {
+		nmb = read(fd, op->buf, op->len - 1);
+		if (nmb >= 0) {
+			op->buf[nmb] = '\0';
+			op->done = nmb;
+		} else {
+			ret = USBG_ERROR_IO;
+		}
+	} else if (op->len > 0) {
+		nmb = write(fd, op->buf, op->len);
+		if (nmb < 0)
+			ret = usbg_translate_error(errno);
+		else if (nmb != op->len)
+			ret = USBG_ERROR_IO;
+		else
+			op->done = nmb;
+	}
+
+	close(fd);
+out:
+	return ret;
+}
+
+int usbg_io_run(struct usbg_io_op *op)
+{
+	int ret;
+
+	op->done = 0;
+
+	switch (op->type) {
+	case USBG_IO_READ:
+	case USBG_IO_WRITE:
+		ret = usbg_io_rw(op);
+		break;
+	case USBG_IO_MKDIR:
+		ret = mkdirat(op->dirfd, op->name, S_IRWXU|S_IRWXG|S_IRWXO);
+		ret = ret ? usbg_translate_error(errno) : USBG_SUCCESS;
+		break;
+	case USBG_IO_RMDIR:
+	case USBG_IO_UNLINK:
+		ret = unlinkat(op->dirfd, op->name, op->type == USBG_IO_RMDIR ?
+			       AT_REMOVEDIR : 0);
+		ret = ret ? usbg_translate_error(errno) : USBG_SUCCESS;
+		break;
+	default:
+		ret = USBG_ERROR_INVALID_PARAM;
+	}
+
+	op->ret = ret;
+	return ret;
+}
+
+int usbg_io_run_all(struct usbg_io_op *ops, int count)
+{
+	int ret = USBG_SUCCESS;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		if (usbg_io_run(ops + i) != USBG_SUCCESS && ret == USBG_SUCCESS)
+			ret = ops[i].ret;
+
+	return ret;
+}
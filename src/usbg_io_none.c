@@ -0,0 +1,24 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+int usbg_io_batch(__attribute__ ((unused)) usbg_state *s,
+		  struct usbg_io_op *ops, int count)
+{
+	return usbg_io_run_all(ops, count);
+}
+
+void usbg_io_cleanup(__attribute__ ((unused)) usbg_state *s)
+{
+}
@@ -0,0 +1,337 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <liburing.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_io_uring.c
+ * @brief io_uring backend of usbg_io_batch()
+ * @details Each read or write is submitted as a hard linked chain of
+ * openat into a fixed file slot, read/write on that slot and close of it,
+ * so a file costs no additional round trip to user space. Directory
+ * operations and unlink take a single entry. If ring can't be set up or
+ * kernel lacks any of needed operations, operations are run synchronously.
+ *
+ * Each submitted entry ends with exactly one completion, so all of them
+ * are reaped before the next chunk is queued. If submission or waiting
+ * fails, entries left in the ring would complete into the next batch.
+ * The ring is then torn down, to be set up again by the next batch, and
+ * operations which haven't finished are run synchronously.
+ *
+ * Attributes of different gadgets are accessed in parallel, so only one
+ * thread at a time uses the ring, others run their batches synchronously.
+ */
+
+#define USBG_IO_RING_ENTRIES 64
+/* Each read and write needs three entries and one fixed file slot */
+#define USBG_IO_RING_SLOTS (USBG_IO_RING_ENTRIES / 3)
+
+enum {
+	USBG_IO_STAGE_OPEN = 0,
+	USBG_IO_STAGE_RW,
+	USBG_IO_STAGE_CLOSE,
+	USBG_IO_STAGE_DIR,
+};
+
+#define USBG_IO_DATA(idx, stage) (((uint64_t)(idx) << 2) | (stage))
+#define USBG_IO_DATA_IDX(data) ((data) >> 2)
+#define USBG_IO_DATA_STAGE(data) ((data) & 3)
+
+struct usbg_io_ring {
+	struct io_uring ring;
+	/* false if io_uring is not usable and we fall back to sync I/O */
+	bool ready;
+};
+
+static bool usbg_io_ring_probe(struct io_uring *ring)
+{
+	static const int needed[] = {
+		IORING_OP_OPENAT,
+		IORING_OP_READ,
+		IORING_OP_WRITE,
+		IORING_OP_CLOSE,
+		IORING_OP_MKDIRAT,
+		IORING_OP_UNLINKAT,
+	};
+	struct io_uring_probe *probe;
+	bool ret = true;
+	int i;
+
+	probe = io_uring_get_probe_ring(ring);
+	if (!probe)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(needed); ++i)
+		ret = ret && io_uring_opcode_supported(probe, needed[i]);
+
+	io_uring_free_probe(probe);
+	return ret;
+}
+
+static struct usbg_io_ring *usbg_io_ring_get(usbg_state *s)
+{
+	struct usbg_io_ring *io = s->io;
+	int ret;
+
+	if (io)
+		goto out;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		goto out;
+
+	ret = io_uring_queue_init(USBG_IO_RING_ENTRIES, &io->ring, 0);
+	if (ret < 0)
+		goto out_set;
+
+	if (!usbg_io_ring_probe(&io->ring) ||
+	    io_uring_register_files_sparse(&io->ring, USBG_IO_RING_SLOTS) < 0) {
+		io_uring_queue_exit(&io->ring);
+		goto out_set;
+	}
+
+	io->ready = true;
+out_set:
+	s->io = io;
+out:
+	return io;
+}
+
+/* Drop ring with everything what is left in it */
+static void usbg_io_ring_reset(usbg_state *s)
+{
+	struct usbg_io_ring *io = s->io;
+
+	if (io->ready)
+		io_uring_queue_exit(&io->ring);
+	free(io);
+	s->io = NULL;
+}
+
+/* Number of entries taken by operation */
+static int usbg_io_entries(struct usbg_io_op *op)
+{
+	if (op->type != USBG_IO_READ && op->type != USBG_IO_WRITE)
+		return 1;
+
+	/* Empty write only opens and closes the file */
+	if (op->type == USBG_IO_WRITE && op->len == 0)
+		return 2;
+
+	return 3;
+}
+
+static void usbg_io_prep_rw(struct io_uring *ring, struct usbg_io_op *op,
+			    int idx, int slot)
+{
+	struct io_uring_sqe *sqe;
+	int flags = op->type == USBG_IO_READ ? O_RDONLY : O_WRONLY;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_openat_direct(sqe, op->dirfd, op->name, flags, 0, slot);
+	sqe->flags |= IOSQE_IO_HARDLINK;
+	sqe->user_data = USBG_IO_DATA(idx, USBG_IO_STAGE_OPEN);
+
+	/* Writing nothing just like write(fd, buf, 0), only open the file */
+	if (op->type == USBG_IO_READ || op->len > 0) {
+		sqe = io_uring_get_sqe(ring);
+		if (op->type == USBG_IO_READ)
+			io_uring_prep_read(sqe, slot, op->buf, op->len - 1, 0);
+		else
+			io_uring_prep_write(sqe, slot, op->buf, op->len, 0);
+		sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+		sqe->user_data = USBG_IO_DATA(idx, USBG_IO_STAGE_RW);
+	}
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_close_direct(sqe, slot);
+	sqe->user_data = USBG_IO_DATA(idx, USBG_IO_STAGE_CLOSE);
+}
+
+static void usbg_io_prep_dir(struct io_uring *ring, struct usbg_io_op *op,
+			     int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (op->type == USBG_IO_MKDIR)
+		io_uring_prep_mkdirat(sqe, op->dirfd, op->name,
+				      S_IRWXU|S_IRWXG|S_IRWXO);
+	else
+		io_uring_prep_unlinkat(sqe, op->dirfd, op->name,
+				       op->type == USBG_IO_RMDIR ?
+				       AT_REMOVEDIR : 0);
+	sqe->user_data = USBG_IO_DATA(idx, USBG_IO_STAGE_DIR);
+}
+
+/* Returns true when result of operation is known */
+static bool usbg_io_complete(struct usbg_io_op *op, int stage, int res)
+{
+	switch (stage) {
+	case USBG_IO_STAGE_OPEN:
+		/* Failed open takes precedence over EBADF of following I/O */
+		if (res < 0)
+			op->ret = usbg_translate_error(-res);
+		return res < 0 || usbg_io_entries(op) == 2;
+	case USBG_IO_STAGE_RW:
+		/* Result of failed open is already known */
+		if (op->ret != USBG_SUCCESS)
+			return false;
+		if (res < 0) {
+			op->ret = op->type == USBG_IO_READ ? USBG_ERROR_IO
+				: usbg_translate_error(-res);
+		} else if (op->type == USBG_IO_READ) {
+			op->buf[res] = '\0';
+			op->done = res;
+		} else if (res != op->len) {
+			op->ret = USBG_ERROR_IO;
+		} else {
+			op->done = res;
+		}
+		return true;
+	case USBG_IO_STAGE_DIR:
+		if (res < 0)
+			op->ret = usbg_translate_error(-res);
+		return true;
+	default:
+		/* Nothing reasonable to do if close fails */
+		return false;
+	}
+}
+
+/* Called with io_lock held */
+static int usbg_io_batch_ring(usbg_state *s, struct usbg_io_op *ops, int count)
+{
+	/* Operations of current chunk whose result is known */
+	bool finished[USBG_IO_RING_ENTRIES];
+	struct usbg_io_ring *io;
+	struct io_uring_cqe *cqe;
+	int queued, slot, need;
+	int submitted, reaped;
+	int ret = USBG_SUCCESS;
+	int first, idx;
+	int i, j;
+
+	io = usbg_io_ring_get(s);
+	if (!io || !io->ready)
+		return usbg_io_run_all(ops, count);
+
+	for (i = 0; i < count; ++i) {
+		ops[i].ret = USBG_SUCCESS;
+		ops[i].done = 0;
+	}
+
+	i = 0;
+	while (i < count) {
+		first = i;
+		queued = 0;
+		slot = 0;
+
+		for (; i < count; ++i) {
+			bool rw = ops[i].type == USBG_IO_READ ||
+				ops[i].type == USBG_IO_WRITE;
+
+			need = usbg_io_entries(ops + i);
+			if (queued + need > USBG_IO_RING_ENTRIES ||
+			    (rw && slot >= USBG_IO_RING_SLOTS))
+				break;
+
+			if (rw)
+				usbg_io_prep_rw(&io->ring, ops + i, i, slot++);
+			else
+				usbg_io_prep_dir(&io->ring, ops + i, i);
+			finished[i - first] = false;
+			queued += need;
+		}
+
+		do {
+			submitted = io_uring_submit_and_wait(&io->ring, queued);
+		} while (submitted == -EINTR);
+
+		if (submitted < 0) {
+			ERROR("io_uring submission failed: %d", submitted);
+			submitted = 0;
+		}
+
+		/* Cancelled links complete too, with -ECANCELED */
+		for (reaped = 0; reaped < submitted; ++reaped) {
+			do {
+				j = io_uring_wait_cqe(&io->ring, &cqe);
+			} while (j == -EINTR);
+
+			if (j < 0) {
+				ERROR("io_uring completion failed: %d", j);
+				break;
+			}
+
+			idx = USBG_IO_DATA_IDX(cqe->user_data);
+			if (usbg_io_complete(ops + idx,
+					     USBG_IO_DATA_STAGE(cqe->user_data),
+					     cqe->res))
+				finished[idx - first] = true;
+			io_uring_cqe_seen(&io->ring, cqe);
+		}
+
+		if (reaped == queued)
+			continue;
+
+		usbg_io_ring_reset(s);
+		for (j = first; j < i; ++j)
+			if (!finished[j - first])
+				usbg_io_run(ops + j);
+		usbg_io_run_all(ops + i, count - i);
+		break;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (ops[i].ret != USBG_SUCCESS) {
+			ret = ops[i].ret;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+int usbg_io_batch(usbg_state *s, struct usbg_io_op *ops, int count)
+{
+	int ret;
+
+	/*
+	 * Single operation is not worth the submission. Ring is shared
+	 * by all threads, if it is busy the batch is run here instead of
+	 * waiting for it.
+	 */
+	if (count < 2 || pthread_mutex_trylock(&s->io_lock))
+		return usbg_io_run_all(ops, count);
+
+	ret = usbg_io_batch_ring(s, ops, count);
+	pthread_mutex_unlock(&s->io_lock);
+
+	return ret;
+}
+
+void usbg_io_cleanup(usbg_state *s)
+{
+	if (s->io)
+		usbg_io_ring_reset(s);
+}
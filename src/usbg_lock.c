@@ -0,0 +1,195 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_lock.c
+ * @brief Locking of library state
+ * @details Lookups, iteration and attribute access take the state lock
+ * shared, changes of gadgets, configs, functions and bindings take it
+ * exclusive. Public functions call each other, so each thread counts
+ * how many times it has taken the lock and only the outermost call
+ * really locks it. The count is kept in thread specific data of a key
+ * owned by the state, so a thread may hold locks of several states.
+ *
+ * Caches and open transaction of a gadget, its configs and functions
+ * are guarded by lock of the gadget, so attributes of different gadgets
+ * are read and written in parallel.
+ */
+
+/* Thread specific value of owner key is depth << 1 | exclusive */
+#define USBG_OWNER(depth, exclusive) \
+	((void *)(((uintptr_t)(depth) << 1) | (exclusive)))
+#define USBG_OWNER_DEPTH(val) ((uintptr_t)(val) >> 1)
+#define USBG_OWNER_EXCLUSIVE(val) ((uintptr_t)(val) & 1)
+
+static int usbg_recursive_mutex_init(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+	int ret;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	ret = pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return ret;
+}
+
+int usbg_lock_init(usbg_state *s)
+{
+	int ret;
+
+	ret = pthread_key_create(&s->owner, NULL);
+	if (ret)
+		goto out;
+
+	ret = pthread_rwlock_init(&s->lock, NULL);
+	if (ret)
+		goto out_key;
+
+	/* Object data is touched from inside of other locked functions */
+	ret = usbg_recursive_mutex_init(&s->obj_lock);
+	if (ret)
+		goto out_rwlock;
+
+	ret = pthread_mutex_init(&s->io_lock, NULL);
+	if (ret)
+		goto out_obj_lock;
+
+	return USBG_SUCCESS;
+
+out_obj_lock:
+	pthread_mutex_destroy(&s->obj_lock);
+out_rwlock:
+	pthread_rwlock_destroy(&s->lock);
+out_key:
+	pthread_key_delete(s->owner);
+out:
+	return usbg_translate_error(ret);
+}
+
+void usbg_lock_destroy(usbg_state *s)
+{
+	pthread_mutex_destroy(&s->io_lock);
+	pthread_mutex_destroy(&s->obj_lock);
+	pthread_rwlock_destroy(&s->lock);
+	pthread_key_delete(s->owner);
+}
+
+static bool usbg_lock_nested(usbg_state *s)
+{
+	void *val = pthread_getspecific(s->owner);
+
+	if (!val)
+		return false;
+
+	pthread_setspecific(s->owner, USBG_OWNER(USBG_OWNER_DEPTH(val) + 1,
+						 USBG_OWNER_EXCLUSIVE(val)));
+	return true;
+}
+
+void usbg_lock_shared(usbg_state *s)
+{
+	if (usbg_lock_nested(s))
+		return;
+
+	pthread_rwlock_rdlock(&s->lock);
+	pthread_setspecific(s->owner, USBG_OWNER(1, false));
+}
+
+int usbg_lock_exclusive(usbg_state *s)
+{
+	void *val = pthread_getspecific(s->owner);
+
+	/* Shared lock can't be upgraded without a deadlock */
+	if (val && !USBG_OWNER_EXCLUSIVE(val))
+		return USBG_ERROR_BUSY;
+
+	if (usbg_lock_nested(s))
+		return USBG_SUCCESS;
+
+	pthread_rwlock_wrlock(&s->lock);
+	pthread_setspecific(s->owner, USBG_OWNER(1, true));
+	return USBG_SUCCESS;
+}
+
+void usbg_unlock(usbg_state *s)
+{
+	void *val = pthread_getspecific(s->owner);
+
+	if (USBG_OWNER_DEPTH(val) > 1) {
+		pthread_setspecific(s->owner,
+				    USBG_OWNER(USBG_OWNER_DEPTH(val) - 1,
+					       USBG_OWNER_EXCLUSIVE(val)));
+		return;
+	}
+
+	pthread_setspecific(s->owner, NULL);
+	pthread_rwlock_unlock(&s->lock);
+}
+
+void usbg_lock_obj(usbg_state *s)
+{
+	usbg_lock_shared(s);
+	pthread_mutex_lock(&s->obj_lock);
+}
+
+void usbg_unlock_obj(usbg_state *s)
+{
+	pthread_mutex_unlock(&s->obj_lock);
+	usbg_unlock(s);
+}
+
+int usbg_attr_lock_init(usbg_gadget *g)
+{
+	int ret;
+
+	/* Attribute functions call each other */
+	ret = usbg_recursive_mutex_init(&g->attr_lock);
+	return ret ? usbg_translate_error(ret) : USBG_SUCCESS;
+}
+
+void usbg_attr_lock_destroy(usbg_gadget *g)
+{
+	pthread_mutex_destroy(&g->attr_lock);
+}
+
+void usbg_lock_attrs(usbg_gadget *g)
+{
+	usbg_lock_shared(g->parent);
+	pthread_mutex_lock(&g->attr_lock);
+}
+
+void usbg_unlock_attrs(usbg_gadget *g)
+{
+	pthread_mutex_unlock(&g->attr_lock);
+	usbg_unlock(g->parent);
+}
+
+void usbg_lock_state(usbg_state *s)
+{
+	if (s)
+		usbg_lock_shared(s);
+}
+
+void usbg_unlock_state(usbg_state *s)
+{
+	if (s)
+		usbg_unlock(s);
+}
@@ -0,0 +1,166 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <string.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_order.c
+ * @brief Ordered index of library objects
+ * @details AVL tree of nodes embedded in objects, keyed by object
+ * name. It is used only to find where a new object belongs in its
+ * parent's sorted list, iteration still walks the list. Names are
+ * unique among children of one parent, so a node is always found
+ * by its key. Depth of the tree is logarithmic, so are recursive
+ * add and delete.
+ */
+
+static inline int usbg_onode_height(struct usbg_onode *n)
+{
+	return n ? n->height : 0;
+}
+
+static void usbg_onode_update(struct usbg_onode *n)
+{
+	int hl = usbg_onode_height(n->left);
+	int hr = usbg_onode_height(n->right);
+
+	n->height = (hl > hr ? hl : hr) + 1;
+}
+
+static struct usbg_onode *usbg_order_rotate_right(struct usbg_onode *n)
+{
+	struct usbg_onode *l = n->left;
+
+	n->left = l->right;
+	l->right = n;
+	usbg_onode_update(n);
+	usbg_onode_update(l);
+	return l;
+}
+
+static struct usbg_onode *usbg_order_rotate_left(struct usbg_onode *n)
+{
+	struct usbg_onode *r = n->right;
+
+	n->right = r->left;
+	r->left = n;
+	usbg_onode_update(n);
+	usbg_onode_update(r);
+	return r;
+}
+
+static struct usbg_onode *usbg_order_balance(struct usbg_onode *n)
+{
+	int diff;
+
+	usbg_onode_update(n);
+	diff = usbg_onode_height(n->left) - usbg_onode_height(n->right);
+
+	if (diff > 1) {
+		if (usbg_onode_height(n->left->left) <
+		    usbg_onode_height(n->left->right))
+			n->left = usbg_order_rotate_left(n->left);
+		return usbg_order_rotate_right(n);
+	}
+
+	if (diff < -1) {
+		if (usbg_onode_height(n->right->right) <
+		    usbg_onode_height(n->right->left))
+			n->right = usbg_order_rotate_right(n->right);
+		return usbg_order_rotate_left(n);
+	}
+
+	return n;
+}
+
+static struct usbg_onode *usbg_order_insert(struct usbg_onode *root,
+		struct usbg_onode *n, struct usbg_onode **next)
+{
+	if (!root)
+		return n;
+
+	if (strcmp(n->key, root->key) < 0) {
+		/* Last node at which we turn left follows the new one */
+		*next = root;
+		root->left = usbg_order_insert(root->left, n, next);
+	} else {
+		root->right = usbg_order_insert(root->right, n, next);
+	}
+
+	return usbg_order_balance(root);
+}
+
+static struct usbg_onode *usbg_order_pop_min(struct usbg_onode *root,
+		struct usbg_onode **min)
+{
+	if (!root->left) {
+		*min = root;
+		return root->right;
+	}
+
+	root->left = usbg_order_pop_min(root->left, min);
+	return usbg_order_balance(root);
+}
+
+static struct usbg_onode *usbg_order_remove(struct usbg_onode *root,
+		struct usbg_onode *n)
+{
+	struct usbg_onode *min, *right;
+
+	/* Node is not in this tree */
+	if (!root)
+		return NULL;
+
+	if (root == n) {
+		if (!n->right)
+			return n->left;
+
+		right = usbg_order_pop_min(n->right, &min);
+		min->left = n->left;
+		min->right = right;
+		return usbg_order_balance(min);
+	}
+
+	if (strcmp(n->key, root->key) < 0)
+		root->left = usbg_order_remove(root->left, n);
+	else
+		root->right = usbg_order_remove(root->right, n);
+
+	return usbg_order_balance(root);
+}
+
+void usbg_order_init(struct usbg_order *o)
+{
+	o->root = NULL;
+}
+
+struct usbg_onode *usbg_order_add(struct usbg_order *o, struct usbg_onode *n,
+		const char *key)
+{
+	struct usbg_onode *next = NULL;
+
+	n->left = NULL;
+	n->right = NULL;
+	n->key = key;
+	n->height = 1;
+	o->root = usbg_order_insert(o->root, n, &next);
+
+	return next;
+}
+
+void usbg_order_del(struct usbg_order *o, struct usbg_onode *n)
+{
+	o->root = usbg_order_remove(o->root, n);
+}
@@ -0,0 +1,649 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_reconcile.c
+ * @brief Bringing gadget to desired state
+ * @details Gadget is compared with its description to make a plan
+ * of operations, which is then executed in order. Objects to be
+ * removed or modified are remembered in the plan. Objects to be
+ * created are only described there, bindings are resolved when they
+ * are added because their config or function may not exist yet.
+ */
+
+struct usbg_step {
+	usbg_op op;
+	/* Existing object to be removed or modified */
+	void *obj;
+	/* Description of object to be created or modified */
+	const void *desc;
+	/* Config of binding to be added */
+	const usbg_config_desc *cdesc;
+};
+
+struct usbg_plan {
+	struct usbg_step *steps;
+	int count;
+	int size;
+};
+
+static int usbg_plan_add(struct usbg_plan *p, usbg_op_type type, void *obj,
+			 const void *desc, const char *fmt, ...)
+{
+	struct usbg_step *steps;
+	struct usbg_step *st;
+	va_list args;
+
+	if (p->count == p->size) {
+		p->size = p->size ? p->size * 2 : 16;
+		steps = realloc(p->steps, p->size * sizeof(*steps));
+		if (!steps)
+			return USBG_ERROR_NO_MEM;
+		p->steps = steps;
+	}
+
+	st = p->steps + p->count++;
+	st->op.type = type;
+	st->obj = obj;
+	st->desc = desc;
+	st->cdesc = NULL;
+
+	va_start(args, fmt);
+	vsnprintf(st->op.name, sizeof(st->op.name), fmt, args);
+	va_end(args);
+
+	return USBG_SUCCESS;
+}
+
+static inline const char *usbg_config_desc_label(const usbg_config_desc *cd)
+{
+	return cd->label ? cd->label : DEFAULT_CONFIG_LABEL;
+}
+
+static const usbg_config_desc *usbg_find_config_desc(
+		const usbg_gadget_desc *desc, usbg_config *c)
+{
+	int i;
+
+	for (i = 0; i < desc->nconfigs; ++i) {
+		if (desc->configs[i].id == c->id &&
+		    !strcmp(usbg_config_desc_label(desc->configs + i),
+			    c->label))
+			return desc->configs + i;
+	}
+
+	return NULL;
+}
+
+static const usbg_function_desc *usbg_find_function_desc(
+		const usbg_gadget_desc *desc, usbg_function_type type,
+		const char *instance)
+{
+	int i;
+
+	for (i = 0; i < desc->nfunctions; ++i) {
+		if (desc->functions[i].type == type &&
+		    !strcmp(desc->functions[i].instance, instance))
+			return desc->functions + i;
+	}
+
+	return NULL;
+}
+
+/* Binding takes function name if it hasn't been given any */
+static void usbg_binding_desc_name(const usbg_binding_desc *bd, char *buf,
+				   size_t size)
+{
+	if (bd->name)
+		snprintf(buf, size, "%s", bd->name);
+	else
+		snprintf(buf, size, "%s.%s",
+			 usbg_get_function_type_str(bd->type), bd->instance);
+}
+
+static bool usbg_binding_matches(usbg_binding *b, const usbg_binding_desc *bd)
+{
+	char name[USBG_MAX_STR_LENGTH];
+
+	usbg_binding_desc_name(bd, name, sizeof(name));
+
+	return !strcmp(b->name, name) && b->target->type == bd->type &&
+		!strcmp(b->target->instance, bd->instance);
+}
+
+static bool usbg_str_differ(const char *a, const char *b)
+{
+	return strcmp(a ? a : "", b ? b : "");
+}
+
+static bool usbg_gadget_attrs_differ(const usbg_gadget_attrs *a,
+				     const usbg_gadget_attrs *b)
+{
+	return a->bcdUSB != b->bcdUSB ||
+		a->bDeviceClass != b->bDeviceClass ||
+		a->bDeviceSubClass != b->bDeviceSubClass ||
+		a->bDeviceProtocol != b->bDeviceProtocol ||
+		a->bMaxPacketSize0 != b->bMaxPacketSize0 ||
+		a->idVendor != b->idVendor ||
+		a->idProduct != b->idProduct ||
+		a->bcdDevice != b->bcdDevice;
+}
+
+static bool usbg_gadget_strs_differ(const usbg_gadget_strs *a,
+				    const usbg_gadget_strs *b)
+{
+	return strcmp(a->str_ser, b->str_ser) ||
+		strcmp(a->str_mnf, b->str_mnf) ||
+		strcmp(a->str_prd, b->str_prd);
+}
+
+static bool usbg_ms_attrs_differ(const usbg_f_ms_attrs *cur,
+				 const usbg_f_ms_attrs *want)
+{
+	usbg_f_ms_lun_attrs *a, *b;
+	int i;
+
+	if (cur->stall != want->stall)
+		return true;
+
+	/* Luns are left as they are if they are not given */
+	if (!want->luns || want->nluns <= 0)
+		return false;
+
+	if (cur->nluns != want->nluns)
+		return true;
+
+	for (i = 0; i < want->nluns; ++i) {
+		a = cur->luns[i];
+		b = want->luns[i];
+		if (!b)
+			continue;
+
+		if (a->cdrom != b->cdrom || a->ro != b->ro ||
+		    a->nofua != b->nofua || a->removable != b->removable ||
+		    usbg_str_differ(a->filename, b->filename))
+			return true;
+	}
+
+	return false;
+}
+
+/* Read only and virtual attributes are not compared */
+static bool usbg_function_attrs_differ(const usbg_function_attrs *cur,
+				       const usbg_function_attrs *want)
+{
+	const usbg_f_attrs *a = &cur->attrs;
+	const usbg_f_attrs *b = &want->attrs;
+
+	switch (cur->header.attrs_type) {
+	case USBG_F_ATTRS_NET:
+		return memcmp(&a->net.dev_addr, &b->net.dev_addr,
+			      sizeof(a->net.dev_addr)) ||
+			memcmp(&a->net.host_addr, &b->net.host_addr,
+			       sizeof(a->net.host_addr)) ||
+			a->net.qmult != b->net.qmult;
+	case USBG_F_ATTRS_MS:
+		return usbg_ms_attrs_differ(&a->ms, &b->ms);
+	case USBG_F_ATTRS_MIDI:
+		return a->midi.index != b->midi.index ||
+			usbg_str_differ(a->midi.id, b->midi.id) ||
+			a->midi.in_ports != b->midi.in_ports ||
+			a->midi.out_ports != b->midi.out_ports ||
+			a->midi.buflen != b->midi.buflen ||
+			a->midi.qlen != b->midi.qlen;
+	case USBG_F_ATTRS_LOOPBACK:
+		return a->loopback.buflen != b->loopback.buflen ||
+			a->loopback.qlen != b->loopback.qlen;
+	default:
+		return false;
+	}
+}
+
+/* Bindings, configs and functions which are not described */
+static int usbg_plan_removals(usbg_gadget *g, const usbg_gadget_desc *desc,
+			      struct usbg_plan *p)
+{
+	const usbg_config_desc *cd;
+	usbg_config *c;
+	usbg_binding *b;
+	usbg_function *f;
+	int ret = USBG_SUCCESS;
+	int i;
+
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		cd = usbg_find_config_desc(desc, c);
+		if (!cd) {
+			/* Its bindings are removed together with it */
+			ret = usbg_plan_add(p, USBG_OP_RM_CONFIG, c, NULL,
+					    "%s", c->name);
+			if (ret != USBG_SUCCESS)
+				goto out;
+			continue;
+		}
+
+		TAILQ_FOREACH(b, &c->bindings, bnode) {
+			for (i = 0; i < cd->nbindings; ++i) {
+				if (usbg_binding_matches(b, cd->bindings + i))
+					break;
+			}
+			if (i < cd->nbindings)
+				continue;
+
+			ret = usbg_plan_add(p, USBG_OP_RM_BINDING, b, NULL,
+					    "%s/%s", c->name, b->name);
+			if (ret != USBG_SUCCESS)
+				goto out;
+		}
+	}
+
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		if (usbg_find_function_desc(desc, f->type, f->instance))
+			continue;
+
+		ret = usbg_plan_add(p, USBG_OP_RM_FUNCTION, f, NULL,
+				    "%s", f->name);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+out:
+	return ret;
+}
+
+static int usbg_plan_gadget(usbg_gadget *g, const usbg_gadget_desc *desc,
+			    struct usbg_plan *p)
+{
+	usbg_gadget_attrs attrs;
+	usbg_gadget_strs strs;
+	int ret = USBG_SUCCESS;
+
+	if (desc->attrs) {
+		ret = usbg_get_gadget_attrs(g, &attrs);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		if (usbg_gadget_attrs_differ(&attrs, desc->attrs))
+			ret = usbg_plan_add(p, USBG_OP_SET_GADGET_ATTRS, g,
+					    desc->attrs, "%s", g->name);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	/* Strings may not exist yet for this language */
+	if (desc->strs &&
+	    (usbg_get_gadget_strs(g, LANG_US_ENG, &strs) != USBG_SUCCESS ||
+	     usbg_gadget_strs_differ(&strs, desc->strs)))
+		ret = usbg_plan_add(p, USBG_OP_SET_GADGET_STRS, g, desc->strs,
+				    "%s", g->name);
+
+out:
+	return ret;
+}
+
+static int usbg_plan_functions(usbg_gadget *g, const usbg_gadget_desc *desc,
+			       struct usbg_plan *p)
+{
+	const usbg_function_desc *fd;
+	usbg_function_attrs attrs;
+	usbg_function *f;
+	bool differ;
+	int ret = USBG_SUCCESS;
+	int i;
+
+	for (i = 0; i < desc->nfunctions; ++i) {
+		fd = desc->functions + i;
+		f = usbg_get_function(g, fd->type, fd->instance);
+		if (!f) {
+			ret = usbg_plan_add(p, USBG_OP_CREATE_FUNCTION, NULL, fd,
+					    "%s.%s",
+					    usbg_get_function_type_str(fd->type),
+					    fd->instance);
+			if (ret != USBG_SUCCESS)
+				break;
+			continue;
+		}
+
+		if (!fd->attrs)
+			continue;
+
+		ret = usbg_get_function_attrs(f, &attrs);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		differ = usbg_function_attrs_differ(&attrs, fd->attrs);
+		usbg_cleanup_function_attrs(&attrs);
+		if (!differ)
+			continue;
+
+		ret = usbg_plan_add(p, USBG_OP_SET_FUNCTION_ATTRS, f, fd,
+				    "%s", f->name);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_plan_config(usbg_gadget *g, const usbg_config_desc *cd,
+			    struct usbg_plan *p)
+{
+	usbg_config *c;
+	usbg_config_attrs attrs;
+	usbg_config_strs strs;
+	int ret = USBG_SUCCESS;
+
+	c = usbg_get_config(g, cd->id, usbg_config_desc_label(cd));
+	if (!c)
+		return usbg_plan_add(p, USBG_OP_CREATE_CONFIG, NULL, cd,
+				     "%s.%d", usbg_config_desc_label(cd),
+				     cd->id);
+
+	if (cd->attrs) {
+		ret = usbg_get_config_attrs(c, &attrs);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		if (attrs.bMaxPower != cd->attrs->bMaxPower ||
+		    attrs.bmAttributes != cd->attrs->bmAttributes)
+			ret = usbg_plan_add(p, USBG_OP_SET_CONFIG_ATTRS, c, cd,
+					    "%s", c->name);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	if (cd->strs &&
+	    (usbg_get_config_strs(c, LANG_US_ENG, &strs) != USBG_SUCCESS ||
+	     strcmp(strs.configuration, cd->strs->configuration)))
+		ret = usbg_plan_add(p, USBG_OP_SET_CONFIG_STRS, c, cd,
+				    "%s", c->name);
+
+out:
+	return ret;
+}
+
+static int usbg_plan_bindings(usbg_gadget *g, const usbg_gadget_desc *desc,
+			      const usbg_config_desc *cd, struct usbg_plan *p)
+{
+	const usbg_binding_desc *bd;
+	usbg_config *c;
+	usbg_binding *b = NULL;
+	char name[USBG_MAX_STR_LENGTH];
+	int ret = USBG_SUCCESS;
+	int i;
+
+	c = usbg_get_config(g, cd->id, usbg_config_desc_label(cd));
+
+	for (i = 0; i < cd->nbindings; ++i) {
+		bd = cd->bindings + i;
+		if (!usbg_find_function_desc(desc, bd->type, bd->instance)) {
+			ERROR("binding to function which is not desired\n");
+			ret = USBG_ERROR_INVALID_PARAM;
+			break;
+		}
+
+		if (c) {
+			TAILQ_FOREACH(b, &c->bindings, bnode) {
+				if (usbg_binding_matches(b, bd))
+					break;
+			}
+			if (b)
+				continue;
+		}
+
+		usbg_binding_desc_name(bd, name, sizeof(name));
+		ret = usbg_plan_add(p, USBG_OP_ADD_BINDING, NULL, bd, "%s.%d/%s",
+				    usbg_config_desc_label(cd), cd->id, name);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		p->steps[p->count - 1].cdesc = cd;
+	}
+
+	return ret;
+}
+
+static int usbg_plan_gadget_content(usbg_gadget *g,
+				    const usbg_gadget_desc *desc,
+				    struct usbg_plan *p)
+{
+	int ret;
+	int i;
+
+	ret = usbg_plan_removals(g, desc, p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_plan_gadget(g, desc, p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_plan_functions(g, desc, p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	for (i = 0; i < desc->nconfigs && ret == USBG_SUCCESS; ++i)
+		ret = usbg_plan_config(g, desc->configs + i, p);
+
+	for (i = 0; i < desc->nconfigs && ret == USBG_SUCCESS; ++i)
+		ret = usbg_plan_bindings(g, desc, desc->configs + i, p);
+
+out:
+	return ret;
+}
+
+/* Attributes and strings of gadget may be changed while it is enabled */
+static bool usbg_plan_needs_disable(struct usbg_plan *p)
+{
+	int i;
+
+	for (i = 0; i < p->count; ++i) {
+		if (p->steps[i].op.type != USBG_OP_SET_GADGET_ATTRS &&
+		    p->steps[i].op.type != USBG_OP_SET_GADGET_STRS)
+			return true;
+	}
+
+	return false;
+}
+
+static int usbg_plan_wrap_disable(usbg_gadget *g, struct usbg_plan *p)
+{
+	struct usbg_step disable;
+	usbg_udc *u;
+	int ret;
+
+	u = usbg_get_gadget_udc(g);
+	if (!u || !usbg_plan_needs_disable(p))
+		return USBG_SUCCESS;
+
+	ret = usbg_plan_add(p, USBG_OP_ENABLE_GADGET, u, NULL, "%s", g->name);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_plan_add(p, USBG_OP_DISABLE_GADGET, NULL, NULL, "%s",
+			    g->name);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	/* Move disable in front of everything else */
+	disable = p->steps[p->count - 1];
+	memmove(p->steps + 1, p->steps, (p->count - 1) * sizeof(*p->steps));
+	p->steps[0] = disable;
+
+	return USBG_SUCCESS;
+}
+
+/* Only values which differ are written */
+static int usbg_run_gadget_step(usbg_gadget *g, struct usbg_step *st)
+{
+	int ret;
+
+	ret = usbg_begin_gadget_transaction(g);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (st->op.type == USBG_OP_SET_GADGET_ATTRS)
+		ret = usbg_set_gadget_attrs(g, st->desc);
+	else
+		ret = usbg_set_gadget_strs(g, LANG_US_ENG, st->desc);
+
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_commit_gadget_transaction(g);
+	} else {
+		usbg_abort_gadget_transaction(g);
+	}
+
+	return ret;
+}
+
+static int usbg_run_add_binding(usbg_gadget *g, struct usbg_step *st)
+{
+	const usbg_binding_desc *bd = st->desc;
+	usbg_config *c;
+	usbg_function *f;
+
+	c = usbg_get_config(g, st->cdesc->id, usbg_config_desc_label(st->cdesc));
+	f = usbg_get_function(g, bd->type, bd->instance);
+	if (!c || !f)
+		return USBG_ERROR_NOT_FOUND;
+
+	return usbg_add_config_function(c, bd->name, f);
+}
+
+static int usbg_run_step(usbg_gadget *g, struct usbg_step *st)
+{
+	const usbg_function_desc *fd = st->desc;
+	const usbg_config_desc *cd = st->desc;
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+
+	switch (st->op.type) {
+	case USBG_OP_DISABLE_GADGET:
+		ret = usbg_disable_gadget(g);
+		break;
+	case USBG_OP_RM_BINDING:
+		ret = usbg_rm_binding(st->obj);
+		break;
+	case USBG_OP_RM_CONFIG:
+		ret = usbg_rm_config(st->obj, USBG_RM_RECURSE);
+		break;
+	case USBG_OP_RM_FUNCTION:
+		ret = usbg_rm_function(st->obj, USBG_RM_RECURSE);
+		break;
+	case USBG_OP_SET_GADGET_ATTRS:
+	case USBG_OP_SET_GADGET_STRS:
+		ret = usbg_run_gadget_step(g, st);
+		break;
+	case USBG_OP_CREATE_FUNCTION:
+		ret = usbg_create_function(g, fd->type, fd->instance, fd->attrs,
+					   &f);
+		break;
+	case USBG_OP_SET_FUNCTION_ATTRS:
+		ret = usbg_set_function_attrs(st->obj, fd->attrs);
+		break;
+	case USBG_OP_CREATE_CONFIG:
+		ret = usbg_create_config(g, cd->id, usbg_config_desc_label(cd),
+					 cd->attrs, cd->strs, &c);
+		break;
+	case USBG_OP_SET_CONFIG_ATTRS:
+		ret = usbg_set_config_attrs(st->obj, cd->attrs);
+		break;
+	case USBG_OP_SET_CONFIG_STRS:
+		ret = usbg_set_config_strs(st->obj, LANG_US_ENG, cd->strs);
+		break;
+	case USBG_OP_ADD_BINDING:
+		ret = usbg_run_add_binding(g, st);
+		break;
+	case USBG_OP_ENABLE_GADGET:
+		ret = usbg_enable_gadget(g, st->obj);
+		break;
+	default:
+		ret = USBG_ERROR_INVALID_PARAM;
+		break;
+	}
+
+	return ret;
+}
+
+int usbg_reconcile_gadget(usbg_gadget *g, const usbg_gadget_desc *desc,
+		int opts, usbg_op **ops)
+{
+	struct usbg_plan p = {
+		.steps = NULL,
+		.count = 0,
+		.size = 0,
+	};
+	int ret;
+	int i;
+
+	if (!g || !desc)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (ops)
+		*ops = NULL;
+
+	/* Plan must not be outdated by other thread before it's run */
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_parse_lazy_gadget(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_plan_gadget_content(g, desc, &p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_plan_wrap_disable(g, &p);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	if (ops) {
+		*ops = malloc((p.count ? p.count : 1) * sizeof(**ops));
+		if (!*ops) {
+			ret = USBG_ERROR_NO_MEM;
+			goto out;
+		}
+
+		for (i = 0; i < p.count; ++i)
+			(*ops)[i] = p.steps[i].op;
+	}
+
+	if (opts & USBG_RECONCILE_DRY_RUN)
+		goto out;
+
+	for (i = 0; i < p.count && ret == USBG_SUCCESS; ++i) {
+		ret = usbg_run_step(g, p.steps + i);
+		if (ret != USBG_SUCCESS)
+			ERROR("%s failed on %s\n", usbg_strerror(ret),
+			      p.steps[i].op.name);
+	}
+
+out:
+	if (ret != USBG_SUCCESS && ops) {
+		free(*ops);
+		*ops = NULL;
+	}
+	free(p.steps);
+	usbg_unlock(g->parent);
+	return ret == USBG_SUCCESS ? p.count : ret;
+}
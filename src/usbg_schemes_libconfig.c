@@ -11,6 +11,8 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libconfig.h>
@@ -95,7 +97,7 @@ static int usbg_export_config_bindings(usbg_config *c, config_setting_t *root)
 	return ret;
 }
 
-static int usbg_export_config_strs_lang(usbg_config *c, char *lang_str,
+static int usbg_export_config_strs_lang(usbg_config *c, const char *lang_str,
 					config_setting_t *root)
 {
 	config_setting_t *node;
@@ -151,7 +153,7 @@ static int usbg_export_config_strings(usbg_config *c, config_setting_t *root)
 	int nmb, i;
 	int ret = USBG_ERROR_NO_MEM;
 	char spath[USBG_MAX_PATH_LENGTH];
-	struct dirent **dent;
+	struct usbg_dir dir;
 
 	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", c->path,
 		       c->name, STRINGS_DIR);
@@ -160,29 +162,27 @@ static int usbg_export_config_strings(usbg_config *c, config_setting_t *root)
 		goto out;
 	}
 
-	nmb = scandir(spath, &dent, file_select, alphasort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+	usbg_ret = usbg_read_dir(AT_FDCWD, spath, file_select, usbg_dirent_cmp,
+				 &dir);
+	if (usbg_ret != USBG_SUCCESS) {
+		ret = usbg_ret;
 		goto out;
 	}
 
-	for (i = 0; i < nmb; ++i) {
+	for (i = 0; i < dir.n; ++i) {
 		node = config_setting_add(root, NULL, CONFIG_TYPE_GROUP);
-		if (!node)
-			goto out;
+		if (!node) {
+			usbg_ret = USBG_ERROR_NO_MEM;
+			break;
+		}
 
-		usbg_ret = usbg_export_config_strs_lang(c, dent[i]->d_name,
+		usbg_ret = usbg_export_config_strs_lang(c, dir.ents[i].name,
 							node);
 		if (usbg_ret != USBG_SUCCESS)
 			break;
-
-		free(dent[i]);
 	}
-	/* This loop will be executed only if error occurred in previous one */
-	for (; i < nmb; ++i)
-		free(dent[i]);
 
-	free(dent);
+	usbg_release_dir(&dir);
 	ret = usbg_ret;
 out:
 	return ret;
@@ -719,7 +719,7 @@ static int usbg_export_gadget_strings(usbg_gadget *g, config_setting_t *root)
 	int nmb, i;
 	int ret = USBG_ERROR_NO_MEM;
 	char spath[USBG_MAX_PATH_LENGTH];
-	struct dirent **dent;
+	struct usbg_dir dir;
 
 	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", g->path,
 		       g->name, STRINGS_DIR);
@@ -728,29 +728,27 @@ static int usbg_export_gadget_strings(usbg_gadget *g, config_setting_t *root)
 		goto out;
 	}
 
-	nmb = scandir(spath, &dent, file_select, alphasort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+	usbg_ret = usbg_read_dir(AT_FDCWD, spath, file_select, usbg_dirent_cmp,
+				 &dir);
+	if (usbg_ret != USBG_SUCCESS) {
+		ret = usbg_ret;
 		goto out;
 	}
 
-	for (i = 0; i < nmb; ++i) {
+	for (i = 0; i < dir.n; ++i) {
 		node = config_setting_add(root, NULL, CONFIG_TYPE_GROUP);
-		if (!node)
+		if (!node) {
+			usbg_ret = USBG_ERROR_NO_MEM;
 			break;
+		}
 
-		usbg_ret = usbg_export_gadget_strs_lang(g, dent[i]->d_name,
+		usbg_ret = usbg_export_gadget_strs_lang(g, dir.ents[i].name,
 							node);
 		if (usbg_ret != USBG_SUCCESS)
 			break;
-
-		free(dent[i]);
 	}
-	/* This loop will be executed only if error occurred in previous one */
-	for (; i < nmb; ++i)
-		free(dent[i]);
 
-	free(dent);
+	usbg_release_dir(&dir);
 	ret = usbg_ret;
 out:
 	return ret;
@@ -811,6 +809,13 @@ static int usbg_export_gadget_prep(usbg_gadget *g, config_setting_t *root)
 	/* We don't export name tag because name should be given during
 	 * loading of gadget */
 
+	/* Functions and configs of lazily parsed gadget may be unknown yet */
+	usbg_ret = usbg_parse_lazy_gadget(g);
+	if (usbg_ret) {
+		ret = usbg_ret;
+		goto out;
+	}
+
 	node = config_setting_add(root, USBG_ATTRS_TAG, CONFIG_TYPE_GROUP);
 	if (!node)
 		goto out;
@@ -873,7 +878,9 @@ int usbg_export_function(usbg_function *f, FILE *stream)
 	/* Always successful */
 	root = config_root_setting(&cfg);
 
+	usbg_lock_shared(f->parent->parent);
 	ret = usbg_export_function_prep(f, root);
+	usbg_unlock(f->parent->parent);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -900,7 +907,9 @@ int usbg_export_config(usbg_config *c, FILE *stream)
 	/* Always successful */
 	root = config_root_setting(&cfg);
 
+	usbg_lock_shared(c->parent->parent);
 	ret = usbg_export_config_prep(c, root);
+	usbg_unlock(c->parent->parent);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -927,7 +936,9 @@ int usbg_export_gadget(usbg_gadget *g, FILE *stream)
 	/* Always successful */
 	root = config_root_setting(&cfg);
 
+	usbg_lock_shared(g->parent);
 	ret = usbg_export_gadget_prep(g, root);
+	usbg_unlock(g->parent);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -973,14 +984,85 @@ out:
 	return ret;
 }
 
-static void usbg_set_failed_import(config_t **to_set, config_t *failed)
+/*
+ * Each thread keeps its last failed import together with the gadget
+ * or state it has been done on, until its next import.
+ */
+struct usbg_failed_import {
+	const void *owner;
+	config_t *cfg;
+};
+
+static pthread_key_t usbg_failed_import_key;
+static pthread_once_t usbg_failed_import_once = PTHREAD_ONCE_INIT;
+
+static void usbg_free_failed_import(void *data)
+{
+	struct usbg_failed_import *fi = data;
+
+	if (fi->cfg) {
+		config_destroy(fi->cfg);
+		free(fi->cfg);
+	}
+	free(fi);
+}
+
+static void usbg_failed_import_key_init(void)
+{
+	pthread_key_create(&usbg_failed_import_key, usbg_free_failed_import);
+}
+
+static struct usbg_failed_import *usbg_get_failed_import_slot(void)
 {
-	if (*to_set != NULL) {
-		config_destroy(*to_set);
-		free(*to_set);
+	struct usbg_failed_import *fi;
+
+	pthread_once(&usbg_failed_import_once, usbg_failed_import_key_init);
+	fi = pthread_getspecific(usbg_failed_import_key);
+	if (!fi) {
+		fi = calloc(1, sizeof(*fi));
+		if (fi && pthread_setspecific(usbg_failed_import_key, fi)) {
+			free(fi);
+			fi = NULL;
+		}
+	}
+
+	return fi;
+}
+
+static void usbg_set_failed_import(const void *owner, config_t *failed)
+{
+	struct usbg_failed_import *fi;
+
+	fi = usbg_get_failed_import_slot();
+	if (!fi) {
+		/* Error details are lost but import result is still valid */
+		if (failed) {
+			config_destroy(failed);
+			free(failed);
+		}
+		return;
+	}
+
+	if (fi->cfg) {
+		config_destroy(fi->cfg);
+		free(fi->cfg);
 	}
 
-	*to_set = failed;
+	fi->owner = owner;
+	fi->cfg = failed;
+}
+
+static config_t *usbg_get_failed_import(const void *owner)
+{
+	struct usbg_failed_import *fi;
+
+	if (!owner)
+		return NULL;
+
+	pthread_once(&usbg_failed_import_once, usbg_failed_import_key_init);
+	fi = pthread_getspecific(usbg_failed_import_key);
+
+	return fi && fi->owner == owner ? fi->cfg : NULL;
 }
 
 static int usbg_import_f_net_attrs(config_setting_t *root, usbg_function *f)
@@ -1797,11 +1879,15 @@ static int usbg_import_gadget_functions(config_setting_t *root, usbg_gadget *g)
 			break;
 		}
 
-		f->label = strdup(label);
+		/* Label is freed together with function */
+		f->label = usbg_arena_alloc(&g->parent->arena,
+					    strlen(label) + 1);
 		if (!f->label) {
 			ret = USBG_ERROR_NO_MEM;
 			break;
 		}
+
+		strcpy(f->label, label);
 	}
 
 	return ret;
@@ -2021,7 +2107,7 @@ int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
 
 	cfg_ret = config_read(cfg, stream);
 	if (cfg_ret != CONFIG_TRUE) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
+		usbg_set_failed_import(g, cfg);
 		ret = USBG_ERROR_INVALID_FORMAT;
 		goto out;
 	}
@@ -2029,9 +2115,13 @@ int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
 	/* Always successful */
 	root = config_root_setting(cfg);
 
-	ret = usbg_import_function_run(g, root, instance, &newf);
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_import_function_run(g, root, instance, &newf);
+		usbg_unlock(g->parent);
+	}
 	if (ret != USBG_SUCCESS) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
+		usbg_set_failed_import(g, cfg);
 		goto out;
 	}
 
@@ -2041,7 +2131,7 @@ int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
 	config_destroy(cfg);
 	free(cfg);
 	/* Clean last error */
-	usbg_set_failed_import(&g->last_failed_import, NULL);
+	usbg_set_failed_import(g, NULL);
 out:
 	return ret;
 
@@ -2065,7 +2155,7 @@ int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
 
 	cfg_ret = config_read(cfg, stream);
 	if (cfg_ret != CONFIG_TRUE) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
+		usbg_set_failed_import(g, cfg);
 		ret = USBG_ERROR_INVALID_FORMAT;
 		goto out;
 	}
@@ -2073,9 +2163,13 @@ int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
 	/* Always successful */
 	root = config_root_setting(cfg);
 
-	ret = usbg_import_config_run(g, root, id, &newc);
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_import_config_run(g, root, id, &newc);
+		usbg_unlock(g->parent);
+	}
 	if (ret != USBG_SUCCESS) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
+		usbg_set_failed_import(g, cfg);
 		goto out;
 	}
 
@@ -2085,7 +2179,7 @@ int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
 	config_destroy(cfg);
 	free(cfg);
 	/* Clean last error */
-	usbg_set_failed_import(&g->last_failed_import, NULL);
+	usbg_set_failed_import(g, NULL);
 out:
 	return ret;
 }
@@ -2109,7 +2203,7 @@ int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
 
 	cfg_ret = config_read(cfg, stream);
 	if (cfg_ret != CONFIG_TRUE) {
-		usbg_set_failed_import(&s->last_failed_import, cfg);
+		usbg_set_failed_import(s, cfg);
 		ret = USBG_ERROR_INVALID_FORMAT;
 		goto out;
 	}
@@ -2117,9 +2211,13 @@ int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
 	/* Always successful */
 	root = config_root_setting(cfg);
 
-	ret = usbg_import_gadget_run(s, root, name, &newg);
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_import_gadget_run(s, root, name, &newg);
+		usbg_unlock(s);
+	}
 	if (ret != USBG_SUCCESS) {
-		usbg_set_failed_import(&s->last_failed_import, cfg);
+		usbg_set_failed_import(s, cfg);
 		goto out;
 	}
 
@@ -2129,56 +2227,68 @@ int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
 	config_destroy(cfg);
 	free(cfg);
 	/* Clean last error */
-	usbg_set_failed_import(&s->last_failed_import, NULL);
+	usbg_set_failed_import(s, NULL);
 out:
 	return ret;
 }
 
 const char *usbg_get_func_import_error_text(usbg_gadget *g)
 {
-	if (!g || !g->last_failed_import)
+	config_t *cfg = usbg_get_failed_import(g);
+
+	if (!cfg)
 		return NULL;
 
-	return config_error_text(g->last_failed_import);
+	return config_error_text(cfg);
 }
 
 int usbg_get_func_import_error_line(usbg_gadget *g)
 {
-	if (!g || !g->last_failed_import)
+	config_t *cfg = usbg_get_failed_import(g);
+
+	if (!cfg)
 		return -1;
 
-	return config_error_line(g->last_failed_import);
+	return config_error_line(cfg);
 }
 
 const char *usbg_get_config_import_error_text(usbg_gadget *g)
 {
-	if (!g || !g->last_failed_import)
+	config_t *cfg = usbg_get_failed_import(g);
+
+	if (!cfg)
 		return NULL;
 
-	return config_error_text(g->last_failed_import);
+	return config_error_text(cfg);
 }
 
 int usbg_get_config_import_error_line(usbg_gadget *g)
 {
-	if (!g || !g->last_failed_import)
+	config_t *cfg = usbg_get_failed_import(g);
+
+	if (!cfg)
 		return -1;
 
-	return config_error_line(g->last_failed_import);
+	return config_error_line(cfg);
 }
 
 const char *usbg_get_gadget_import_error_text(usbg_state *s)
 {
-	if (!s || !s->last_failed_import)
+	config_t *cfg = usbg_get_failed_import(s);
+
+	if (!cfg)
 		return NULL;
 
-	return config_error_text(s->last_failed_import);
+	return config_error_text(cfg);
 }
 
 int usbg_get_gadget_import_error_line(usbg_state *s)
 {
-	if (!s || !s->last_failed_import)
+	config_t *cfg = usbg_get_failed_import(s);
+
+	if (!cfg)
 		return -1;
 
-	return config_error_line(s->last_failed_import);
+	return config_error_line(cfg);
 }
 
@@ -0,0 +1,312 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_warm_pool.c
+ * @brief Gadgets kept ready to be bound to UDC
+ * @details Everything what takes time (creating directories, writing
+ * attributes, linking functions and opening UDC files) is done when
+ * gadget is put into pool. Switch only writes to two UDC files which
+ * are already open.
+ *
+ * Pools are registered in state, entry of gadget is dropped when the
+ * gadget is freed, whoever frees it. UDC is looked up by name on each
+ * call as it may be removed and come back.
+ */
+
+struct usbg_warm_entry
+{
+	usbg_gadget *gadget;
+	int udc_fd;
+};
+
+struct usbg_warm_pool
+{
+	/* NULL when state has been cleaned up before the pool */
+	usbg_state *state;
+	char *udc_name;
+	struct usbg_warm_entry *entries;
+	int count;
+	int size;
+	struct usbg_warm_pool *next;
+};
+
+int usbg_warm_pool_new(usbg_udc *u, usbg_warm_pool **p)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!u || !p)
+		return USBG_ERROR_INVALID_PARAM;
+
+	*p = calloc(1, sizeof(**p));
+	if (!*p)
+		return USBG_ERROR_NO_MEM;
+
+	(*p)->udc_name = strdup(u->name);
+	if (!(*p)->udc_name) {
+		ret = USBG_ERROR_NO_MEM;
+		goto err;
+	}
+
+	s = u->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	(*p)->state = s;
+	(*p)->next = s->pools;
+	s->pools = *p;
+	usbg_unlock(s);
+
+	return USBG_SUCCESS;
+
+err:
+	free((*p)->udc_name);
+	free(*p);
+	*p = NULL;
+	return ret;
+}
+
+static void usbg_warm_pool_drop(usbg_warm_pool *p, int i)
+{
+	close(p->entries[i].udc_fd);
+	p->entries[i] = p->entries[--p->count];
+}
+
+void usbg_warm_pool_forget_gadget(usbg_gadget *g)
+{
+	usbg_warm_pool *p;
+	int i;
+
+	for (p = g->parent->pools; p; p = p->next)
+		for (i = 0; i < p->count; ++i)
+			if (p->entries[i].gadget == g) {
+				usbg_warm_pool_drop(p, i);
+				break;
+			}
+}
+
+void usbg_warm_pool_orphan_all(usbg_state *s)
+{
+	usbg_warm_pool *p;
+
+	for (p = s->pools; p; p = p->next) {
+		while (p->count)
+			usbg_warm_pool_drop(p, p->count - 1);
+		p->state = NULL;
+	}
+
+	s->pools = NULL;
+}
+
+static struct usbg_warm_entry *usbg_warm_pool_find(usbg_warm_pool *p,
+						   usbg_gadget *g)
+{
+	int i;
+
+	for (i = 0; i < p->count; ++i)
+		if (p->entries[i].gadget == g)
+			return p->entries + i;
+
+	return NULL;
+}
+
+static int usbg_warm_pool_add_locked(usbg_warm_pool *p, const char *name,
+		const usbg_gadget_desc *desc, usbg_gadget **g)
+{
+	usbg_state *s = p->state;
+	struct usbg_warm_entry *entries;
+	usbg_udc *u;
+	int created = 0;
+	int added = 0;
+	int ret;
+	int fd;
+
+	u = usbg_get_udc(s, p->udc_name);
+	*g = usbg_get_gadget(s, name);
+	if (*g && (*g)->udc && (*g)->udc != u)
+		return USBG_ERROR_BUSY;
+
+	if (*g && usbg_warm_pool_find(p, *g))
+		goto reconcile;
+
+	if (p->count == p->size) {
+		entries = realloc(p->entries, (p->size ? p->size * 2 : 4) *
+				  sizeof(*entries));
+		if (!entries)
+			return USBG_ERROR_NO_MEM;
+
+		p->entries = entries;
+		p->size = p->size ? p->size * 2 : 4;
+	}
+
+	if (!*g) {
+		ret = usbg_create_gadget(s, name, NULL, NULL, g);
+		if (ret != USBG_SUCCESS)
+			return ret;
+		created = 1;
+	}
+
+	ret = usbg_open_udc_file(*g, &fd);
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	p->entries[p->count].gadget = *g;
+	p->entries[p->count].udc_fd = fd;
+	p->count++;
+	added = 1;
+
+reconcile:
+	if (!desc)
+		return USBG_SUCCESS;
+
+	/* Number of operations done is of no interest here */
+	ret = usbg_reconcile_gadget(*g, desc, 0, NULL);
+	if (ret >= 0)
+		return USBG_SUCCESS;
+
+	/* Don't leave half configured gadget in pool */
+	if (added) {
+		p->count--;
+		close(p->entries[p->count].udc_fd);
+	}
+err:
+	if (created) {
+		usbg_rm_gadget(*g, USBG_RM_RECURSE);
+		*g = NULL;
+	}
+	return ret;
+}
+
+int usbg_warm_pool_add(usbg_warm_pool *p, const char *name,
+		const usbg_gadget_desc *desc, usbg_gadget **g)
+{
+	usbg_gadget *gadget;
+	int ret;
+
+	if (!p || !p->state || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(p->state);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_warm_pool_add_locked(p, name, desc, &gadget);
+		usbg_unlock(p->state);
+	}
+
+	if (ret == USBG_SUCCESS && g)
+		*g = gadget;
+
+	return ret;
+}
+
+static int usbg_warm_pool_switch_locked(usbg_warm_pool *p, const char *name,
+		uint64_t *latency_ns)
+{
+	struct usbg_warm_entry *to, *from = NULL;
+	usbg_gadget *g, *cur;
+	int from_fd = -1;
+	usbg_udc *u;
+	int ret;
+
+	u = usbg_get_udc(p->state, p->udc_name);
+	if (!u)
+		return USBG_ERROR_NO_DEV;
+
+	g = usbg_get_gadget(p->state, name);
+	to = g ? usbg_warm_pool_find(p, g) : NULL;
+	if (!to)
+		return USBG_ERROR_NOT_FOUND;
+
+	/* Someone else could have bound or unbound gadget meanwhile */
+	usbg_check_udc_binding(u);
+	cur = u->gadget;
+	if (cur == g) {
+		if (latency_ns)
+			*latency_ns = 0;
+		return USBG_SUCCESS;
+	}
+
+	if (g->udc)
+		return USBG_ERROR_BUSY;
+
+	if (cur) {
+		from = usbg_warm_pool_find(p, cur);
+		if (from) {
+			from_fd = from->udc_fd;
+		} else {
+			/* Gadget bound from outside of pool */
+			ret = usbg_open_udc_file(cur, &from_fd);
+			if (ret != USBG_SUCCESS)
+				return ret;
+		}
+	}
+
+	ret = usbg_switch_udc(u, cur, from_fd, g, to->udc_fd, latency_ns);
+
+	if (cur && !from)
+		close(from_fd);
+
+	return ret;
+}
+
+int usbg_warm_pool_switch(usbg_warm_pool *p, const char *name,
+		uint64_t *latency_ns)
+{
+	int ret;
+
+	if (!p || !p->state || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(p->state);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_warm_pool_switch_locked(p, name, latency_ns);
+		usbg_unlock(p->state);
+	}
+
+	return ret;
+}
+
+void usbg_warm_pool_free(usbg_warm_pool *p)
+{
+	usbg_warm_pool **pp;
+	usbg_state *s;
+	int ret;
+	int i;
+
+	if (!p)
+		return;
+
+	s = p->state;
+	if (s) {
+		ret = usbg_lock_exclusive(s);
+		for (pp = &s->pools; *pp != p; pp = &(*pp)->next)
+			;
+		*pp = p->next;
+		if (ret == USBG_SUCCESS)
+			usbg_unlock(s);
+	}
+
+	for (i = 0; i < p->count; ++i)
+		close(p->entries[i].udc_fd);
+
+	free(p->entries);
+	free(p->udc_name);
+	free(p);
+}
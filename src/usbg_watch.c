@@ -0,0 +1,788 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_watch.c
+ * @brief Tracking of UDCs with kernel notifications
+ * @details State file of each UDC is watched for sysfs notification
+ * (POLLPRI) and kernel uevents are received from netlink socket. Both
+ * are kept in one epoll set, so checking if anything has changed costs
+ * a single epoll_wait() with zero timeout. Kernel sends "change" uevent
+ * of UDC whenever gadget is bound to it or unbound from it, also when
+ * it decides to detach gadget on its own, so UDC files of gadgets are
+ * read only when such uevent arrives.
+ *
+ * Events are queued when notifications are applied, whichever function
+ * does it, and delivered by usbg_process_events(). Binding is reported
+ * by comparison with gadget from last reported event, so changes made
+ * by this library are reported as well as changes made by others.
+ *
+ * UDCs which appear or disappear ("add" and "remove" uevents) change
+ * the list of UDCs, which may be done only with state locked exclusive.
+ * Such uevents are kept aside and applied by usbg_process_events().
+ *
+ * Socket is read only when caller syncs, so its buffer is enlarged to
+ * survive bursts. If kernel still has to drop uevents, recv() fails
+ * with ENOBUFS. Binding of all UDCs is then read again at once and the
+ * list of UDCs is compared with sysfs by next usbg_process_events().
+ *
+ * Time of each bind done by this library is recorded together with
+ * time when UDC has been noticed in configured state for the first time
+ * after it, which gives bind to enumeration latency.
+ */
+
+#define UDC_CLASS_PATH "/sys/class/udc"
+
+/* Max size of kernel uevent message */
+#define USBG_UEVENT_BUF_SIZE 8192
+
+/* Receive buffer of uevent socket */
+#define USBG_UEVENT_RCVBUF (1024 * 1024)
+
+#define USBG_WATCH_BATCH 16
+
+struct usbg_watch
+{
+	/* State files of all watched UDCs and uevent socket */
+	int epfd;
+	/* Uevent socket, -1 if netlink is not available */
+	int nlfd;
+	/* Events not yet delivered, queued only if someone waits for them */
+	int queue_events;
+	usbg_event *events;
+	int nevents;
+	int size;
+	/* UDCs added or removed since last usbg_process_events() */
+	struct usbg_hotplug *hotplug;
+	struct usbg_hotplug **hotplug_tail;
+	/* Uevents have been dropped, list of UDCs has to be read again */
+	int lost_uevents;
+};
+
+struct usbg_hotplug
+{
+	struct usbg_hotplug *next;
+	int add;
+	char name[];
+};
+
+static const char * const udc_state_names[] = {
+	[USBG_UDC_STATE_UNKNOWN] = "unknown",
+	[USBG_UDC_STATE_NOT_ATTACHED] = "not attached",
+	[USBG_UDC_STATE_ATTACHED] = "attached",
+	[USBG_UDC_STATE_POWERED] = "powered",
+	[USBG_UDC_STATE_RECONNECTING] = "reconnecting",
+	[USBG_UDC_STATE_UNAUTHENTICATED] = "unauthenticated",
+	[USBG_UDC_STATE_DEFAULT] = "default",
+	[USBG_UDC_STATE_ADDRESS] = "addressed",
+	[USBG_UDC_STATE_CONFIGURED] = "configured",
+	[USBG_UDC_STATE_SUSPENDED] = "suspended",
+};
+
+const char *usbg_get_udc_state_str(usbg_udc_state state)
+{
+	if (state < 0 || state >= ARRAY_SIZE(udc_state_names))
+		state = USBG_UDC_STATE_UNKNOWN;
+
+	return udc_state_names[state];
+}
+
+/* Sysfs file has to be read from the beginning to rearm notification */
+static usbg_udc_state usbg_read_udc_state(int fd)
+{
+	char buf[USBG_MAX_STR_LENGTH];
+	ssize_t nmb;
+	int i;
+
+	nmb = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (nmb <= 0)
+		return USBG_UDC_STATE_UNKNOWN;
+
+	buf[nmb] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	for (i = USBG_UDC_STATE_UNKNOWN + 1; i < ARRAY_SIZE(udc_state_names);
+	     ++i)
+		if (!strcmp(buf, udc_state_names[i]))
+			return i;
+
+	return USBG_UDC_STATE_UNKNOWN;
+}
+
+static int usbg_open_udc_state(usbg_udc *u, int *fd)
+{
+	char path[USBG_MAX_PATH_LENGTH];
+	int nmb;
+
+	nmb = snprintf(path, sizeof(path), UDC_CLASS_PATH "/%s/state",
+		       u->name);
+	if (nmb >= sizeof(path))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	*fd = openat(AT_FDCWD, path, O_RDONLY | O_CLOEXEC);
+	return *fd < 0 ? usbg_translate_error(errno) : USBG_SUCCESS;
+}
+
+void usbg_udc_bound(usbg_udc *u, uint64_t bind_ns)
+{
+	u->bind_ns = bind_ns;
+	u->configured_ns = 0;
+}
+
+/*
+ * Only first configuration after bind counts. Time is taken when
+ * notification arrived, not when it has been processed.
+ */
+static void usbg_udc_seen_state(usbg_udc *u, usbg_udc_state state,
+				uint64_t seen_ns)
+{
+	if (state == USBG_UDC_STATE_CONFIGURED && u->bind_ns &&
+	    !u->configured_ns)
+		u->configured_ns = seen_ns;
+}
+
+static void usbg_watch_queue(usbg_udc *u, usbg_event_type type,
+			     usbg_gadget *g)
+{
+	struct usbg_watch *w = u->parent->watch;
+	usbg_event *events;
+	int size;
+
+	if (!w->queue_events)
+		return;
+
+	if (w->nevents == w->size) {
+		size = w->size ? w->size * 2 : 8;
+		events = realloc(w->events, size * sizeof(*events));
+		if (!events) {
+			ERROR("event lost, no memory");
+			return;
+		}
+
+		w->events = events;
+		w->size = size;
+	}
+
+	w->events[w->nevents].type = type;
+	w->events[w->nevents].udc = u;
+	w->events[w->nevents].gadget = g;
+	w->events[w->nevents].state = u->state;
+	w->nevents++;
+}
+
+static void usbg_watch_report_binding(usbg_udc *u)
+{
+	if (!u->parent->watch || u->gadget == u->event_gadget)
+		return;
+
+	if (u->event_gadget)
+		usbg_watch_queue(u, USBG_EVENT_GADGET_UNBOUND, u->event_gadget);
+	if (u->gadget)
+		usbg_watch_queue(u, USBG_EVENT_GADGET_BOUND, u->gadget);
+
+	u->event_gadget = u->gadget;
+}
+
+/* Check if kernel has bound or unbound any gadget to this UDC */
+static void usbg_watch_check_binding(usbg_udc *u)
+{
+	char buf[USBG_MAX_STR_LENGTH];
+	usbg_gadget *old = u->gadget;
+	usbg_gadget *g;
+
+	if (old) {
+		if (usbg_read_gadget_udc(old, buf) != USBG_SUCCESS ||
+		    !strcmp(buf, u->name))
+			goto out;
+
+		/* Kernel decided to detach this gadget */
+		old->udc = NULL;
+		u->gadget = NULL;
+	}
+
+	/* Someone else could have bound other gadget in its place */
+	TAILQ_FOREACH(g, &u->parent->gadgets, gnode) {
+		if (g->udc || g == old)
+			continue;
+
+		if (usbg_read_gadget_udc(g, buf) == USBG_SUCCESS &&
+		    !strcmp(buf, u->name)) {
+			g->udc = u;
+			u->gadget = g;
+			break;
+		}
+	}
+
+out:
+	usbg_watch_report_binding(u);
+}
+
+void usbg_check_udc_binding(usbg_udc *u)
+{
+	usbg_lock_obj(u->parent);
+	/* Uevents keep binding up to date */
+	if (u->parent->watch && u->parent->watch->nlfd >= 0)
+		usbg_watch_sync(u->parent);
+	else
+		usbg_watch_check_binding(u);
+	usbg_unlock_obj(u->parent);
+}
+
+static void usbg_watch_state_changed(usbg_udc *u, uint64_t seen_ns)
+{
+	usbg_udc_state state;
+
+	state = usbg_read_udc_state(u->state_fd);
+	usbg_udc_seen_state(u, state, seen_ns);
+	if (state != u->state) {
+		u->state = state;
+		usbg_watch_queue(u, USBG_EVENT_UDC_STATE, NULL);
+	}
+
+	/* Without uevents state change is the only hint */
+	if (u->parent->watch->nlfd < 0)
+		usbg_watch_check_binding(u);
+}
+
+static void usbg_watch_add_hotplug(struct usbg_watch *w, const char *name,
+				   int add)
+{
+	struct usbg_hotplug *h;
+
+	h = malloc(sizeof(*h) + strlen(name) + 1);
+	if (!h) {
+		ERROR("hotplug of %s lost, no memory", name);
+		return;
+	}
+
+	h->next = NULL;
+	h->add = add;
+	strcpy(h->name, name);
+	*w->hotplug_tail = h;
+	w->hotplug_tail = &h->next;
+}
+
+static void usbg_watch_uevent(usbg_state *s, char *msg, size_t len)
+{
+	const char *subsystem = NULL;
+	const char *devpath = NULL;
+	const char *action = NULL;
+	const char *name;
+	usbg_udc *u;
+	size_t pos;
+
+	/* Header "action@devpath" is followed by KEY=value strings */
+	for (pos = strlen(msg) + 1; pos < len; pos += strlen(msg + pos) + 1) {
+		if (!strncmp(msg + pos, "ACTION=", 7))
+			action = msg + pos + 7;
+		else if (!strncmp(msg + pos, "DEVPATH=", 8))
+			devpath = msg + pos + 8;
+		else if (!strncmp(msg + pos, "SUBSYSTEM=", 10))
+			subsystem = msg + pos + 10;
+	}
+
+	if (!action || !devpath || !subsystem || strcmp(subsystem, "udc"))
+		return;
+
+	name = strrchr(devpath, '/');
+	name = name ? name + 1 : devpath;
+
+	if (!strcmp(action, "add") || !strcmp(action, "remove")) {
+		usbg_watch_add_hotplug(s->watch, name, action[0] == 'a');
+		return;
+	}
+
+	u = usbg_get_udc(s, name);
+	if (u && !strcmp(action, "change"))
+		usbg_watch_check_binding(u);
+}
+
+static void usbg_watch_read_uevents(usbg_state *s)
+{
+	char buf[USBG_UEVENT_BUF_SIZE];
+	int lost = 0;
+	ssize_t nmb;
+	usbg_udc *u;
+
+	for (;;) {
+		nmb = recv(s->watch->nlfd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (nmb > 0) {
+			buf[nmb] = '\0';
+			usbg_watch_uevent(s, buf, nmb);
+		} else if (nmb < 0 && errno == ENOBUFS) {
+			/* Socket overflowed, messages after it can be read */
+			lost = 1;
+		} else if (nmb < 0 && errno == EINTR) {
+			continue;
+		} else {
+			break;
+		}
+	}
+
+	if (!lost)
+		return;
+
+	ERROR("uevents lost, reading binding of all UDCs");
+	s->watch->lost_uevents = 1;
+	TAILQ_FOREACH(u, &s->udcs, unode)
+		usbg_watch_check_binding(u);
+}
+
+void usbg_watch_sync(usbg_state *s)
+{
+	struct epoll_event evs[USBG_WATCH_BATCH];
+	uint64_t now;
+	int nmb;
+	int i;
+
+	if (!s->watch)
+		return;
+
+	do {
+		nmb = epoll_wait(s->watch->epfd, evs, ARRAY_SIZE(evs), 0);
+		now = usbg_monotonic_ns();
+		for (i = 0; i < nmb; ++i) {
+			if (evs[i].data.ptr)
+				usbg_watch_state_changed(evs[i].data.ptr, now);
+			else
+				usbg_watch_read_uevents(s);
+		}
+	} while (nmb == ARRAY_SIZE(evs));
+}
+
+int usbg_watch_udc(usbg_udc *u)
+{
+	struct epoll_event ev = {
+		.events = EPOLLPRI | EPOLLERR,
+		.data.ptr = u,
+	};
+	int ret;
+	int fd;
+
+	ret = usbg_open_udc_state(u, &fd);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	/* Read clears pending notification, so it goes before epoll */
+	u->state = usbg_read_udc_state(fd);
+	if (epoll_ctl(u->parent->watch->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		ret = usbg_translate_error(errno);
+		close(fd);
+		return ret;
+	}
+
+	u->state_fd = fd;
+	u->event_gadget = u->gadget;
+	return USBG_SUCCESS;
+}
+
+static int usbg_uevent_open(int epfd)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		/* Group of uevents sent by kernel itself */
+		.nl_groups = 1,
+	};
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	int size = USBG_UEVENT_RCVBUF;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	/* Going over rmem_max requires CAP_NET_ADMIN, otherwise it's cut */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int usbg_watch_start(usbg_state *s)
+{
+	struct usbg_watch *w;
+	usbg_udc *u;
+	int ret = USBG_SUCCESS;
+
+	if (s->watch)
+		return USBG_SUCCESS;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return USBG_ERROR_NO_MEM;
+
+	w->queue_events = 0;
+	w->events = NULL;
+	w->nevents = 0;
+	w->size = 0;
+	w->hotplug = NULL;
+	w->hotplug_tail = &w->hotplug;
+	w->lost_uevents = 0;
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd < 0) {
+		ret = usbg_translate_error(errno);
+		free(w);
+		return ret;
+	}
+
+	/* Watch still works without uevents, only less precisely */
+	w->nlfd = usbg_uevent_open(w->epfd);
+	s->watch = w;
+
+	TAILQ_FOREACH(u, &s->udcs, unode) {
+		ret = usbg_watch_udc(u);
+		if (ret != USBG_SUCCESS) {
+			usbg_watch_stop(s);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+void usbg_watch_stop(usbg_state *s)
+{
+	struct usbg_hotplug *h;
+	usbg_udc *u;
+
+	if (!s->watch)
+		return;
+
+	while (s->watch->hotplug) {
+		h = s->watch->hotplug;
+		s->watch->hotplug = h->next;
+		free(h);
+	}
+
+	TAILQ_FOREACH(u, &s->udcs, unode) {
+		if (u->state_fd >= 0)
+			close(u->state_fd);
+		u->state_fd = -1;
+	}
+
+	if (s->watch->nlfd >= 0)
+		close(s->watch->nlfd);
+	close(s->watch->epfd);
+	free(s->watch->events);
+	free(s->watch);
+	s->watch = NULL;
+}
+
+usbg_udc_state usbg_get_udc_state(usbg_udc *u)
+{
+	usbg_udc_state state;
+	int fd;
+
+	if (!u)
+		return USBG_UDC_STATE_UNKNOWN;
+
+	usbg_lock_obj(u->parent);
+	if (u->parent->watch) {
+		usbg_watch_sync(u->parent);
+		state = u->state;
+	} else if (usbg_open_udc_state(u, &fd) == USBG_SUCCESS) {
+		state = usbg_read_udc_state(fd);
+		close(fd);
+		usbg_udc_seen_state(u, state, usbg_monotonic_ns());
+	} else {
+		state = USBG_UDC_STATE_UNKNOWN;
+	}
+	usbg_unlock_obj(u->parent);
+
+	return state;
+}
+
+int usbg_wait_udc_state(usbg_udc *u, usbg_udc_state state, int timeout_ms)
+{
+	struct pollfd pfd;
+	uint64_t end = 0;
+	uint64_t seen;
+	int64_t left;
+	int ret;
+	int n;
+
+	if (!u)
+		return USBG_ERROR_INVALID_PARAM;
+
+	/* Own file, so waiting doesn't steal notifications from the watch */
+	usbg_lock_obj(u->parent);
+	ret = usbg_open_udc_state(u, &pfd.fd);
+	usbg_unlock_obj(u->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (timeout_ms >= 0)
+		end = usbg_monotonic_ns() + (uint64_t)timeout_ms * 1000000;
+
+	pfd.events = POLLPRI | POLLERR;
+	seen = usbg_monotonic_ns();
+	while (usbg_read_udc_state(pfd.fd) != state) {
+		left = -1;
+		if (timeout_ms >= 0) {
+			left = (int64_t)(end - usbg_monotonic_ns()) / 1000000;
+			if (left < 0)
+				left = 0;
+		}
+
+		n = poll(&pfd, 1, left);
+		seen = usbg_monotonic_ns();
+		if (n == 0) {
+			ret = USBG_ERROR_TIMEOUT;
+			goto out;
+		}
+
+		if (n < 0 && errno != EINTR) {
+			ret = usbg_translate_error(errno);
+			goto out;
+		}
+	}
+
+	usbg_lock_obj(u->parent);
+	usbg_udc_seen_state(u, state, seen);
+	usbg_unlock_obj(u->parent);
+out:
+	close(pfd.fd);
+	return ret;
+}
+
+int usbg_get_udc_timings(usbg_udc *u, usbg_udc_timings *t)
+{
+	if (!u || !t)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_obj(u->parent);
+	/* Configuration may have been noticed only by the watch */
+	if (u->parent->watch)
+		usbg_watch_sync(u->parent);
+	t->bind_ns = u->bind_ns;
+	t->configured_ns = u->configured_ns;
+	usbg_unlock_obj(u->parent);
+
+	return USBG_SUCCESS;
+}
+
+/* Remove from queue all events which refer to given UDC or gadget */
+static void usbg_watch_drop_events(struct usbg_watch *w, usbg_udc *u,
+				   usbg_gadget *g)
+{
+	int i, n = 0;
+
+	for (i = 0; i < w->nevents; ++i) {
+		if ((u && w->events[i].udc == u) ||
+		    (g && w->events[i].gadget == g))
+			continue;
+		w->events[n++] = w->events[i];
+	}
+
+	w->nevents = n;
+}
+
+void usbg_watch_forget_gadget(usbg_gadget *g)
+{
+	struct usbg_watch *w = g->parent->watch;
+	usbg_udc *u;
+
+	if (!w)
+		return;
+
+	TAILQ_FOREACH(u, &g->parent->udcs, unode)
+		if (u->event_gadget == g)
+			u->event_gadget = NULL;
+
+	usbg_watch_drop_events(w, NULL, g);
+}
+
+void usbg_watch_forget_udc(usbg_udc *u)
+{
+	if (u->parent->watch)
+		usbg_watch_drop_events(u->parent->watch, u, NULL);
+}
+
+int usbg_get_event_fd(usbg_state *s)
+{
+	usbg_udc *u;
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (!s->watch) {
+		ret = usbg_watch_start(s);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		/* Binding could have been changed since it was read */
+		TAILQ_FOREACH(u, &s->udcs, unode)
+			if (u->gadget)
+				usbg_watch_check_binding(u);
+	}
+
+	s->watch->queue_events = 1;
+	ret = s->watch->epfd;
+out:
+	usbg_unlock(s);
+	return ret;
+}
+
+/* Apply hotplug uevents, removed UDCs are put on list to be freed */
+static void usbg_watch_apply_hotplug(usbg_state *s, struct uhead *removed)
+{
+	struct usbg_watch *w = s->watch;
+	struct usbg_hotplug *h;
+	usbg_udc *u;
+	int ret;
+
+	while (w->hotplug) {
+		h = w->hotplug;
+		w->hotplug = h->next;
+		if (!w->hotplug)
+			w->hotplug_tail = &w->hotplug;
+
+		u = usbg_get_udc(s, h->name);
+		if (h->add && !u) {
+			ret = usbg_parse_udc(s, h->name);
+			u = usbg_get_udc(s, h->name);
+			if (ret == USBG_SUCCESS) {
+				usbg_watch_queue(u, USBG_EVENT_UDC_ADDED, NULL);
+				/* Gadget may have been bound to it already */
+				usbg_watch_check_binding(u);
+			} else if (u) {
+				/* UDC is gone before it could be watched */
+				usbg_detach_udc(u);
+				usbg_free_udc(u);
+			}
+		} else if (!h->add && u) {
+			/* Kernel unbinds gadget together with removal of UDC */
+			if (u->gadget)
+				u->gadget->udc = NULL;
+			u->gadget = NULL;
+			usbg_watch_report_binding(u);
+			usbg_watch_queue(u, USBG_EVENT_UDC_REMOVED, NULL);
+
+			if (u->state_fd >= 0)
+				close(u->state_fd);
+			u->state_fd = -1;
+			usbg_detach_udc(u);
+			TAILQ_INSERT_TAIL(removed, u, unode);
+		}
+
+		free(h);
+	}
+}
+
+/* Compare list of UDCs with sysfs after uevents have been lost */
+static void usbg_watch_rescan(usbg_state *s)
+{
+	struct usbg_dir dir;
+	usbg_udc *u;
+	int ret;
+	int i;
+
+	ret = usbg_read_dir(AT_FDCWD, UDC_CLASS_PATH, file_select,
+			    usbg_dirent_cmp, &dir);
+	if (ret != USBG_SUCCESS) {
+		ERROR("UDCs can't be listed: %s", usbg_strerror(ret));
+		return;
+	}
+
+	TAILQ_FOREACH(u, &s->udcs, unode)
+		if (!usbg_dir_contains(&dir, u->name))
+			usbg_watch_add_hotplug(s->watch, u->name, 0);
+
+	for (i = 0; i < dir.n; ++i)
+		if (!usbg_get_udc(s, dir.ents[i].name))
+			usbg_watch_add_hotplug(s->watch, dir.ents[i].name, 1);
+
+	usbg_release_dir(&dir);
+}
+
+int usbg_process_events(usbg_state *s, usbg_event_cb cb, void *data)
+{
+	struct uhead removed = TAILQ_HEAD_INITIALIZER(removed);
+	struct usbg_watch *w;
+	usbg_event ev;
+	usbg_udc *u;
+	int ret;
+	int i;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	w = s->watch;
+	if (!w) {
+		ret = USBG_ERROR_INVALID_PARAM;
+		goto out;
+	}
+
+	usbg_lock_obj(s);
+	usbg_watch_sync(s);
+	usbg_unlock_obj(s);
+
+	usbg_watch_apply_hotplug(s, &removed);
+
+	if (w->lost_uevents) {
+		w->lost_uevents = 0;
+		usbg_watch_rescan(s);
+		usbg_watch_apply_hotplug(s, &removed);
+	}
+
+	/* Callback may cause new events, they are delivered as well */
+	for (i = 0; i < w->nevents; ++i) {
+		ev = w->events[i];
+		if (cb)
+			cb(&ev, data);
+	}
+
+	ret = w->nevents;
+	w->nevents = 0;
+
+	while (!TAILQ_EMPTY(&removed)) {
+		u = TAILQ_FIRST(&removed);
+		TAILQ_REMOVE(&removed, u, unode);
+		usbg_free_udc(u);
+	}
+out:
+	usbg_unlock(s);
+	return ret;
+}
@@ -0,0 +1,286 @@
+#include <usbg/usbg.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * @file tests/test-io-uring.c
+ * @brief Tests of io_uring backend
+ * @details Kernel executes submitted operations on its own, so they
+ * can't be caught by wrappers of test.c. Instead, configfs is imitated
+ * by ordinary directory tree in temporary directory.
+ */
+
+struct io_test_state {
+	char root[64];
+	usbg_state *s;
+};
+
+static usbg_gadget_attrs test_attrs = {
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0xef,
+	.bDeviceSubClass = 0x02,
+	.bDeviceProtocol = 0x01,
+	.bMaxPacketSize0 = 0x40,
+	.idVendor = 0x1d6b,
+	.idProduct = 0x0104,
+	.bcdDevice = 0x0100,
+};
+
+static void make_dir(const char *root, const char *name)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	assert_int_equal(mkdir(path, 0755), 0);
+}
+
+static void write_file(const char *root, const char *name, const char *val)
+{
+	char path[256];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	fputs(val, fp);
+	fclose(fp);
+}
+
+static void remove_file(const char *root, const char *name)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	assert_int_equal(unlink(path), 0);
+}
+
+static void read_file(const char *root, const char *name, char *buf,
+		      size_t len)
+{
+	char path[256];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fp = fopen(path, "r");
+	assert_non_null(fp);
+	assert_non_null(fgets(buf, len, fp));
+	fclose(fp);
+	buf[strcspn(buf, "\n")] = '\0';
+}
+
+/* Gadget directory as created by kernel, with given attributes */
+static void make_gadget(const char *root, const char *name,
+			const usbg_gadget_attrs *a)
+{
+	static const char * const subdirs[] = {
+		"functions", "configs", "strings", "os_desc", NULL,
+	};
+	const char * const *d;
+	char path[128];
+	char val[16];
+
+	snprintf(path, sizeof(path), "usb_gadget/%s", name);
+	make_dir(root, path);
+	for (d = subdirs; *d; d++) {
+		snprintf(path, sizeof(path), "usb_gadget/%s/%s", name, *d);
+		make_dir(root, path);
+	}
+
+#define GADGET_FILE(attr, fmt) do {\
+	snprintf(path, sizeof(path), "usb_gadget/%s/" #attr, name);\
+	snprintf(val, sizeof(val), fmt "\n", a->attr);\
+	write_file(root, path, val);\
+} while (0)
+
+	GADGET_FILE(bcdUSB, "0x%04x");
+	GADGET_FILE(bDeviceClass, "0x%02x");
+	GADGET_FILE(bDeviceSubClass, "0x%02x");
+	GADGET_FILE(bDeviceProtocol, "0x%02x");
+	GADGET_FILE(bMaxPacketSize0, "0x%02x");
+	GADGET_FILE(idVendor, "0x%04x");
+	GADGET_FILE(idProduct, "0x%04x");
+	GADGET_FILE(bcdDevice, "0x%04x");
+
+#undef GADGET_FILE
+
+	snprintf(path, sizeof(path), "usb_gadget/%s/UDC", name);
+	write_file(root, path, "\n");
+}
+
+static int setup_io_state(void **state)
+{
+	struct io_test_state *ts;
+	int ret;
+
+	ts = calloc(1, sizeof(*ts));
+	if (!ts)
+		return -1;
+
+	strcpy(ts->root, "/tmp/usbg-io-XXXXXX");
+	if (!mkdtemp(ts->root)) {
+		free(ts);
+		return -1;
+	}
+
+	make_dir(ts->root, "usb_gadget");
+	make_gadget(ts->root, "g1", &test_attrs);
+	make_gadget(ts->root, "broken", &test_attrs);
+	/* Read of this gadget's attributes fails in the middle of batch */
+	remove_file(ts->root, "usb_gadget/broken/bcdDevice");
+
+	ret = usbg_init(ts->root, &ts->s);
+	if (ret != USBG_SUCCESS) {
+		free(ts);
+		return -1;
+	}
+
+	*state = ts;
+	return 0;
+}
+
+static int teardown_io_state(void **state)
+{
+	struct io_test_state *ts = *state;
+	char cmd[128];
+
+	usbg_cleanup(ts->s);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", ts->root);
+	if (system(cmd))
+		return -1;
+
+	free(ts);
+	return 0;
+}
+
+/**
+ * @brief Tests reading and writing gadget attributes with io_uring
+ * @details Check if values read in one batch land in right fields
+ * and if values written in one batch land in right files
+ */
+static void test_io_uring_gadget_attrs(void **state)
+{
+	struct io_test_state *ts = *state;
+	usbg_gadget_attrs attrs;
+	usbg_gadget *g;
+	char buf[32];
+	int ret;
+
+	g = usbg_get_gadget(ts->s, "g1");
+	assert_non_null(g);
+
+	ret = usbg_get_gadget_attrs(g, &attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(attrs.bcdUSB, test_attrs.bcdUSB);
+	assert_int_equal(attrs.bDeviceClass, test_attrs.bDeviceClass);
+	assert_int_equal(attrs.bDeviceSubClass, test_attrs.bDeviceSubClass);
+	assert_int_equal(attrs.bDeviceProtocol, test_attrs.bDeviceProtocol);
+	assert_int_equal(attrs.bMaxPacketSize0, test_attrs.bMaxPacketSize0);
+	assert_int_equal(attrs.idVendor, test_attrs.idVendor);
+	assert_int_equal(attrs.idProduct, test_attrs.idProduct);
+	assert_int_equal(attrs.bcdDevice, test_attrs.bcdDevice);
+
+	attrs.idVendor = 0x0525;
+	attrs.idProduct = 0xa4a7;
+	ret = usbg_set_gadget_attrs(g, &attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	read_file(ts->root, "usb_gadget/g1/idVendor", buf, sizeof(buf));
+	assert_string_equal(buf, "0x0525");
+	read_file(ts->root, "usb_gadget/g1/idProduct", buf, sizeof(buf));
+	assert_string_equal(buf, "0xa4a7");
+	read_file(ts->root, "usb_gadget/g1/bcdUSB", buf, sizeof(buf));
+	assert_string_equal(buf, "0x0200");
+}
+
+/**
+ * @brief Tests batch following failed one
+ * @details Check if failed operations don't leave anything in ring
+ * which would be taken as result of next batch
+ */
+static void test_io_uring_failed_batch(void **state)
+{
+	struct io_test_state *ts = *state;
+	usbg_gadget_attrs attrs;
+	usbg_gadget *g;
+	int ret;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		g = usbg_get_gadget(ts->s, "broken");
+		assert_non_null(g);
+		ret = usbg_get_gadget_attrs(g, &attrs);
+		assert_int_not_equal(ret, USBG_SUCCESS);
+
+		g = usbg_get_gadget(ts->s, "g1");
+		assert_non_null(g);
+		memset(&attrs, 0, sizeof(attrs));
+		ret = usbg_get_gadget_attrs(g, &attrs);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_int_equal(attrs.bcdUSB, test_attrs.bcdUSB);
+		assert_int_equal(attrs.bcdDevice, test_attrs.bcdDevice);
+	}
+}
+
+/**
+ * @brief Tests committing transaction with io_uring
+ * @details Check if attributes and strings written in one batch
+ * land in right files
+ */
+static void test_io_uring_transaction(void **state)
+{
+	struct io_test_state *ts = *state;
+	usbg_gadget *g;
+	char buf[32];
+	int ret;
+
+	/* Plain directory doesn't get string files like configfs one */
+	make_dir(ts->root, "usb_gadget/g1/strings/0x409");
+	write_file(ts->root, "usb_gadget/g1/strings/0x409/serialnumber", "\n");
+	write_file(ts->root, "usb_gadget/g1/strings/0x409/product", "\n");
+
+	g = usbg_get_gadget(ts->s, "g1");
+	assert_non_null(g);
+
+	ret = usbg_begin_gadget_transaction(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_set_gadget_vendor_id(g, 0x0525);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_set_gadget_serial_number(g, 0x409, "serial");
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_set_gadget_product(g, 0x409, "product");
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_commit_gadget_transaction(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	read_file(ts->root, "usb_gadget/g1/idVendor", buf, sizeof(buf));
+	assert_string_equal(buf, "0x0525");
+	read_file(ts->root, "usb_gadget/g1/strings/0x409/serialnumber",
+		  buf, sizeof(buf));
+	assert_string_equal(buf, "serial");
+	read_file(ts->root, "usb_gadget/g1/strings/0x409/product",
+		  buf, sizeof(buf));
+	assert_string_equal(buf, "product");
+}
+
+#define USBG_IO_TEST(name, test) \
+	{name, test, setup_io_state, teardown_io_state}
+
+static struct CMUnitTest tests[] = {
+	USBG_IO_TEST("test_io_uring_gadget_attrs",
+		     test_io_uring_gadget_attrs),
+	USBG_IO_TEST("test_io_uring_failed_batch",
+		     test_io_uring_failed_batch),
+	USBG_IO_TEST("test_io_uring_transaction",
+		     test_io_uring_transaction),
+};
+
+int main(void)
+{
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
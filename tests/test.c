@@ -138,6 +138,17 @@ static struct test_function same_type_funcs[] = {
 	TEST_FUNCTION_LIST_END
 };
 
+/**
+ * @brief Functions with read only or virtual attributes
+ * @details Used to check if these attributes are skipped when copying
+ */
+static struct test_function clone_funcs[] = {
+	FUNC_FROM_TYPE(F_ACM),
+	FUNC_FROM_TYPE(F_FFS),
+	FUNC_FROM_TYPE(F_MASS_STORAGE),
+	TEST_FUNCTION_LIST_END
+};
+
 /**
  * @brief No functions at all
  * @details Check if gadget with no functions (or config with no bindings)
@@ -165,6 +176,14 @@ static struct test_config all_bindings_confs[] = {
 	TEST_CONFIG_LIST_END
 };
 
+/**
+ * @brief Configs bound to functions which are copied
+ */
+static struct test_config clone_confs[] = {
+	CONF_FROM_BOUND(clone_funcs),
+	TEST_CONFIG_LIST_END
+};
+
 #define GADGET(n, u, c, f) \
 	{ \
 		.name = n, \
@@ -189,6 +208,14 @@ static struct test_gadget all_funcs_gadgets[] = {
 	TEST_GADGET_LIST_END
 };
 
+/**
+ * @brief Gadget with functions and config to be copied
+ */
+static struct test_gadget clone_gadgets[] = {
+	GADGET("clone_gadget1", "UDC1", clone_confs, clone_funcs),
+	TEST_GADGET_LIST_END
+};
+
 static struct test_gadget long_udc_gadgets[] = {
 	GADGET("long_udc_gadgets", long_usbg_string, simple_confs, simple_funcs),
 	TEST_GADGET_LIST_END
@@ -220,6 +247,22 @@ static usbg_function_attrs writable_net_attrs = FUNC_ATTRS(USBG_F_ATTRS_NET, net
 static usbg_function_attrs writable_phonet_attrs = FUNC_ATTRS(USBG_F_ATTRS_PHONET, phonet, "");
 static usbg_function_attrs simple_ffs_attrs = FUNC_ATTRS(USBG_F_ATTRS_FFS, ffs, "0");
 static usbg_function_attrs writable_ffs_attrs = FUNC_ATTRS(USBG_F_ATTRS_FFS, ffs, "");
+static usbg_f_ms_lun_attrs writable_ms_lun0 = {
+	.id = 0,
+	.ro = true,
+	.filename = "/dev/sdb",
+};
+static usbg_f_ms_lun_attrs writable_ms_lun1 = {
+	.id = -1,
+	.cdrom = true,
+	.removable = true,
+};
+static usbg_f_ms_lun_attrs *writable_ms_luns[] = {
+	&writable_ms_lun0,
+	&writable_ms_lun1,
+	NULL,
+};
+static usbg_function_attrs writable_ms_attrs = FUNC_ATTRS(USBG_F_ATTRS_MS, ms, true, 2, writable_ms_luns);
 
 struct test_gadget_strs_data {
 	struct test_state *state;
@@ -242,6 +285,11 @@ static struct test_state simple_state = STATE("config", simple_gadgets, simple_u
  */
 static struct test_state all_funcs_state = STATE("all_funcs_configfs", all_funcs_gadgets, simple_udcs);
 
+/**
+ * @brief State with gadget to be copied
+ */
+static struct test_state clone_state = STATE("clone_configfs", clone_gadgets, simple_udcs);
+
 static struct test_state long_path_state = STATE(long_path_str, simple_gadgets, simple_udcs);
 
 static struct test_state long_udc_state = STATE("simple_path", long_udc_gadgets, long_udcs);
@@ -402,6 +450,15 @@ static int setup_long_path_state(void **state)
 	return 0;
 }
 
+/**
+ * @brief Setup state with gadget to be copied
+ */
+static int setup_clone_state(void **state)
+{
+	*state = prepare_state(&clone_state);
+	return 0;
+}
+
 /**
  * @brief Setup state with long udc name
  */
@@ -503,6 +560,12 @@ static int setup_f_ecm_writable_attrs(void **state)
 	return 0;
 }
 
+static int setup_f_ms_writable_attrs(void **state)
+{
+	*state = setup_f_attrs(F_MASS_STORAGE, &writable_ms_attrs);
+	return 0;
+}
+
 static int setup_f_subset_attrs(void **state)
 {
 	*state = setup_f_attrs(F_SUBSET, &simple_net_attrs);
@@ -633,6 +696,63 @@ static void test_get_first_gadget_fail(void **state)
 	assert_null(g);
 }
 
+static void try_get_functions_by_index(usbg_gadget *g, struct test_gadget *tg)
+{
+	usbg_function **functions;
+	usbg_function *f;
+	int n, i;
+
+	for (n = 0; tg->functions[n].instance; n++)
+		;
+
+	assert_int_equal(usbg_get_function_count(g), n);
+	assert_int_equal(usbg_get_functions(g, &functions), n);
+
+	f = usbg_get_first_function(g);
+	for (i = 0; i < n; i++) {
+		assert_ptr_equal(usbg_get_function_at(g, i), f);
+		assert_ptr_equal(functions[i], f);
+		assert_func_equal(f, &tg->functions[i]);
+		f = usbg_get_next_function(f);
+	}
+	assert_null(usbg_get_function_at(g, n));
+	free(functions);
+}
+
+/**
+ * @brief Tests count and index based access to gadgets and functions
+ * @details Check if objects are returned in the same order as by
+ * usbg_get_first_*() and usbg_get_next_*()
+ */
+static void test_get_by_index(void **state)
+{
+	usbg_gadget **gadgets;
+	usbg_gadget *g;
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	int n, i;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (n = 0; ts->gadgets[n].name; n++)
+		;
+
+	assert_int_equal(usbg_get_gadget_count(s), n);
+	assert_int_equal(usbg_get_gadgets(s, &gadgets), n);
+
+	g = usbg_get_first_gadget(s);
+	for (i = 0; i < n; i++) {
+		assert_ptr_equal(usbg_get_gadget_at(s, i), g);
+		assert_ptr_equal(gadgets[i], g);
+		g = usbg_get_next_gadget(g);
+	}
+	assert_null(usbg_get_gadget_at(s, n));
+	assert_null(usbg_get_gadget_at(s, -1));
+	free(gadgets);
+
+	for_each_test_gadget(ts, s, try_get_functions_by_index);
+}
+
 static void try_get_gadget_name(usbg_gadget *g, struct test_gadget *tg)
 {
 	const char *name;
@@ -760,6 +880,188 @@ static void test_init(void **state)
 	assert_state_equal(s, st);
 }
 
+/**
+ * @brief Tests init in lazy mode
+ * @details Check if gadgets content is parsed on first access and
+ * usbg state match given state
+ */
+static void test_init_lazy(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	struct test_gadget *tg;
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	push_init_opts(st, USBG_INIT_LAZY, NULL);
+	ret = usbg_init_opts(st->configfs_path, USBG_INIT_LAZY, NULL, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	/* Gadgets are accessed in order by assert_state_equal() */
+	for (tg = st->gadgets; tg->name; tg++)
+		push_lazy_gadget(tg);
+
+	assert_state_equal(s, st);
+}
+
+/**
+ * @brief Tests init with gadgets parsed by worker threads
+ * @details Check if usbg state match given state and gadgets
+ * are in the same order as with sequential parsing
+ */
+static void test_init_parallel(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	push_init_opts(st, USBG_INIT_PARALLEL, NULL);
+	ret = usbg_init_opts(st->configfs_path, USBG_INIT_PARALLEL, NULL, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	assert_state_equal(s, st);
+}
+
+/**
+ * @brief Tests init without sorting
+ * @details Check if usbg state match given state after it has
+ * been sorted on demand
+ */
+static void test_init_unordered(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	push_init_opts(st, USBG_INIT_UNORDERED, NULL);
+	ret = usbg_init_opts(st->configfs_path, USBG_INIT_UNORDERED, NULL, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	ret = usbg_sort_state(s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	assert_state_equal(s, st);
+}
+
+/**
+ * @brief Tests init with gadget name filter
+ * @details Check if only gadgets matching pattern are parsed
+ */
+static void test_init_filter(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	struct test_gadget *tg;
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	tg = st->gadgets;
+	push_init_opts(st, 0, tg->name);
+	ret = usbg_init_opts(st->configfs_path, 0, tg->name, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	assert_gadget_equal(usbg_get_first_gadget(s), tg);
+	for (tg++; tg->name; tg++)
+		assert_null(usbg_get_gadget(s, tg->name));
+
+	push_init_opts(st, 0, "*not_matching");
+	usbg_cleanup(s);
+	*state = NULL;
+	ret = usbg_init_opts(st->configfs_path, 0, "*not_matching", &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	assert_null(usbg_get_first_gadget(s));
+}
+
+struct test_changes {
+	int count[USBG_CHANGE_MODIFIED + 1][USBG_OBJ_UDC + 1];
+};
+
+static void count_change(usbg_change_type change, usbg_object_type type,
+		void *obj, void *data)
+{
+	struct test_changes *changes = data;
+
+	assert_non_null(obj);
+	changes->count[change][type]++;
+}
+
+/**
+ * @brief Tests refresh when nothing has changed
+ * @details Check if no change is reported and all objects are kept
+ */
+static void test_refresh_unchanged(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+
+	safe_init_with_state(state, &st, &s);
+
+	g = usbg_get_first_gadget(s);
+	f = usbg_get_first_function(g);
+	c = usbg_get_first_config(g);
+
+	push_refresh(st);
+	ret = usbg_refresh(s, NULL, NULL);
+	assert_int_equal(ret, 0);
+
+	assert_ptr_equal(usbg_get_first_gadget(s), g);
+	assert_ptr_equal(usbg_get_first_function(g), f);
+	assert_ptr_equal(usbg_get_first_config(g), c);
+	assert_state_equal(s, st);
+}
+
+/**
+ * @brief Tests refresh after all gadgets has been removed
+ * @details Check if each gadget removal is reported
+ */
+static void test_refresh_removed(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	struct test_state empty;
+	struct test_gadget no_gadgets[] = {
+		TEST_GADGET_LIST_END
+	};
+	struct test_gadget *tg;
+	struct test_changes changes;
+	int ret, n = 0;
+
+	safe_init_with_state(state, &st, &s);
+
+	for (tg = st->gadgets; tg->name; tg++)
+		n++;
+
+	empty = *st;
+	empty.gadgets = no_gadgets;
+	memset(&changes, 0, sizeof(changes));
+
+	push_refresh(&empty);
+	ret = usbg_refresh(s, count_change, &changes);
+	assert_int_equal(ret, n);
+	assert_int_equal(changes.count[USBG_CHANGE_REMOVED][USBG_OBJ_GADGET], n);
+	assert_null(usbg_get_first_gadget(s));
+}
+
 /**
  * @brief Test getting function by name
  * @param[in] state Pointer to pointer to correctly initialized test_state structure
@@ -1173,90 +1475,1275 @@ static void test_get_config_id(void **state)
 	usbg_state *s = NULL;
 	struct test_state *ts;
 
-	safe_init_with_state(state, &ts, &s);
-	for_each_test_config(ts, s, try_get_config_id);
+	safe_init_with_state(state, &ts, &s);
+	for_each_test_config(ts, s, try_get_config_id);
+}
+
+/**
+ * @brief Test getting given attributes from gadgets present in state
+ * @param[in] s Pointer to usbg state
+ * @param[in] ts Pointer to test state matching given usbg state
+ * @param[in] attrs Pointer to gadget attributes which should be put in
+ * virtual filesystem for writting by usbg
+ */
+static void try_get_gadget_attrs(usbg_state *s, struct test_state *ts,
+		usbg_gadget_attrs *attrs)
+{
+	usbg_gadget *g = NULL;
+	usbg_gadget_attrs actual;
+	struct test_gadget *tg;
+	int ret;
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		push_gadget_attrs(tg, attrs);
+		ret = usbg_get_gadget_attrs(g, &actual);
+
+		assert_int_equal(ret, 0);
+		assert_gadget_attrs_equal(&actual, attrs);
+	}
+}
+
+/**
+ * @brief Tests getting gadget attributes
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_get_gadget_attrs(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+
+	safe_init_with_state(state, &ts, &s);
+
+	try_get_gadget_attrs(s, ts, &min_gadget_attrs);
+	try_get_gadget_attrs(s, ts, &max_gadget_attrs);
+	try_get_gadget_attrs(s, ts, get_random_gadget_attrs());
+}
+
+/**
+ * @brief Test getting all gadget attributes with single vectored read
+ * @param[in] s Pointer to usbg state
+ * @param[in] ts Pointer to test state matching given usbg state
+ * @param[in] attrs Pointer to gadget attributes which should be put in
+ * virtual filesystem for reading by usbg
+ */
+static void try_get_gadget_attr_vec(usbg_state *s, struct test_state *ts,
+		usbg_gadget_attrs *attrs)
+{
+	usbg_gadget *g = NULL;
+	struct test_gadget *tg;
+	usbg_attr_io io[USBG_GADGET_ATTR_MAX];
+	int vals[USBG_GADGET_ATTR_MAX];
+	int ret;
+	int i;
+
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; i++) {
+		io[i].name = usbg_get_gadget_attr_str(i);
+		io[i].type = USBG_ATTR_HEX;
+		io[i].dest = &vals[i];
+	}
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		push_gadget_attrs(tg, attrs);
+		ret = usbg_get_gadget_attr_vec(g, io, USBG_GADGET_ATTR_MAX);
+
+		assert_int_equal(ret, 0);
+		for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; i++)
+			assert_int_equal(vals[i], get_gadget_attr(attrs, i));
+	}
+}
+
+/**
+ * @brief Tests getting gadget attributes using vectored read
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_get_gadget_attr_vec(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+
+	safe_init_with_state(state, &ts, &s);
+
+	try_get_gadget_attr_vec(s, ts, &min_gadget_attrs);
+	try_get_gadget_attr_vec(s, ts, &max_gadget_attrs);
+	try_get_gadget_attr_vec(s, ts, get_random_gadget_attrs());
+}
+
+/**
+ * @brief Tests getting gadget attributes in cache mode
+ * @details Check if attributes are read only once and read again
+ * after invalidation
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_get_gadget_attrs_cached(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	struct test_gadget *tg;
+	usbg_gadget *g;
+	usbg_gadget_attrs actual;
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	push_init_opts(st, USBG_INIT_CACHE, NULL);
+	ret = usbg_init_opts(st->configfs_path, USBG_INIT_CACHE, NULL, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	for (tg = st->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		push_gadget_attrs(tg, &min_gadget_attrs);
+		ret = usbg_get_gadget_attrs(g, &actual);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_gadget_attrs_equal(&actual, &min_gadget_attrs);
+
+		/* No file is read this time */
+		ret = usbg_get_gadget_attrs(g, &actual);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_gadget_attrs_equal(&actual, &min_gadget_attrs);
+		assert_int_equal(usbg_get_gadget_attr(g, ID_VENDOR),
+				 min_gadget_attrs.idVendor);
+
+		usbg_invalidate_gadget(g);
+		push_gadget_attrs(tg, &max_gadget_attrs);
+		ret = usbg_get_gadget_attrs(g, &actual);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_gadget_attrs_equal(&actual, &max_gadget_attrs);
+	}
+}
+
+/**
+ * @brief Tests getting gadget strings in cache mode
+ * @details Check if strings are read only once and read again
+ * after their language has been removed
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_get_gadget_strs_cached(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	struct test_gadget *tg;
+	usbg_gadget *g;
+	usbg_gadget_strs strs = {
+		.str_ser = "serial",
+		.str_mnf = "manufacturer",
+		.str_prd = "product",
+	};
+	usbg_gadget_strs actual;
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	push_init_opts(st, USBG_INIT_CACHE, NULL);
+	ret = usbg_init_opts(st->configfs_path, USBG_INIT_CACHE, NULL, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	for (tg = st->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		push_gadget_strs(tg, LANG_US_ENG, &strs);
+		ret = usbg_get_gadget_strs(g, LANG_US_ENG, &actual);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_gadget_strs_equal(&actual, &strs);
+
+		/* No file is read this time */
+		ret = usbg_get_gadget_strs(g, LANG_US_ENG, &actual);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_gadget_strs_equal(&actual, &strs);
+
+		/* Cache is dropped whatever the result of removal is */
+		usbg_rm_gadget_strs(g, LANG_US_ENG);
+		push_gadget_strs(tg, LANG_US_ENG, &strs);
+		ret = usbg_get_gadget_strs(g, LANG_US_ENG, &actual);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_gadget_strs_equal(&actual, &strs);
+	}
+}
+
+/**
+ * @brief Test setting given attributes on gadgets present in state
+ * @param[in] s Pointer to usbg state
+ * @param[in] ts Pointer to test state matching given usbg state
+ * @param[in] attrs Pointer to gadget attributes to be set
+ */
+static void try_set_gadget_attrs(usbg_state *s, struct test_state *ts,
+		usbg_gadget_attrs *attrs)
+{
+	usbg_gadget *g = NULL;
+	struct test_gadget *tg;
+	int ret;
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		pull_gadget_attrs(tg, attrs);
+		ret = usbg_set_gadget_attrs(g, attrs);
+
+		assert_int_equal(ret, 0);
+	}
+}
+/**
+ * @brief Tests setting gadget attributes
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_set_gadget_attrs(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+
+	safe_init_with_state(state, &ts, &s);
+
+	try_set_gadget_attrs(s, ts, &min_gadget_attrs);
+	try_set_gadget_attrs(s, ts, &max_gadget_attrs);
+	try_set_gadget_attrs(s, ts, get_random_gadget_attrs());
+}
+
+/**
+ * @brief Tests setting gadget attributes in transaction
+ * @details Check if nothing is written until commit and only
+ * changed attribute is written then
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_gadget_transaction(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg;
+	usbg_gadget *g;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		ret = usbg_begin_gadget_transaction(g);
+		assert_int_equal(ret, USBG_SUCCESS);
+		ret = usbg_begin_gadget_transaction(g);
+		assert_int_equal(ret, USBG_ERROR_BUSY);
+
+		ret = usbg_set_gadget_attrs(g, &min_gadget_attrs);
+		assert_int_equal(ret, USBG_SUCCESS);
+		ret = usbg_set_gadget_vendor_id(g, max_gadget_attrs.idVendor);
+		assert_int_equal(ret, USBG_SUCCESS);
+
+		push_gadget_attrs(tg, &min_gadget_attrs);
+		pull_gadget_attribute(tg, ID_VENDOR, max_gadget_attrs.idVendor);
+		ret = usbg_commit_gadget_transaction(g);
+		assert_int_equal(ret, USBG_SUCCESS);
+
+		/* Transaction is closed after commit */
+		ret = usbg_commit_gadget_transaction(g);
+		assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+	}
+}
+
+/**
+ * @brief Tests rollback of transaction
+ * @details Check if language directory is created only on commit
+ * and if it is removed together with restoring written attribute
+ * when write fails
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_gadget_transaction_rollback(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg;
+	usbg_gadget *g;
+	int lang = 0x415;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		ret = usbg_begin_gadget_transaction(g);
+		assert_int_equal(ret, USBG_SUCCESS);
+
+		ret = usbg_set_gadget_vendor_id(g, max_gadget_attrs.idVendor);
+		assert_int_equal(ret, USBG_SUCCESS);
+		ret = usbg_set_gadget_serial_number(g, lang, "serial");
+		assert_int_equal(ret, USBG_SUCCESS);
+
+		push_gadget_attrs(tg, &min_gadget_attrs);
+		push_missing_gadget_string(tg, lang, STR_SER);
+		pull_new_gadget_str_dir(tg, lang);
+		pull_gadget_attribute(tg, ID_VENDOR, max_gadget_attrs.idVendor);
+		pull_gadget_string_error(tg, lang, STR_SER, "serial", EIO);
+		pull_gadget_attribute(tg, ID_VENDOR, min_gadget_attrs.idVendor);
+		pull_rm_gadget_str_dir(tg, lang);
+		ret = usbg_commit_gadget_transaction(g);
+		assert_int_equal(ret, USBG_ERROR_IO);
+	}
+}
+
+/**
+ * @brief Tests setting function attributes in transaction
+ * @details Check if nothing is written until commit and only
+ * changed attributes are written then
+ * @param[in] state Pointer to pointer to correctly initialized state
+ */
+static void test_function_transaction(void **state)
+{
+	struct test_function_attrs_data *data;
+	struct test_function *tf;
+	struct ether_addr addr = {{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 }};
+	usbg_state *s;
+	usbg_function *f;
+	usbg_gadget *g;
+	int ret;
+
+	data = (struct test_function_attrs_data *)(*state);
+	*state = NULL;
+
+	init_with_state(data->state, &s);
+	*state = s;
+
+	g = usbg_get_first_gadget(s);
+	assert_non_null(g);
+	f = usbg_get_first_function(g);
+	assert_non_null(f);
+	tf = &data->state->gadgets[0].functions[0];
+
+	ret = usbg_begin_gadget_transaction(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_set_function_attrs(f, data->attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_set_net_host_addr(f, &addr);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	push_function_attrs(tf, &simple_net_attrs);
+	pull_function_attr(tf, "host_addr", "02:00:00:00:00:01");
+	pull_function_attr(tf, "qmult", "42\n");
+	ret = usbg_commit_gadget_transaction(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+}
+
+/**
+ * @brief Tests locking state for reading
+ * @details Check if lookups work while state is locked and changes
+ * made by the same thread are refused instead of deadlocking
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_lock_state(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg;
+	usbg_gadget *g;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		usbg_lock_state(s);
+		usbg_lock_state(s);
+
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+		assert_ptr_equal(usbg_get_first_gadget(s), g);
+
+		ret = usbg_rm_gadget(g, USBG_RM_RECURSE);
+		assert_int_equal(ret, USBG_ERROR_BUSY);
+
+		usbg_unlock_state(s);
+		ret = usbg_create_gadget(s, tg->name, NULL, NULL, &g);
+		assert_int_equal(ret, USBG_ERROR_BUSY);
+
+		usbg_unlock_state(s);
+		assert_ptr_equal(usbg_get_gadget(s, tg->name), g);
+	}
+}
+
+/**
+ * @brief Tests locking two states by one thread
+ * @details Check if thread which holds lock of one state is still
+ * recognized as holder of the other one after the first is unlocked
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_lock_two_states(void **state)
+{
+	usbg_state *s = NULL;
+	usbg_state *s2 = NULL;
+	struct test_state *ts;
+	usbg_gadget *g;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+	init_with_state(ts, &s2);
+
+	usbg_lock_state(s);
+	usbg_lock_state(s2);
+	usbg_unlock_state(s);
+
+	g = usbg_get_gadget(s2, ts->gadgets[0].name);
+	assert_non_null(g);
+
+	/* Would deadlock if s2 was not known to be held shared */
+	ret = usbg_rm_gadget(g, USBG_RM_RECURSE);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+
+	usbg_unlock_state(s2);
+	assert_ptr_equal(usbg_get_gadget(s2, ts->gadgets[0].name), g);
+
+	usbg_cleanup(s2);
+}
+
+/**
+ * @brief Tests planning reconciliation of gadget with empty description
+ * @details Check if all configs and functions are going to be removed
+ * and gadget is disabled for that time. Nothing should be written.
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_reconcile_dry_run(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg;
+	struct test_config *tc;
+	struct test_function *tf;
+	usbg_gadget_desc desc = {0};
+	usbg_gadget *g;
+	usbg_op *ops;
+	int count, i;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		push_gadget_udc(tg);
+		count = usbg_reconcile_gadget(g, &desc, USBG_RECONCILE_DRY_RUN,
+					      &ops);
+		assert_true(count > 0);
+		assert_non_null(ops);
+
+		i = 0;
+		assert_int_equal(ops[i++].type, USBG_OP_DISABLE_GADGET);
+		for (tc = tg->configs; tc->label; tc++)
+			assert_int_equal(ops[i++].type, USBG_OP_RM_CONFIG);
+		for (tf = tg->functions; tf->instance; tf++)
+			assert_int_equal(ops[i++].type, USBG_OP_RM_FUNCTION);
+		assert_int_equal(ops[i++].type, USBG_OP_ENABLE_GADGET);
+		assert_int_equal(count, i);
+
+		free(ops);
+	}
+}
+
+/**
+ * @brief Tests creating many gadgets from one template
+ * @details Check if directories of all gadgets are created before any
+ * attribute is written and serial number is taken from override
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_create_gadgets(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget tg[3];
+	usbg_gadget_strs strs = {
+		.str_mnf = "manufacturer",
+		.str_prd = "product",
+	};
+	usbg_gadget_desc tmpl = {
+		.attrs = &max_gadget_attrs,
+		.strs = &strs,
+	};
+	usbg_gadget_override overrides[ARRAY_SIZE(tg)];
+	usbg_gadget *gadgets[ARRAY_SIZE(tg)];
+	/* Expected strings are compared when written, keep them all */
+	usbg_gadget_strs expected[ARRAY_SIZE(tg)];
+	int i;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (i = 0; i < ARRAY_SIZE(tg); i++) {
+		memset(tg + i, 0, sizeof(tg[i]));
+		safe_asprintf(&tg[i].name, "batch%d", i);
+		tg[i].path = ts->path;
+		expected[i] = strs;
+		snprintf(expected[i].str_ser, sizeof(expected[i].str_ser),
+			 "%08d", i);
+		overrides[i].serial = expected[i].str_ser;
+		overrides[i].attrs = NULL;
+		pull_create_gadget_dir(tg + i);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(tg); i++) {
+		pull_gadget_attrs(tg + i, &max_gadget_attrs);
+		pull_gadget_strs(tg + i, LANG_US_ENG, expected + i);
+	}
+
+	ret = usbg_create_gadgets(s, "batch", ARRAY_SIZE(tg), &tmpl,
+				  overrides, gadgets);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	for (i = 0; i < ARRAY_SIZE(tg); i++) {
+		assert_non_null(gadgets[i]);
+		assert_string_equal(usbg_get_gadget_name(gadgets[i]),
+				    tg[i].name);
+		assert_ptr_equal(usbg_get_gadget(s, tg[i].name), gadgets[i]);
+	}
+}
+
+/**
+ * @brief Tests cloning gadget
+ * @details Check if attributes and strings are copied from source gadget
+ * and serial number is taken from override
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_clone_gadget(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_state *empty;
+	struct test_gadget *tg;
+	struct test_gadget clone;
+	usbg_gadget_strs strs = {
+		.str_ser = "serial",
+		.str_mnf = "manufacturer",
+		.str_prd = "product",
+	};
+	usbg_gadget_strs expected = strs;
+	usbg_gadget_override override = {
+		.serial = "clone serial",
+	};
+	int lang = LANG_US_ENG;
+	usbg_gadget *g;
+	int ret;
+
+	ts = (struct test_state *)(*state);
+	*state = NULL;
+
+	empty = build_empty_gadget_state(ts);
+
+	init_with_state(empty, &s);
+	*state = s;
+
+	strcpy(expected.str_ser, override.serial);
+	for (tg = empty->gadgets; tg->name; tg++) {
+		memset(&clone, 0, sizeof(clone));
+		safe_asprintf(&clone.name, "%s_clone", tg->name);
+		clone.path = tg->path;
+		clone.udc = "";
+
+		push_gadget_attrs(tg, &max_gadget_attrs);
+		pull_create_gadget(&clone);
+		pull_gadget_attrs(&clone, &max_gadget_attrs);
+		push_gadget_str_langs(tg, &lang, 1);
+		push_gadget_strs(tg, LANG_US_ENG, &strs);
+		pull_gadget_strs(&clone, LANG_US_ENG, &expected);
+
+		ret = usbg_clone_gadget(usbg_get_gadget(s, tg->name),
+					clone.name, &override, &g);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_non_null(g);
+		assert_string_equal(usbg_get_gadget_name(g), clone.name);
+		assert_ptr_equal(usbg_get_gadget(s, clone.name), g);
+		assert_null(usbg_get_first_function(g));
+		assert_null(usbg_get_first_config(g));
+	}
+}
+
+/**
+ * @brief Tests cloning gadget with network function
+ * @details Check if function of clone gets MAC addresses which differ
+ * from those of source function
+ * @param[in] state Pointer to pointer to correctly initialized state
+ */
+static void test_clone_gadget_net(void **state)
+{
+	struct test_function_attrs_data *data;
+	usbg_function_attrs attrs;
+	struct test_gadget *tg;
+	struct test_gadget clone;
+	struct test_function clone_func;
+	struct ether_addr dev_addr = {{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 }};
+	struct ether_addr host_addr = {{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 }};
+	usbg_state *s;
+	usbg_gadget *g;
+	int ret;
+
+	data = (struct test_function_attrs_data *)(*state);
+	*state = NULL;
+
+	init_with_state(data->state, &s);
+	*state = s;
+
+	tg = data->state->gadgets;
+	attrs = *data->attrs;
+	attrs.attrs.net.dev_addr = dev_addr;
+	attrs.attrs.net.host_addr = host_addr;
+
+	memset(&clone, 0, sizeof(clone));
+	safe_asprintf(&clone.name, "%s_clone", tg->name);
+	clone.path = tg->path;
+	clone.udc = "";
+	clone_func = tg->functions[0];
+	clone_func.attrs = NULL;
+	safe_asprintf(&clone_func.path, "%s/%s/functions",
+		      clone.path, clone.name);
+
+	push_gadget_attrs(tg, &max_gadget_attrs);
+	pull_create_gadget(&clone);
+	pull_gadget_attrs(&clone, &max_gadget_attrs);
+	push_gadget_str_langs(tg, NULL, 0);
+	push_function_attrs(tg->functions, &attrs);
+	pull_create_function(&clone_func);
+	pull_function_new_ether_addr(&clone_func, "dev_addr",
+				     "02:00:00:00:00:01");
+	pull_function_new_ether_addr(&clone_func, "host_addr",
+				     "02:00:00:00:00:02");
+	pull_function_attr(&clone_func, "qmult", "1\n");
+
+	ret = usbg_clone_gadget(usbg_get_gadget(s, tg->name), clone.name,
+				NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_non_null(usbg_get_function(g, tg->functions[0].type,
+					  tg->functions[0].instance));
+}
+
+/* Attributes of source function of each type in clone_state */
+static usbg_function_attrs *clone_func_attrs(usbg_function_type type)
+{
+	switch (type) {
+	case F_ACM:
+		return &simple_serial_attrs;
+	case F_FFS:
+		return &simple_ffs_attrs;
+	case F_MASS_STORAGE:
+		return &writable_ms_attrs;
+	default:
+		fail();
+	}
+
+	return NULL;
+}
+
+static struct test_function *find_test_function(struct test_function *funcs,
+		struct test_function *which)
+{
+	for (; funcs->instance; funcs++)
+		if (funcs->type == which->type &&
+		    !strcmp(funcs->instance, which->instance))
+			return funcs;
+
+	fail();
+	return NULL;
+}
+
+/**
+ * @brief Tests cloning gadget with functions and configs
+ * @details Check if read only and virtual attributes of functions
+ * are not written to clone and bindings link to copied functions
+ * @param[in] state Pointer to pointer to correctly initialized state
+ */
+static void test_clone_gadget_content(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg;
+	struct test_gadget clone;
+	struct test_function *tf, *funcs;
+	struct test_config *tc;
+	struct test_config conf;
+	struct test_binding *tb;
+	struct test_binding binding;
+	usbg_function_attrs *attrs;
+	usbg_binding *b;
+	usbg_function *f;
+	usbg_config *c;
+	usbg_gadget *g;
+	int count = 0;
+	int i;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+	tg = ts->gadgets;
+
+	memset(&clone, 0, sizeof(clone));
+	safe_asprintf(&clone.name, "%s_clone", tg->name);
+	clone.path = tg->path;
+	clone.udc = "";
+
+	for (tf = tg->functions; tf->instance; tf++)
+		count++;
+
+	funcs = safe_calloc(count + 1, sizeof(*funcs));
+
+	push_gadget_attrs(tg, &max_gadget_attrs);
+	pull_create_gadget(&clone);
+	pull_gadget_attrs(&clone, &max_gadget_attrs);
+	push_gadget_str_langs(tg, NULL, 0);
+
+	for (i = 0; i < count; i++) {
+		attrs = clone_func_attrs(tg->functions[i].type);
+		funcs[i] = tg->functions[i];
+		safe_asprintf(&funcs[i].path, "%s/%s/functions",
+			      clone.path, clone.name);
+		/* Nothing is written for functions without writable attrs */
+		funcs[i].attrs = attrs->header.attrs_type == USBG_F_ATTRS_MS ?
+			attrs : NULL;
+
+		push_function_attrs(tg->functions + i, attrs);
+		pull_create_function(funcs + i);
+	}
+
+	for (tc = tg->configs; tc->label; tc++) {
+		conf = *tc;
+		safe_asprintf(&conf.path, "%s/%s/configs",
+			      clone.path, clone.name);
+		conf.attrs = &max_config_attrs;
+		conf.strs = NULL;
+
+		push_config_attrs(tc, &max_config_attrs);
+		pull_create_config(&conf);
+		push_config_str_langs(tc, NULL, 0);
+
+		for (tb = tc->bindings; tb->name; tb++) {
+			binding = *tb;
+			binding.target = find_test_function(funcs, tb->target);
+			pull_add_binding(&conf, &binding);
+		}
+	}
+
+	ret = usbg_clone_gadget(usbg_get_gadget(s, tg->name), clone.name,
+				NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	for (tf = tg->functions; tf->instance; tf++)
+		assert_non_null(usbg_get_function(g, tf->type, tf->instance));
+
+	for (tc = tg->configs; tc->label; tc++) {
+		c = usbg_get_config(g, tc->id, tc->label);
+		assert_non_null(c);
+
+		/* Each binding links function of clone */
+		count = 0;
+		for (b = usbg_get_first_binding(c); b;
+		     b = usbg_get_next_binding(b)) {
+			f = usbg_get_binding_target(b);
+			assert_ptr_equal(f, usbg_get_function(g,
+					usbg_get_function_type(f),
+					usbg_get_function_instance(f)));
+			count++;
+		}
+
+		for (tb = tc->bindings; tb->name; tb++)
+			count--;
+		assert_int_equal(count, 0);
+	}
+}
+
+/**
+ * @brief Tests removing all gadgets
+ * @details Check if bound gadgets are disabled and content of each
+ * gadget is removed before the gadget itself
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_rm_all_gadgets(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg;
+	usbg_udc *u;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (tg = ts->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			pull_disable_gadget(tg);
+
+	for (tg = ts->gadgets; tg->name; tg++)
+		pull_rm_gadget(tg);
+
+	ret = usbg_rm_all_gadgets(s, USBG_RM_RECURSE);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_null(usbg_get_first_gadget(s));
+
+	for (u = usbg_get_first_udc(s); u; u = usbg_get_next_udc(u))
+		assert_null(usbg_get_udc_gadget(u));
+}
+
+/**
+ * @brief Tests switching gadget bound to UDC
+ * @details Check if bound gadget is unbound, new one is bound and
+ * both gadget and UDC point to each other afterwards
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_switch_gadget(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg;
+	struct test_gadget to;
+	usbg_gadget *from, *g;
+	uint64_t latency = UINT64_MAX;
+	usbg_udc *u;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (tg = ts->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			break;
+	assert_non_null(tg->name);
+
+	memset(&to, 0, sizeof(to));
+	to.name = "switched";
+	to.path = tg->path;
+	to.udc = "";
+
+	pull_create_gadget(&to);
+	ret = usbg_create_gadget(s, to.name, NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	from = usbg_get_gadget(s, tg->name);
+	u = usbg_get_udc(s, tg->udc);
+
+	pull_switch_gadget(tg, &to, tg->udc);
+	ret = usbg_switch_gadget(u, from, g, &latency);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(latency < UINT64_MAX);
+
+	to.udc = tg->udc;
+	push_gadget_udc(&to);
+	assert_ptr_equal(usbg_get_udc_gadget(u), g);
+
+	/* Old gadget is no longer bound */
+	ret = usbg_switch_gadget(u, from, g, NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+}
+
+/**
+ * @brief Tests switching gadgets from warm pool
+ * @details Check if gadget removed from state leaves the pool and
+ * if switch notices that kernel has unbound gadget in the meantime
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_warm_pool(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+	struct test_gadget *tg, *other;
+	struct test_config no_configs[] = { TEST_CONFIG_LIST_END };
+	struct test_function no_funcs[] = { TEST_FUNCTION_LIST_END };
+	struct test_gadget to;
+	usbg_gadget_desc desc = {
+		.attrs = &max_gadget_attrs,
+	};
+	usbg_warm_pool *p;
+	usbg_gadget *g, *pooled;
+	usbg_udc *u;
+	int fd;
+	int ret;
+
+	safe_init_with_state(state, &ts, &s);
+
+	for (tg = ts->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			break;
+	assert_non_null(tg->name);
+
+	u = usbg_get_udc(s, tg->udc);
+	ret = usbg_warm_pool_new(u, &p);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	memset(&to, 0, sizeof(to));
+	to.name = "pooled";
+	to.path = tg->path;
+	to.udc = "";
+	to.configs = no_configs;
+	to.functions = no_funcs;
+
+	/* New gadget which needs some work to match description */
+	pull_create_gadget(&to);
+	fd = pull_open_udc_file(&to);
+	/* Read once to plan and once more to write only what differs */
+	push_gadget_attrs(&to, &min_gadget_attrs);
+	push_gadget_attrs(&to, &min_gadget_attrs);
+	pull_gadget_attrs(&to, &max_gadget_attrs);
+	ret = usbg_warm_pool_add(p, to.name, &desc, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Gadget already in pool is taken as it is */
+	ret = usbg_warm_pool_add(p, to.name, NULL, &pooled);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_ptr_equal(pooled, g);
+
+	/* Kernel has unbound gadget, so there is nothing to unbind */
+	tg->udc = "";
+	for (other = ts->gadgets; other->name; other++)
+		push_gadget_udc(other);
+	push_gadget_udc(&to);
+	pull_write_fd(fd, u->name);
+	ret = usbg_warm_pool_switch(p, to.name, NULL);
+	tg->udc = u->name;
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	to.udc = tg->udc;
+	push_gadget_udc(&to);
+	assert_ptr_equal(usbg_get_udc_gadget(u), g);
+
+	/* Removed gadgets leave the pool */
+	pull_disable_gadget(&to);
+	for (other = ts->gadgets; other->name; other++)
+		pull_rm_gadget(other);
+	pull_rm_gadget(&to);
+	pull_close_fd(fd);
+	ret = usbg_rm_all_gadgets(s, USBG_RM_RECURSE);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_warm_pool_switch(p, to.name, NULL);
+	assert_int_equal(ret, USBG_ERROR_NOT_FOUND);
+
+	usbg_warm_pool_free(p);
+}
+
+/**
+ * @brief Tests watching UDCs
+ * @details Check if binding and state of UDC are returned without
+ * reading any file and updated when kernel sends notification
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_watch_udcs(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	struct test_gadget *tg;
+	struct test_gadget detached;
+	usbg_gadget *g;
+	usbg_udc *u;
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	push_init_opts(st, USBG_INIT_WATCH, NULL);
+	ret = usbg_init_opts(st->configfs_path, USBG_INIT_WATCH, NULL, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	for (tg = st->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			break;
+	assert_non_null(tg->name);
+
+	g = usbg_get_gadget(s, tg->name);
+	u = usbg_get_udc(s, tg->udc);
+
+	/* No file is read */
+	assert_ptr_equal(usbg_get_gadget_udc(g), u);
+	assert_ptr_equal(usbg_get_udc_gadget(u), g);
+	assert_int_equal(usbg_get_udc_state(u), USBG_UDC_STATE_NOT_ATTACHED);
+
+	push_udc_state_change(tg->udc, "configured\n");
+	assert_int_equal(usbg_get_udc_state(u), USBG_UDC_STATE_CONFIGURED);
+	assert_int_equal(usbg_get_udc_state(u), USBG_UDC_STATE_CONFIGURED);
+
+	/* Kernel detaches gadget on its own */
+	detached = *tg;
+	detached.udc = "";
+	push_udc_uevent("change", tg->udc);
+	push_gadget_udc(&detached);
+	assert_null(usbg_get_gadget_udc(g));
+	assert_null(usbg_get_udc_gadget(u));
+
+	pull_unwatch_udcs();
+	usbg_cleanup(s);
+	*state = NULL;
+}
+
+struct test_events {
+	usbg_event events[4];
+	int count;
+};
+
+static void record_event(const usbg_event *ev, void *data)
+{
+	struct test_events *te = data;
+
+	assert_true(te->count < ARRAY_SIZE(te->events));
+	te->events[te->count++] = *ev;
+}
+
+static const usbg_event *find_event(struct test_events *te,
+				    usbg_event_type type)
+{
+	int i;
+
+	for (i = 0; i < te->count; i++)
+		if (te->events[i].type == type)
+			return &te->events[i];
+
+	return NULL;
 }
 
 /**
- * @brief Test getting given attributes from gadgets present in state
- * @param[in] s Pointer to usbg state
- * @param[in] ts Pointer to test state matching given usbg state
- * @param[in] attrs Pointer to gadget attributes which should be put in
- * virtual filesystem for writting by usbg
- */
-static void try_get_gadget_attrs(usbg_state *s, struct test_state *ts,
-		usbg_gadget_attrs *attrs)
+ * @brief Tests processing events
+ * @details Check if change of UDC state and gadget detached by kernel
+ * are reported after event fd has been requested
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_process_events(void **state)
 {
-	usbg_gadget *g = NULL;
-	usbg_gadget_attrs actual;
+	usbg_state *s = NULL;
+	struct test_state *st;
 	struct test_gadget *tg;
+	struct test_gadget detached;
+	struct test_events te = { .count = 0 };
+	const usbg_event *ev;
+	usbg_gadget *g;
+	usbg_udc *u;
 	int ret;
 
-	for (tg = ts->gadgets; tg->name; tg++) {
-		g = usbg_get_gadget(s, tg->name);
-		assert_non_null(g);
+	safe_init_with_state(state, &st, &s);
 
-		push_gadget_attrs(tg, attrs);
-		ret = usbg_get_gadget_attrs(g, &actual);
+	for (tg = st->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			break;
+	assert_non_null(tg->name);
 
-		assert_int_equal(ret, 0);
-		assert_gadget_attrs_equal(&actual, attrs);
-	}
+	g = usbg_get_gadget(s, tg->name);
+	u = usbg_get_udc(s, tg->udc);
+
+	/* Nothing to process before anyone asked for events */
+	ret = usbg_process_events(s, record_event, &te);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	push_watch_udcs(st);
+	push_gadget_udc(tg);
+	ret = usbg_get_event_fd(s);
+	assert_true(ret >= 0);
+
+	ret = usbg_process_events(s, record_event, &te);
+	assert_int_equal(ret, 0);
+
+	detached = *tg;
+	detached.udc = "";
+	push_udc_state_change(tg->udc, "suspended\n");
+	push_udc_uevent("change", tg->udc);
+	push_gadget_udc(&detached);
+
+	ret = usbg_process_events(s, record_event, &te);
+	assert_int_equal(ret, 2);
+	assert_int_equal(te.count, 2);
+
+	ev = find_event(&te, USBG_EVENT_UDC_STATE);
+	assert_non_null(ev);
+	assert_ptr_equal(ev->udc, u);
+	assert_int_equal(ev->state, USBG_UDC_STATE_SUSPENDED);
+
+	ev = find_event(&te, USBG_EVENT_GADGET_UNBOUND);
+	assert_non_null(ev);
+	assert_ptr_equal(ev->udc, u);
+	assert_ptr_equal(ev->gadget, g);
+
+	pull_unwatch_udcs();
+	usbg_cleanup(s);
+	*state = NULL;
 }
 
 /**
- * @brief Tests getting gadget attributes
+ * @brief Tests UDC hotplug
+ * @details Check if UDCs are added and removed in place when kernel
+ * sends uevents about them and gadget bound to removed UDC is unbound
  * @param[in] state Pointer to correctly initialized test_state structure
  **/
-static void test_get_gadget_attrs(void **state)
+static void test_udc_hotplug(void **state)
 {
 	usbg_state *s = NULL;
-	struct test_state *ts;
+	struct test_state *st;
+	struct test_gadget *tg;
+	struct test_events te = { .count = 0 };
+	const usbg_event *ev;
+	usbg_gadget *g;
+	usbg_udc *u, *other;
+	int count;
+	int ret;
 
-	safe_init_with_state(state, &ts, &s);
+	safe_init_with_state(state, &st, &s);
 
-	try_get_gadget_attrs(s, ts, &min_gadget_attrs);
-	try_get_gadget_attrs(s, ts, &max_gadget_attrs);
-	try_get_gadget_attrs(s, ts, get_random_gadget_attrs());
+	for (tg = st->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			break;
+	assert_non_null(tg->name);
+
+	g = usbg_get_gadget(s, tg->name);
+	u = usbg_get_udc(s, tg->udc);
+	count = usbg_get_udc_count(s);
+
+	push_watch_udcs(st);
+	push_gadget_udc(tg);
+	ret = usbg_get_event_fd(s);
+	assert_true(ret >= 0);
+
+	push_udc_uevent("add", "hotplug.0");
+	push_watch_udc("hotplug.0");
+	ret = usbg_process_events(s, record_event, &te);
+	assert_int_equal(ret, 1);
+
+	other = usbg_get_udc(s, "hotplug.0");
+	assert_non_null(other);
+	assert_int_equal(usbg_get_udc_count(s), count + 1);
+	assert_int_equal(te.events[0].type, USBG_EVENT_UDC_ADDED);
+	assert_ptr_equal(te.events[0].udc, other);
+	/* Other objects are left in place */
+	assert_ptr_equal(usbg_get_udc(s, tg->udc), u);
+
+	te.count = 0;
+	push_udc_uevent("remove", tg->udc);
+	pull_unwatch_udc(tg->udc);
+	ret = usbg_process_events(s, record_event, &te);
+	assert_int_equal(ret, 2);
+
+	ev = find_event(&te, USBG_EVENT_GADGET_UNBOUND);
+	assert_non_null(ev);
+	assert_ptr_equal(ev->gadget, g);
+	assert_non_null(find_event(&te, USBG_EVENT_UDC_REMOVED));
+
+	assert_null(usbg_get_udc(s, tg->udc));
+	assert_null(usbg_get_gadget_udc(g));
+	assert_int_equal(usbg_get_udc_count(s), count);
+
+	pull_unwatch_udcs();
+	usbg_cleanup(s);
+	*state = NULL;
 }
 
 /**
- * @brief Test setting given attributes on gadgets present in state
- * @param[in] s Pointer to usbg state
- * @param[in] ts Pointer to test state matching given usbg state
- * @param[in] attrs Pointer to gadget attributes to be set
- */
-static void try_set_gadget_attrs(usbg_state *s, struct test_state *ts,
-		usbg_gadget_attrs *attrs)
+ * @brief Tests overflow of uevent socket
+ * @details Check if UDCs added and removed while uevents have been
+ * dropped are found by reading list of UDCs again
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_uevent_overflow(void **state)
 {
-	usbg_gadget *g = NULL;
+	usbg_state *s = NULL;
+	struct test_state *st;
 	struct test_gadget *tg;
+	struct test_events te = { .count = 0 };
+	const usbg_event *ev;
+	const char *udcs[] = { NULL, "hotplug.0", NULL };
+	const char *gone;
 	int ret;
 
-	for (tg = ts->gadgets; tg->name; tg++) {
-		g = usbg_get_gadget(s, tg->name);
-		assert_non_null(g);
-
-		pull_gadget_attrs(tg, attrs);
-		ret = usbg_set_gadget_attrs(g, attrs);
+	safe_init_with_state(state, &st, &s);
 
-		assert_int_equal(ret, 0);
-	}
+	for (tg = st->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			break;
+	assert_non_null(tg->name);
+
+	/* Bound UDC stays, other one disappears */
+	udcs[0] = tg->udc;
+	gone = strcmp(st->udcs[0], tg->udc) ? st->udcs[0] : st->udcs[1];
+
+	push_watch_udcs(st);
+	push_gadget_udc(tg);
+	ret = usbg_get_event_fd(s);
+	assert_true(ret >= 0);
+
+	fake_uevent_overflow();
+	/* Binding is read at once, list of UDCs when events are processed */
+	push_gadget_udc(tg);
+	push_udc_list(udcs);
+	pull_unwatch_udc(gone);
+	push_watch_udc("hotplug.0");
+	ret = usbg_process_events(s, record_event, &te);
+	assert_int_equal(ret, 2);
+
+	ev = find_event(&te, USBG_EVENT_UDC_ADDED);
+	assert_non_null(ev);
+	assert_ptr_equal(ev->udc, usbg_get_udc(s, "hotplug.0"));
+	assert_non_null(find_event(&te, USBG_EVENT_UDC_REMOVED));
+	assert_null(usbg_get_udc(s, gone));
+	assert_non_null(usbg_get_udc(s, tg->udc));
+
+	pull_unwatch_udcs();
+	usbg_cleanup(s);
+	*state = NULL;
 }
+
 /**
- * @brief Tests setting gadget attributes
+ * @brief Tests waiting for enumeration of gadget
+ * @details Check if waiting ends with timeout when state doesn't
+ * change, succeeds after notification of configured state and if
+ * time of bind and configuration are recorded
  * @param[in] state Pointer to correctly initialized test_state structure
  **/
-static void test_set_gadget_attrs(void **state)
+static void test_wait_udc_state(void **state)
 {
 	usbg_state *s = NULL;
 	struct test_state *ts;
+	struct test_gadget *tg;
+	struct test_gadget to;
+	usbg_udc_timings t;
+	usbg_gadget *from, *g;
+	usbg_udc *u;
+	int ret;
 
 	safe_init_with_state(state, &ts, &s);
 
-	try_set_gadget_attrs(s, ts, &min_gadget_attrs);
-	try_set_gadget_attrs(s, ts, &max_gadget_attrs);
-	try_set_gadget_attrs(s, ts, get_random_gadget_attrs());
+	for (tg = ts->gadgets; tg->name; tg++)
+		if (tg->udc && tg->udc[0])
+			break;
+	assert_non_null(tg->name);
+
+	memset(&to, 0, sizeof(to));
+	to.name = "waited";
+	to.path = tg->path;
+	to.udc = "";
+
+	pull_create_gadget(&to);
+	ret = usbg_create_gadget(s, to.name, NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	from = usbg_get_gadget(s, tg->name);
+	u = usbg_get_udc(s, tg->udc);
+
+	pull_switch_gadget(tg, &to, tg->udc);
+	ret = usbg_switch_gadget(u, from, g, NULL);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	push_wait_udc_state(tg->udc, "default\n", NULL);
+	ret = usbg_wait_udc_state(u, USBG_UDC_STATE_CONFIGURED, 10);
+	assert_int_equal(ret, USBG_ERROR_TIMEOUT);
+
+	ret = usbg_get_udc_timings(u, &t);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(t.bind_ns > 0);
+	assert_true(t.configured_ns == 0);
+
+	push_wait_udc_state(tg->udc, "addressed\n", "configured\n");
+	ret = usbg_wait_udc_state(u, USBG_UDC_STATE_CONFIGURED, -1);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_get_udc_timings(u, &t);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(t.configured_ns >= t.bind_ns);
 }
 
 /**
@@ -1494,6 +2981,40 @@ static void test_get_binding_target(void **state)
 	for_each_binding(ts, s, try_get_binding_target);
 }
 
+/**
+ * @brief Try to add duplicate of binding
+ * @details Check if binding with the same name or the same target
+ * is found and rejected before touching configfs
+ * @param[in] tb Test binding
+ * @param[in] b Binding
+ */
+static void try_add_duplicate_binding(struct test_binding *tb, usbg_binding *b)
+{
+	usbg_config *c = b->parent;
+	usbg_function *f = usbg_get_binding_target(b);
+	int ret;
+
+	ret = usbg_add_config_function(c, tb->name, f);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+
+	ret = usbg_add_config_function(c, "not_existing_binding", f);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+}
+
+/**
+ * @brief Test adding duplicates of all bindings present in given state
+ * @param[in, out] state Pointer to pointer to correctly initialized test state,
+ * will point to usbg state when finished.
+ */
+static void test_add_duplicate_binding(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *ts;
+
+	safe_init_with_state(state, &ts, &s);
+	for_each_binding(ts, s, try_add_duplicate_binding);
+}
+
 /**
  * @brief Get binding name
  * @details Check if name of given binding is equal name of given function
@@ -1757,6 +3278,50 @@ static void test_create_function(void **state)
 	}
 }
 
+/**
+ * @brief Start with empty gadget, add all functions in reverse order
+ * @details Check if functions are kept sorted by name
+ */
+static void test_create_function_reverse(void **state)
+{
+	usbg_state *s = NULL;
+	usbg_gadget *g = NULL;
+	usbg_function *f = NULL;
+	struct test_state *ts;
+	struct test_state *empty;
+	struct test_gadget *tg;
+	struct test_function *tf;
+
+	ts = (struct test_state *)(*state);
+	*state = NULL;
+
+	empty = build_empty_gadget_state(ts);
+
+	init_with_state(empty, &s);
+	*state = s;
+
+	for (tg = ts->gadgets; tg->name; tg++) {
+		g = usbg_get_gadget(s, tg->name);
+		assert_non_null(g);
+
+		for (tf = tg->functions; tf->instance; tf++)
+			;
+		while (tf-- > tg->functions) {
+			pull_create_function(tf);
+			usbg_create_function(g, tf->type, tf->instance,
+					tf->attrs, &f);
+		}
+
+		f = usbg_get_first_function(g);
+		for (tf = tg->functions; tf->instance; tf++) {
+			assert_non_null(f);
+			assert_func_equal(f, tf);
+			f = usbg_get_next_function(f);
+		}
+		assert_null(f);
+	}
+}
+
 /**
  * @brief Test only one given function for attribute getting
  * @param[in] state Pointer to pointer to correctly initialized state
@@ -1883,6 +3448,71 @@ static struct CMUnitTest tests[] = {
 	 */
 	USBG_TEST_TS("test_init_long_udc",
 		     test_init, setup_long_udc_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_lazy_simple,
+	 * Check if lazy init parses gadget content on first access,
+	 * usbg_init_opts}
+	 */
+	USBG_TEST_TS("test_init_lazy_simple",
+		     test_init_lazy, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_lazy_all_funcs,
+	 * Check if lazy init parses all avaible functions on first access,
+	 * usbg_init_opts}
+	 */
+	USBG_TEST_TS("test_init_lazy_all_funcs",
+		     test_init_lazy, setup_all_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_parallel_all_funcs,
+	 * Check if state parsed by worker threads is correct,
+	 * usbg_init_opts}
+	 */
+	USBG_TEST_TS("test_init_parallel_all_funcs",
+		     test_init_parallel, setup_all_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_unordered_all_funcs,
+	 * Check if state parsed without sorting is correct after sorting it,
+	 * usbg_init_opts}
+	 */
+	USBG_TEST_TS("test_init_unordered_all_funcs",
+		     test_init_unordered, setup_all_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_filter_simple,
+	 * Check if only gadgets matching filter are parsed,
+	 * usbg_init_opts}
+	 */
+	USBG_TEST_TS("test_init_filter_simple",
+		     test_init_filter, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_refresh_unchanged_simple,
+	 * Check if refresh of unchanged state keeps all objects,
+	 * usbg_refresh}
+	 */
+	USBG_TEST_TS("test_refresh_unchanged_simple",
+		     test_refresh_unchanged, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_refresh_unchanged_all_funcs,
+	 * Check if refresh of unchanged state with all functions
+	 * keeps all objects,
+	 * usbg_refresh}
+	 */
+	USBG_TEST_TS("test_refresh_unchanged_all_funcs",
+		     test_refresh_unchanged, setup_all_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_refresh_removed_simple,
+	 * Check if refresh reports removed gadgets,
+	 * usbg_refresh}
+	 */
+	USBG_TEST_TS("test_refresh_removed_simple",
+		     test_refresh_removed, setup_simple_state),
 	/**
 	 * @usbg_test
 	 * @test_desc{test_get_gadget_simple,
@@ -1917,6 +3547,15 @@ static struct CMUnitTest tests[] = {
 	 * usbg_get_first_gadget}
 	 */
 	unit_test(test_get_first_gadget_fail),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_get_by_index_all_funcs,
+	 * Check if count, index and array of gadgets and functions
+	 * match order of iteration,
+	 * usbg_get_gadget_at}
+	 */
+	USBG_TEST_TS("test_get_by_index_all_funcs",
+		     test_get_by_index, setup_all_funcs_state),
 	/**
 	 * @usbg_test
 	 * @test_desc{test_get_gadget_name_simple,
@@ -2118,6 +3757,33 @@ static struct CMUnitTest tests[] = {
 	 */
 	USBG_TEST_TS("test_get_gadget_attrs_simple",
 		     test_get_gadget_attrs, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_get_gadget_attr_vec_simple,
+	 * Get gadget attributes with one vectored read and compare them
+	 * with original,
+	 * usbg_get_gadget_attr_vec}
+	 */
+	USBG_TEST_TS("test_get_gadget_attr_vec_simple",
+		     test_get_gadget_attr_vec, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_get_gadget_attrs_cached_simple,
+	 * Get gadget attributes in cache mode twice and check if they
+	 * are read again only after invalidation,
+	 * usbg_get_gadget_attrs}
+	 */
+	USBG_TEST_TS("test_get_gadget_attrs_cached_simple",
+		     test_get_gadget_attrs_cached, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_get_gadget_strs_cached_simple,
+	 * Get gadget strings in cache mode twice and check if they
+	 * are read again only after removing their language,
+	 * usbg_get_gadget_strs}
+	 */
+	USBG_TEST_TS("test_get_gadget_strs_cached_simple",
+		     test_get_gadget_strs_cached, setup_simple_state),
 	/**
 	 * @usbg_tets
 	 * @test_desc{test_set_gadget_attrs_simple,
@@ -2127,6 +3793,151 @@ static struct CMUnitTest tests[] = {
 	 */
 	USBG_TEST_TS("test_set_gadget_attrs_simple",
 		     test_set_gadget_attrs, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_gadget_transaction_simple,
+	 * Set gadget attributes in transaction\, check if only changed
+	 * attribute is written on commit,
+	 * usbg_commit_gadget_transaction}
+	 */
+	USBG_TEST_TS("test_gadget_transaction_simple",
+		     test_gadget_transaction, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_gadget_transaction_rollback_simple,
+	 * Set gadget attribute and string of new language in transaction\,
+	 * fail string write and check if attribute is restored and
+	 * language directory removed,
+	 * usbg_commit_gadget_transaction}
+	 */
+	USBG_TEST_TS("test_gadget_transaction_rollback_simple",
+		     test_gadget_transaction_rollback, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_reconcile_dry_run_simple,
+	 * Plan reconciliation of gadget with empty description\, check
+	 * if everything is going to be removed without touching configfs,
+	 * usbg_reconcile_gadget}
+	 */
+	/**
+	 * @usbg_test
+	 * @test_desc{test_lock_state_simple,
+	 * Lock state for reading\, check if lookups work and changes
+	 * are refused,
+	 * usbg_lock_state}
+	 */
+	USBG_TEST_TS("test_lock_state_simple",
+		     test_lock_state, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_lock_two_states_simple,
+	 * Lock two states by one thread\, check if changes of the one
+	 * still locked are refused after the other is unlocked,
+	 * usbg_lock_state}
+	 */
+	USBG_TEST_TS("test_lock_two_states_simple",
+		     test_lock_two_states, setup_simple_state),
+	USBG_TEST_TS("test_reconcile_dry_run_simple",
+		     test_reconcile_dry_run, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_create_gadgets_simple,
+	 * Create gadgets from template,
+	 * usbg_create_gadgets}
+	 */
+	USBG_TEST_TS("test_create_gadgets_simple",
+		     test_create_gadgets, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_clone_gadget_simple,
+	 * Clone gadget,
+	 * usbg_clone_gadget}
+	 */
+	USBG_TEST_TS("test_clone_gadget_simple",
+		     test_clone_gadget, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_clone_gadget_ecm,
+	 * Clone gadget with f_ecm function\, check if clone gets
+	 * different MAC addresses,
+	 * usbg_clone_gadget}
+	 */
+	USBG_TEST_TS("test_clone_gadget_ecm",
+		     test_clone_gadget_net, setup_f_ecm_attrs),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_clone_gadget_content,
+	 * Clone gadget with acm\, ffs and mass storage functions bound
+	 * to config\, check if only writable attributes are set and
+	 * bindings point to copied functions,
+	 * usbg_clone_gadget}
+	 */
+	USBG_TEST_TS("test_clone_gadget_content",
+		     test_clone_gadget_content, setup_clone_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_rm_all_gadgets_simple,
+	 * Remove all gadgets,
+	 * usbg_rm_all_gadgets}
+	 */
+	USBG_TEST_TS("test_rm_all_gadgets_simple",
+		     test_rm_all_gadgets, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_switch_gadget_simple,
+	 * Switch gadget bound to UDC,
+	 * usbg_switch_gadget}
+	 */
+	USBG_TEST_TS("test_switch_gadget_simple",
+		     test_switch_gadget, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_warm_pool_simple,
+	 * Add gadget reconciled to description and switch gadgets from warm pool,
+	 * usbg_warm_pool_switch}
+	 */
+	USBG_TEST_TS("test_warm_pool_simple",
+		     test_warm_pool, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_watch_udcs_simple,
+	 * Track UDCs with kernel notifications,
+	 * usbg_get_gadget_udc}
+	 */
+	USBG_TEST_TS("test_watch_udcs_simple",
+		     test_watch_udcs, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_process_events_simple,
+	 * Process events of UDCs and gadgets,
+	 * usbg_process_events}
+	 */
+	USBG_TEST_TS("test_process_events_simple",
+		     test_process_events, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_udc_hotplug_simple,
+	 * Add and remove UDCs on uevents,
+	 * usbg_process_events}
+	 */
+	USBG_TEST_TS("test_udc_hotplug_simple",
+		     test_udc_hotplug, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_uevent_overflow_simple,
+	 * Read UDCs again when uevents are lost,
+	 * usbg_process_events}
+	 */
+	USBG_TEST_TS("test_uevent_overflow_simple",
+		     test_uevent_overflow, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_wait_udc_state_simple,
+	 * Wait for enumeration and get its timings,
+	 * usbg_wait_udc_state}
+	 */
+	USBG_TEST_TS("test_wait_udc_state_simple",
+		     test_wait_udc_state, setup_simple_state),
 	/**
 	 * @usbg_test
 	 * @test_desc{test_set_specific_gadget_attr_simple,
@@ -2195,6 +4006,14 @@ static struct CMUnitTest tests[] = {
 	 * Get binding name,
 	 * usbg_get_binding_name}
 	 */
+	/**
+	 * @usbg_test
+	 * @test_desc{test_add_duplicate_binding_all_funcs,
+	 * Try to add binding with existing name or target,
+	 * usbg_add_config_function}
+	 */
+	USBG_TEST_TS("test_add_duplicate_binding_all_funcs",
+		     test_add_duplicate_binding, setup_all_funcs_state),
 	USBG_TEST_TS("test_get_binding_name_simple",
 		     test_get_binding_name, setup_simple_state),
 	/**
@@ -2397,6 +4216,24 @@ static struct CMUnitTest tests[] = {
 	 */
 	USBG_TEST_TS("test_set_f_ecm_attrs",
 		     test_set_function_attrs, setup_f_ecm_writable_attrs),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_set_f_ms_attrs,
+	 * Set f_mass_storage function attributes with two luns\, check
+	 * if missing lun is created and kept,
+	 * usbg_set_function_attrs}
+	 */
+	USBG_TEST_TS("test_set_f_ms_attrs",
+		     test_set_function_attrs, setup_f_ms_writable_attrs),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_f_ecm_transaction,
+	 * Set f_ecm function attributes in transaction\, check if only
+	 * changed attributes are written on commit,
+	 * usbg_commit_gadget_transaction}
+	 */
+	USBG_TEST_TS("test_f_ecm_transaction",
+		     test_function_transaction, setup_f_ecm_writable_attrs),
 	/**
 	 * @usbg_test
 	 * @test_desc{test_get_f_eem_attrs,
@@ -2453,6 +4290,14 @@ static struct CMUnitTest tests[] = {
 	 */
 	USBG_TEST_TS("test_create_all_functions",
 		     test_create_function, setup_all_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_create_all_functions_reverse,
+	 * Create all functions in reverse order and check if they are sorted,
+	 * usbg_create_function}
+	 */
+	USBG_TEST_TS("test_create_all_functions_reverse",
+		     test_create_function_reverse, setup_all_funcs_state),
 	/**
 	 * @usbg_test
 	 * @test_desc{test_get_gadget_str_name,
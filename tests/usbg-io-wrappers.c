@@ -9,42 +9,284 @@
 #include <cmocka.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
-typedef int (*fputs_f_type)(const char *, FILE *);
-typedef int (*fflush_f_type)(FILE *);
-typedef fflush_f_type ferror_f_type;
+#include "usbg-test.h"
+
+typedef ssize_t (*read_f_type)(int, void *, size_t);
+typedef ssize_t (*write_f_type)(int, const void *, size_t);
+typedef int (*close_f_type)(int);
+typedef int (*epoll_ctl_f_type)(int, int, int, struct epoll_event *);
+typedef int (*socket_f_type)(int, int, int);
+typedef int (*bind_f_type)(int, const struct sockaddr *, socklen_t);
+typedef int (*setsockopt_f_type)(int, int, int, const void *, socklen_t);
+typedef int (*poll_f_type)(struct pollfd *, nfds_t, int);
+
+/* Paths of directories "opened" by openat(), indexed by fd - FAKE_DIR_FD */
+static char *dir_paths[FAKE_DIR_FD_MAX - FAKE_DIR_FD];
+
+/* Entries of directory which are being read by getdents64() */
+struct fake_dir {
+	int started;
+	int count;
+	int pos;
+	char **names;
+	unsigned char *types;
+};
+
+static struct fake_dir dirs[FAKE_DIR_FD_MAX - FAKE_DIR_FD];
+
+/* Fake fds added to epoll set and events pending on them */
+#define FAKE_EPOLL_MAX 32
+
+struct fake_watch {
+	int fd;
+	int ready;
+	epoll_data_t data;
+};
+
+static struct fake_watch watches[FAKE_EPOLL_MAX];
+
+/* Uevents to be received from fake netlink socket */
+struct fake_uevent {
+	char *msg;
+	size_t len;
+	struct fake_uevent *next;
+};
+
+static struct fake_uevent *uevents;
+
+static struct fake_watch *find_watch(int fd)
+{
+	int i;
+
+	for (i = 0; i < FAKE_EPOLL_MAX; i++)
+		if (watches[i].fd == fd)
+			return &watches[i];
+
+	return NULL;
+}
+
+static int is_fake_file(int fd)
+{
+	return fd >= FAKE_FILE_FD && fd < FAKE_DIR_FD;
+}
+
+static int is_fake_dir(int fd)
+{
+	return fd >= FAKE_DIR_FD && fd < FAKE_DIR_FD_MAX;
+}
 
 /**
- * @brief Simulates opening file
- * @details Checks if path is equal expected value and returns given pointer
- * from cmocka queue
+ * @brief Get full path of file given relative to directory fd
+ * @return Newly allocated string
  */
-FILE *fopen(const char *path, const char *mode)
+static char *resolve_path(int dirfd, const char *name)
 {
+	char *path;
+	int ret;
+
+	if (name[0] == '/' || dirfd == AT_FDCWD) {
+		path = strdup(name);
+	} else {
+		if (!is_fake_dir(dirfd) || !dir_paths[dirfd - FAKE_DIR_FD])
+			fail_msg("openat() called with unknown dirfd %d", dirfd);
+		ret = asprintf(&path, "%s/%s", dir_paths[dirfd - FAKE_DIR_FD],
+			       name);
+		if (ret < 0)
+			path = NULL;
+	}
+
+	if (!path)
+		fail();
+
+	return path;
+}
+
+/**
+ * @brief Simulates opening file relative to directory
+ * @details Directories are always opened successfully and get a new fake fd,
+ * their path is remembered to resolve files opened relative to them.
+ * For regular files checks if full path is equal expected value and returns
+ * fd from cmocka queue.
+ */
+int openat(int dirfd, const char *name, int flags, ...)
+{
+	char *path;
+	int fd;
+
+	path = resolve_path(dirfd, name);
+
+	if (flags & O_DIRECTORY) {
+		for (fd = 0; fd < FAKE_DIR_FD_MAX - FAKE_DIR_FD; fd++)
+			if (!dir_paths[fd])
+				break;
+
+		if (fd >= FAKE_DIR_FD_MAX - FAKE_DIR_FD)
+			fail_msg("Too many directories opened");
+		dir_paths[fd] = path;
+		return FAKE_DIR_FD + fd;
+	}
+
 	check_expected(path);
-	return mock_ptr_type(FILE *);
+	free(path);
+
+	fd = mock_type(int);
+	if (fd < 0)
+		errno = -fd;
+
+	return fd < 0 ? -1 : fd;
 }
 
 /**
  * @brief Simulates closing file
- * @details Does absolutely nothing, always acts as successfull close
+ * @details Checks if file fd is expected one, directory fds are always
+ * closed successfully. Other fds are closed for real.
  */
-int fclose(FILE *fp)
+int close(int fd)
 {
-	check_expected(fp);
-	return mock_type(int);
+	close_f_type orig_close;
+	struct fake_watch *w;
+
+	if (is_fake_dir(fd)) {
+		free(dir_paths[fd - FAKE_DIR_FD]);
+		dir_paths[fd - FAKE_DIR_FD] = NULL;
+		free(dirs[fd - FAKE_DIR_FD].names);
+		free(dirs[fd - FAKE_DIR_FD].types);
+		memset(&dirs[fd - FAKE_DIR_FD], 0, sizeof(dirs[0]));
+		return 0;
+	}
+
+	/* As real epoll does, forget fd when it's closed */
+	if (is_fake_file(fd) || fd == FAKE_SOCKET_FD) {
+		w = find_watch(fd);
+		if (w)
+			memset(w, 0, sizeof(*w));
+	}
+
+	if (fd == FAKE_SOCKET_FD)
+		return 0;
+
+	if (is_fake_file(fd)) {
+		check_expected(fd);
+		return mock_type(int);
+	}
+
+	orig_close = (close_f_type)dlsym(RTLD_NEXT, "close");
+	return orig_close(fd);
 }
 
 /**
  * @brief Simulates reading file
  * @details Does not read any file, instead returns value from cmocka queue
- * @return value specified by caller previously
+ * @return length of value specified by caller previously
+ */
+ssize_t read(int fd, void *buf, size_t count)
+{
+	read_f_type orig_read;
+	const char *content;
+	size_t len;
+
+	if (!is_fake_file(fd)) {
+		orig_read = (read_f_type)dlsym(RTLD_NEXT, "read");
+		return orig_read(fd, buf, count);
+	}
+
+	check_expected(fd);
+	content = mock_ptr_type(char *);
+	len = strlen(content);
+	if (len > count)
+		len = count;
+
+	memcpy(buf, content, len);
+	return len;
+}
+
+/**
+ * @brief Simulates reading file from given offset
+ * @details Works as read(), offset is ignored
+ */
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	const char *content;
+	size_t len;
+
+	if (!is_fake_file(fd))
+		fail_msg("pread() called with unknown fd %d", fd);
+
+	check_expected(fd);
+	content = mock_ptr_type(char *);
+	len = strlen(content);
+	if (len > count)
+		len = count;
+
+	memcpy(buf, content, len);
+	return len;
+}
+
+/**
+ * @brief Simulates waiting for notification on file
+ * @details Never blocks, number of ready files is taken from cmocka
+ * queue and all of them get POLLPRI
+ */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	poll_f_type orig_poll;
+	nfds_t i;
+	int ret;
+
+	if (nfds != 1 || !is_fake_file(fds[0].fd)) {
+		orig_poll = dlsym(RTLD_NEXT, "poll");
+		return orig_poll(fds, nfds, timeout);
+	}
+
+	ret = mock_type(int);
+	for (i = 0; i < nfds; i++)
+		fds[i].revents = ret > 0 ? POLLPRI : 0;
+
+	return ret;
+}
+
+/**
+ * @brief Simulates write, with user-specified behavior
+ * @details Check if user is trying to write expected data
+ * @return count if value received from cmocka queue is 0,
+ * otherwise -1 with errno set to that value
  */
-char *fgets(char *s, int size, FILE *stream)
+ssize_t write(int fd, const void *buf, size_t count)
 {
-	check_expected(stream);
-	strncpy(s, mock_ptr_type(char *), size);
-	return s;
+	write_f_type orig_write;
+	char *s;
+	int err;
+
+	/* Cmocka (or anything else) may want to print some errors */
+	if (!is_fake_file(fd)) {
+		orig_write = (write_f_type)dlsym(RTLD_NEXT, "write");
+		return orig_write(fd, buf, count);
+	}
+
+	s = strndup(buf, count);
+	if (!s)
+		fail();
+
+	check_expected(fd);
+	check_expected(s);
+	free(s);
+
+	err = mock_type(int);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return count;
 }
 
 /**
@@ -74,58 +316,98 @@ int closedir(DIR *dirp)
 	return mock_type(int);
 }
 
+/* Record layout used by getdents64() */
+struct fake_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static int put_dirent(char *buf, size_t len, const char *name,
+		      unsigned char type)
+{
+	struct fake_dirent64 *rec = (struct fake_dirent64 *)buf;
+	size_t reclen;
+
+	reclen = offsetof(struct fake_dirent64, d_name) + strlen(name) + 1;
+	reclen = (reclen + 7) & ~(size_t)7;
+	if (reclen > len)
+		return 0;
+
+	memset(rec, 0, reclen);
+	rec->d_ino = 1;
+	rec->d_reclen = reclen;
+	rec->d_type = type;
+	strcpy(rec->d_name, name);
+	return reclen;
+}
+
 /**
- * @brief Simulates scanning directory
- * @details Checks if dirp has expected value. Then consecutive values from
- * cmocka queue are proceed. First value must be integer and indicates number
- * of directory entries which should be returned. Next number of values indicate
- * names of directory entries.
+ * @brief Simulates reading entries of directory opened by openat()
+ * @details On first call for given fd checks if path of directory has
+ * expected value. Then consecutive values from cmocka queue are proceed.
+ * First value must be integer and indicates number of directory entries
+ * which should be returned. Each entry is described by its name and type.
+ * "." and ".." are added in front as real directories contain them too.
+ * Entries are returned in as many calls as the buffer size requires.
  */
-int scandir(const char *dirp, struct dirent ***namelist,
-		int (*filter)(const struct dirent *),
-		int (*compar)(const struct dirent **, const struct dirent **))
+ssize_t getdents64(int fd, void *buffer, size_t length)
 {
+	struct fake_dir *d;
+	char *path;
 	int count;
-	int i, j = 0;
-	char *name;
-	struct dirent **entries;
-	struct dirent *entry;
-	int tmp, expected;
+	int i;
+	size_t len = 0;
+	int ret;
 
-	check_expected(dirp);
-	count = mock_type(int);
+	if (!is_fake_dir(fd) || !dir_paths[fd - FAKE_DIR_FD])
+		fail_msg("getdents64() called with unknown fd %d", fd);
 
-	if (count > 0)
-		entries = calloc(count, sizeof(*entries));
-	else
-		entries = NULL;
+	d = &dirs[fd - FAKE_DIR_FD];
+	if (!d->started) {
+		path = dir_paths[fd - FAKE_DIR_FD];
+		check_expected(path);
+		count = mock_type(int);
+		if (count < 0) {
+			errno = -count;
+			return -1;
+		}
 
-	for (i = 0; i < count; i++) {
-		name = mock_ptr_type(char *);
-		entry = malloc(sizeof(*entry));
-		if (strlen(name) >= NAME_MAX)
+		d->started = 1;
+		d->count = count + 2;
+		d->names = calloc(d->count, sizeof(*d->names));
+		d->types = calloc(d->count, sizeof(*d->types));
+		if (!d->names || !d->types)
 			fail();
 
-		strcpy(entry->d_name, name);
-		entry->d_type = mock_type(unsigned char);
-
-		expected = mock_type(int);
-		if (filter) {
-			tmp = filter(entry);
-			assert_int_equal(tmp, expected);
-			if (tmp)
-				entries[j++] = entry;
-			else
-				free(entry);
+		d->names[0] = ".";
+		d->types[0] = DT_DIR;
+		d->names[1] = "..";
+		d->types[1] = DT_DIR;
+		for (i = 2; i < d->count; i++) {
+			d->names[i] = mock_ptr_type(char *);
+			if (strlen(d->names[i]) >= NAME_MAX)
+				fail();
+			d->types[i] = mock_type(unsigned char);
 		}
 	}
 
-	if (compar)
-		qsort(entries, count, sizeof(*entries),
-			(int (*)(const void *,const void *))compar);
+	for (; d->pos < d->count; d->pos++) {
+		ret = put_dirent((char *)buffer + len, length - len,
+				 d->names[d->pos], d->types[d->pos]);
+		if (!ret)
+			break;
+		len += ret;
+	}
+
+	if (len == 0 && d->pos < d->count) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	*namelist = entries;
-	return j;
+	return len;
 }
 
 /**
@@ -151,22 +433,14 @@ ssize_t readlink(const char *path, char *buf, size_t bufsiz)
 }
 
 /**
- * @brief Simulates puts, with user-specified behavior
- * @details Check if user is trying to write expected data
- * @return value received from cmocka queue
+ * @brief Simulates creating symbolic link
+ * @details Check if target and link path equal expected values
+ * and return value given by cmocka
  */
-int fputs(const char *s, FILE *stream)
+int symlink(const char *target, const char *linkpath)
 {
-	/* Cmocka (or anything else) may want to print some errors.
-	 * Especially when running fputs itself */
-	if (stream == stderr || stream == stdout) {
-		fputs_f_type orig_fputs;
-		orig_fputs = (fputs_f_type)dlsym(RTLD_NEXT, "fputs");
-		return orig_fputs(s, stream);
-	}
-
-	check_expected(stream);
-	check_expected(s);
+	check_expected(target);
+	check_expected(linkpath);
 	return mock_type(int);
 }
 
@@ -177,27 +451,211 @@ int mkdir(const char *pathname, mode_t mode)
 	return mock_type(int);
 }
 
+int mkdirat(int dirfd, const char *name, mode_t mode)
+{
+	char *pathname;
+	int err;
+
+	pathname = resolve_path(dirfd, name);
+	check_expected(pathname);
+	check_expected(mode);
+	free(pathname);
+
+	err = mock_type(int);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int unlinkat(int dirfd, const char *name, int flags)
+{
+	char *pathname;
+	int err;
+
+	pathname = resolve_path(dirfd, name);
+	check_expected(pathname);
+	check_expected(flags);
+	free(pathname);
+
+	err = mock_type(int);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
- * @brief Does nothing.
+ * @brief Simulates adding fd to epoll set
+ * @details Fake fds are remembered together with their event data,
+ * other fds are passed to real epoll
  */
-int fflush(FILE *stream)
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
-	if (stream == stderr || stream == stdout) {
-		fflush_f_type orig_fflush;
-		orig_fflush = (fflush_f_type)dlsym(RTLD_NEXT, "fflush");
-		return orig_fflush(stream);
+	epoll_ctl_f_type orig_epoll_ctl;
+	struct fake_watch *w;
+
+	if (!is_fake_file(fd) && fd != FAKE_SOCKET_FD) {
+		orig_epoll_ctl = (epoll_ctl_f_type)dlsym(RTLD_NEXT,
+							 "epoll_ctl");
+		return orig_epoll_ctl(epfd, op, fd, event);
 	}
 
+	w = find_watch(fd);
+	if (op == EPOLL_CTL_DEL) {
+		if (w)
+			memset(w, 0, sizeof(*w));
+		return 0;
+	}
+
+	if (op == EPOLL_CTL_ADD) {
+		if (w)
+			fail_msg("fd %d added to epoll twice", fd);
+		w = find_watch(0);
+		if (!w)
+			fail_msg("Too many fds in epoll");
+		w->fd = fd;
+	}
+
+	w->data = event->data;
 	return 0;
 }
 
-int ferror(FILE *stream)
+/**
+ * @brief Simulates waiting for events
+ * @details Returns events marked with fake_fd_ready() and never blocks
+ */
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+	       int timeout)
 {
-	if (stream == stderr || stream == stdout) {
-		ferror_f_type orig_ferror;
-		orig_ferror = (ferror_f_type)dlsym(RTLD_NEXT, "ferror");
-		return orig_ferror(stream);
+	int n = 0;
+	int i;
+
+	for (i = 0; i < FAKE_EPOLL_MAX && n < maxevents; i++) {
+		if (!watches[i].fd || !watches[i].ready)
+			continue;
+
+		watches[i].ready = 0;
+		events[n].events = EPOLLPRI;
+		events[n].data = watches[i].data;
+		n++;
 	}
 
-	return 0;
+	return n;
+}
+
+void fake_fd_ready(int fd)
+{
+	struct fake_watch *w;
+
+	w = find_watch(fd);
+	if (!w)
+		fail_msg("fd %d is not watched", fd);
+
+	w->ready = 1;
+}
+
+/**
+ * @brief Simulates creating socket
+ * @details Netlink socket gets FAKE_SOCKET_FD
+ */
+int socket(int domain, int type, int protocol)
+{
+	socket_f_type orig_socket;
+
+	if (domain == AF_NETLINK)
+		return FAKE_SOCKET_FD;
+
+	orig_socket = (socket_f_type)dlsym(RTLD_NEXT, "socket");
+	return orig_socket(domain, type, protocol);
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	bind_f_type orig_bind;
+
+	if (fd == FAKE_SOCKET_FD)
+		return 0;
+
+	orig_bind = (bind_f_type)dlsym(RTLD_NEXT, "bind");
+	return orig_bind(fd, addr, len);
+}
+
+int setsockopt(int fd, int level, int name, const void *val, socklen_t len)
+{
+	setsockopt_f_type orig_setsockopt;
+
+	if (fd == FAKE_SOCKET_FD)
+		return 0;
+
+	orig_setsockopt = (setsockopt_f_type)dlsym(RTLD_NEXT, "setsockopt");
+	return orig_setsockopt(fd, level, name, val, len);
+}
+
+/**
+ * @brief Simulates receiving uevent from netlink socket
+ * @details Returns messages queued with fake_uevent() in order,
+ * overflow queued with fake_uevent_overflow() fails with ENOBUFS
+ */
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+	struct fake_uevent *ev = uevents;
+	size_t n;
+
+	if (fd != FAKE_SOCKET_FD)
+		fail_msg("recv() called with unknown fd %d", fd);
+
+	if (!ev) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	uevents = ev->next;
+	if (!ev->msg) {
+		free(ev);
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	n = ev->len < len ? ev->len : len;
+	memcpy(buf, ev->msg, n);
+	free(ev->msg);
+	free(ev);
+
+	return n;
+}
+
+void fake_uevent(const char *msg, size_t len)
+{
+	struct fake_uevent *ev, **tail;
+
+	ev = malloc(sizeof(*ev));
+	if (!ev)
+		fail();
+
+	ev->msg = NULL;
+	if (msg) {
+		ev->msg = malloc(len);
+		if (!ev->msg)
+			fail();
+		memcpy(ev->msg, msg, len);
+	}
+
+	ev->len = len;
+	ev->next = NULL;
+
+	for (tail = &uevents; *tail; tail = &(*tail)->next)
+		;
+	*tail = ev;
+
+	fake_fd_ready(FAKE_SOCKET_FD);
+}
+
+void fake_uevent_overflow(void)
+{
+	fake_uevent(NULL, 0);
 }
@@ -8,7 +8,9 @@
 #include <stddef.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
+#include <fnmatch.h>
 
 #include "usbg-test.h"
 
@@ -61,26 +63,26 @@ static int dir_id = 0;
 
 #define PUSH_FILE(file, content) do {\
 	file_id++;\
-	expect_path(fopen, path, file);\
-	will_return(fopen, file_id);\
-	expect_value(fgets, stream, file_id);\
-	will_return(fgets, content);\
-	expect_value(fclose, fp, file_id);\
-	will_return(fclose, 0);\
+	expect_path(openat, path, file);\
+	will_return(openat, FAKE_FILE_FD + file_id);\
+	expect_value(read, fd, FAKE_FILE_FD + file_id);\
+	will_return(read, content);\
+	expect_value(close, fd, FAKE_FILE_FD + file_id);\
+	will_return(close, 0);\
 } while(0)
 
 #define PUSH_FILE_ALWAYS(dflt) do {\
-	expect_any_count(fopen, path, -1);\
-	will_return_always(fopen, 1);\
-	expect_any_count(fgets, stream, 1);\
-	will_return_always(fgets, dflt);\
-	expect_any_count(fclose, fp, 1);\
-	will_return_always(fclose, 0);\
+	expect_any_count(openat, path, -1);\
+	will_return_always(openat, FAKE_FILE_FD);\
+	expect_any_count(read, fd, -1);\
+	will_return_always(read, dflt);\
+	expect_any_count(close, fd, -1);\
+	will_return_always(close, 0);\
 } while(0)
 
 #define PUSH_EMPTY_DIR(p) do {\
-	expect_string(scandir, dirp, p);\
-	will_return(scandir, 0);\
+	expect_string(getdents64, path, p);\
+	will_return(getdents64, 0);\
 } while(0)
 
 #define EXPECT_OPENDIR(n) do {\
@@ -99,14 +101,13 @@ static int dir_id = 0;
 } while(0)
 
 #define PUSH_DIR(p, c) do {\
-	expect_path(scandir, dirp, p);\
-	will_return(scandir, c);\
+	expect_path(getdents64, path, p);\
+	will_return(getdents64, c);\
 } while(0)
 
 #define PUSH_DIR_ENTRY(name, type) do {\
-	will_return(scandir, name);\
-	will_return(scandir, type);\
-	will_return(scandir, 1);\
+	will_return(getdents64, name);\
+	will_return(getdents64, type);\
 } while(0)
 
 #define PUSH_LINK(p, c, len) do {\
@@ -117,24 +118,26 @@ static int dir_id = 0;
 
 #define EXPECT_WRITE(file, content) do {\
 	file_id++;\
-	expect_path(fopen, path, file);\
-	will_return(fopen, file_id);\
-	expect_value(fputs, stream, file_id);\
-	expect_string(fputs, s, content);\
-	will_return(fputs, 0);\
-	expect_value(fclose, fp, file_id);\
-	will_return(fclose, 0);\
+	expect_path(openat, path, file);\
+	will_return(openat, FAKE_FILE_FD + file_id);\
+	if ((content)[0]) {\
+		expect_value(write, fd, FAKE_FILE_FD + file_id);\
+		expect_string(write, s, content);\
+		will_return(write, 0);\
+	}\
+	expect_value(close, fd, FAKE_FILE_FD + file_id);\
+	will_return(close, 0);\
 } while(0)
 
 #define EXPECT_HEX_WRITE(file, content) do {\
 	file_id++;\
-	expect_path(fopen, path, file);\
-	will_return(fopen, file_id);\
-	expect_value(fputs, stream, file_id);\
-	expect_check(fputs, s, hex_str_equal_display_error, content);\
-	will_return(fputs, 0);\
-	expect_value(fclose, fp, file_id);\
-	will_return(fclose, 0);\
+	expect_path(openat, path, file);\
+	will_return(openat, FAKE_FILE_FD + file_id);\
+	expect_value(write, fd, FAKE_FILE_FD + file_id);\
+	expect_check(write, s, hex_str_equal_display_error, content);\
+	will_return(write, 0);\
+	expect_value(close, fd, FAKE_FILE_FD + file_id);\
+	will_return(close, 0);\
 } while(0)
 
 #define EXPECT_MKDIR(p) do {\
@@ -143,6 +146,24 @@ static int dir_id = 0;
 	will_return(mkdir, 0);\
 } while(0)
 
+#define EXPECT_MKDIRAT(p, e) do {\
+	expect_path(mkdirat, pathname, p);\
+	expect_value(mkdirat, mode, 00777);\
+	will_return(mkdirat, e);\
+} while(0)
+
+#define EXPECT_UNLINKAT(p, f) do {\
+	expect_path(unlinkat, pathname, p);\
+	expect_value(unlinkat, flags, f);\
+	will_return(unlinkat, 0);\
+} while(0)
+
+#define EXPECT_SYMLINK(t, p) do {\
+	expect_path(symlink, target, t);\
+	expect_path(symlink, linkpath, p);\
+	will_return(symlink, 0);\
+} while(0)
+
 /**
  * @brief Compare test gadgets' names
  */
@@ -604,15 +625,11 @@ static void push_config(struct test_config *c)
 	}
 }
 
-static void push_gadget(struct test_gadget *g)
+void push_lazy_gadget(struct test_gadget *g)
 {
 	int count;
 	struct test_config *c;
 	struct test_function *f;
-	char *path;
-
-	safe_asprintf(&path, "%s/%s/UDC", g->path, g->name);
-	PUSH_FILE(path, g->udc);
 
 	count = 0;
 	for (f = g->functions; f->instance; f++)
@@ -634,14 +651,28 @@ static void push_gadget(struct test_gadget *g)
 		push_config(c);
 }
 
-void push_init(struct test_state *state)
+void push_gadget_udc(struct test_gadget *g)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s/UDC", g->path, g->name);
+	PUSH_FILE(path, g->udc);
+}
+
+static void push_gadget(struct test_gadget *g, int opts)
+{
+	push_gadget_udc(g);
+
+	if (!(opts & USBG_INIT_LAZY))
+		push_lazy_gadget(g);
+}
+
+static void push_state(struct test_state *state, int opts, const char *filter)
 {
 	char **udc;
 	struct test_gadget *g;
 	int count = 0;
 
-	EXPECT_OPENDIR(state->path);
-
 	for (udc = state->udcs; *udc; udc++)
 		count++;
 
@@ -659,7 +690,161 @@ void push_init(struct test_state *state)
 	}
 
 	for (g = state->gadgets; g->name; g++)
-		push_gadget(g);
+		if (!filter || !fnmatch(filter, g->name, 0))
+			push_gadget(g, opts);
+}
+
+/* Fds of UDC state files opened by watch, in order of opening */
+#define MAX_WATCHED_UDCS 16
+
+static struct {
+	const char *name;
+	int fd;
+} watched_udcs[MAX_WATCHED_UDCS];
+
+static int watched_count;
+
+void push_watch_udc(const char *udc)
+{
+	char *path;
+
+	if (watched_count >= MAX_WATCHED_UDCS)
+		fail_msg("Too many UDCs to watch");
+
+	safe_asprintf(&path, "/sys/class/udc/%s/state", udc);
+	file_id++;
+	expect_path(openat, path, path);
+	will_return(openat, FAKE_FILE_FD + file_id);
+	expect_value(pread, fd, FAKE_FILE_FD + file_id);
+	will_return(pread, "not attached\n");
+
+	watched_udcs[watched_count].name = udc;
+	watched_udcs[watched_count].fd = FAKE_FILE_FD + file_id;
+	watched_count++;
+}
+
+void push_watch_udcs(struct test_state *state)
+{
+	char **udc;
+
+	for (udc = state->udcs; *udc; udc++)
+		push_watch_udc(*udc);
+}
+
+static int watched_udc_index(const char *udc)
+{
+	int i;
+
+	for (i = 0; i < watched_count; i++)
+		if (watched_udcs[i].name && !strcmp(watched_udcs[i].name, udc))
+			return i;
+
+	fail_msg("UDC %s is not watched", udc);
+	return -1;
+}
+
+static int watched_udc_fd(const char *udc)
+{
+	return watched_udcs[watched_udc_index(udc)].fd;
+}
+
+void push_udc_state_change(const char *udc, const char *state)
+{
+	int fd = watched_udc_fd(udc);
+
+	fake_fd_ready(fd);
+	expect_value(pread, fd, fd);
+	will_return(pread, state);
+}
+
+void push_udc_uevent(const char *action, const char *udc)
+{
+	char msg[USBG_MAX_PATH_LENGTH];
+	int len;
+
+	len = snprintf(msg, sizeof(msg),
+		       "%s@/devices/virtual/udc/%s%c"
+		       "ACTION=%s%c"
+		       "DEVPATH=/devices/virtual/udc/%s%c"
+		       "SUBSYSTEM=udc",
+		       action, udc, 0, action, 0, udc, 0);
+	fake_uevent(msg, len + 1);
+}
+
+void push_udc_list(const char **udcs)
+{
+	int count = 0;
+
+	while (udcs[count])
+		count++;
+
+	PUSH_DIR("/sys/class/udc", count);
+	for (; *udcs; udcs++)
+		PUSH_DIR_ENTRY(*udcs, DT_LNK);
+}
+
+void pull_unwatch_udc(const char *udc)
+{
+	int i = watched_udc_index(udc);
+
+	expect_value(close, fd, watched_udcs[i].fd);
+	will_return(close, 0);
+	watched_udcs[i].name = NULL;
+}
+
+void pull_unwatch_udcs(void)
+{
+	int i;
+
+	for (i = 0; i < watched_count; i++)
+		if (watched_udcs[i].name)
+			pull_unwatch_udc(watched_udcs[i].name);
+
+	watched_count = 0;
+}
+
+void push_wait_udc_state(const char *udc, const char *before,
+			 const char *after)
+{
+	char *path;
+	int fd;
+
+	safe_asprintf(&path, "/sys/class/udc/%s/state", udc);
+	file_id++;
+	fd = FAKE_FILE_FD + file_id;
+	expect_path(openat, path, path);
+	will_return(openat, fd);
+	expect_value(pread, fd, fd);
+	will_return(pread, before);
+
+	if (after) {
+		will_return(poll, 1);
+		expect_value(pread, fd, fd);
+		will_return(pread, after);
+	} else {
+		will_return(poll, 0);
+	}
+
+	expect_value(close, fd, fd);
+	will_return(close, 0);
+}
+
+void push_init_opts(struct test_state *state, int opts, const char *filter)
+{
+	EXPECT_OPENDIR(state->path);
+	push_state(state, opts, filter);
+	if (opts & USBG_INIT_WATCH)
+		push_watch_udcs(state);
+}
+
+void push_init(struct test_state *state)
+{
+	push_init_opts(state, 0, NULL);
+}
+
+void push_refresh(struct test_state *state)
+{
+	push_state(state, 0, NULL);
 }
 
 int get_gadget_attr(usbg_gadget_attrs *attrs, usbg_gadget_attr attr)
@@ -876,12 +1061,8 @@ static void pull_gadget_str_dir(struct test_gadget *gadget, int lang)
 	srand(time(NULL));
 	tmp = rand() % 2;
 
-	if (tmp) {
-		EXPECT_OPENDIR(dir);
-	} else {
-		EXPECT_OPENDIR_ERROR(dir, ENOENT);
-		EXPECT_MKDIR(dir);
-	}
+	/* Directory may already exist or be created now */
+	EXPECT_MKDIRAT(dir, tmp ? EEXIST : 0);
 }
 
 static void pull_gadget_str(struct test_gadget *gadget, const char *attr_name,
@@ -910,14 +1091,40 @@ void pull_gadget_strs(struct test_gadget *gadget, int lang, usbg_gadget_strs *st
 		pull_gadget_str(gadget, gadget_str_names[i], lang, get_gadget_str(strs, i));
 }
 
-static void push_gadget_str_dir(struct test_gadget *gadget, int lang)
+void pull_new_gadget_str_dir(struct test_gadget *gadget, int lang)
 {
 	char *dir;
 
 	safe_asprintf(&dir, "%s/%s/strings/0x%x",
 			gadget->path, gadget->name, lang);
+	EXPECT_MKDIRAT(dir, 0);
+}
+
+void pull_rm_gadget_str_dir(struct test_gadget *gadget, int lang)
+{
+	char *dir;
+
+	safe_asprintf(&dir, "%s/%s/strings/0x%x",
+			gadget->path, gadget->name, lang);
+	EXPECT_UNLINKAT(dir, AT_REMOVEDIR);
+}
+
+void pull_gadget_string_error(struct test_gadget *gadget, int lang,
+		gadget_str str, const char *content, int error)
+{
+	char *path;
 
-	EXPECT_OPENDIR(dir);
+	safe_asprintf(&path, "%s/%s/strings/0x%x/%s", gadget->path,
+			gadget->name, lang, gadget_str_names[str]);
+
+	file_id++;
+	expect_path(openat, path, path);
+	will_return(openat, FAKE_FILE_FD + file_id);
+	expect_value(write, fd, FAKE_FILE_FD + file_id);
+	expect_string(write, s, content);
+	will_return(write, error);
+	expect_value(close, fd, FAKE_FILE_FD + file_id);
+	will_return(close, 0);
 }
 
 static void push_gadget_str(struct test_gadget *gadget, const char *attr_name,
@@ -934,11 +1141,36 @@ void push_gadget_strs(struct test_gadget *gadget, int lang, usbg_gadget_strs *st
 {
 	int i;
 
-	push_gadget_str_dir(gadget, lang);
 	for (i = 0; i < GADGET_STR_MAX; i++)
 		push_gadget_str(gadget, gadget_str_names[i], lang, get_gadget_str(strs, i));
 }
 
+void push_missing_gadget_string(struct test_gadget *gadget, int lang,
+		gadget_str str)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s/strings/0x%x/%s", gadget->path,
+			gadget->name, lang, gadget_str_names[str]);
+	expect_path(openat, path, path);
+	will_return(openat, -ENOENT);
+}
+
+void push_gadget_str_langs(struct test_gadget *gadget, const int *langs,
+		int count)
+{
+	char *path;
+	char *name;
+	int i;
+
+	safe_asprintf(&path, "%s/%s/strings", gadget->path, gadget->name);
+	PUSH_DIR(path, count);
+	for (i = 0; i < count; i++) {
+		safe_asprintf(&name, "0x%x", langs[i]);
+		PUSH_DIR_ENTRY(name, DT_DIR);
+	}
+}
+
 void pull_config_string(struct test_config *config, int lang, const char *str)
 {
 	char *path;
@@ -951,12 +1183,8 @@ void pull_config_string(struct test_config *config, int lang, const char *str)
 	srand(time(NULL));
 	tmp = rand() % 2;
 
-	if (tmp) {
-		EXPECT_OPENDIR(path);
-	} else {
-		EXPECT_OPENDIR_ERROR(path, ENOENT);
-		EXPECT_MKDIR(path);
-	}
+	/* Directory may already exist or be created now */
+	EXPECT_MKDIRAT(path, tmp ? EEXIST : 0);
 
 	safe_asprintf(&path, "%s/configuration", path);
 
@@ -972,13 +1200,9 @@ void push_config_string(struct test_config *config, int lang, const char *str)
 {
 	char *path;
 
-	safe_asprintf(&path, "%s/%s/strings/0x%x",
+	safe_asprintf(&path, "%s/%s/strings/0x%x/configuration",
 			config->path, config->name, lang);
 
-	EXPECT_OPENDIR(path);
-
-	safe_asprintf(&path, "%s/configuration", path);
-
 	PUSH_FILE(path, str);
 }
 
@@ -987,6 +1211,21 @@ void push_config_strs(struct test_config *config, int lang, usbg_config_strs *st
 	push_config_string(config, lang, strs->configuration);
 }
 
+void push_config_str_langs(struct test_config *config, const int *langs,
+		int count)
+{
+	char *path;
+	char *name;
+	int i;
+
+	safe_asprintf(&path, "%s/%s/strings", config->path, config->name);
+	PUSH_DIR(path, count);
+	for (i = 0; i < count; i++) {
+		safe_asprintf(&name, "0x%x", langs[i]);
+		PUSH_DIR_ENTRY(name, DT_DIR);
+	}
+}
+
 void assert_config_attrs_equal(usbg_config_attrs *actual, usbg_config_attrs *expected)
 {
 	assert_int_equal(actual->bmAttributes, expected->bmAttributes);
@@ -1006,6 +1245,112 @@ void pull_create_config(struct test_config *tc)
 		pull_config_strs(tc, LANG_US_ENG, tc->strs);
 }
 
+void pull_add_binding(struct test_config *tc, struct test_binding *tb)
+{
+	char *s_path;
+	char *d_path;
+
+	safe_asprintf(&s_path, "%s/%s/%s", tc->path, tc->name, tb->name);
+	safe_asprintf(&d_path, "%s/%s", tb->target->path, tb->target->name);
+
+	EXPECT_SYMLINK(d_path, s_path);
+}
+
+void pull_create_gadget(struct test_gadget *tg)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s", tg->path, tg->name);
+	EXPECT_MKDIR(path);
+	push_gadget_udc(tg);
+}
+
+void pull_create_gadget_dir(struct test_gadget *tg)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s", tg->path, tg->name);
+	EXPECT_MKDIRAT(path, 0);
+}
+
+void pull_disable_gadget(struct test_gadget *tg)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s/UDC", tg->path, tg->name);
+	EXPECT_WRITE(path, "\n");
+}
+
+void pull_switch_gadget(struct test_gadget *from, struct test_gadget *to,
+			const char *udc)
+{
+	char *path;
+
+	pull_disable_gadget(from);
+	safe_asprintf(&path, "%s/%s/UDC", to->path, to->name);
+	EXPECT_WRITE(path, udc);
+}
+
+int pull_open_udc_file(struct test_gadget *tg)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s/UDC", tg->path, tg->name);
+	file_id++;
+	expect_path(openat, path, path);
+	will_return(openat, FAKE_FILE_FD + file_id);
+
+	return FAKE_FILE_FD + file_id;
+}
+
+void pull_write_fd(int fd, const char *content)
+{
+	expect_value(write, fd, fd);
+	expect_string(write, s, content);
+	will_return(write, 0);
+}
+
+void pull_close_fd(int fd)
+{
+	expect_value(close, fd, fd);
+	will_return(close, 0);
+}
+
+void pull_rm_gadget(struct test_gadget *tg)
+{
+	struct test_config *tc;
+	struct test_binding *tb;
+	struct test_function *tf;
+	char *path;
+
+	for (tc = tg->configs; tc->label; tc++) {
+		for (tb = tc->bindings; tb->name; tb++) {
+			safe_asprintf(&path, "%s/%s/%s", tc->path, tc->name,
+				      tb->name);
+			EXPECT_UNLINKAT(path, 0);
+		}
+	}
+
+	safe_asprintf(&path, "%s/%s/strings", tg->path, tg->name);
+	PUSH_DIR(path, 0);
+	for (tc = tg->configs; tc->label; tc++) {
+		safe_asprintf(&path, "%s/%s/strings", tc->path, tc->name);
+		PUSH_DIR(path, 0);
+	}
+
+	for (tc = tg->configs; tc->label; tc++) {
+		safe_asprintf(&path, "%s/%s", tc->path, tc->name);
+		EXPECT_UNLINKAT(path, AT_REMOVEDIR);
+	}
+	for (tf = tg->functions; tf->instance; tf++) {
+		safe_asprintf(&path, "%s/%s", tf->path, tf->name);
+		EXPECT_UNLINKAT(path, AT_REMOVEDIR);
+	}
+
+	safe_asprintf(&path, "%s/%s", tg->path, tg->name);
+	EXPECT_UNLINKAT(path, AT_REMOVEDIR);
+}
+
 #define ETHER_ADDR_STR_LEN 19
 
 static void push_serial_attrs(struct test_function *func,
@@ -1061,6 +1406,45 @@ static void push_phonet_attrs(struct test_function *func,
 	PUSH_FILE(path, content);
 }
 
+static void push_ms_attrs(struct test_function *func,
+		usbg_f_ms_attrs *attrs)
+{
+	usbg_f_ms_lun_attrs *lun;
+	char *path;
+	char *content;
+	int i;
+
+	safe_asprintf(&path, "%s/%s/stall", func->path, func->name);
+	safe_asprintf(&content, "%d\n", attrs->stall);
+	PUSH_FILE(path, content);
+
+	safe_asprintf(&path, "%s/%s", func->path, func->name);
+	PUSH_DIR(path, attrs->nluns);
+	for (i = 0; i < attrs->nluns; i++) {
+		safe_asprintf(&content, "lun.%d", i);
+		PUSH_DIR_ENTRY(content, DT_DIR);
+	}
+
+	for (i = 0; i < attrs->nluns; i++) {
+		lun = attrs->luns[i];
+
+#define PUSH_LUN_ATTR(attr, fmt, val) do {\
+	safe_asprintf(&path, "%s/%s/lun.%d/" attr, func->path, func->name, i);\
+	safe_asprintf(&content, fmt, val);\
+	PUSH_FILE(path, content);\
+} while (0)
+
+		PUSH_LUN_ATTR("cdrom", "%d\n", lun->cdrom);
+		PUSH_LUN_ATTR("ro", "%d\n", lun->ro);
+		PUSH_LUN_ATTR("nofua", "%d\n", lun->nofua);
+		PUSH_LUN_ATTR("removable", "%d\n", lun->removable);
+		PUSH_LUN_ATTR("file", "%s\n",
+			      lun->filename ? lun->filename : "");
+
+#undef PUSH_LUN_ATTR
+	}
+}
+
 void push_function_attrs(struct test_function *func, usbg_function_attrs *function_attrs)
 {
 	int attrs_type;
@@ -1078,6 +1462,9 @@ void push_function_attrs(struct test_function *func, usbg_function_attrs *functi
 	case USBG_F_ATTRS_PHONET:
 		push_phonet_attrs(func, &attrs->phonet);
 		break;
+	case USBG_F_ATTRS_MS:
+		push_ms_attrs(func, &attrs->ms);
+		break;
 	case USBG_F_ATTRS_FFS:
 		// ffs does not exist in filesystem
 	default:
@@ -1109,11 +1496,105 @@ static void pull_function_net_attrs(struct test_function *func, usbg_f_net_attrs
 	EXPECT_WRITE(path, content);
 }
 
+void pull_function_attr(struct test_function *func, const char *attr,
+		const char *content)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s/%s", func->path, func->name, attr);
+	EXPECT_WRITE(path, content);
+}
+
+/* Check if written address is new unicast, locally administered one */
+static int new_ether_addr_check(const LargestIntegralType actual,
+		const LargestIntegralType old)
+{
+	unsigned char octets[6];
+	int n;
+
+	n = sscanf((const char *)actual, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+			&octets[0], &octets[1], &octets[2],
+			&octets[3], &octets[4], &octets[5]);
+	if (n == 6 && (octets[0] & 0x03) == 0x02 &&
+	    strcmp((const char *)actual, (const char *)old))
+		return 1;
+
+	fprintf(stderr, "%s is not new address (old %s)\n",
+			(const char *)actual, (const char *)old);
+	return 0;
+}
+
+void pull_function_new_ether_addr(struct test_function *func,
+		const char *attr, const char *old)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s/%s", func->path, func->name, attr);
+
+	file_id++;
+	expect_path(openat, path, path);
+	will_return(openat, FAKE_FILE_FD + file_id);
+	expect_value(write, fd, FAKE_FILE_FD + file_id);
+	expect_check(write, s, new_ether_addr_check, old);
+	will_return(write, 0);
+	expect_value(close, fd, FAKE_FILE_FD + file_id);
+	will_return(close, 0);
+}
+
+void pull_function_ms_attrs(struct test_function *func,
+		usbg_f_ms_attrs *attrs, int nexisting)
+{
+	usbg_f_ms_lun_attrs *lun;
+	char *path;
+	char *content;
+	int i;
+
+	safe_asprintf(&path, "%s/%s/stall", func->path, func->name);
+	safe_asprintf(&content, "%d\n", attrs->stall);
+	EXPECT_WRITE(path, content);
+
+	for (i = 0; i < attrs->nluns; i++) {
+		safe_asprintf(&path, "%s/%s/lun.%d", func->path, func->name, i);
+		EXPECT_MKDIRAT(path, i < nexisting ? EEXIST : 0);
+	}
+
+	for (i = 0; i < attrs->nluns; i++) {
+		lun = attrs->luns[i];
+		if (!lun)
+			continue;
+
+#define PULL_LUN_ATTR(attr, fmt, val) do {\
+	safe_asprintf(&path, "%s/%s/lun.%d/" attr, func->path, func->name, i);\
+	safe_asprintf(&content, fmt, val);\
+	EXPECT_WRITE(path, content);\
+} while (0)
+
+		PULL_LUN_ATTR("cdrom", "%d\n", lun->cdrom);
+		PULL_LUN_ATTR("ro", "%d\n", lun->ro);
+		PULL_LUN_ATTR("nofua", "%d\n", lun->nofua);
+		PULL_LUN_ATTR("removable", "%d\n", lun->removable);
+		PULL_LUN_ATTR("file", "%s", lun->filename ? lun->filename : "");
+
+#undef PULL_LUN_ATTR
+	}
+
+	/* No more luns than the set ones are found */
+	safe_asprintf(&path, "%s/%s", func->path, func->name);
+	PUSH_DIR(path, attrs->nluns);
+	for (i = 0; i < attrs->nluns; i++) {
+		safe_asprintf(&content, "lun.%d", i);
+		PUSH_DIR_ENTRY(content, DT_DIR);
+	}
+}
+
 void pull_function_attrs(struct test_function *func, usbg_function_attrs *attrs)
 {
-	/* only net attributes are writtable */
+	/* only net and mass storage attributes are writtable */
 	if (attrs->header.attrs_type == USBG_F_ATTRS_NET)
 		pull_function_net_attrs(func, &attrs->attrs.net);
+	else if (attrs->header.attrs_type == USBG_F_ATTRS_MS)
+		/* lun.0 is created by kernel together with function */
+		pull_function_ms_attrs(func, &attrs->attrs.ms, 1);
 }
 
 void pull_create_function(struct test_function *tf)
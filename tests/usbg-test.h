@@ -98,6 +98,15 @@ typedef enum {
 		.functions = NULL, \
 	}
 
+/*
+ * Fake file descriptors returned by openat() wrapper. Files get
+ * FAKE_FILE_FD + consecutive id, directories are numbered from FAKE_DIR_FD.
+ */
+#define FAKE_FILE_FD 1000
+#define FAKE_SOCKET_FD 999
+#define FAKE_DIR_FD 10000
+#define FAKE_DIR_FD_MAX 20000
+
 #define expect_path(function, param, data) \
 	expect_check(function, param, \
 		     (CheckParameterValue)(path_equal_display_error), data)
@@ -159,6 +168,37 @@ void prepare_binding(struct test_binding *b, struct test_function *f, char *fpat
  */
 void push_init(struct test_state *state);
 
+/**
+ * @brief Prepare fake filesystem to init usbg with given options
+ * @details Only gadgets which match filter are read. In USBG_INIT_LAZY
+ * mode their functions and configs have to be pushed separately
+ * with push_lazy_gadget().
+ * @param[in] state Fake state of configfs defined in test
+ * @param[in] opts Options passed to usbg_init_opts()
+ * @param[in] filter Gadget name pattern passed to usbg_init_opts()
+ */
+void push_init_opts(struct test_state *state, int opts, const char *filter);
+
+/**
+ * @brief Prepare fake filesystem for parsing content of lazy gadget
+ * @param[in] g Test gadget which will be accessed for the first time
+ */
+void push_lazy_gadget(struct test_gadget *g);
+
+/**
+ * @brief Prepare fake filesystem for reading UDC of gadget
+ * @param[in] g Test gadget which UDC will be checked
+ */
+void push_gadget_udc(struct test_gadget *g);
+
+/**
+ * @brief Prepare fake filesystem to refresh usbg state
+ * @details usbg_refresh() reads the whole state except gadgets attributes
+ * and strings, so new state may differ from the one used for init.
+ * @param[in] state Fake state of configfs after changes
+ */
+void push_refresh(struct test_state *state);
+
 /**
  * Prepare specific attributes writting/reading
  **/
@@ -242,6 +282,35 @@ void push_function_attrs(struct test_function *func, usbg_function_attrs *attrs)
  */
 void pull_function_attrs(struct test_function *func, usbg_function_attrs *attrs);
 
+/**
+ * @brief Prepare fake filesystem to set mass storage attributes
+ * @details Luns which don't exist yet are expected to be created
+ * and no other luns are left in function directory.
+ * @param[in] func Mass storage function
+ * @param[in] attrs Attributes expected to be set
+ * @param[in] nexisting Number of luns which already exist
+ */
+void pull_function_ms_attrs(struct test_function *func,
+		usbg_f_ms_attrs *attrs, int nexisting);
+
+/**
+ * @brief Prepare fake filesystem to set single function attribute
+ * @param[in] func Function which attribute will be set
+ * @param[in] attr Name of attribute file
+ * @param[in] content Value expected to be written
+ */
+void pull_function_attr(struct test_function *func, const char *attr,
+		const char *content);
+
+/**
+ * @brief Prepare fake filesystem to set newly generated MAC address
+ * @param[in] func Function which address will be set
+ * @param[in] attr Name of address attribute
+ * @param[in] old Address which new one has to differ from
+ */
+void pull_function_new_ether_addr(struct test_function *func,
+		const char *attr, const char *old);
+
 /**
  * @brief Get gadget string
  * @param[in] strs Set of gadget strings
@@ -268,11 +337,54 @@ void pull_gadget_string(struct test_gadget *gadget, int lang,
  */
 void pull_gadget_strs(struct test_gadget *gadget, int lang, usbg_gadget_strs *strs);
 
+/**
+ * @brief Prepare filesystem to create directory of gadget strings
+ * @param[in] gadget Gadget which strings will be set
+ * @param[in] lang Language of strings, directory doesn't exist yet
+ */
+void pull_new_gadget_str_dir(struct test_gadget *gadget, int lang);
+
+/**
+ * @brief Prepare filesystem to remove directory of gadget strings
+ * @param[in] gadget Gadget which strings have been set
+ * @param[in] lang Language of strings
+ */
+void pull_rm_gadget_str_dir(struct test_gadget *gadget, int lang);
+
+/**
+ * @brief Prepare filesystem to fail setting selected gadget string
+ * @param[in] gadget Gadget on which str will be set
+ * @param[in] lang Language of string
+ * @param[in] str String identifier
+ * @param[in] content String expected to be set
+ * @param[in] error errno set by failed write
+ */
+void pull_gadget_string_error(struct test_gadget *gadget, int lang,
+		gadget_str str, const char *content, int error);
+
 /**
  * @brief prepare for reading gadget's strings
  */
 void push_gadget_strs(struct test_gadget *gadget, int lang, usbg_gadget_strs *strs);
 
+/**
+ * @brief Prepare for reading string of language without directory
+ * @param[in] gadget Gadget which string will be read
+ * @param[in] lang Language of string
+ * @param[in] str String identifier
+ */
+void push_missing_gadget_string(struct test_gadget *gadget, int lang,
+		gadget_str str);
+
+/**
+ * @brief Prepare for listing languages of gadget strings
+ * @param[in] gadget Gadget which strings will be listed
+ * @param[in] langs Languages which should be returned
+ * @param[in] count Number of languages
+ */
+void push_gadget_str_langs(struct test_gadget *gadget, const int *langs,
+		int count);
+
 /**
  * @brief Prepare for /ref usbg_set_config_string calling
  * @details Expect setting the same string as given one
@@ -307,18 +419,155 @@ void push_config_string(struct test_config *config, int lang, const char *str);
  */
 void push_config_strs(struct test_config *config, int lang, usbg_config_strs *strs);
 
+/**
+ * @brief Prepare for listing languages of config strings
+ * @param[in] config Config which strings will be listed
+ * @param[in] langs Languages which should be returned
+ * @param[in] count Number of languages
+ */
+void push_config_str_langs(struct test_config *config, const int *langs,
+		int count);
+
 /**
  * @brief Prepare for creating config
  * @param[in] tc Test config to be created
  */
 void pull_create_config(struct test_config *tc);
 
+/**
+ * @brief Prepare for adding function to config
+ * @param[in] tc Test config to which function is added
+ * @param[in] tb Test binding with name and target of link
+ */
+void pull_add_binding(struct test_config *tc, struct test_binding *tb);
+
 /**
  * @brief Prepare for creating function
  * @param[in] tf Test function to be created
  */
 void pull_create_function(struct test_function *tf);
 
+/**
+ * @brief Prepare for creating gadget
+ * @param[in] tg Test gadget to be created, with empty udc
+ */
+void pull_create_gadget(struct test_gadget *tg);
+
+/**
+ * @brief Prepare for disabling gadget
+ * @param[in] tg Test gadget to be unbound from its UDC
+ */
+void pull_disable_gadget(struct test_gadget *tg);
+
+/**
+ * @brief Prepare for binding gadget to UDC in place of other one
+ * @param[in] from Test gadget bound to UDC
+ * @param[in] to Test gadget to be bound
+ * @param[in] udc Name of UDC
+ */
+void pull_switch_gadget(struct test_gadget *from, struct test_gadget *to,
+			const char *udc);
+
+/**
+ * @brief Prepare for opening UDC file of gadget which is kept open
+ * @param[in] tg Test gadget
+ * @return Fake fd of opened file
+ */
+int pull_open_udc_file(struct test_gadget *tg);
+
+/**
+ * @brief Prepare for write to file which is already open
+ * @param[in] fd Fake fd of file
+ * @param[in] content Expected data
+ */
+void pull_write_fd(int fd, const char *content);
+
+/**
+ * @brief Prepare for closing file which has been kept open
+ * @param[in] fd Fake fd of file
+ */
+void pull_close_fd(int fd);
+
+/**
+ * @brief Prepare for recursive removal of gadget without strings
+ * @param[in] tg Test gadget to be removed
+ */
+void pull_rm_gadget(struct test_gadget *tg);
+
+/**
+ * @brief Prepare for opening state files of all UDCs to watch them
+ * @param[in] state Test state, all UDCs are in "not attached" state
+ */
+void push_watch_udcs(struct test_state *state);
+
+/**
+ * @brief Prepare for opening state file of UDC to watch it
+ * @param[in] udc Name of UDC, in "not attached" state
+ */
+void push_watch_udc(const char *udc);
+
+/**
+ * @brief Prepare for reading state of UDC after kernel notification
+ * @param[in] udc Name of UDC watched since init
+ * @param[in] state Content of state file
+ */
+void push_udc_state_change(const char *udc, const char *state);
+
+/**
+ * @brief Queue uevent of UDC to be received by library
+ * @param[in] action Uevent action, e.g. "change"
+ * @param[in] udc Name of UDC
+ */
+void push_udc_uevent(const char *action, const char *udc);
+
+/**
+ * @brief Prepare for listing of UDCs in sysfs
+ * @param[in] udcs NULL terminated list of UDC names
+ */
+void push_udc_list(const char **udcs);
+
+/**
+ * @brief Prepare for closing state file of UDC which disappears
+ * @param[in] udc Name of watched UDC
+ */
+void pull_unwatch_udc(const char *udc);
+
+/**
+ * @brief Prepare for closing state files of all watched UDCs
+ */
+void pull_unwatch_udcs(void);
+
+/**
+ * @brief Prepare for waiting for state of UDC
+ * @param[in] udc Name of UDC
+ * @param[in] before State read when waiting starts
+ * @param[in] after State read after notification, NULL if no
+ * notification arrives before timeout
+ */
+void push_wait_udc_state(const char *udc, const char *before,
+			 const char *after);
+
+/**
+ * @brief Mark fake fd added to epoll as ready
+ */
+void fake_fd_ready(int fd);
+
+/**
+ * @brief Queue message to be received from fake netlink socket
+ */
+void fake_uevent(const char *msg, size_t len);
+
+/**
+ * @brief Queue overflow of fake netlink socket, uevents are lost
+ */
+void fake_uevent_overflow(void);
+
+/**
+ * @brief Prepare for creating directory of gadget
+ * @param[in] tg Test gadget to be created
+ */
+void pull_create_gadget_dir(struct test_gadget *tg);
+
 /**
  * @brief Copy state without configs and functions
  * @param[in] ts State to bo copied